@@ -0,0 +1,603 @@
+//! Benchmark suite for the block/patch pipeline.
+//!
+//! Drives every stage a release could regress -- config and CSV loading,
+//! diffing, delta merging, block creation, patch consolidation, wire encoding
+//! and SQL generation -- over synthetic tables at several scales. Each stage
+//! reports its best and median wall time, throughput, and the peak heap growth
+//! seen by a counting global allocator while it ran.
+//!
+//! ```sh
+//! cargo bench --bench pipeline -- --rows 1000,100000 --blocks 10 \
+//!     --output bench.json --baseline previous.json
+//! ```
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::collections::HashMap;
+use std::fmt;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, Instant, SystemTime};
+
+use anyhow::{Context, Result, bail};
+use clap::Parser;
+use leech2::block::Block;
+use leech2::cell::Interner;
+use leech2::config::Config;
+use leech2::delta::{Delta, ProtoDelta};
+use leech2::merge::MergedDelta;
+use leech2::patch::Patch;
+use leech2::sql;
+use leech2::state::State;
+use leech2::table::Table;
+use leech2::wire;
+use rand::rngs::StdRng;
+use rand::{Rng, SeedableRng};
+use serde_json::{Value, json};
+
+const TABLE_NAME: &str = "bench";
+const CSV_FILE: &str = "bench.csv";
+
+/// Number of distinct values a TEXT column draws from. Keeps the generated
+/// data as repetitive as typical inventory tables.
+const TEXT_VOCABULARY: u32 = 1000;
+
+/// Heap bytes currently allocated by the process.
+static ALLOCATED: AtomicUsize = AtomicUsize::new(0);
+/// High-water mark of `ALLOCATED` since the last [`reset_peak`].
+static PEAK: AtomicUsize = AtomicUsize::new(0);
+
+/// Forwards to the system allocator while tracking live and peak heap bytes.
+struct CountingAllocator;
+
+impl CountingAllocator {
+    fn grow(size: usize) {
+        let now = ALLOCATED.fetch_add(size, Ordering::Relaxed) + size;
+        PEAK.fetch_max(now, Ordering::Relaxed);
+    }
+
+    fn shrink(size: usize) {
+        ALLOCATED.fetch_sub(size, Ordering::Relaxed);
+    }
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let ptr = unsafe { System.alloc(layout) };
+        if !ptr.is_null() {
+            Self::grow(layout.size());
+        }
+        ptr
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        let ptr = unsafe { System.alloc_zeroed(layout) };
+        if !ptr.is_null() {
+            Self::grow(layout.size());
+        }
+        ptr
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        unsafe { System.dealloc(ptr, layout) };
+        Self::shrink(layout.size());
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let new_ptr = unsafe { System.realloc(ptr, layout, new_size) };
+        if !new_ptr.is_null() {
+            Self::shrink(layout.size());
+            Self::grow(new_size);
+        }
+        new_ptr
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+/// Restart peak tracking from the current allocation level and return it.
+fn reset_peak() -> usize {
+    let now = ALLOCATED.load(Ordering::Relaxed);
+    PEAK.store(now, Ordering::Relaxed);
+    now
+}
+
+#[derive(Parser)]
+#[command(name = "pipeline", about = "Benchmark the leech2 block/patch pipeline")]
+struct Args {
+    /// Number of rows in the generated table (comma-separated for several)
+    #[arg(long, value_delimiter = ',', default_value = "1000,10000,100000")]
+    rows: Vec<usize>,
+
+    /// Number of fields per row, including the primary key
+    #[arg(long, value_delimiter = ',', default_value = "8")]
+    width: Vec<usize>,
+
+    /// Fraction of rows inserted, updated or deleted between blocks
+    #[arg(long, value_delimiter = ',', default_value = "0.1")]
+    change_ratio: Vec<f64>,
+
+    /// Number of delta blocks in the chain a patch is consolidated from
+    #[arg(long, value_delimiter = ',', default_value = "10")]
+    blocks: Vec<usize>,
+
+    /// Timed iterations per stage; the best and median are reported
+    #[arg(long, default_value_t = 5)]
+    iterations: usize,
+
+    /// Seed for the synthetic data generator
+    #[arg(long, default_value_t = 0x1eec4)]
+    seed: u64,
+
+    /// Write the results as JSON to <path>
+    #[arg(long)]
+    output: Option<PathBuf>,
+
+    /// Compare against the JSON results of an earlier run
+    #[arg(long)]
+    baseline: Option<PathBuf>,
+
+    /// Passed by `cargo bench`; ignored
+    #[arg(long = "bench", hide = true)]
+    _bench: bool,
+}
+
+/// One point in the benchmark matrix.
+#[derive(Debug, Clone, Copy)]
+struct Scenario {
+    rows: usize,
+    width: usize,
+    change_ratio: f64,
+    blocks: usize,
+}
+
+impl fmt::Display for Scenario {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "rows={} width={} change={:.2} blocks={}",
+            self.rows, self.width, self.change_ratio, self.blocks
+        )
+    }
+}
+
+/// Timing and memory figures for one stage of one scenario.
+struct Sample {
+    scenario: Scenario,
+    stage: &'static str,
+    /// Work done per iteration, in `unit`s, used to derive throughput.
+    items: u64,
+    unit: &'static str,
+    best: Duration,
+    median: Duration,
+    peak_bytes: usize,
+}
+
+impl Sample {
+    fn throughput(&self) -> f64 {
+        self.items as f64 / self.best.as_secs_f64().max(f64::MIN_POSITIVE)
+    }
+
+    fn to_json(&self) -> Value {
+        json!({
+            "stage": self.stage,
+            "rows": self.scenario.rows,
+            "width": self.scenario.width,
+            "change_ratio": self.scenario.change_ratio,
+            "blocks": self.scenario.blocks,
+            "items": self.items,
+            "unit": self.unit,
+            "best_ms": self.best.as_secs_f64() * 1000.0,
+            "median_ms": self.median.as_secs_f64() * 1000.0,
+            "throughput": self.throughput(),
+            "peak_bytes": self.peak_bytes,
+        })
+    }
+}
+
+/// Best and median wall time plus the largest peak heap growth over all
+/// iterations of a stage.
+struct Measurement {
+    best: Duration,
+    median: Duration,
+    peak_bytes: usize,
+}
+
+/// Time `routine` over `iterations` runs. `setup` prepares each run's input
+/// outside the timed region, and the routine's output is dropped after the
+/// clock stops so teardown is not billed to the stage.
+fn measure<I, T>(
+    iterations: usize,
+    mut setup: impl FnMut() -> Result<I>,
+    mut routine: impl FnMut(I) -> Result<T>,
+) -> Result<Measurement> {
+    let mut times = Vec::with_capacity(iterations);
+    let mut peak_bytes = 0;
+    for _ in 0..iterations.max(1) {
+        let input = setup()?;
+        let baseline = reset_peak();
+        let start = Instant::now();
+        let output = routine(input)?;
+        times.push(start.elapsed());
+        peak_bytes = peak_bytes.max(PEAK.load(Ordering::Relaxed).saturating_sub(baseline));
+        drop(output);
+    }
+    times.sort();
+    Ok(Measurement {
+        best: times[0],
+        median: times[times.len() / 2],
+        peak_bytes,
+    })
+}
+
+/// Synthetic table whose rows drift by a fixed ratio every generation.
+///
+/// Field 0 is a NUMBER primary key; the remaining fields alternate between
+/// TEXT and NUMBER. Each generation updates half of the changed rows, deletes
+/// a quarter and inserts the rest, so the table size stays roughly constant.
+struct Generator {
+    width: usize,
+    change_ratio: f64,
+    rows: Vec<(u64, Vec<String>)>,
+    next_id: u64,
+    rng: StdRng,
+}
+
+impl Generator {
+    fn new(scenario: &Scenario, seed: u64) -> Self {
+        let mut generator = Generator {
+            width: scenario.width,
+            change_ratio: scenario.change_ratio,
+            rows: Vec::with_capacity(scenario.rows),
+            next_id: 0,
+            rng: StdRng::seed_from_u64(seed),
+        };
+        for _ in 0..scenario.rows {
+            generator.insert();
+        }
+        generator
+    }
+
+    fn value(&mut self, field: usize) -> String {
+        if field % 2 == 1 {
+            format!("value-{}", self.rng.random_range(0..TEXT_VOCABULARY))
+        } else {
+            self.rng.random_range(0..1_000_000u32).to_string()
+        }
+    }
+
+    fn insert(&mut self) {
+        let values = (1..self.width).map(|field| self.value(field)).collect();
+        self.rows.push((self.next_id, values));
+        self.next_id += 1;
+    }
+
+    /// Advance to the next generation. At least one row changes, so every
+    /// generation yields a non-empty delta.
+    fn advance(&mut self) {
+        let changes = ((self.rows.len() as f64 * self.change_ratio).round() as usize).max(1);
+        let deletes = (changes / 4).min(self.rows.len());
+        let updates = changes / 2;
+        let inserts = changes - updates - deletes;
+
+        for _ in 0..deletes {
+            let index = self.rng.random_range(0..self.rows.len());
+            self.rows.swap_remove(index);
+        }
+        for _ in 0..updates {
+            if self.rows.is_empty() {
+                break;
+            }
+            let index = self.rng.random_range(0..self.rows.len());
+            let field = self.rng.random_range(1..self.width);
+            let value = self.value(field);
+            self.rows[index].1[field - 1] = value;
+        }
+        for _ in 0..inserts {
+            self.insert();
+        }
+    }
+
+    fn write_csv(&self, work_dir: &Path) -> Result<u64> {
+        let mut content = String::new();
+        for (id, values) in &self.rows {
+            content.push_str(&id.to_string());
+            for value in values {
+                content.push(',');
+                content.push_str(value);
+            }
+            content.push('\n');
+        }
+        std::fs::write(work_dir.join(CSV_FILE), &content)
+            .with_context(|| format!("failed to write {}", CSV_FILE))?;
+        Ok(content.len() as u64)
+    }
+}
+
+fn config_toml(width: usize) -> String {
+    let mut content = String::from(
+        "[tables.bench]\nfields = [\n    { name = \"id\", type = \"NUMBER\", primary-key = true },\n",
+    );
+    for field in 1..width {
+        let kind = if field % 2 == 1 { "TEXT" } else { "NUMBER" };
+        content.push_str(&format!(
+            "    {{ name = \"field_{}\", type = \"{}\" }},\n",
+            field, kind
+        ));
+    }
+    content.push_str(&format!(
+        "]\n\n[tables.bench.csv]\nsource = \"{}\"\n",
+        CSV_FILE
+    ));
+    content
+}
+
+fn single_table_state(table: Table) -> State {
+    State {
+        tables: HashMap::from([(TABLE_NAME.to_string(), table)]),
+    }
+}
+
+fn compute_delta(previous: &State, current: &State, threads: usize) -> Result<Delta> {
+    Delta::compute(Some(previous.clone()), current, threads)
+        .remove(TABLE_NAME)
+        .flatten()
+        .context("expected a delta for the benchmark table")
+}
+
+fn delta_size(delta: &Delta) -> u64 {
+    (delta.inserts.len() + delta.deletes.len() + delta.updates.len()) as u64
+}
+
+/// Run every stage of the pipeline for one scenario.
+fn run_scenario(scenario: Scenario, args: &Args) -> Result<Vec<Sample>> {
+    let tmp = tempfile::tempdir().context("failed to create work directory")?;
+    let work_dir = tmp.path();
+    let config_path = work_dir.join("config.toml");
+    let config_content = config_toml(scenario.width);
+    std::fs::write(&config_path, &config_content).context("failed to write config.toml")?;
+    // Backdate config.toml past the settle time of the config cache, which
+    // does not key on files that changed just now.
+    std::fs::File::options()
+        .write(true)
+        .open(&config_path)
+        .and_then(|file| file.set_modified(SystemTime::now() - Duration::from_secs(60)))
+        .context("failed to backdate config.toml")?;
+
+    let mut generator = Generator::new(&scenario, args.seed);
+    let csv_bytes = generator.write_csv(work_dir)?;
+    let config = Config::load(work_dir)?;
+    let table_config = config
+        .tables
+        .get(TABLE_NAME)
+        .context("benchmark table missing from config")?;
+    let iterations = args.iterations;
+    let mut samples = Vec::new();
+    let mut push = |stage, items, unit, measurement: Measurement| {
+        samples.push(Sample {
+            scenario,
+            stage,
+            items,
+            unit,
+            best: measurement.best,
+            median: measurement.median,
+            peak_bytes: measurement.peak_bytes,
+        })
+    };
+
+    // No state directory exists yet, so the first load parses config.toml.
+    // The second one runs once CONFIG.cache is stored in the state
+    // directory, and only deserializes the cached tree.
+    let config_bytes = config_content.len() as u64;
+    let measurement = measure(iterations, || Ok(()), |_| Config::load_read_only(work_dir))?;
+    push("config_load", config_bytes, "bytes", measurement);
+    config.ensure_state_dir()?;
+    Config::load(work_dir)?;
+    let measurement = measure(iterations, || Ok(()), |_| Config::load(work_dir))?;
+    push("config_load_cached", config_bytes, "bytes", measurement);
+
+    let load = || Table::load_from_csv(work_dir, TABLE_NAME, table_config);
+    push(
+        "load_csv",
+        csv_bytes,
+        "bytes",
+        measure(iterations, || Ok(()), |_| load())?,
+    );
+
+    // Three consecutive generations give two deltas to diff and merge.
+    let first = single_table_state(load()?);
+    generator.advance();
+    generator.write_csv(work_dir)?;
+    let second = single_table_state(load()?);
+    generator.advance();
+    generator.write_csv(work_dir)?;
+    let third = single_table_state(load()?);
+
+    let measurement = measure(
+        iterations,
+        || Ok(first.clone()),
+        |previous| Ok(Delta::compute(Some(previous), &second, config.threads)),
+    )?;
+    push("delta_compute", scenario.rows as u64, "rows", measurement);
+
+    // Consolidation merges the wire form of the block deltas, as read from
+    // the block files.
+    let parent = compute_delta(&first, &second, config.threads)?;
+    let child = compute_delta(&second, &third, config.threads)?;
+    let merged_records = delta_size(&parent) + delta_size(&child);
+    let parent = ProtoDelta::from(parent);
+    let child = ProtoDelta::from(child);
+    let measurement = measure(
+        iterations,
+        || Ok((parent.clone(), child.clone())),
+        |(parent, child)| {
+            let mut interner = Interner::new();
+            let mut merged = MergedDelta::from_proto(parent, &mut interner)?;
+            merged.merge_proto(child, &mut interner)?;
+            Ok(merged)
+        },
+    )?;
+    push("delta_merge", merged_records, "records", measurement);
+
+    // Build the chain: a genesis block with the full state, followed by
+    // `blocks` delta blocks that the patch below consolidates.
+    let reference = Block::create(&config, None)?;
+    let measurement = measure(
+        scenario.blocks,
+        || {
+            generator.advance();
+            generator.write_csv(work_dir)
+        },
+        |_| Block::create(&config, None),
+    )?;
+    push("block_create", scenario.rows as u64, "rows", measurement);
+
+    let patch = Patch::create(&config, &reference)?;
+    let measurement = measure(
+        iterations,
+        || Ok(()),
+        |_| Patch::create(&config, &reference),
+    )?;
+    push(
+        "patch_create",
+        patch.num_blocks as u64,
+        "blocks",
+        measurement,
+    );
+
+    let encoded = wire::encode_patch(&config, &patch)?;
+    let measurement = measure(
+        iterations,
+        || Ok(()),
+        |_| wire::encode_patch(&config, &patch),
+    )?;
+    push("encode_patch", encoded.len() as u64, "bytes", measurement);
+
+    let sql_bytes = sql::patch_to_sql(&config, &patch)?.map_or(0, |sql| sql.len());
+    let measurement = measure(
+        iterations,
+        || Ok(()),
+        |_| sql::patch_to_sql(&config, &patch),
+    )?;
+    push("patch_to_sql", sql_bytes as u64, "bytes", measurement);
+
+    let measurement = measure(
+        iterations,
+        || Ok(()),
+        |_| sql::write_patch_sql(&config, &patch, &mut std::io::sink()),
+    )?;
+    push("write_patch_sql", sql_bytes as u64, "bytes", measurement);
+
+    Ok(samples)
+}
+
+/// Index an earlier run's results by stage and scenario parameters.
+fn load_baseline(path: &Path) -> Result<HashMap<String, Value>> {
+    let content = std::fs::read_to_string(path)
+        .with_context(|| format!("failed to read baseline '{}'", path.display()))?;
+    let document: Value = serde_json::from_str(&content)
+        .with_context(|| format!("failed to parse baseline '{}'", path.display()))?;
+    let Some(results) = document.get("results").and_then(Value::as_array) else {
+        bail!("baseline '{}' has no results array", path.display());
+    };
+    Ok(results
+        .iter()
+        .map(|result| (baseline_key(result), result.clone()))
+        .collect())
+}
+
+fn baseline_key(result: &Value) -> String {
+    format!(
+        "{}/{}/{}/{}/{}",
+        result["stage"], result["rows"], result["width"], result["change_ratio"], result["blocks"]
+    )
+}
+
+fn percent_change(current: f64, previous: Option<f64>) -> String {
+    match previous {
+        Some(previous) if previous > 0.0 => {
+            format!("{:+.1}%", (current - previous) / previous * 100.0)
+        }
+        _ => "-".to_string(),
+    }
+}
+
+fn print_sample(sample: &Sample, baseline: Option<&Value>) {
+    let best_ms = sample.best.as_secs_f64() * 1000.0;
+    let peak_mib = sample.peak_bytes as f64 / (1024.0 * 1024.0);
+    let mut line = format!(
+        "{:<44} {:<14} best {:>10.3} ms  median {:>10.3} ms  {:>14.0} {}/s  peak {:>9.2} MiB",
+        sample.scenario.to_string(),
+        sample.stage,
+        best_ms,
+        sample.median.as_secs_f64() * 1000.0,
+        sample.throughput(),
+        sample.unit,
+        peak_mib,
+    );
+    if let Some(previous) = baseline {
+        line.push_str(&format!(
+            "  time {}  peak {}",
+            percent_change(best_ms, previous["best_ms"].as_f64()),
+            percent_change(sample.peak_bytes as f64, previous["peak_bytes"].as_f64()),
+        ));
+    }
+    println!("{}", line);
+}
+
+fn main() -> Result<()> {
+    let args = Args::parse();
+    if let Some(width) = args.width.iter().find(|&&width| width < 2) {
+        bail!("--width must be >= 2, got {}", width);
+    }
+    if let Some(ratio) = args
+        .change_ratio
+        .iter()
+        .find(|ratio| !(0.0..=1.0).contains(*ratio))
+    {
+        bail!("--change-ratio must be within [0, 1], got {}", ratio);
+    }
+    if args.blocks.contains(&0) {
+        bail!("--blocks must be >= 1");
+    }
+    let baseline = match &args.baseline {
+        Some(path) => load_baseline(path)?,
+        None => HashMap::new(),
+    };
+
+    let mut samples = Vec::new();
+    for &rows in &args.rows {
+        for &width in &args.width {
+            for &change_ratio in &args.change_ratio {
+                for &blocks in &args.blocks {
+                    let scenario = Scenario {
+                        rows,
+                        width,
+                        change_ratio,
+                        blocks,
+                    };
+                    for sample in run_scenario(scenario, &args)
+                        .with_context(|| format!("scenario '{}' failed", scenario))?
+                    {
+                        let json = sample.to_json();
+                        print_sample(&sample, baseline.get(&baseline_key(&json)));
+                        samples.push(json);
+                    }
+                }
+            }
+        }
+    }
+
+    if let Some(path) = &args.output {
+        let document = json!({
+            "version": env!("CARGO_PKG_VERSION"),
+            "seed": args.seed,
+            "iterations": args.iterations,
+            "results": samples,
+        });
+        let content = serde_json::to_string_pretty(&document)?;
+        std::fs::write(path, content)
+            .with_context(|| format!("failed to write '{}'", path.display()))?;
+    }
+    Ok(())
+}
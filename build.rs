@@ -4,13 +4,16 @@ use std::process::Command;
 fn main() {
     let proto_files = [
         "proto/block.proto",
+        "proto/checkpoint.proto",
         "proto/delta.proto",
         "proto/record.proto",
         "proto/injected.proto",
+        "proto/journal.proto",
         "proto/patch.proto",
         "proto/state.proto",
         "proto/table.proto",
         "proto/update.proto",
+        "proto/wire.proto",
         "proto/cell.proto",
     ];
     prost_build::compile_protos(&proto_files, &["proto/"])
@@ -24,6 +24,9 @@ extern "C" {
 #define LCH_END_OF_TABLE 1
 #define LCH_SKIP_RECORD 2
 
+/* Completion-callback status of a cancelled task (see lch_task_cancel). */
+#define LCH_CANCELLED 3
+
 /**
  * Log severity levels.
  *
@@ -142,12 +145,32 @@ typedef struct LchConfig lch_config_t;
  */
 extern lch_config_t *lch_init(const char *work_dir);
 
+/**
+ * Initialize the library with a sized executor for the asynchronous API.
+ *
+ * Like lch_init(), but the tasks queued by lch_block_create_async(),
+ * lch_patch_create_async() and lch_patch_to_sql_async() on the returned
+ * handle run on @p workers threads owned by leech2, so several of them can
+ * run at once. A handle from lch_init() runs them on a single thread. The
+ * threads are started by the first asynchronous call.
+ *
+ * @param work_dir  Path to the leech2 working directory (must not be NULL).
+ * @param workers   Number of executor threads (at least 1).
+ * @return An opaque config handle on success, or NULL on failure.
+ *         The caller must free the handle with lch_deinit().
+ */
+extern lch_config_t *lch_init_async(const char *work_dir, size_t workers);
+
 /**
  * Free a configuration handle.
  *
  * Releases all resources associated with the handle. Passing NULL is a safe
  * no-op. After this call the handle is invalid and must not be used.
  *
+ * Blocks until every queued asynchronous task has completed and its
+ * completion callback has returned. Must therefore not be called from a
+ * completion callback.
+ *
  * @param cfg  Handle previously returned by lch_init(), or NULL.
  */
 extern void lch_deinit(lch_config_t *cfg);
@@ -194,7 +217,11 @@ typedef int (*lch_table_end_cb_t)(const char *table, void *usr_data);
  *     @p col or @p field_name.
  *   - A table is fully drained before any other table is processed, and the
  *     callback is invoked exclusively on the thread that called
- *     lch_block_create().
+ *     lch_block_create(). Tables declaring `thread-safe = true` in the
+ *     config are the exception: they are loaded on the worker pool sized by
+ *     the `threads` option, so callbacks for different such tables may run
+ *     concurrently on any thread. Each table is still drained by a single
+ *     thread, in ascending row order.
  *
  * LCH_END_OF_TABLE / LCH_SKIP_RECORD on any cell short-circuits the rest
  * of the row: leech2 won't ask for the remaining cells, and any cells
@@ -246,6 +273,60 @@ typedef int (*lch_read_cell_cb_t)(const char *table, size_t row, size_t col,
  */
 typedef void (*lch_destroy_cell_cb_t)(lch_cell_t *cell, void *usr_data);
 
+/**
+ * Batch callback for callback-backed tables.
+ *
+ * Alternative to lch_read_cell_cb_t that fills a whole block of rows per
+ * call. When set in lch_callbacks_t, it is used for every callback-backed
+ * table and read_cell / destroy_cell are never invoked. The threading rules
+ * are the same as for lch_read_cell_cb_t.
+ *
+ * leech2 owns @p cells, which holds @p max_rows x @p num_cols zero-initialised
+ * cells in row-major order: the cell for field @c col of the @c r th returned
+ * row is cells[r * num_cols + col], with @c col the field's 0-based index in
+ * config.toml declaration order. The same typing rules as for read_cell
+ * apply. Rows the producer wants to drop are simply not returned.
+ *
+ * @param table        Null-terminated table name. Borrowed.
+ * @param field_names  Array of @p num_cols null-terminated field names, in
+ *                     declaration order. Borrowed.
+ * @param num_cols     Number of fields per row.
+ * @param first_row    Number of rows returned by earlier calls for this
+ *                     table; 0 on the first call.
+ * @param max_rows     Maximum number of rows to write into @p cells.
+ * @param cells        Caller-owned cell block; see above.
+ * @param out_rows     On LCH_SUCCESS, set to the number of rows written, from
+ *                     1 to @p max_rows. Fewer than @p max_rows does not end
+ *                     the table.
+ * @param usr_data     Opaque pointer from lch_callbacks_t::usr_data.
+ * @return LCH_SUCCESS         *out_rows rows written; leech2 calls again with
+ *                             first_row advanced by *out_rows.
+ *         LCH_END_OF_TABLE    No rows remain; iteration for this table stops.
+ *                             @p cells is ignored.
+ *         LCH_FAILURE         Unrecoverable error; block creation aborts.
+ */
+typedef int (*lch_read_batch_cb_t)(const char *table,
+                                   const char *const *field_names,
+                                   size_t num_cols, size_t first_row,
+                                   size_t max_rows, lch_cell_t *cells,
+                                   size_t *out_rows, void *usr_data);
+
+/**
+ * Per-batch cleanup hook for callback-backed tables.
+ *
+ * Invoked once for each lch_read_batch_cb_t call that returned LCH_SUCCESS,
+ * after leech2 has copied every cell into its own storage. Text pointers in a
+ * batch can therefore share one producer-side arena, released here in a single
+ * step. Not invoked for LCH_END_OF_TABLE or LCH_FAILURE.
+ *
+ * @param cells     The cell block passed to read_batch.
+ * @param num_rows  Number of rows read_batch reported in *out_rows.
+ * @param num_cols  Number of fields per row.
+ * @param usr_data  Opaque pointer from lch_callbacks_t::usr_data.
+ */
+typedef void (*lch_destroy_batch_cb_t)(lch_cell_t *cells, size_t num_rows,
+                                       size_t num_cols, void *usr_data);
+
 /**
  * Callback bundle passed to lch_block_create() for callback-backed tables.
  *
@@ -256,7 +337,8 @@ typedef void (*lch_destroy_cell_cb_t)(lch_cell_t *cell, void *usr_data);
 typedef struct {
   /** May be NULL if no per-table setup is needed. */
   lch_table_begin_cb_t table_begin;
-  /** Required when any table in the config is callback-backed. */
+  /** Required when any table in the config is callback-backed, unless
+   *  read_batch is set. */
   lch_read_cell_cb_t read_cell;
   /** May be NULL if no per-cell cleanup is needed. Invoked after every
    *  successful read_cell, for every cell kind; see lch_destroy_cell_cb_t. */
@@ -266,6 +348,12 @@ typedef struct {
   /** Opaque pointer forwarded verbatim to every invoked callback. May be
    *  NULL if the callbacks do not need shared state. */
   void *usr_data;
+  /** May be NULL. When set, replaces read_cell / destroy_cell and pulls
+   *  rows a block at a time; see lch_read_batch_cb_t. */
+  lch_read_batch_cb_t read_batch;
+  /** May be NULL if no per-batch cleanup is needed. Invoked after every
+   *  successful read_batch; see lch_destroy_batch_cb_t. */
+  lch_destroy_batch_cb_t destroy_batch;
 } lch_callbacks_t;
 
 /**
@@ -333,6 +421,117 @@ extern int lch_patch_create(const lch_config_t *cfg, const char *hash,
 extern int lch_patch_to_sql(const lch_config_t *cfg, const lch_buffer_t *patch,
                             char **sql);
 
+/**
+ * Statement callback for lch_patch_to_sql_stream().
+ *
+ * @param stmt      One null-terminated SQL statement, ending in ";\n".
+ *                  Borrowed; valid only for the duration of the call.
+ * @param len       Length of @p stmt in bytes, excluding the terminator.
+ * @param usr_data  Opaque pointer passed to lch_patch_to_sql_stream().
+ * @return LCH_SUCCESS to continue with the next statement.
+ *         Any other value aborts the conversion, and lch_patch_to_sql_stream
+ *         returns LCH_FAILURE.
+ */
+typedef int (*lch_sql_cb_t)(const char *stmt, size_t len, void *usr_data);
+
+/**
+ * Convert an encoded patch to SQL statements, one callback per statement.
+ *
+ * Produces the same statements as lch_patch_to_sql(), in the same order, but
+ * hands each one to @p callback as soon as it is rendered instead of
+ * building the whole SQL text in memory. Prefer this for full-state patches
+ * of large tables. A framed patch (the `framed-patches` option) is
+ * decompressed, decoded and converted one chunk at a time, so the patch
+ * itself is never held in memory in full either. An empty patch invokes the
+ * callback zero times. The callback is invoked on the calling thread.
+ *
+ * On failure, some statements may already have been delivered; callers that
+ * need atomicity should wrap the statements in their own transaction and
+ * roll it back.
+ *
+ * @param cfg       Valid config handle (must not be NULL).
+ * @param patch     Encoded patch buffer (must not be NULL).
+ * @param callback  Statement callback (must not be NULL).
+ * @param usr_data  Opaque pointer forwarded to @p callback.
+ * @return LCH_SUCCESS on success, LCH_FAILURE on error or if the callback
+ *         aborted.
+ */
+extern int lch_patch_to_sql_stream(const lch_config_t *cfg,
+                                   const lch_buffer_t *patch,
+                                   lch_sql_cb_t callback, void *usr_data);
+
+/**
+ * Operation kinds of the statements produced by lch_patch_to_statements().
+ */
+typedef enum {
+  /* Remove a table's rows before a full-state reload: TRUNCATE, or a DELETE
+   * scoped by the injected fields. */
+  LCH_OP_CLEAR = 0,
+  LCH_OP_DELETE = 1,
+  LCH_OP_INSERT = 2,
+  LCH_OP_UPDATE = 3,
+} lch_op_t;
+
+/**
+ * One row operation of a patch as a parameterized statement.
+ *
+ * All pointers are borrowed and valid only for the duration of the
+ * lch_statement_cb_t invocation that receives the statement.
+ */
+typedef struct {
+  lch_op_t op;
+  /* Null-terminated table name. */
+  const char *table;
+  /* Null-terminated SQL with $1..$n placeholders numbered in parameter order,
+   * without a trailing semicolon. Every operation of the same kind on the
+   * same table shares one text (updates: one per set of changed columns),
+   * so it can serve as the key of a prepared-statement cache. */
+  const char *sql;
+  /* num_params null-terminated column names; columns[i] is bound by
+   * params[i]. */
+  const char *const *columns;
+  /* num_params typed parameter values. TEXT values are null-terminated. */
+  const lch_cell_t *params;
+  size_t num_params;
+} lch_statement_t;
+
+/**
+ * Statement callback for lch_patch_to_statements().
+ *
+ * @param stmt      The statement. Borrowed; valid only for the duration of
+ *                  the call.
+ * @param usr_data  Opaque pointer passed to lch_patch_to_statements().
+ * @return LCH_SUCCESS to continue with the next statement.
+ *         Any other value aborts the conversion, and lch_patch_to_statements
+ *         returns LCH_FAILURE.
+ */
+typedef int (*lch_statement_cb_t)(const lch_statement_t *stmt, void *usr_data);
+
+/**
+ * Convert an encoded patch to parameterized statements.
+ *
+ * Delivers the same operations as lch_patch_to_sql(), in the same order, but
+ * as statement templates plus typed parameter rows instead of SQL text with
+ * literal values, so the caller can prepare each distinct template once and
+ * bind rows to it (or feed a bulk-binding API). Each operation covers one
+ * row; the [sql] batch-size option does not apply. An empty patch invokes
+ * the callback zero times. The callback is invoked on the calling thread.
+ *
+ * On failure, some statements may already have been delivered; callers that
+ * need atomicity should apply them in their own transaction and roll it back.
+ *
+ * @param cfg       Valid config handle (must not be NULL).
+ * @param patch     Encoded patch buffer (must not be NULL).
+ * @param callback  Statement callback (must not be NULL).
+ * @param usr_data  Opaque pointer forwarded to @p callback.
+ * @return LCH_SUCCESS on success, LCH_FAILURE on error or if the callback
+ *         aborted.
+ */
+extern int lch_patch_to_statements(const lch_config_t *cfg,
+                                   const lch_buffer_t *patch,
+                                   lch_statement_cb_t callback,
+                                   void *usr_data);
+
 /**
  * Inject a field into an encoded patch.
  *
@@ -364,12 +563,46 @@ extern int lch_patch_inject(const lch_config_t *cfg, const lch_buffer_t *in,
                             const char *name, const lch_cell_t *cell,
                             lch_buffer_t *out);
 
+/**
+ * Coalesce queued patches into one.
+ *
+ * Decodes the @p num_patches encoded patches in @p patches, oldest first,
+ * and folds them into a single patch with the same effect as applying them
+ * in turn: a row inserted by one patch and deleted by a later one vanishes,
+ * consecutive updates of a row collapse into one, and a full table state
+ * supersedes everything queued before it. The result is encoded into a new
+ * caller-owned buffer written to @p out and can be passed to any other
+ * patch function. The input buffers are not modified.
+ *
+ * Patches do not record the block they start from, so the order cannot be
+ * proven. The call fails if a patch was created before the one preceding
+ * it, repeats its head (the same patch queued twice), injects different
+ * fields, or contradicts it (e.g. inserts a row it already inserted).
+ *
+ * The buffer written to @p out must eventually be freed with
+ * lch_buffer_free().
+ *
+ * @param cfg          Valid config handle (must not be NULL).
+ * @param patches      Array of encoded patches, oldest first (must not be
+ *                     NULL).
+ * @param num_patches  Number of patches in @p patches (at least one).
+ * @param[out] out     Receives the encoded coalesced patch (must not be
+ *                     NULL).
+ * @return LCH_SUCCESS on success, LCH_FAILURE on error.
+ */
+extern int lch_patch_coalesce(const lch_config_t *cfg,
+                              const lch_buffer_t *patches, size_t num_patches,
+                              lch_buffer_t *out);
+
 /**
  * Extract the head hash from an encoded patch.
  *
  * Decodes @p patch and returns its head hash -- the hash of the most recent
  * block consolidated into the patch -- as a newly allocated, null-terminated
  * string. The hash is always exactly 40 hexadecimal characters (SHA-1).
+ * Since no config is passed, patches compressed with a zstd dictionary
+ * (see the [compression] dictionary option) cannot be read here; use
+ * lch_patch_hash_with() for those.
  *
  * Useful when multiple receivers consume patches from the same agent and
  * each needs to track its own last-known position independently of the
@@ -386,6 +619,25 @@ extern int lch_patch_inject(const lch_config_t *cfg, const lch_buffer_t *in,
  */
 extern int lch_patch_hash(const lch_buffer_t *patch, char **out);
 
+/**
+ * Extract the head hash from an encoded patch, using a config.
+ *
+ * Like lch_patch_hash(), but decodes @p patch with the configuration of
+ * @p cfg, so patches compressed with its zstd dictionary (the
+ * [compression] dictionary option) can be read too. Receivers that enable
+ * a dictionary must use this variant.
+ *
+ * The string written to @p out must eventually be freed with
+ * lch_string_free().
+ *
+ * @param cfg       Valid config handle (must not be NULL).
+ * @param patch     Encoded patch buffer (must not be NULL).
+ * @param[out] out  Receives a pointer to the hash string (must not be NULL).
+ * @return LCH_SUCCESS on success, LCH_FAILURE on error.
+ */
+extern int lch_patch_hash_with(const lch_config_t *cfg,
+                               const lch_buffer_t *patch, char **out);
+
 /**
  * Mark a patch as applied.
  *
@@ -411,6 +663,134 @@ extern int lch_patch_applied(const lch_config_t *cfg,
  */
 extern int lch_patch_failed(const lch_config_t *cfg);
 
+/**
+ * Cancel handle of a queued asynchronous task.
+ *
+ * Returned by lch_block_create_async(), lch_patch_create_async() and
+ * lch_patch_to_sql_async(), and freed with lch_task_free().
+ */
+typedef struct LchTask lch_task_t;
+
+/**
+ * Completion callback for lch_block_create_async().
+ *
+ * Invoked exactly once, on an executor thread.
+ *
+ * @param status    LCH_SUCCESS, LCH_FAILURE, or LCH_CANCELLED if the task
+ *                  was cancelled before it started.
+ * @param usr_data  Opaque pointer passed to lch_block_create_async().
+ */
+typedef void (*lch_block_done_cb_t)(int status, void *usr_data);
+
+/**
+ * Completion callback for lch_patch_create_async().
+ *
+ * Invoked exactly once, on an executor thread.
+ *
+ * @param status    LCH_SUCCESS, LCH_FAILURE, or LCH_CANCELLED if the task
+ *                  was cancelled before it started.
+ * @param patch     On LCH_SUCCESS, the encoded patch; the callee takes
+ *                  ownership and must free it with lch_buffer_free().
+ *                  Otherwise @c data is NULL.
+ * @param usr_data  Opaque pointer passed to lch_patch_create_async().
+ */
+typedef void (*lch_patch_done_cb_t)(int status, lch_buffer_t patch,
+                                    void *usr_data);
+
+/**
+ * Completion callback for lch_patch_to_sql_async().
+ *
+ * Invoked exactly once, on an executor thread.
+ *
+ * @param status    LCH_SUCCESS, LCH_FAILURE, or LCH_CANCELLED if the task
+ *                  was cancelled before it started.
+ * @param sql       On LCH_SUCCESS, the SQL string as from lch_patch_to_sql(),
+ *                  or NULL if the patch is empty; the callee takes ownership
+ *                  and must free it with lch_string_free(). Otherwise NULL.
+ * @param usr_data  Opaque pointer passed to lch_patch_to_sql_async().
+ */
+typedef void (*lch_sql_done_cb_t)(int status, char *sql, void *usr_data);
+
+/**
+ * Queue lch_block_create() on the executor of @p cfg.
+ *
+ * Returns immediately; @p done reports the outcome. Callbacks in
+ * @p callbacks are invoked on the executor thread running the task, and the
+ * bundle and its @c usr_data must stay valid until @p done has been called.
+ * Block creations on the same work directory serialize, as they do when
+ * called synchronously.
+ *
+ * @param cfg        Valid config handle (must not be NULL).
+ * @param callbacks  Optional callback bundle, as for lch_block_create().
+ * @param done       Completion callback (must not be NULL).
+ * @param usr_data   Opaque pointer forwarded to @p done.
+ * @return A task handle to free with lch_task_free(), or NULL if the task
+ *         could not be queued, in which case @p done is never called.
+ */
+extern lch_task_t *lch_block_create_async(const lch_config_t *cfg,
+                                          const lch_callbacks_t *callbacks,
+                                          lch_block_done_cb_t done,
+                                          void *usr_data);
+
+/**
+ * Queue lch_patch_create() on the executor of @p cfg.
+ *
+ * Returns immediately; @p done reports the outcome and receives the patch.
+ * @p hash is copied before this function returns.
+ *
+ * @param cfg       Valid config handle (must not be NULL).
+ * @param hash      Last-known block hash, or NULL, as for lch_patch_create().
+ * @param done      Completion callback (must not be NULL).
+ * @param usr_data  Opaque pointer forwarded to @p done.
+ * @return A task handle to free with lch_task_free(), or NULL if the task
+ *         could not be queued, in which case @p done is never called.
+ */
+extern lch_task_t *lch_patch_create_async(const lch_config_t *cfg,
+                                          const char *hash,
+                                          lch_patch_done_cb_t done,
+                                          void *usr_data);
+
+/**
+ * Queue lch_patch_to_sql() on the executor of @p cfg.
+ *
+ * Returns immediately; @p done reports the outcome and receives the SQL. The
+ * bytes of @p patch are copied before this function returns, so the buffer
+ * may be freed right away.
+ *
+ * @param cfg       Valid config handle (must not be NULL).
+ * @param patch     Encoded patch buffer (must not be NULL).
+ * @param done      Completion callback (must not be NULL).
+ * @param usr_data  Opaque pointer forwarded to @p done.
+ * @return A task handle to free with lch_task_free(), or NULL if the task
+ *         could not be queued, in which case @p done is never called.
+ */
+extern lch_task_t *lch_patch_to_sql_async(const lch_config_t *cfg,
+                                          const lch_buffer_t *patch,
+                                          lch_sql_done_cb_t done,
+                                          void *usr_data);
+
+/**
+ * Cancel a queued task that has not started yet.
+ *
+ * A cancelled task does not run; its completion callback is still invoked,
+ * with LCH_CANCELLED. A task that is already running runs to completion.
+ *
+ * @param task  Task handle (must not be NULL).
+ * @return LCH_SUCCESS if the task was cancelled, LCH_FAILURE if it already
+ *         started or finished.
+ */
+extern int lch_task_cancel(const lch_task_t *task);
+
+/**
+ * Free a task handle.
+ *
+ * Does not cancel the task: it still runs and calls its completion callback.
+ * Passing NULL is a safe no-op.
+ *
+ * @param task  Task handle, or NULL.
+ */
+extern void lch_task_free(lch_task_t *task);
+
 /**
  * Free a library-owned buffer.
  *
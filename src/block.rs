@@ -1,19 +1,26 @@
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::fmt;
 use std::path::Path;
-use std::time::SystemTime;
+use std::sync::Mutex;
+use std::time::{Instant, SystemTime};
 
 use anyhow::{Context, Result, bail};
 use prost::Message;
+use prost::encoding::{WireType, decode_key, decode_varint};
 
 use crate::callbacks::Callbacks;
+use crate::chain::{self, BlockSummary};
 use crate::config::Config;
 use crate::delta;
 use crate::head;
-use crate::proto::block::{BlockHeader, TableChange};
+use crate::pack;
+use crate::proto::block::{BlockHeader, TableChange, TableChangeSummary};
 use crate::proto::delta::Delta as ProtoDelta;
+use crate::proto::state::State as ProtoState;
 use crate::state;
 use crate::storage;
+use crate::table::SortedTable;
+use crate::trace::{self, BlockStages, BlockTrace, TableLoad};
 use crate::truncate;
 use crate::utils;
 
@@ -51,27 +58,239 @@ impl fmt::Display for Block {
     }
 }
 
+/// Bytes read from the start of a block file when only its header is needed.
+/// The parent hash and timestamp take well under 100 bytes, so this almost
+/// always covers the whole header.
+const HEADER_PREFIX_LEN: usize = 256;
+
+/// Field tag of `Block::payload`, the first field that is not part of
+/// [`BlockHeader`].
+const PAYLOAD_TAG: u32 = 3;
+
+/// Length of the leading [`BlockHeader`] fields in an encoded block. prost
+/// writes fields in tag order, so the header is everything before the first
+/// payload field. Returns `None` when `data` is too short to tell, i.e. the
+/// scan ran into the end of `data` inside a field; reaching the end of `data`
+/// exactly on a field boundary returns `data.len()`.
+fn header_len(data: &[u8]) -> Option<usize> {
+    let mut rest = data;
+    while !rest.is_empty() {
+        let offset = data.len() - rest.len();
+        let (tag, wire_type) = decode_key(&mut rest).ok()?;
+        if tag >= PAYLOAD_TAG {
+            return Some(offset);
+        }
+        let skip = match wire_type {
+            WireType::Varint => {
+                decode_varint(&mut rest).ok()?;
+                0
+            }
+            WireType::LengthDelimited => usize::try_from(decode_varint(&mut rest).ok()?).ok()?,
+            WireType::SixtyFourBit => 8,
+            WireType::ThirtyTwoBit => 4,
+            _ => return None,
+        };
+        rest = rest.get(skip..)?;
+    }
+    Some(data.len())
+}
+
+/// Whether block `hash` has a loose file. Checked before reading it, since
+/// taking the lock of a block that has moved into the pack would recreate its
+/// lock file. Truncation packs a block before removing its loose file, so a
+/// block that is not loose here is found in the pack.
+fn is_loose(work_dir: &Path, hash: &str) -> bool {
+    work_dir.join(hash).exists()
+}
+
+/// Stored names of the tables whose partition count changed since the
+/// previous block. Records move between partitions then, and the deltas of
+/// different partitions are applied in no particular order, so such a table
+/// is shipped as a whole instead: the diffs of its previous and current
+/// partitions are dropped, and each current partition is recorded as a
+/// layout change.
+#[derive(Debug, Default)]
+struct Repartitioned {
+    /// Previous and current stored names, whose diffs are dropped.
+    dropped: HashSet<String>,
+    /// Current stored names, recorded as layout changes.
+    current: Vec<String>,
+}
+
+impl Repartitioned {
+    /// Compare the tables stored as `previous_names` in the previous block
+    /// against the partitions `config` declares now.
+    fn find(config: &Config, previous_names: &HashSet<String>) -> Self {
+        let mut previous_groups: HashMap<&str, HashSet<&str>> = HashMap::new();
+        for stored_name in previous_names {
+            if let Some((name, _)) = config.table_of(stored_name) {
+                previous_groups
+                    .entry(name)
+                    .or_default()
+                    .insert(stored_name.as_str());
+            }
+        }
+        let mut repartitioned = Repartitioned::default();
+        for (name, stored) in previous_groups {
+            let Some(table_config) = config.tables.get(name) else {
+                continue;
+            };
+            let current = table_config.stored_names(name);
+            if current.len() == stored.len()
+                && current
+                    .iter()
+                    .all(|stored_name| stored.contains(stored_name.as_str()))
+            {
+                continue;
+            }
+            log::warn!(
+                "Table '{}': partition count changed, will use full state",
+                name
+            );
+            repartitioned
+                .dropped
+                .extend(stored.into_iter().map(str::to_string));
+            repartitioned.dropped.extend(current.iter().cloned());
+            repartitioned.current.extend(current);
+        }
+        repartitioned
+    }
+}
+
+/// Incremental encoder of a block. The header is encoded first, and each
+/// table change is appended as one `payload` map entry as soon as it is
+/// ready. Concatenated protobuf fields decode as a single message, so the
+/// result is an ordinary encoded [`Block`]. The SHA-1 is updated with every
+/// piece, so hashing overlaps with the diffs still running and the decoded
+/// deltas never need to be held together.
+struct BlockEncoder {
+    header: BlockHeader,
+    encoded: Vec<u8>,
+    hasher: utils::StreamHasher,
+    tables: HashMap<String, TableChangeSummary>,
+}
+
+/// One table change, encoded as a `payload` map entry of a [`Block`].
+struct EncodedChange {
+    name: String,
+    summary: TableChangeSummary,
+    bytes: Vec<u8>,
+}
+
+impl EncodedChange {
+    fn new(name: String, change: TableChange) -> Self {
+        let summary = TableChangeSummary::from(&change);
+        // A block with nothing but this entry: prost skips the empty parent
+        // and timestamp, leaving exactly the encoded map entry.
+        let entry = Block {
+            payload: HashMap::from([(name.clone(), change)]),
+            ..Default::default()
+        };
+        EncodedChange {
+            name,
+            summary,
+            bytes: entry.encode_to_vec(),
+        }
+    }
+}
+
+impl BlockEncoder {
+    fn new(header: BlockHeader) -> Self {
+        let encoded = header.encode_to_vec();
+        let mut hasher = utils::StreamHasher::default();
+        hasher.update(&encoded);
+        BlockEncoder {
+            header,
+            encoded,
+            hasher,
+            tables: HashMap::new(),
+        }
+    }
+
+    fn append(&mut self, change: EncodedChange) {
+        self.hasher.update(&change.bytes);
+        self.encoded.extend_from_slice(&change.bytes);
+        self.tables.insert(change.name, change.summary);
+    }
+
+    fn contains(&self, name: &str) -> bool {
+        self.tables.contains_key(name)
+    }
+
+    /// The hash, the encoded block and its summary.
+    fn finish(self) -> (String, Vec<u8>, BlockSummary) {
+        let hash = self.hasher.finish();
+        let summary =
+            BlockSummary::from_header(&hash, self.header, self.encoded.len(), self.tables);
+        (hash, self.encoded, summary)
+    }
+}
+
 impl Block {
     pub fn load(work_dir: &Path, hash: &str, mode: u32) -> Result<Block> {
-        let Some(data) = storage::load(work_dir, hash, mode)? else {
+        Self::load_with_buffer(work_dir, hash, mode, &mut Vec::new())
+    }
+
+    /// Like [`Block::load`], but reads the block file into `buf` so callers
+    /// loading many blocks in a row reuse one allocation for the raw bytes.
+    pub fn load_with_buffer(
+        work_dir: &Path,
+        hash: &str,
+        mode: u32,
+        buf: &mut Vec<u8>,
+    ) -> Result<Block> {
+        let loaded = is_loose(work_dir, hash) && storage::load_into(work_dir, hash, mode, buf)?;
+        if !loaded && !pack::load_into(work_dir, hash, mode, buf)? {
             bail!("failed to load block '{:.7}...'", hash);
-        };
-        let block = Block::decode(data.as_slice())
+        }
+        let block = Block::decode(buf.as_slice())
             .with_context(|| format!("failed to decode block '{:.7}...'", hash))?;
         log::debug!("Loaded block '{:.7}...'", hash);
         Ok(block)
     }
 
+    /// Whether block `hash` is stored, as a loose file or in the pack.
+    pub fn is_stored(work_dir: &Path, hash: &str, mode: u32) -> bool {
+        is_loose(work_dir, hash) || pack::contains(work_dir, hash, mode).unwrap_or(false)
+    }
+
     /// Load the block header (parent hash + created timestamp) without
-    /// decoding the full payload. Reads the block file and decodes it as a
-    /// [`BlockHeader`], which shares field tags with [`Block`] — prost skips
-    /// the unknown payload field so only the parent hash and timestamp are
-    /// deserialized.
+    /// decoding the full payload. Only the first [`HEADER_PREFIX_LEN`] bytes
+    /// of the block file are read and decoded as a [`BlockHeader`], which
+    /// shares field tags with [`Block`]. Falls back to reading the whole file
+    /// if the header does not fit in that prefix; prost then skips the unknown
+    /// payload field. A packed block is decompressed whole.
     pub fn load_header(work_dir: &Path, hash: &str, mode: u32) -> Result<BlockHeader> {
-        let Some(data) = storage::load(work_dir, hash, mode)? else {
-            bail!("failed to load block '{:.7}...'", hash);
+        let prefix = if is_loose(work_dir, hash) {
+            storage::load_prefix(work_dir, hash, mode, HEADER_PREFIX_LEN)?
+        } else {
+            None
+        };
+        let Some(mut data) = prefix else {
+            let mut data = Vec::new();
+            if !pack::load_into(work_dir, hash, mode, &mut data)? {
+                bail!("failed to load block '{:.7}...'", hash);
+            }
+            let len = header_len(&data).unwrap_or(data.len());
+            return BlockHeader::decode(&data[..len])
+                .with_context(|| format!("failed to decode block header '{:.7}...'", hash));
+        };
+        let is_whole_file = data.len() < HEADER_PREFIX_LEN;
+        let len = match header_len(&data) {
+            Some(len) if len < data.len() || is_whole_file => len,
+            _ => {
+                log::trace!(
+                    "Header of block '{:.7}...' exceeds prefix, reading whole file",
+                    hash
+                );
+                let Some(whole) = storage::load(work_dir, hash, mode)? else {
+                    bail!("failed to load block '{:.7}...'", hash);
+                };
+                data = whole;
+                data.len()
+            }
         };
-        let header = BlockHeader::decode(data.as_slice())
+        let header = BlockHeader::decode(&data[..len])
             .with_context(|| format!("failed to decode block header '{:.7}...'", hash))?;
         log::debug!("Loaded block header '{:.7}...'", hash);
         Ok(header)
@@ -81,72 +300,230 @@ impl Block {
     /// through `callbacks`. Pass `None` when every table in `config` is
     /// CSV-backed.
     ///
-    /// The write window — store the new block file, then store STATE, then
-    /// advance HEAD — is held under an exclusive lock on `.chain.lock` so a
-    /// concurrent truncation cannot observe the new block file before HEAD
-    /// points at it (which would orphan-mark and delete it). After HEAD
-    /// advances, truncation is kicked off on a background thread; use
-    /// [`truncate::wait_for_pending`] to observe its completion.
+    /// The write window -- commit the new block file, STATE and HEAD in one
+    /// `storage::Transaction` (file by file, or as a single journal record),
+    /// then append to the `BLOCKS` index -- is held under an exclusive lock
+    /// on `.chain.lock` so a concurrent truncation cannot observe the new
+    /// block file before HEAD points at it (which would orphan-mark and
+    /// delete it). After HEAD advances, truncation is kicked off on a
+    /// background thread; use [`truncate::wait_for_pending`] to observe its
+    /// completion.
     pub fn create(config: &Config, callbacks: Option<&Callbacks>) -> Result<String> {
+        let start = Instant::now();
+        let mut stages = BlockStages::default();
         let state_dir = config.ensure_state_dir()?;
         let file_mode = config.file_mode;
-        let current_state =
-            state::State::compute(config, callbacks).context("failed to compute current state")?;
 
+        storage::recover_journal(&state_dir, file_mode, config.dry_run)
+            .context("failed to recover journal")?;
         let parent_hash =
             head::load(&state_dir, file_mode).context("failed to load head of chain")?;
+        let genesis = parent_hash == utils::GENESIS_HASH;
+
+        // The previous index tells which CSV sources are unchanged since the
+        // last block. Those tables are neither parsed nor diffed, and STATE
+        // keeps pointing at their existing segments.
+        let previous_index = if genesis {
+            None
+        } else {
+            ProtoState::load_index(&state_dir, file_mode)
+                .context("failed to load previous state")?
+        };
+        let previous_sources = previous_index
+            .as_ref()
+            .map(|index| index.source_fingerprints(&state_dir))
+            .unwrap_or_default();
+        let lap = Instant::now();
+        let (current_state, sources) = state::State::compute(config, callbacks, &previous_sources)
+            .context("failed to compute current state")?;
+        stages.load_ms = trace::ms(lap.elapsed());
+        let resident = if config.resident_state && !genesis && !config.dry_run {
+            state::ResidentState::take(config, &parent_hash)
+        } else {
+            None
+        };
 
         let created = Some(SystemTime::now().into());
+        let mut encoder = Mutex::new(BlockEncoder::new(BlockHeader {
+            parent: parent_hash,
+            created,
+        }));
 
         // When starting a fresh chain (HEAD is genesis), store an empty payload.
         // The first block's deltas are never used during patch creation: a genesis
         // reference always produces a full state patch from the STATE file, and
         // non-genesis references exclude the first block from consolidation.
         // Any stale STATE file left from a previous run is also ignored.
-        let payload = if parent_hash == utils::GENESIS_HASH {
-            HashMap::new()
+        //
+        // With `resident-state`, the tables of unchanged sources are kept for
+        // the next block instead, so they are loaded (or taken from memory) too.
+        let (unchanged, kept) = if genesis {
+            (HashSet::new(), HashMap::new())
         } else {
-            let previous_state = state::State::load(&state_dir, file_mode)
-                .context("failed to load previous state")?;
+            let lap = Instant::now();
+            let previous_tables = match resident {
+                Some(tables) => tables,
+                None => {
+                    let mut index = previous_index.unwrap_or_default();
+                    if !config.resident_state {
+                        index
+                            .segments
+                            .retain(|name, _| !sources.unchanged.contains(name));
+                    }
+                    state::State::sorted_from_index(index, &state_dir, file_mode)
+                        .context("failed to load previous state")?
+                }
+            };
+            let (previous_tables, kept): (HashMap<_, _>, HashMap<_, _>) = previous_tables
+                .into_iter()
+                .partition(|(name, _)| !sources.unchanged.contains(name));
+            let previous_names: HashSet<String> = previous_tables.keys().cloned().collect();
+            stages.previous_ms = trace::ms(lap.elapsed());
+
+            // Each table's delta is encoded on the worker that computed it
+            // and dropped right away; only the appending to the block and
+            // its hash is serialized.
+            let lap = Instant::now();
+            let repartitioned = Repartitioned::find(config, &previous_names);
+            delta::Delta::compute_sorted_with(
+                previous_tables,
+                &current_state,
+                config.threads,
+                |name, delta| {
+                    if repartitioned.dropped.contains(&name) {
+                        return;
+                    }
+                    let change = EncodedChange::new(name, TableChange::from(delta));
+                    encoder
+                        .lock()
+                        .unwrap_or_else(|e| e.into_inner())
+                        .append(change);
+                },
+            );
+            let encoder = encoder.get_mut().unwrap_or_else(|e| e.into_inner());
+            for stored_name in repartitioned.current {
+                encoder.append(EncodedChange::new(stored_name, TableChange { delta: None }));
+            }
+            stages.diff_ms = trace::ms(lap.elapsed());
 
-            delta::Delta::compute(previous_state, &current_state)
+            // Tables that existed before and produced no change are identical
+            // to the stored state, so STATE can re-reference their segments.
+            let unchanged = previous_names
                 .into_iter()
-                .map(|(name, delta)| (name, TableChange::from(delta)))
-                .collect()
+                .filter(|name| current_state.tables.contains_key(name) && !encoder.contains(name))
+                .collect();
+            (unchanged, kept)
         };
 
-        let block = Block {
-            parent: parent_hash,
-            created,
-            payload,
-        };
-        let mut encoded = Vec::new();
-        block
-            .encode(&mut encoded)
-            .context("failed to encode block")?;
-        let hash = utils::compute_hash(&encoded);
+        let lap = Instant::now();
+        let (hash, encoded, summary) = encoder
+            .into_inner()
+            .unwrap_or_else(|e| e.into_inner())
+            .finish();
+        stages.encode_ms = trace::ms(lap.elapsed());
 
         if !config.dry_run {
-            log::info!("Created block '{:.7}...': {}", hash, block);
+            log::info!(
+                "Created block '{:.7}...' ({} table(s) changed, {} bytes)",
+                hash,
+                summary.tables.len(),
+                summary.size
+            );
+            // The block is not held decoded, so it is only decoded again to
+            // show it when someone is listening.
+            if log::log_enabled!(log::Level::Debug) {
+                let block = Block::decode(encoded.as_slice()).context("failed to decode block")?;
+                log::debug!("Block '{:.7}...': {}", hash, block);
+            }
         } else {
             // `dry_run` is only ever set by the CLI, so this stdout print never
             // reaches FFI consumers. Show the block that would have been created.
+            let block = Block::decode(encoded.as_slice()).context("failed to decode block")?;
             println!("Would have created block '{:.7}...'\n{}", hash, block);
         }
 
+        let lap = Instant::now();
         let chain_lock = storage::acquire_lock(&state_dir, "chain", true, file_mode)
             .context("failed to acquire chain lock")?;
 
-        storage::store(&state_dir, &hash, &encoded, file_mode, config.dry_run)
-            .with_context(|| format!("failed to store block {:.7}", hash))?;
-
+        // The block, its state and HEAD are committed together: either file
+        // by file, or as a single journal record with one fsync.
+        let mut transaction = storage::Transaction::default();
+        transaction.store(&hash, encoded);
         current_state
-            .store(&state_dir, file_mode, config.dry_run)
+            .stage(
+                &mut transaction,
+                &state_dir,
+                file_mode,
+                &unchanged,
+                &sources,
+            )
             .context("failed to store current state")?;
-        head::store(&state_dir, &hash, file_mode, config.dry_run)
-            .context("failed to update head of state")?;
+        head::stage(&mut transaction, &hash);
+        let committed = if config.journal.enable {
+            transaction.commit_journaled(
+                &state_dir,
+                config.journal.checkpoint_size,
+                file_mode,
+                config.dry_run,
+            )
+        } else {
+            transaction.apply(&state_dir, file_mode, config.dry_run)
+        };
+        committed.with_context(|| format!("failed to store block {:.7}", hash))?;
+
+        // The index only accelerates chain walks, so with the journal enabled
+        // its append is not synced and the commit keeps its single fsync.
+        chain::append(
+            &state_dir,
+            &summary,
+            file_mode,
+            !config.journal.enable,
+            config.dry_run,
+        )
+        .context("failed to update block index")?;
+        log::debug!("Updated head to '{:.7}...'", hash);
 
         drop(chain_lock);
+        stages.commit_ms = trace::ms(lap.elapsed());
+
+        if config.stats.trace {
+            let mut record = BlockTrace::new(hash.clone());
+            record.stages = stages;
+            record.bytes = summary.size;
+            for (name, elapsed) in &sources.load_times {
+                let stored_names = config
+                    .tables
+                    .get(name)
+                    .map(|table_config| table_config.stored_names(name))
+                    .unwrap_or_default();
+                let table = TableLoad {
+                    rows: stored_names
+                        .iter()
+                        .filter_map(|stored_name| current_state.tables.get(stored_name))
+                        .map(|table| table.records.len() as u64)
+                        .sum(),
+                    load_ms: trace::ms(*elapsed),
+                    skipped: stored_names
+                        .iter()
+                        .any(|stored_name| sources.unchanged.contains(stored_name)),
+                };
+                record.tables.insert(name.clone(), table);
+            }
+            record.duration_ms = trace::ms(start.elapsed());
+            trace::record(config, &record);
+        }
+
+        if config.resident_state && !config.dry_run {
+            let mut tables = kept;
+            tables.extend(
+                current_state
+                    .tables
+                    .into_iter()
+                    .map(|(name, table)| (name, SortedTable::from(table))),
+            );
+            state::ResidentState::keep(config, hash.clone(), tables);
+        }
 
         // In dry-run this reports what truncation would remove; otherwise it
         // kicks off the real cleanup on a background thread.
@@ -195,6 +572,80 @@ mod tests {
         assert_eq!(header.created, block.created);
     }
 
+    fn block_with_payload() -> Block {
+        let mut block = dummy_block();
+        let delta = ProtoDelta {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: vec!["name".to_string(); 64],
+            ..Default::default()
+        };
+        block
+            .payload
+            .insert("users".to_string(), TableChange { delta: Some(delta) });
+        block
+    }
+
+    #[test]
+    fn test_header_len_stops_at_payload() {
+        let block = block_with_payload();
+        let buf = block.encode_to_vec();
+        assert!(buf.len() > HEADER_PREFIX_LEN);
+
+        let len = header_len(&buf).unwrap();
+        assert!(len < buf.len());
+        let header = BlockHeader::decode(&buf[..len]).unwrap();
+        assert_eq!(header.parent, block.parent);
+        assert_eq!(header.created, block.created);
+
+        // A prefix cut inside a header field can't be measured.
+        assert_eq!(header_len(&buf[..3]), None);
+    }
+
+    #[test]
+    fn test_load_header_reads_prefix_and_whole_file() {
+        let dir = tempfile::tempdir().unwrap();
+        for block in [dummy_block(), block_with_payload()] {
+            let buf = block.encode_to_vec();
+            let hash = utils::compute_hash(&buf);
+            storage::store(dir.path(), &hash, &buf, 0o600, false).unwrap();
+
+            let header = Block::load_header(dir.path(), &hash, 0o600).unwrap();
+            assert_eq!(header.parent, block.parent);
+            assert_eq!(header.created, block.created);
+
+            let mut reused = Vec::new();
+            let loaded = Block::load_with_buffer(dir.path(), &hash, 0o600, &mut reused).unwrap();
+            assert_eq!(loaded, block);
+        }
+    }
+
+    #[test]
+    fn test_encoder_matches_block_encoding() {
+        let mut block = block_with_payload();
+        block
+            .payload
+            .insert("orders".to_string(), TableChange { delta: None });
+
+        let mut encoder = BlockEncoder::new(BlockHeader {
+            parent: block.parent.clone(),
+            created: block.created,
+        });
+        for (name, change) in block.payload.clone() {
+            encoder.append(EncodedChange::new(name, change));
+        }
+        assert!(encoder.contains("users") && !encoder.contains("items"));
+        let (hash, encoded, summary) = encoder.finish();
+
+        assert_eq!(hash, utils::compute_hash(&encoded));
+        assert_eq!(Block::decode(encoded.as_slice()).unwrap(), block);
+        assert_eq!(summary, BlockSummary::new(&hash, &block, encoded.len()));
+        let len = header_len(&encoded).unwrap();
+        assert_eq!(
+            BlockHeader::decode(&encoded[..len]).unwrap().parent,
+            block.parent
+        );
+    }
+
     #[test]
     fn test_block_display() {
         let block = dummy_block();
@@ -3,9 +3,10 @@
 //! mirror of `lch_callbacks_t` from `leech2.h`; it is bound to one table at
 //! a time via [`Callbacks::for_table`].
 //!
-//! Not `Send`/`Sync`: callbacks are invoked exclusively on the thread that
-//! called `lch_block_create`, and the raw `usr_data` pointer is the C
-//! caller's responsibility.
+//! Not `Send`/`Sync`: callbacks are invoked on the thread that called
+//! `lch_block_create`, and the raw `usr_data` pointer is the C caller's
+//! responsibility. Tables marked `thread-safe` in the config are the one
+//! exception; they reach worker threads through [`ThreadSafeCallbacks`].
 
 use std::ffi::{CString, c_char, c_void};
 
@@ -27,6 +28,17 @@ type ReadCellFn = unsafe extern "C" fn(
     *mut c_void,
 ) -> i32;
 type DestroyCellFn = unsafe extern "C" fn(*mut FfiCell, *mut c_void);
+type ReadBatchFn = unsafe extern "C" fn(
+    *const c_char,
+    *const *const c_char,
+    usize,
+    usize,
+    usize,
+    *mut FfiCell,
+    *mut usize,
+    *mut c_void,
+) -> i32;
+type DestroyBatchFn = unsafe extern "C" fn(*mut FfiCell, usize, usize, *mut c_void);
 
 /// ABI-compatible mirror of `lch_callbacks_t` from `leech2.h`. Function fields
 /// use `Option<unsafe extern "C" fn ...>` so a NULL function pointer on the C
@@ -38,6 +50,35 @@ pub struct Callbacks {
     pub destroy_cell: Option<DestroyCellFn>,
     pub table_end: Option<TableEndFn>,
     pub usr_data: *mut c_void,
+    pub read_batch: Option<ReadBatchFn>,
+    pub destroy_batch: Option<DestroyBatchFn>,
+}
+
+/// A [`Callbacks`] reference that may cross into worker threads. Only handed
+/// out for tables whose config declares `thread-safe = true`, i.e. where the C
+/// caller promised that its callbacks and `usr_data` tolerate concurrent
+/// invocation for different tables.
+#[derive(Clone, Copy)]
+pub struct ThreadSafeCallbacks<'a> {
+    inner: &'a Callbacks,
+}
+
+// SAFETY: the C caller opted in via `thread-safe = true`; see `new`.
+unsafe impl Send for ThreadSafeCallbacks<'_> {}
+unsafe impl Sync for ThreadSafeCallbacks<'_> {}
+
+impl<'a> ThreadSafeCallbacks<'a> {
+    /// # Safety
+    ///
+    /// The callbacks in `inner` and its `usr_data` must be safe to invoke from
+    /// any thread, concurrently for different tables.
+    pub unsafe fn new(inner: &'a Callbacks) -> Self {
+        Self { inner }
+    }
+
+    pub fn get(&self) -> &'a Callbacks {
+        self.inner
+    }
 }
 
 /// Outcome of a single `lch_read_cell_cb_t` invocation, after translating
@@ -51,6 +92,14 @@ pub enum CellResult {
     SkipRecord,
 }
 
+/// Outcome of a single `lch_read_batch_cb_t` invocation.
+pub enum BatchResult {
+    /// `LCH_SUCCESS`: this many rows were decoded into the output buffer.
+    Rows(usize),
+    /// `LCH_END_OF_TABLE`: the table is drained.
+    EndOfTable,
+}
+
 impl Callbacks {
     /// Bind this callback bundle to one table. The returned handle owns the
     /// pre-encoded C strings for the table name and every field, so the inner
@@ -67,10 +116,14 @@ impl Callbacks {
                 )
             })?);
         }
+        // The CString buffers live on the heap, so these pointers stay valid
+        // for as long as `field_cstrings` does.
+        let field_ptrs = field_cstrings.iter().map(|field| field.as_ptr()).collect();
         Ok(TableCallbacks {
             inner: self,
             table_c,
             field_cstrings,
+            field_ptrs,
         })
     }
 }
@@ -82,6 +135,8 @@ pub struct TableCallbacks<'a> {
     inner: &'a Callbacks,
     table_c: CString,
     field_cstrings: Vec<CString>,
+    /// `field_cstrings` as the pointer array handed to `read_batch`.
+    field_ptrs: Vec<*const c_char>,
 }
 
 impl TableCallbacks<'_> {
@@ -172,6 +227,105 @@ impl TableCallbacks<'_> {
         }
     }
 
+    /// Whether the bundle provides `read_batch`. When it does, tables are
+    /// pulled a block of rows at a time and `read_cell` is not used.
+    pub fn has_read_batch(&self) -> bool {
+        self.inner.read_batch.is_some()
+    }
+
+    /// Invoke the optional `read_batch` hook for up to `max_rows` rows,
+    /// starting with row `first_row`. On success `out` holds the decoded
+    /// cells of every returned row in row-major order, one cell per field in
+    /// declaration order.
+    pub fn read_batch(
+        &self,
+        first_row: usize,
+        max_rows: usize,
+        out: &mut Vec<Cell>,
+    ) -> Result<BatchResult> {
+        let Some(cb) = self.inner.read_batch else {
+            bail!(
+                "table '{}' has no read_batch callback",
+                self.table_c.to_string_lossy()
+            );
+        };
+        let num_cols = self.field_cstrings.len();
+        let capacity = max_rows
+            .checked_mul(num_cols)
+            .context("read_batch block size overflows")?;
+        let mut cells: Vec<FfiCell> = (0..capacity)
+            .map(|_| FfiCell {
+                kind: VALUE_NULL,
+                payload: FfiCellPayload { number: 0.0 },
+            })
+            .collect();
+        let mut num_rows: usize = 0;
+        let rc = unsafe {
+            cb(
+                self.table_c.as_ptr(),
+                self.field_ptrs.as_ptr(),
+                num_cols,
+                first_row,
+                max_rows,
+                cells.as_mut_ptr(),
+                &mut num_rows,
+                self.inner.usr_data,
+            )
+        };
+        match rc {
+            SUCCESS => {}
+            END_OF_TABLE => return Ok(BatchResult::EndOfTable),
+            _ => bail!(
+                "read_batch callback returned failure for table '{}' at row {}",
+                self.table_c.to_string_lossy(),
+                first_row + 1,
+            ),
+        }
+        if num_rows == 0 || num_rows > max_rows {
+            self.destroy_batch(&mut cells, num_rows.min(max_rows));
+            bail!(
+                "read_batch callback for table '{}' returned {} rows; expected 1 to {}",
+                self.table_c.to_string_lossy(),
+                num_rows,
+                max_rows,
+            );
+        }
+
+        out.clear();
+        out.reserve(num_rows * num_cols);
+        let mut invalid = None;
+        for (index, ffi_cell) in cells[..num_rows * num_cols].iter().enumerate() {
+            match unsafe { cell_from_ffi("lch_block_create", ffi_cell) } {
+                Some(cell) => out.push(cell),
+                None => {
+                    invalid = Some(index);
+                    break;
+                }
+            }
+        }
+        // As with destroy_cell, hand the batch back before acting on a decode
+        // failure so the caller's storage is always released.
+        self.destroy_batch(&mut cells, num_rows);
+        if let Some(index) = invalid {
+            bail!(
+                "invalid cell from read_batch for table '{}' row {} field '{}'",
+                self.table_c.to_string_lossy(),
+                first_row + index / num_cols + 1,
+                self.field_cstrings[index % num_cols].to_string_lossy(),
+            );
+        }
+        Ok(BatchResult::Rows(num_rows))
+    }
+
+    /// Invoke the optional `destroy_batch` hook for the first `num_rows` rows
+    /// of a successfully read batch. A `None` hook is a no-op.
+    fn destroy_batch(&self, cells: &mut [FfiCell], num_rows: usize) {
+        if let Some(cb) = self.inner.destroy_batch {
+            let num_cols = self.field_cstrings.len();
+            unsafe { cb(cells.as_mut_ptr(), num_rows, num_cols, self.inner.usr_data) };
+        }
+    }
+
     /// Invoke the optional `destroy_cell` hook for a successfully read cell,
     /// regardless of kind. A `None` hook is a no-op.
     fn destroy_cell(&self, cell: &mut FfiCell) {
@@ -203,6 +357,8 @@ mod tests {
             destroy_cell: None,
             table_end: None,
             usr_data: std::ptr::null_mut(),
+            read_batch: None,
+            destroy_batch: None,
         }
     }
 
@@ -213,6 +369,8 @@ mod tests {
             destroy_cell: None,
             table_end: Some(fail_table_end),
             usr_data: std::ptr::null_mut(),
+            read_batch: None,
+            destroy_batch: None,
         }
     }
 
@@ -249,6 +407,8 @@ mod tests {
             destroy_cell: None,
             table_end: None,
             usr_data: std::ptr::null_mut(),
+            read_batch: None,
+            destroy_batch: None,
         }
     }
 
@@ -288,6 +448,8 @@ mod tests {
             destroy_cell: None,
             table_end: None,
             usr_data: std::ptr::null_mut(),
+            read_batch: None,
+            destroy_batch: None,
         };
         let bound = callbacks.for_table("t", &["id"]).unwrap();
         let err = match bound.read_cell(0, 0) {
@@ -345,13 +507,15 @@ mod tests {
             destroy_cell: Some(destroy_cell_free),
             table_end: None,
             usr_data: std::ptr::null_mut(),
+            read_batch: None,
+            destroy_batch: None,
         };
         let bound = callbacks.for_table("t", &["v"]).unwrap();
 
         // Each successful read_cell hands back exactly one destroy_cell call.
         for row in 0..2 {
             match bound.read_cell(row, 0).unwrap() {
-                CellResult::Cell(Cell::Text(text)) => assert_eq!(text, format!("value-{row}")),
+                CellResult::Cell(Cell::Text(text)) => assert_eq!(&*text, format!("value-{row}")),
                 _ => panic!("expected a text cell for row {row}"),
             }
         }
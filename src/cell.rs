@@ -1,5 +1,8 @@
+use std::cmp::Ordering;
+use std::collections::HashSet;
 use std::fmt;
 use std::hash::{Hash, Hasher};
+use std::sync::Arc;
 
 use anyhow::{Context, Result, bail};
 use regex::Regex;
@@ -13,10 +16,14 @@ use crate::proto::cell::cell::Kind as ProtoKind;
 /// representation wraps the variant in `Option<Kind>` because protobuf
 /// can't distinguish "the oneof was set to a default-valued variant" from
 /// "the oneof was never set"; the domain type has no such ambiguity.
+///
+/// Text is held as a shared `Arc<str>` so that tables loaded through an
+/// [`Interner`] store each distinct value once, however many rows repeat
+/// it, and cloning a cell never copies its bytes.
 #[derive(Clone, Debug)]
 pub enum Cell {
     Null,
-    Text(String),
+    Text(Arc<str>),
     Boolean(bool),
     Number(f64),
 }
@@ -90,6 +97,36 @@ impl Hash for Cell {
     }
 }
 
+/// Total order used to sort records by primary key (STATE is stored in this
+/// order so the previous snapshot can be diffed in a single merge pass).
+/// Variants order as `Null < Boolean < Number < Text`; numbers compare with
+/// `f64::total_cmp`, which agrees with the bitwise equality above because
+/// `Cell::number` rejects `NaN` and normalizes `-0.0`.
+impl Ord for Cell {
+    fn cmp(&self, other: &Self) -> Ordering {
+        fn rank(cell: &Cell) -> u8 {
+            match cell {
+                Cell::Null => 0,
+                Cell::Boolean(_) => 1,
+                Cell::Number(_) => 2,
+                Cell::Text(_) => 3,
+            }
+        }
+        match (self, other) {
+            (Cell::Text(a), Cell::Text(b)) => a.cmp(b),
+            (Cell::Boolean(a), Cell::Boolean(b)) => a.cmp(b),
+            (Cell::Number(a), Cell::Number(b)) => a.total_cmp(b),
+            _ => rank(self).cmp(&rank(other)),
+        }
+    }
+}
+
+impl PartialOrd for Cell {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
 impl fmt::Display for Cell {
     fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
         match self {
@@ -103,13 +140,13 @@ impl fmt::Display for Cell {
 
 impl From<&str> for Cell {
     fn from(s: &str) -> Self {
-        Cell::Text(s.to_string())
+        Cell::Text(s.into())
     }
 }
 
 impl From<String> for Cell {
     fn from(s: String) -> Self {
-        Cell::Text(s)
+        Cell::Text(s.into())
     }
 }
 
@@ -133,7 +170,7 @@ impl TryFrom<ProtoCell> for Cell {
     fn try_from(proto: ProtoCell) -> Result<Self> {
         match proto.kind {
             Some(ProtoKind::Null(())) => Ok(Cell::Null),
-            Some(ProtoKind::Text(s)) => Ok(Cell::Text(s)),
+            Some(ProtoKind::Text(s)) => Ok(Cell::Text(s.into())),
             Some(ProtoKind::Boolean(b)) => Ok(Cell::Boolean(b)),
             Some(ProtoKind::Number(n)) => Cell::number(n),
             None => bail!("Cell message has no kind set"),
@@ -147,7 +184,7 @@ impl TryFrom<&ProtoCell> for Cell {
     fn try_from(proto: &ProtoCell) -> Result<Self> {
         match &proto.kind {
             Some(ProtoKind::Null(())) => Ok(Cell::Null),
-            Some(ProtoKind::Text(s)) => Ok(Cell::Text(s.clone())),
+            Some(ProtoKind::Text(s)) => Ok(Cell::Text(s.as_str().into())),
             Some(ProtoKind::Boolean(b)) => Ok(Cell::Boolean(*b)),
             Some(ProtoKind::Number(n)) => Cell::number(*n),
             None => bail!("Cell message has no kind set"),
@@ -174,6 +211,50 @@ pub fn decode_proto_cells(protos: Vec<ProtoCell>) -> Result<Vec<Cell>> {
     Ok(out)
 }
 
+/// Deduplicates text values while a table is being built.
+///
+/// Configuration-style tables repeat the same strings (hostnames, package
+/// names, states) across many rows; routing every text cell through one
+/// interner per load makes those rows share a single allocation. The
+/// interner only lives for the duration of the load, so its own lookup set
+/// does not add to the steady-state footprint of the finished table.
+#[derive(Default)]
+pub struct Interner {
+    strings: HashSet<Arc<str>>,
+}
+
+impl Interner {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Return a text cell for `value`, reusing an earlier allocation of the
+    /// same string when there is one.
+    pub fn text(&mut self, value: &str) -> Cell {
+        if let Some(existing) = self.strings.get(value) {
+            return Cell::Text(Arc::clone(existing));
+        }
+        let shared: Arc<str> = value.into();
+        self.strings.insert(Arc::clone(&shared));
+        Cell::Text(shared)
+    }
+
+    /// Swap the text of an already-built cell for its interned copy. Non-text
+    /// cells pass through untouched.
+    pub fn intern(&mut self, cell: Cell) -> Cell {
+        match cell {
+            Cell::Text(s) => match self.strings.get(&*s) {
+                Some(existing) => Cell::Text(Arc::clone(existing)),
+                None => {
+                    self.strings.insert(Arc::clone(&s));
+                    Cell::Text(s)
+                }
+            },
+            other => other,
+        }
+    }
+}
+
 /// Build a `Vec<Cell>` of `Text` variants from a slice of `&str` — handy
 /// for test fixtures.
 #[cfg(test)]
@@ -205,7 +286,7 @@ impl From<Cell> for ProtoCell {
     fn from(cell: Cell) -> Self {
         let kind = match cell {
             Cell::Null => ProtoKind::Null(()),
-            Cell::Text(s) => ProtoKind::Text(s),
+            Cell::Text(s) => ProtoKind::Text(s.to_string()),
             Cell::Boolean(b) => ProtoKind::Boolean(b),
             Cell::Number(n) => ProtoKind::Number(n),
         };
@@ -281,7 +362,7 @@ fn describe_sentinel(pattern: Option<&Regex>, default: &str) -> String {
 pub fn parse_typed_cell(value: &str, kind: Kind) -> Result<Cell> {
     match kind {
         Kind::Null => bail!("cannot parse value as NULL"),
-        Kind::Text => Ok(Cell::Text(value.to_string())),
+        Kind::Text => Ok(Cell::Text(value.into())),
         Kind::Number => {
             let parsed: f64 = value
                 .parse()
@@ -349,7 +430,7 @@ mod tests {
 
     #[test]
     fn equality_across_variants_is_false() {
-        assert_ne!(Cell::Null, Cell::Text(String::new()));
+        assert_ne!(Cell::Null, Cell::Text("".into()));
         assert_ne!(Cell::Boolean(false), Cell::Number(0.0));
         assert_ne!(Cell::Text("true".into()), Cell::Boolean(true));
     }
@@ -383,7 +464,7 @@ mod tests {
         // hash differently — otherwise Boolean(false) and Number(0.0) and
         // Text("") could collide in a HashMap.
         let null_h = hash_of(&Cell::Null);
-        let text_h = hash_of(&Cell::Text(String::new()));
+        let text_h = hash_of(&Cell::Text("".into()));
         let bool_h = hash_of(&Cell::Boolean(false));
         let num_h = hash_of(&Cell::Number(0.0));
         // At least one pair differs; checking all-distinct is too strict
@@ -394,6 +475,34 @@ mod tests {
         assert_eq!(unique.len(), 4, "expected 4 distinct hashes: {hashes:?}");
     }
 
+    #[test]
+    fn ordering_is_total_and_matches_equality() {
+        let mut cells = vec![
+            Cell::Text("b".into()),
+            Cell::Number(2.0),
+            Cell::Null,
+            Cell::Text("a".into()),
+            Cell::Boolean(true),
+            Cell::Number(-1.5),
+            Cell::Boolean(false),
+        ];
+        cells.sort();
+        assert_eq!(
+            cells,
+            vec![
+                Cell::Null,
+                Cell::Boolean(false),
+                Cell::Boolean(true),
+                Cell::Number(-1.5),
+                Cell::Number(2.0),
+                Cell::Text("a".into()),
+                Cell::Text("b".into()),
+            ]
+        );
+        let zero = Cell::number(-0.0).unwrap();
+        assert_eq!(zero.cmp(&Cell::Number(0.0)), Ordering::Equal);
+    }
+
     #[test]
     fn proto_round_trip() {
         let cases = [
@@ -450,6 +559,21 @@ mod tests {
         assert_eq!(Cell::Boolean(true).kind(), Kind::Boolean);
     }
 
+    #[test]
+    fn test_interner_shares_equal_strings() {
+        let mut interner = Interner::new();
+        let (Cell::Text(a), Cell::Text(b), Cell::Text(c)) = (
+            interner.text("host"),
+            interner.intern(Cell::from("host")),
+            interner.text("other"),
+        ) else {
+            panic!("expected text cells");
+        };
+        assert!(Arc::ptr_eq(&a, &b));
+        assert!(!Arc::ptr_eq(&a, &c));
+        assert_eq!(interner.intern(Cell::Boolean(true)), Cell::Boolean(true));
+    }
+
     #[test]
     fn test_parse_typed_cell_rejects_null_kind() {
         assert!(parse_typed_cell("anything", Kind::Null).is_err());
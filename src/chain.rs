@@ -0,0 +1,271 @@
+//! The `BLOCKS` chain index.
+//!
+//! `BLOCKS` sits next to `HEAD` and holds one length-delimited
+//! [`BlockSummary`] per block: hash, parent, timestamp, encoded size and
+//! per-table change counts. `Block::create` appends to it under the chain
+//! lock, and `truncate::run` rewrites it to match the retained chain. Chain
+//! walks read it in one sequential read instead of opening every block file.
+//! The index only accelerates walks: blocks it has no entry for (e.g. written
+//! before it existed, or lost to a torn append) are read from their files.
+
+use std::collections::HashMap;
+use std::path::Path;
+
+use anyhow::Result;
+use prost::Message;
+
+use crate::block::Block;
+use crate::proto::block::{BlockHeader, TableChange, TableChangeSummary};
+use crate::storage;
+
+pub use crate::proto::block::BlockSummary;
+
+const BLOCKS_FILE: &str = "BLOCKS";
+
+impl From<&TableChange> for TableChangeSummary {
+    fn from(change: &TableChange) -> Self {
+        match &change.delta {
+            Some(delta) => TableChangeSummary {
+                inserts: delta.inserts.len() as u64,
+                updates: delta.updates.len() as u64,
+                deletes: delta.deletes.len() as u64,
+                layout_changed: false,
+            },
+            None => TableChangeSummary {
+                layout_changed: true,
+                ..Default::default()
+            },
+        }
+    }
+}
+
+impl From<&BlockSummary> for BlockHeader {
+    fn from(summary: &BlockSummary) -> Self {
+        BlockHeader {
+            parent: summary.parent.clone(),
+            created: summary.created,
+        }
+    }
+}
+
+impl BlockSummary {
+    /// Summarize `block`, stored as `hash` with an encoded size of `size`
+    /// bytes.
+    pub fn new(hash: &str, block: &Block, size: usize) -> Self {
+        let header = BlockHeader {
+            parent: block.parent.clone(),
+            created: block.created,
+        };
+        let tables = block
+            .payload
+            .iter()
+            .map(|(name, change)| (name.clone(), TableChangeSummary::from(change)))
+            .collect();
+        BlockSummary::from_header(hash, header, size, tables)
+    }
+
+    /// Summarize a block that is not held decoded, from its `header` and
+    /// the summaries of its table changes.
+    pub fn from_header(
+        hash: &str,
+        header: BlockHeader,
+        size: usize,
+        tables: HashMap<String, TableChangeSummary>,
+    ) -> Self {
+        BlockSummary {
+            hash: hash.to_string(),
+            parent: header.parent,
+            created: header.created,
+            size: size as u64,
+            tables,
+        }
+    }
+}
+
+/// In-memory view of the `BLOCKS` index, keyed by block hash.
+#[derive(Debug, Default)]
+pub struct ChainIndex {
+    summaries: HashMap<String, BlockSummary>,
+}
+
+impl ChainIndex {
+    /// Load the index from `work_dir`. A missing or unreadable index is
+    /// empty, and a torn record at the end is dropped along with anything
+    /// after it; those blocks are then read from their files.
+    pub fn load(work_dir: &Path, mode: u32) -> Self {
+        let data = match storage::load(work_dir, BLOCKS_FILE, mode) {
+            Ok(Some(data)) => data,
+            Ok(None) => return ChainIndex::default(),
+            Err(e) => {
+                log::warn!("Ignoring unreadable {} index: {:#}", BLOCKS_FILE, e);
+                return ChainIndex::default();
+            }
+        };
+
+        let mut summaries = HashMap::new();
+        let mut rest = data.as_slice();
+        while !rest.is_empty() {
+            let remaining = rest.len();
+            match BlockSummary::decode_length_delimited(&mut rest) {
+                Ok(summary) => {
+                    summaries.insert(summary.hash.clone(), summary);
+                }
+                Err(e) => {
+                    log::warn!(
+                        "Ignoring {} trailing byte(s) of {} index: {}",
+                        remaining,
+                        BLOCKS_FILE,
+                        e
+                    );
+                    break;
+                }
+            }
+        }
+        log::debug!(
+            "Loaded {} index with {} block(s)",
+            BLOCKS_FILE,
+            summaries.len()
+        );
+        ChainIndex { summaries }
+    }
+
+    pub fn len(&self) -> usize {
+        self.summaries.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.summaries.is_empty()
+    }
+
+    pub fn get(&self, hash: &str) -> Option<&BlockSummary> {
+        self.summaries.get(hash)
+    }
+
+    /// Parent and timestamp of block `hash`: from the index when it has an
+    /// entry, otherwise from the block file via [`Block::load_header`].
+    pub fn header(&self, work_dir: &Path, hash: &str, mode: u32) -> Result<BlockHeader> {
+        match self.summaries.get(hash) {
+            Some(summary) => Ok(BlockHeader::from(summary)),
+            None => Block::load_header(work_dir, hash, mode),
+        }
+    }
+
+    /// Summary of block `hash`: from the index when it has an entry,
+    /// otherwise computed by loading the block file.
+    pub fn summary(&self, work_dir: &Path, hash: &str, mode: u32) -> Result<BlockSummary> {
+        match self.summaries.get(hash) {
+            Some(summary) => Ok(summary.clone()),
+            None => {
+                let block = Block::load(work_dir, hash, mode)?;
+                Ok(BlockSummary::new(hash, &block, block.encoded_len()))
+            }
+        }
+    }
+}
+
+/// Append `summary` to the index. Must be called under the chain lock. With
+/// `sync` unset the append is not fsynced; a crash then at worst drops the
+/// entry, which the index tolerates.
+pub(crate) fn append(
+    work_dir: &Path,
+    summary: &BlockSummary,
+    mode: u32,
+    sync: bool,
+    dry_run: bool,
+) -> Result<()> {
+    let data = summary.encode_length_delimited_to_vec();
+    storage::append(work_dir, BLOCKS_FILE, &data, mode, sync, dry_run)
+}
+
+/// Replace the index with `summaries`, oldest block first. Must be called
+/// under the chain lock. Nothing is written when `dry_run` is set.
+pub(crate) fn store<'a>(
+    work_dir: &Path,
+    summaries: impl IntoIterator<Item = &'a BlockSummary>,
+    mode: u32,
+    dry_run: bool,
+) -> Result<()> {
+    if dry_run {
+        return Ok(());
+    }
+    let mut data = Vec::new();
+    for summary in summaries {
+        data.extend_from_slice(&summary.encode_length_delimited_to_vec());
+    }
+    storage::store(work_dir, BLOCKS_FILE, &data, mode, false)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::proto::delta::Delta as ProtoDelta;
+
+    fn summary(hash: &str, parent: &str) -> BlockSummary {
+        let mut block = Block {
+            parent: parent.to_string(),
+            created: Some(prost_types::Timestamp {
+                seconds: 1700000000,
+                nanos: 0,
+            }),
+            payload: HashMap::new(),
+        };
+        block.payload.insert(
+            "users".to_string(),
+            TableChange {
+                delta: Some(ProtoDelta::default()),
+            },
+        );
+        block
+            .payload
+            .insert("orders".to_string(), TableChange { delta: None });
+        BlockSummary::new(hash, &block, 42)
+    }
+
+    #[test]
+    fn test_append_then_load() {
+        let dir = tempfile::tempdir().unwrap();
+        append(dir.path(), &summary("b1", "b0"), 0o600, true, false).unwrap();
+        append(dir.path(), &summary("b2", "b1"), 0o600, true, false).unwrap();
+
+        let index = ChainIndex::load(dir.path(), 0o600);
+        assert_eq!(index.len(), 2);
+        let entry = index.get("b2").unwrap();
+        assert_eq!(entry.parent, "b1");
+        assert_eq!(entry.size, 42);
+        assert!(!entry.tables["users"].layout_changed);
+        assert!(entry.tables["orders"].layout_changed);
+        assert_eq!(index.header(dir.path(), "b1", 0o600).unwrap().parent, "b0");
+    }
+
+    #[test]
+    fn test_load_drops_torn_tail() {
+        let dir = tempfile::tempdir().unwrap();
+        append(dir.path(), &summary("b1", "b0"), 0o600, true, false).unwrap();
+        let torn = summary("b2", "b1").encode_length_delimited_to_vec();
+        storage::append(
+            dir.path(),
+            BLOCKS_FILE,
+            &torn[..torn.len() / 2],
+            0o600,
+            true,
+            false,
+        )
+        .unwrap();
+
+        let index = ChainIndex::load(dir.path(), 0o600);
+        assert_eq!(index.len(), 1);
+        assert!(index.get("b1").is_some());
+    }
+
+    #[test]
+    fn test_store_replaces_index() {
+        let dir = tempfile::tempdir().unwrap();
+        append(dir.path(), &summary("b1", "b0"), 0o600, true, false).unwrap();
+        store(dir.path(), [&summary("b2", "b1")], 0o600, false).unwrap();
+
+        let index = ChainIndex::load(dir.path(), 0o600);
+        assert_eq!(index.len(), 1);
+        assert!(index.get("b1").is_none());
+        assert!(index.get("b2").is_some());
+    }
+}
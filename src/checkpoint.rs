@@ -0,0 +1,302 @@
+use std::collections::{HashMap, HashSet};
+use std::fmt;
+use std::path::Path;
+
+use anyhow::{Context, Result, bail};
+use prost::Message;
+
+use crate::cell::Interner;
+use crate::merge::MergedDelta;
+use crate::proto::checkpoint::{Checkpoint as ProtoCheckpoint, Counts as ProtoCounts};
+use crate::storage;
+use crate::utils::{indent, is_hex_hash};
+
+const CHECKPOINT_PREFIX: &str = "CHECKPOINT.";
+
+fn checkpoint_file_name(base: &str) -> String {
+    format!("{}{}", CHECKPOINT_PREFIX, base)
+}
+
+/// Running tally of how many entries of each kind a table contributed
+/// across the blocks in a consolidation run, before the merge collapses
+/// them. Used to log the pre -> post reduction.
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub(crate) struct DeltaCounts {
+    pub inserts: usize,
+    pub updates: usize,
+    pub deletes: usize,
+}
+
+impl From<DeltaCounts> for ProtoCounts {
+    fn from(counts: DeltaCounts) -> Self {
+        ProtoCounts {
+            inserts: counts.inserts as u64,
+            updates: counts.updates as u64,
+            deletes: counts.deletes as u64,
+        }
+    }
+}
+
+impl From<ProtoCounts> for DeltaCounts {
+    fn from(proto: ProtoCounts) -> Self {
+        DeltaCounts {
+            inserts: proto.inserts as usize,
+            updates: proto.updates as usize,
+            deletes: proto.deletes as usize,
+        }
+    }
+}
+
+/// Consolidation of the chain from a base block (exclusive) up to `tip`
+/// (inclusive). `Patch::create` builds one while merging and persists it as
+/// `CHECKPOINT.<base>`, so the next patch from the same base resumes from
+/// `tip` instead of re-merging the whole range.
+#[derive(Debug, Default, PartialEq)]
+pub(crate) struct Checkpoint {
+    /// Newest block merged so far; empty before the first block.
+    pub tip: String,
+    /// Number of blocks merged so far.
+    pub num_blocks: u32,
+    /// Per-table merged deltas.
+    pub deltas: HashMap<String, MergedDelta>,
+    /// Tables that fall back to full state.
+    pub skipped_tables: HashSet<String>,
+    /// Per-table entry counts before merging.
+    pub counts: HashMap<String, DeltaCounts>,
+}
+
+impl TryFrom<ProtoCheckpoint> for Checkpoint {
+    type Error = anyhow::Error;
+
+    fn try_from(proto: ProtoCheckpoint) -> Result<Self> {
+        let mut interner = Interner::new();
+        let mut deltas = HashMap::with_capacity(proto.deltas.len());
+        for (name, proto_delta) in proto.deltas {
+            let delta = MergedDelta::from_proto(proto_delta, &mut interner)
+                .with_context(|| format!("invalid delta for table '{}'", name))?;
+            deltas.insert(name, delta);
+        }
+        for (name, keys) in proto.conflicts {
+            let Some(delta) = deltas.get_mut(&name) else {
+                bail!("conflicts recorded for table '{}' without a delta", name);
+            };
+            delta.isolate_conflicts = true;
+            delta
+                .mark_conflicts(keys, &mut interner)
+                .with_context(|| format!("invalid conflicts for table '{}'", name))?;
+        }
+        Ok(Checkpoint {
+            tip: proto.tip,
+            num_blocks: proto.num_blocks,
+            deltas,
+            skipped_tables: proto.skipped_tables.into_iter().collect(),
+            counts: proto
+                .counts
+                .into_iter()
+                .map(|(name, counts)| (name, DeltaCounts::from(counts)))
+                .collect(),
+        })
+    }
+}
+
+impl From<&Checkpoint> for ProtoCheckpoint {
+    fn from(checkpoint: &Checkpoint) -> Self {
+        ProtoCheckpoint {
+            tip: checkpoint.tip.clone(),
+            num_blocks: checkpoint.num_blocks,
+            deltas: checkpoint
+                .deltas
+                .iter()
+                .map(|(name, delta)| (name.clone(), delta.to_checkpoint_proto()))
+                .collect(),
+            skipped_tables: checkpoint.skipped_tables.iter().cloned().collect(),
+            counts: checkpoint
+                .counts
+                .iter()
+                .map(|(name, counts)| (name.clone(), ProtoCounts::from(*counts)))
+                .collect(),
+            conflicts: checkpoint
+                .deltas
+                .iter()
+                .filter_map(|(name, delta)| Some((name.clone(), delta.conflicts_proto()?)))
+                .collect(),
+        }
+    }
+}
+
+impl fmt::Display for ProtoCheckpoint {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "Checkpoint:")?;
+        write!(f, "\n  Tip: {}", self.tip)?;
+        write!(f, "\n  Blocks: {}", self.num_blocks)?;
+        for (name, delta) in &self.deltas {
+            write!(f, "\n  '{}' {}", name, indent(&delta.to_string(), "  "))?;
+        }
+        for name in &self.skipped_tables {
+            write!(f, "\n  '{}' (full state)", name)?;
+        }
+        Ok(())
+    }
+}
+
+impl Checkpoint {
+    /// Load the checkpoint for consolidations starting after `base`. A
+    /// checkpoint only saves work, so a missing or unreadable one yields
+    /// `None` and the caller merges the range from scratch.
+    pub fn load(work_dir: &Path, base: &str, mode: u32) -> Option<Self> {
+        let name = checkpoint_file_name(base);
+        let result = storage::load(work_dir, &name, mode).and_then(|data| {
+            data.map(|data| {
+                let proto = ProtoCheckpoint::decode(data.as_slice())
+                    .context("failed to decode checkpoint")?;
+                Checkpoint::try_from(proto)
+            })
+            .transpose()
+        });
+        match result {
+            Ok(Some(checkpoint)) => {
+                log::debug!(
+                    "Loaded checkpoint '{:.7}...' -> '{:.7}...' ({} block(s))",
+                    base,
+                    checkpoint.tip,
+                    checkpoint.num_blocks
+                );
+                Some(checkpoint)
+            }
+            Ok(None) => None,
+            Err(e) => {
+                log::warn!("Ignoring unreadable checkpoint '{}': {:#}", name, e);
+                None
+            }
+        }
+    }
+}
+
+/// Persist `checkpoint` as the consolidation starting after `base`, replacing
+/// any earlier one for the same base.
+pub(crate) fn store(
+    work_dir: &Path,
+    base: &str,
+    checkpoint: &ProtoCheckpoint,
+    mode: u32,
+    dry_run: bool,
+) -> Result<()> {
+    let name = checkpoint_file_name(base);
+    storage::store(work_dir, &name, &checkpoint.encode_to_vec(), mode, dry_run)?;
+    log::debug!(
+        "Stored checkpoint '{:.7}...' -> '{:.7}...' ({} block(s))",
+        base,
+        checkpoint.tip,
+        checkpoint.num_blocks
+    );
+    Ok(())
+}
+
+/// Remove checkpoints whose base block is not in `reachable`. Their base can
+/// no longer be resolved as a reference, so they would never be used again.
+pub(crate) fn remove_stale(
+    work_dir: &Path,
+    reachable: &HashSet<String>,
+    mode: u32,
+    dry_run: bool,
+) -> Result<()> {
+    for entry in std::fs::read_dir(work_dir)? {
+        let entry = entry?;
+        let name = entry.file_name();
+        let Some(name) = name.to_str() else {
+            continue;
+        };
+        let Some(base) = name.strip_prefix(CHECKPOINT_PREFIX) else {
+            continue;
+        };
+        if !is_hex_hash(base) || reachable.contains(base) {
+            continue;
+        }
+        if !dry_run {
+            log::info!("Removing stale checkpoint '{}'", name);
+        }
+        storage::remove(work_dir, name, mode, dry_run)?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cell::text_proto_cells;
+    use crate::proto::delta::Delta as ProtoDelta;
+    use crate::proto::record::Record as ProtoRecord;
+    use crate::proto::update::Update as ProtoUpdate;
+
+    const BASE: &str = "0123456789abcdef0123456789abcdef01234567";
+
+    fn sample_checkpoint() -> Checkpoint {
+        let proto = ProtoDelta {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: vec!["name".to_string(), "role".to_string()],
+            inserts: vec![ProtoRecord {
+                key: text_proto_cells(&["1"]),
+                value: text_proto_cells(&["Alice", "admin"]),
+            }],
+            deletes: vec![ProtoRecord {
+                key: text_proto_cells(&["2"]),
+                value: text_proto_cells(&["Bob", "user"]),
+            }],
+            updates: vec![ProtoUpdate {
+                key: text_proto_cells(&["3"]),
+                changed_indices: Vec::new(),
+                old_value: text_proto_cells(&["Carol", "user"]),
+                new_value: text_proto_cells(&["Carol", "admin"]),
+            }],
+        };
+        let delta = MergedDelta::from_proto(proto, &mut Interner::new()).unwrap();
+        Checkpoint {
+            tip: "fedcba9876543210fedcba9876543210fedcba98".to_string(),
+            num_blocks: 3,
+            deltas: HashMap::from([("users".to_string(), delta)]),
+            skipped_tables: HashSet::from(["orders".to_string()]),
+            counts: HashMap::from([(
+                "users".to_string(),
+                DeltaCounts {
+                    inserts: 2,
+                    updates: 0,
+                    deletes: 1,
+                },
+            )]),
+        }
+    }
+
+    #[test]
+    fn test_checkpoint_store_load_round_trip() {
+        let tmp = tempfile::tempdir().unwrap();
+        let proto = ProtoCheckpoint::from(&sample_checkpoint());
+        store(tmp.path(), BASE, &proto, 0o600, false).unwrap();
+
+        let loaded = Checkpoint::load(tmp.path(), BASE, 0o600).unwrap();
+        assert_eq!(loaded, sample_checkpoint());
+    }
+
+    #[test]
+    fn test_checkpoint_load_missing_or_corrupt() {
+        let tmp = tempfile::tempdir().unwrap();
+        assert!(Checkpoint::load(tmp.path(), BASE, 0o600).is_none());
+
+        std::fs::write(tmp.path().join(checkpoint_file_name(BASE)), b"\xff\xff").unwrap();
+        assert!(Checkpoint::load(tmp.path(), BASE, 0o600).is_none());
+    }
+
+    #[test]
+    fn test_remove_stale_keeps_reachable_bases() {
+        let tmp = tempfile::tempdir().unwrap();
+        let stale = "1111111111111111111111111111111111111111";
+        let proto = ProtoCheckpoint::from(&sample_checkpoint());
+        store(tmp.path(), BASE, &proto, 0o600, false).unwrap();
+        store(tmp.path(), stale, &proto, 0o600, false).unwrap();
+
+        let reachable = HashSet::from([BASE.to_string()]);
+        remove_stale(tmp.path(), &reachable, 0o600, false).unwrap();
+
+        assert!(tmp.path().join(checkpoint_file_name(BASE)).exists());
+        assert!(!tmp.path().join(checkpoint_file_name(stale)).exists());
+    }
+}
@@ -0,0 +1,407 @@
+//! Hub-side coalescing of queued patches.
+//!
+//! When the patches of one agent queue up at the hub, [`coalesce`] folds
+//! them, oldest first, into one patch that has the same effect as applying
+//! them in turn. Rows that net out across patches then cost no statements
+//! at all.
+//!
+//! - Deltas of the same table merge like the block deltas of a consolidation
+//!   ([`CoalescedDelta::from_patch_proto`]), so a key inserted in one patch and
+//!   deleted in a later one disappears, and consecutive updates collapse
+//!   into one.
+//! - The state of a whole table supersedes every earlier payload of that
+//!   table, including its partitions. A later delta (or partition state) is
+//!   applied to the state, so the table keeps a single state.
+//! - The state of a partition replaces only its `replaced_keys`. Keys an
+//!   earlier delta of the partition changed are added to them, since the
+//!   earlier delta is dropped and their rows may differ on the hub.
+//!
+//! A patch does not record the block it starts from, so whether two patches
+//! are consecutive cannot be proven. What can be checked is: the creation
+//! times must not go back, an incremental patch must not repeat the head of
+//! the patch before it (a patch queued twice), and all patches must inject
+//! the same fields. Merge-rule violations (e.g. a key inserted twice) are
+//! errors too, as they would fail on the hub database.
+
+use std::collections::{HashMap, HashSet};
+
+use anyhow::{Context, Result, bail};
+use prost_types::Timestamp;
+
+use crate::cell::{Cell, Interner};
+use crate::config::Config;
+use crate::merge::CoalescedDelta;
+use crate::patch::Patch;
+use crate::proto::cell::Cell as ProtoCell;
+use crate::proto::delta::Delta as ProtoDelta;
+use crate::proto::injected::Field;
+use crate::proto::record::{Keys as ProtoKeys, Record as ProtoRecord};
+use crate::proto::table::Table as ProtoTable;
+
+fn decode_key(key: &[ProtoCell]) -> Result<Vec<Cell>> {
+    key.iter().map(Cell::try_from).collect()
+}
+
+fn check_fields(name: &str, table: &ProtoTable, delta: &ProtoDelta) -> Result<()> {
+    if table.primary_key_names != delta.primary_key_names
+        || table.subsidiary_value_names != delta.subsidiary_value_names
+    {
+        bail!(
+            "table '{}': delta fields (primary_key={:?} subsidiary={:?}) do not match the earlier state (primary_key={:?} subsidiary={:?})",
+            name,
+            delta.primary_key_names,
+            delta.subsidiary_value_names,
+            table.primary_key_names,
+            table.subsidiary_value_names
+        );
+    }
+    Ok(())
+}
+
+/// Apply the patch delta `delta` to the full table `table`.
+fn apply_to_state(name: &str, table: &mut ProtoTable, delta: ProtoDelta) -> Result<()> {
+    check_fields(name, table, &delta)?;
+    let num_values = table.subsidiary_value_names.len();
+    let mut rows: HashMap<Vec<Cell>, ProtoRecord> = HashMap::with_capacity(table.records.len());
+    for record in std::mem::take(&mut table.records) {
+        rows.insert(decode_key(&record.key)?, record);
+    }
+
+    for record in delta.deletes {
+        let key = decode_key(&record.key)?;
+        if rows.remove(&key).is_none() {
+            bail!(
+                "table '{}': key {:?} deleted but not in the earlier state",
+                name,
+                key
+            );
+        }
+    }
+    for record in delta.inserts {
+        let key = decode_key(&record.key)?;
+        if record.value.len() != num_values {
+            bail!(
+                "table '{}': insert of key {:?} has {} values, expected {}",
+                name,
+                key,
+                record.value.len(),
+                num_values
+            );
+        }
+        if rows.insert(key.clone(), record).is_some() {
+            bail!(
+                "table '{}': key {:?} inserted but already in the earlier state",
+                name,
+                key
+            );
+        }
+    }
+    for update in delta.updates {
+        let key = decode_key(&update.key)?;
+        let Some(row) = rows.get_mut(&key) else {
+            bail!(
+                "table '{}': key {:?} updated but not in the earlier state",
+                name,
+                key
+            );
+        };
+        if update.changed_indices.is_empty() {
+            if update.new_value.len() != num_values {
+                bail!(
+                    "table '{}': update of key {:?} has {} values, expected {}",
+                    name,
+                    key,
+                    update.new_value.len(),
+                    num_values
+                );
+            }
+            row.value = update.new_value;
+            continue;
+        }
+        if update.changed_indices.len() != update.new_value.len() {
+            bail!(
+                "table '{}': update of key {:?} has {} changed indices but {} values",
+                name,
+                key,
+                update.changed_indices.len(),
+                update.new_value.len()
+            );
+        }
+        for (column, value) in update.changed_indices.into_iter().zip(update.new_value) {
+            let Some(cell) = row.value.get_mut(column as usize) else {
+                bail!(
+                    "table '{}': update of key {:?} changes column {} of {}",
+                    name,
+                    key,
+                    column,
+                    num_values
+                );
+            };
+            *cell = value;
+        }
+    }
+
+    table.records = rows.into_values().collect();
+    Ok(())
+}
+
+/// Whether `created` is older than `previous`, comparing as timestamps.
+fn is_older(created: &Option<Timestamp>, previous: &Option<Timestamp>) -> bool {
+    match (created, previous) {
+        (Some(created), Some(previous)) => {
+            (created.seconds, created.nanos) < (previous.seconds, previous.nanos)
+        }
+        _ => false,
+    }
+}
+
+/// The patches folded so far.
+struct Coalesced<'a> {
+    config: &'a Config,
+    head: String,
+    created: Option<Timestamp>,
+    injected_fields: Vec<Field>,
+    num_blocks: u32,
+    deltas: HashMap<String, CoalescedDelta>,
+    states: HashMap<String, ProtoTable>,
+    /// Keys replaced by the state of a partition; only partitions have them.
+    replaced_keys: HashMap<String, HashSet<Vec<Cell>>>,
+    interner: Interner,
+}
+
+impl<'a> Coalesced<'a> {
+    /// An empty coalescing; the fields of `first` are what every later patch
+    /// must inject too.
+    fn new(config: &'a Config, first: &Patch) -> Self {
+        Coalesced {
+            config,
+            head: String::new(),
+            created: None,
+            injected_fields: first.injected_fields.clone(),
+            num_blocks: 0,
+            deltas: HashMap::new(),
+            states: HashMap::new(),
+            replaced_keys: HashMap::new(),
+            interner: Interner::new(),
+        }
+    }
+
+    /// The configured table a payload name belongs to, or the name itself
+    /// for a table the config does not know.
+    fn table_of(&self, name: &str) -> String {
+        self.config
+            .table_of(name)
+            .map_or(name, |(table, _)| table)
+            .to_string()
+    }
+
+    /// The whole-table state `name` is part of, if there is one: the state of
+    /// `name` itself, or of its table when `name` is a partition.
+    fn whole_state(&mut self, name: &str) -> Option<&mut ProtoTable> {
+        let table = self.table_of(name);
+        let whole = if self.states.contains_key(name) && !self.replaced_keys.contains_key(name) {
+            name
+        } else if table != name && !self.replaced_keys.contains_key(&table) {
+            table.as_str()
+        } else {
+            return None;
+        };
+        self.states.get_mut(whole)
+    }
+
+    fn validate(&self, index: usize, patch: &Patch) -> Result<()> {
+        if patch.injected_fields != self.injected_fields {
+            bail!(
+                "patch {} injects different fields than the patches before it",
+                index
+            );
+        }
+        if is_older(&patch.created, &self.created) {
+            bail!(
+                "patch {} ('{:.7}...') was created before the patch before it; patches must be in chain order",
+                index,
+                patch.head
+            );
+        }
+        if patch.num_blocks > 0 && patch.head == self.head {
+            bail!(
+                "patch {} repeats head '{:.7}...' of the patch before it (queued twice?)",
+                index,
+                patch.head
+            );
+        }
+        Ok(())
+    }
+
+    fn push(&mut self, patch: Patch) -> Result<()> {
+        let Patch {
+            head,
+            created,
+            num_blocks,
+            deltas,
+            states,
+            mut replaced_keys,
+            ..
+        } = patch;
+
+        for (name, state) in states {
+            match replaced_keys.remove(&name) {
+                Some(keys) => self.replace_partition(name, state, keys)?,
+                None => self.replace_table(name, state),
+            }
+        }
+        if let Some(name) = replaced_keys.keys().next() {
+            bail!("replaced keys of '{}' without its state", name);
+        }
+        for (name, delta) in deltas {
+            self.apply_delta(name, delta)?;
+        }
+
+        self.head = head;
+        self.created = created;
+        self.num_blocks = self.num_blocks.saturating_add(num_blocks);
+        Ok(())
+    }
+
+    /// The state of a whole table: drop every earlier payload of the table.
+    fn replace_table(&mut self, name: String, state: ProtoTable) {
+        let table = self.table_of(&name);
+        let config = self.config;
+        let of_table = |other: &String| {
+            config
+                .table_of(other)
+                .map_or(other.as_str(), |(table, _)| table)
+                == table
+        };
+        self.deltas.retain(|other, _| !of_table(other));
+        self.states.retain(|other, _| !of_table(other));
+        self.replaced_keys.retain(|other, _| !of_table(other));
+        log::debug!("Table '{}': state supersedes earlier payloads", name);
+        self.states.insert(name, state);
+    }
+
+    /// The state of a partition, replacing the rows of `keys`.
+    fn replace_partition(
+        &mut self,
+        name: String,
+        state: ProtoTable,
+        keys: ProtoKeys,
+    ) -> Result<()> {
+        let mut replaced = keys
+            .records
+            .iter()
+            .map(|record| decode_key(&record.key))
+            .collect::<Result<HashSet<Vec<Cell>>>>()?;
+
+        if self.table_of(&name) != name
+            && let Some(whole) = self.whole_state(&name)
+        {
+            // Fold the partition into the state of its table.
+            if whole.primary_key_names != state.primary_key_names
+                || whole.subsidiary_value_names != state.subsidiary_value_names
+            {
+                bail!(
+                    "partition '{}': state fields do not match the earlier state of its table",
+                    name
+                );
+            }
+            let mut kept = Vec::with_capacity(whole.records.len());
+            for record in std::mem::take(&mut whole.records) {
+                if !replaced.contains(&decode_key(&record.key)?) {
+                    kept.push(record);
+                }
+            }
+            kept.extend(state.records);
+            whole.records = kept;
+            return Ok(());
+        }
+
+        if let Some(delta) = self.deltas.remove(&name) {
+            replaced.extend(delta.into_keys());
+        }
+        if let Some(earlier) = self.replaced_keys.remove(&name) {
+            replaced.extend(earlier);
+        }
+        self.states.insert(name.clone(), state);
+        self.replaced_keys.insert(name, replaced);
+        Ok(())
+    }
+
+    fn apply_delta(&mut self, name: String, delta: ProtoDelta) -> Result<()> {
+        if let Some(state) = self.states.get_mut(&name) {
+            return apply_to_state(&name, state, delta);
+        }
+        if let Some(whole) = self.whole_state(&name) {
+            return apply_to_state(&name, whole, delta);
+        }
+        match self.deltas.get_mut(&name) {
+            Some(merged) => merged
+                .merge_proto(delta, &mut self.interner)
+                .with_context(|| format!("table '{}'", name))?,
+            None => {
+                let merged = CoalescedDelta::from_patch_proto(delta, &mut self.interner)
+                    .with_context(|| format!("table '{}'", name))?;
+                self.deltas.insert(name, merged);
+            }
+        }
+        Ok(())
+    }
+
+    fn into_patch(self) -> Patch {
+        let deltas = self
+            .deltas
+            .into_iter()
+            .map(|(name, merged)| (name, merged.into_patch_proto()))
+            .filter(|(_, delta)| {
+                !(delta.inserts.is_empty() && delta.deletes.is_empty() && delta.updates.is_empty())
+            })
+            .collect();
+        let replaced_keys = self
+            .replaced_keys
+            .into_iter()
+            .map(|(name, keys)| {
+                let records = keys
+                    .into_iter()
+                    .map(|key| ProtoRecord {
+                        key: key.into_iter().map(Into::into).collect(),
+                        value: Vec::new(),
+                    })
+                    .collect();
+                (name, ProtoKeys { records })
+            })
+            .collect();
+        Patch {
+            head: self.head,
+            created: self.created,
+            injected_fields: self.injected_fields,
+            num_blocks: self.num_blocks,
+            deltas,
+            states: self.states,
+            replaced_keys,
+        }
+    }
+}
+
+/// Coalesce `patches`, oldest first, into one patch with the same effect as
+/// applying each of them in turn. See the module documentation for the rules
+/// and the checks that reject a list that is not in chain order.
+pub fn coalesce(config: &Config, patches: impl IntoIterator<Item = Patch>) -> Result<Patch> {
+    let mut patches = patches.into_iter();
+    let Some(first) = patches.next() else {
+        bail!("no patches to coalesce");
+    };
+    let mut coalesced = Coalesced::new(config, &first);
+    coalesced.push(first).context("patch 0")?;
+    let mut count = 1;
+    for patch in patches {
+        coalesced.validate(count, &patch)?;
+        coalesced
+            .push(patch)
+            .with_context(|| format!("patch {}", count))?;
+        count += 1;
+    }
+
+    let patch = coalesced.into_patch();
+    log::info!("Coalesced {} patch(es):\n{}", count, patch);
+    Ok(patch)
+}
@@ -1,22 +1,32 @@
 use regex::Regex;
-use serde::{Deserialize, Deserializer};
+use serde::{Deserialize, Deserializer, Serialize};
 use serde_json::Value;
 use std::collections::{HashMap, HashSet};
+use std::fmt;
 use std::fs;
 use std::path::{Path, PathBuf};
 use std::sync::Mutex;
 use std::thread::JoinHandle;
-use std::time::Duration;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
 
 use anyhow::{Context, Result, bail};
 
 use crate::cell::{Kind, parse_typed_cell};
+use crate::storage;
 use crate::utils::{join_logging_panics, parse_duration, parse_file_mode, validate_field_name};
 
 /// Subdirectory of the work directory where state files live when `state-dir`
 /// is not set in the config.
 const STATE_SUBDIR: &str = "state";
 
+/// Name of the merged-config cache in the state directory.
+const CACHE_FILE: &str = "CONFIG.cache";
+
+/// How long before a load a config file must last have changed for the cache
+/// to key on its mtime. This covers filesystems with coarse timestamps, where
+/// a same-size edit in the same tick as the recorded mtime would keep it.
+const CACHE_SETTLE: Duration = Duration::from_secs(2);
+
 /// Post-deserialize semantic checks for config structs (cross-field
 /// invariants, value ranges, etc.) that serde can't express on its own.
 /// Implementors `bail!` on failure.
@@ -73,6 +83,18 @@ fn default_dir_mode() -> u32 {
     0o700
 }
 
+/// Default size of the worker pool used to load and diff tables. One keeps
+/// every table on the calling thread.
+fn default_threads() -> usize {
+    1
+}
+
+/// Default number of newly merged blocks after which `Patch::create` stores a
+/// merge checkpoint.
+fn default_checkpoint_interval() -> u32 {
+    16
+}
+
 // Custom deserializer for `file-mode`: reads the field as a string and parses it
 // via `parse_file_mode`. The parsed value is range checked in `Config::validate`.
 fn deserialize_file_mode<'de, D>(deserializer: D) -> Result<u32, D::Error>
@@ -99,6 +121,9 @@ pub struct TruncateConfig {
     /// When true, blocks already reported to the consumer are eligible for removal.
     #[serde(rename = "truncate-reported")]
     pub truncate_reported: bool,
+    /// Move blocks behind the newest this many blocks of the chain into the packfile. `None` keeps every block in its own file.
+    #[serde(rename = "pack-after")]
+    pub pack_after: Option<u32>,
 }
 
 impl Default for TruncateConfig {
@@ -108,6 +133,7 @@ impl Default for TruncateConfig {
             max_age: None,
             remove_orphans: true,
             truncate_reported: true,
+            pack_after: None,
         }
     }
 }
@@ -119,10 +145,47 @@ impl Validate for TruncateConfig {
         {
             bail!("truncate.max-blocks must be >= 1");
         }
+        if let Some(pack_after) = self.pack_after
+            && pack_after < 1
+        {
+            bail!("truncate.pack-after must be >= 1");
+        }
         Ok(())
     }
 }
 
+/// A trained zstd dictionary loaded from the `[compression]` section.
+pub struct ZstdDictionary {
+    /// Dictionary ID, written into the header of every zstd frame
+    /// compressed with it.
+    pub id: u32,
+    /// The raw dictionary, as produced by `zstd --train`.
+    pub data: Vec<u8>,
+}
+
+impl fmt::Debug for ZstdDictionary {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "ZstdDictionary({}, {} bytes)", self.id, self.data.len())
+    }
+}
+
+impl ZstdDictionary {
+    /// Read the dictionary at `path`. Only trained dictionaries carry an ID,
+    /// and the ID is how a receiver finds the dictionary for a patch, so raw
+    /// content dictionaries are rejected.
+    fn load(path: &Path) -> Result<Self> {
+        let data = fs::read(path)
+            .with_context(|| format!("failed to read zstd dictionary '{}'", path.display()))?;
+        let id = zstd::zstd_safe::get_dict_id_from_dict(&data).with_context(|| {
+            format!(
+                "'{}' is not a trained zstd dictionary (it has no dictionary ID)",
+                path.display()
+            )
+        })?;
+        Ok(ZstdDictionary { id: id.get(), data })
+    }
+}
+
 /// Controls zstd compression of patch payloads.
 #[derive(Debug, Deserialize)]
 #[serde(default, deny_unknown_fields)]
@@ -131,6 +194,21 @@ pub struct CompressionConfig {
     pub enable: bool,
     /// Zstd compression level passed to `zstd::encode_all`. `0` selects the zstd default.
     pub level: i32,
+    /// Trained zstd dictionary to compress patches with (relative to the work
+    /// directory, or absolute). Receivers decode with the dictionary whose
+    /// ID the patch names, so they need the same file configured.
+    pub dictionary: Option<PathBuf>,
+    /// Earlier dictionaries that are still accepted when decoding, so that a
+    /// new dictionary can be rolled out while patches compressed with an
+    /// older one are in flight.
+    #[serde(rename = "previous-dictionaries")]
+    pub previous_dictionaries: Vec<PathBuf>,
+    /// Contents of `dictionary`, read by `Config::load`.
+    #[serde(skip)]
+    pub(crate) loaded_dictionary: Option<ZstdDictionary>,
+    /// Contents of `previous-dictionaries`, read by `Config::load`.
+    #[serde(skip)]
+    pub(crate) loaded_previous_dictionaries: Vec<ZstdDictionary>,
 }
 
 impl Default for CompressionConfig {
@@ -138,10 +216,63 @@ impl Default for CompressionConfig {
         Self {
             enable: true,
             level: 0,
+            dictionary: None,
+            previous_dictionaries: Vec::new(),
+            loaded_dictionary: None,
+            loaded_previous_dictionaries: Vec::new(),
         }
     }
 }
 
+impl CompressionConfig {
+    /// Read the configured dictionaries, resolving relative paths against
+    /// `work_dir`. Fails when a file is unreadable, is not a trained
+    /// dictionary, or shares its ID with another configured dictionary.
+    fn load_dictionaries(&mut self, work_dir: &Path) -> Result<()> {
+        let resolve = |path: &PathBuf| {
+            if path.is_absolute() {
+                path.clone()
+            } else {
+                work_dir.join(path)
+            }
+        };
+        self.loaded_dictionary = self
+            .dictionary
+            .as_ref()
+            .map(|path| ZstdDictionary::load(&resolve(path)))
+            .transpose()?;
+        self.loaded_previous_dictionaries = self
+            .previous_dictionaries
+            .iter()
+            .map(|path| ZstdDictionary::load(&resolve(path)))
+            .collect::<Result<_>>()?;
+
+        let mut ids = HashSet::new();
+        for dictionary in self.dictionaries() {
+            if !ids.insert(dictionary.id) {
+                bail!(
+                    "compression dictionaries must have distinct IDs (ID {} is used twice)",
+                    dictionary.id
+                );
+            }
+        }
+        Ok(())
+    }
+
+    /// Every configured dictionary: the current one first, then the
+    /// previous ones.
+    fn dictionaries(&self) -> impl Iterator<Item = &ZstdDictionary> {
+        self.loaded_dictionary
+            .iter()
+            .chain(&self.loaded_previous_dictionaries)
+    }
+
+    /// The configured dictionary with ID `id`, if any.
+    pub fn dictionary_by_id(&self, id: u32) -> Option<&ZstdDictionary> {
+        self.dictionaries().find(|dictionary| dictionary.id == id)
+    }
+}
+
 impl Validate for CompressionConfig {
     fn validate(&self) -> Result<()> {
         let range = zstd::compression_level_range();
@@ -157,13 +288,66 @@ impl Validate for CompressionConfig {
     }
 }
 
-/// Controls the opt-in cumulative stats file written after patch creation.
+/// Controls the opt-in `STATS` and `TRACE` files in the state directory.
 #[derive(Debug, Default, Deserialize)]
 #[serde(default, deny_unknown_fields)]
 pub struct StatsConfig {
     /// When true, `patch create` appends a run record to the `STATS` JSON file
     /// in the state directory.
     pub enable: bool,
+    /// When true, block creation and SQL conversion append per-stage timings
+    /// to the `TRACE` file in the state directory, one JSON object per line.
+    pub trace: bool,
+}
+
+/// Controls how patches are rendered as SQL on the hub.
+#[derive(Debug, Deserialize)]
+#[serde(default, deny_unknown_fields)]
+pub struct SqlConfig {
+    /// Maximum number of rows per INSERT statement (as a multi-row `VALUES`
+    /// list) and keys per DELETE statement (as `WHERE <key> IN (...)`). `1`
+    /// emits one statement per row.
+    #[serde(rename = "batch-size")]
+    pub batch_size: usize,
+}
+
+impl Default for SqlConfig {
+    fn default() -> Self {
+        Self { batch_size: 1 }
+    }
+}
+
+impl Validate for SqlConfig {
+    fn validate(&self) -> Result<()> {
+        if self.batch_size < 1 {
+            bail!("sql.batch-size must be >= 1");
+        }
+        Ok(())
+    }
+}
+
+/// Controls the opt-in group-commit journal used by block creation.
+#[derive(Debug, Deserialize)]
+#[serde(default, deny_unknown_fields)]
+pub struct JournalConfig {
+    /// When true, `Block::create` commits the block, its state segments,
+    /// `STATE` and `HEAD` as a single `JOURNAL` record with one fsync instead
+    /// of fsyncing every file.
+    pub enable: bool,
+    /// Journal size in bytes at which the journaled files are fsynced and
+    /// the journal is emptied. Recovery rereads the whole journal, so this
+    /// also bounds its cost. `0` checkpoints after every commit.
+    #[serde(rename = "checkpoint-size")]
+    pub checkpoint_size: u64,
+}
+
+impl Default for JournalConfig {
+    fn default() -> Self {
+        Self {
+            enable: false,
+            checkpoint_size: 4 * 1024 * 1024,
+        }
+    }
 }
 
 /// A static field added to every generated SQL row (e.g. a `host` column
@@ -265,6 +449,11 @@ pub struct CsvConfig {
     pub max_field_length: Option<usize>,
     /// Optional include/exclude filter applied at CSV load time.
     pub filter: Option<FilterConfig>,
+    /// When true, an unchanged size and modification time are enough to treat
+    /// the source as unchanged since the previous block; its contents are not
+    /// hashed. Meant for large files whose producer always rewrites them.
+    #[serde(rename = "trust-mtime")]
+    pub trust_mtime: bool,
 }
 
 impl CsvConfig {
@@ -283,8 +472,51 @@ impl CsvConfig {
 
     /// Returns `Some(reason)` if the record should be filtered out, `None` to keep.
     pub fn should_filter(&self, field_names: &[String], values: &[&str]) -> Option<String> {
-        if let Some(max_length) = self.max_field_length {
-            for (name, value) in field_names.iter().zip(values.iter()) {
+        self.row_filter(field_names)
+            .check(|position| values.get(position).copied())
+    }
+
+    /// Resolve this block's record filters against a table's field names once,
+    /// so that checking each row needs no name lookups or allocation.
+    pub fn row_filter<'a>(&'a self, field_names: &'a [String]) -> RowFilter<'a> {
+        let filter_positions = self
+            .filter
+            .as_ref()
+            .map(|filter| {
+                filter
+                    .fields
+                    .iter()
+                    .filter_map(|target| field_names.iter().position(|name| name == target))
+                    .collect()
+            })
+            .unwrap_or_default();
+        RowFilter {
+            csv: self,
+            field_names,
+            filter_positions,
+        }
+    }
+}
+
+/// The record filters of a [`CsvConfig`] bound to one table's field order.
+/// Built by [`CsvConfig::row_filter`].
+pub struct RowFilter<'a> {
+    csv: &'a CsvConfig,
+    field_names: &'a [String],
+    /// Positions in `field_names` of the fields `csv.filter` examines.
+    filter_positions: Vec<usize>,
+}
+
+impl RowFilter<'_> {
+    /// Returns `Some(reason)` if the row should be filtered out, `None` to
+    /// keep. `value_at(i)` yields the row's value for `field_names[i]`, or
+    /// `None` if the row is too short to have one.
+    pub fn check<'v>(&self, value_at: impl Fn(usize) -> Option<&'v str>) -> Option<String> {
+        if let Some(max_length) = self.csv.max_field_length {
+            for (position, name) in self.field_names.iter().enumerate() {
+                let Some(value) = value_at(position) else {
+                    break;
+                };
                 if value.len() > max_length {
                     return Some(format!(
                         "field '{}' length {} exceeds max-field-length {}",
@@ -296,21 +528,21 @@ impl CsvConfig {
             }
         }
 
-        if let Some(filter) = &self.filter {
-            let candidate_values: Vec<&str> = filter
-                .fields
-                .iter()
-                .filter_map(|name| find_field_value(field_names, values, name))
-                .collect();
+        if let Some(filter) = &self.csv.filter {
+            let candidates = || {
+                self.filter_positions
+                    .iter()
+                    .filter_map(|&position| value_at(position))
+            };
 
             if let Some(include) = &filter.include
-                && !candidate_values.iter().any(|v| include.is_match(v))
+                && !candidates().any(|v| include.is_match(v))
             {
                 return Some("no include rule matched".to_string());
             }
 
             if let Some(exclude) = &filter.exclude
-                && let Some(value) = candidate_values.iter().find(|v| exclude.is_match(v))
+                && let Some(value) = candidates().find(|v| exclude.is_match(v))
             {
                 return Some(format!("value '{}' matches exclude rule", value));
             }
@@ -320,18 +552,6 @@ impl CsvConfig {
     }
 }
 
-/// Look up the value whose field name is `target`. Returns `None` if
-/// `target` isn't in `field_names` or if `values` is shorter than
-/// `field_names`.
-fn find_field_value<'a>(
-    field_names: &[String],
-    values: &'a [&str],
-    target: &str,
-) -> Option<&'a str> {
-    let position = field_names.iter().position(|name| name == target)?;
-    values.get(position).copied()
-}
-
 /// Validated configuration: the base `config.toml`/`config.json` in the work
 /// directory deep-merged with any drop-in fragments it pulls in via `include`.
 #[derive(Debug, Deserialize)]
@@ -354,9 +574,15 @@ pub struct Config {
     /// Zstd compression settings for patch payloads.
     #[serde(default)]
     pub compression: CompressionConfig,
-    /// Cumulative patch-creation stats file settings.
+    /// Stats and trace file settings.
     #[serde(default)]
     pub stats: StatsConfig,
+    /// SQL rendering settings.
+    #[serde(default)]
+    pub sql: SqlConfig,
+    /// Group-commit journal settings for block creation.
+    #[serde(default)]
+    pub journal: JournalConfig,
     /// Per-table source-file and field schemas, keyed by table name.
     pub tables: HashMap<String, TableConfig>,
     /// Block chain truncation policy.
@@ -379,6 +605,39 @@ pub struct Config {
         deserialize_with = "deserialize_file_mode"
     )]
     pub dir_mode: u32,
+    /// Number of worker threads used to load and diff independent tables
+    /// during block creation. CSV-backed tables and callback-backed tables
+    /// marked `thread-safe` are spread across the pool; other callback-backed
+    /// tables stay on the calling thread. Patch creation uses the same pool
+    /// to load and merge consolidated blocks in parallel, and SQL conversion
+    /// to render several tables at once.
+    #[serde(default = "default_threads")]
+    pub threads: usize,
+    /// Number of blocks a patch consolidation must merge before it stores the
+    /// result as a merge checkpoint (`CHECKPOINT.<reference>` in the state
+    /// directory). Later patches from the same reference resume from the
+    /// checkpoint and only merge the newer blocks. Zero disables checkpoints.
+    #[serde(
+        default = "default_checkpoint_interval",
+        rename = "checkpoint-interval"
+    )]
+    pub checkpoint_interval: u32,
+    /// When true, patches are encoded as a framed stream of length-prefixed
+    /// chunks (see [`crate::wire::FramedDecoder`]) rather than one protobuf
+    /// message, so receivers can process them with bounded memory. Off by
+    /// default, since receivers built before the format cannot read it.
+    #[serde(default, rename = "framed-patches")]
+    pub framed_patches: bool,
+    /// When true, the previous state is kept in memory between block
+    /// creations on this config (a long-lived `lch_config_t`, or
+    /// `lch watch`), so a block only decodes STATE segments after another
+    /// process advanced the chain. Costs memory for every table.
+    #[serde(default, rename = "resident-state")]
+    pub resident_state: bool,
+    /// The previous state kept by `resident-state`, tagged with the block it
+    /// was stored with. Not deserialized.
+    #[serde(skip)]
+    pub(crate) resident: Mutex<Option<crate::state::ResidentState>>,
     /// Handle of the background truncation thread most recently spawned for
     /// this config (if any). `truncate::spawn_background` only spawns a new
     /// thread when this slot is empty or holds a finished handle, so at most
@@ -392,6 +651,10 @@ pub struct Config {
     /// to the `STATS` file. Not deserialized.
     #[serde(skip)]
     pub(crate) pending_stats: Mutex<crate::stats::PendingStats>,
+    /// Worker pool running the asynchronous C API calls on this config,
+    /// sized by `lch_init_async`. Not deserialized.
+    #[serde(skip)]
+    pub(crate) executor: crate::executor::Executor,
     /// When true, CLI create/mutate operations skip all disk writes and print
     /// "Would have ..." messages instead. CLI-only; set by `lch --dry-run`,
     /// never deserialized.
@@ -407,12 +670,20 @@ impl Default for Config {
             injected_fields: Vec::new(),
             compression: CompressionConfig::default(),
             stats: StatsConfig::default(),
+            sql: SqlConfig::default(),
+            journal: JournalConfig::default(),
             tables: HashMap::new(),
             truncate: TruncateConfig::default(),
             file_mode: default_file_mode(),
             dir_mode: default_dir_mode(),
+            threads: default_threads(),
+            checkpoint_interval: default_checkpoint_interval(),
+            framed_patches: false,
+            resident_state: false,
+            resident: Default::default(),
             background_truncation: Default::default(),
             pending_stats: Default::default(),
+            executor: Default::default(),
             dry_run: false,
         }
     }
@@ -420,6 +691,9 @@ impl Default for Config {
 
 impl Drop for Config {
     fn drop(&mut self) {
+        // Asynchronous tasks may still spawn truncation, so they are waited
+        // for first. `lch_deinit` has normally done this already.
+        self.executor.shutdown();
         let slot = self
             .background_truncation
             .get_mut()
@@ -473,6 +747,24 @@ pub struct TableConfig {
     /// the table is callback-backed and rows are pulled from the FFI cell
     /// callback.
     pub csv: Option<CsvConfig>,
+    /// Declares that the FFI callbacks may be invoked for this table from a
+    /// worker thread, concurrently with other tables. Only meaningful for
+    /// callback-backed tables; CSV-backed tables are always thread-safe.
+    #[serde(default, rename = "thread-safe")]
+    pub thread_safe: bool,
+    /// Number of partitions the table's records are split into by a hash of
+    /// their primary key. Each partition is diffed, stored in STATE and
+    /// consolidated on its own, as `<table>#<index>`, so a merge conflict
+    /// only re-ships the partition it hit. `1` keeps the table whole.
+    #[serde(default = "default_partitions")]
+    pub partitions: u32,
+}
+
+/// Largest accepted `partitions` value.
+const MAX_PARTITIONS: u32 = 4096;
+
+fn default_partitions() -> u32 {
+    1
 }
 
 impl Validate for FieldConfig {
@@ -497,9 +789,20 @@ impl Validate for TableConfig {
         }
 
         if let Some(csv) = &self.csv {
+            if self.thread_safe {
+                bail!("thread-safe only applies to callback-backed tables");
+            }
             csv.validate(&seen)?;
         }
 
+        if !(1..=MAX_PARTITIONS).contains(&self.partitions) {
+            bail!(
+                "partitions must be between 1 and {} (got {})",
+                MAX_PARTITIONS,
+                self.partitions
+            );
+        }
+
         Ok(())
     }
 }
@@ -516,6 +819,27 @@ impl TableConfig {
             .map(|field| field.name.clone())
             .collect()
     }
+
+    pub fn is_partitioned(&self) -> bool {
+        self.partitions > 1
+    }
+
+    /// Names the table `name` is stored under in blocks, STATE and patches:
+    /// the table name itself, or one name per partition.
+    pub fn stored_names(&self, name: &str) -> Vec<String> {
+        if self.is_partitioned() {
+            (0..self.partitions)
+                .map(|index| partition_name(name, index))
+                .collect()
+        } else {
+            vec![name.to_string()]
+        }
+    }
+}
+
+/// Name partition `index` of table `table` is stored under.
+pub fn partition_name(table: &str, index: u32) -> String {
+    format!("{}#{}", table, index)
 }
 
 impl Validate for Config {
@@ -524,6 +848,12 @@ impl Validate for Config {
             bail!("at least one table must be declared under [tables]");
         }
         for (name, table) in &self.tables {
+            if name.contains('#') {
+                bail!(
+                    "table name '{}' must not contain '#' (reserved for partition names)",
+                    name
+                );
+            }
             table
                 .validate()
                 .with_context(|| format!("table '{}'", name))?;
@@ -567,8 +897,13 @@ impl Validate for Config {
             );
         }
 
+        if self.threads < 1 {
+            bail!("threads must be >= 1");
+        }
+
         self.truncate.validate()?;
         self.compression.validate()?;
+        self.sql.validate()?;
 
         Ok(())
     }
@@ -633,6 +968,35 @@ fn take_include_patterns(base: &mut Value, base_path: &Path) -> Result<Vec<Strin
     })
 }
 
+/// Join a relative `include` pattern onto `work_dir`; absolute ones are kept.
+fn include_path(work_dir: &Path, pattern: &str) -> PathBuf {
+    if Path::new(pattern).is_absolute() {
+        PathBuf::from(pattern)
+    } else {
+        work_dir.join(pattern)
+    }
+}
+
+/// The directories the `include` patterns glob in, whose mtimes change when a
+/// matching fragment is added or removed. Returns `None` when a pattern has a
+/// wildcard before its last component or ends in `**`, as its matches can
+/// then come from directories no fixed list covers.
+fn include_dirs(work_dir: &Path, patterns: &[String]) -> Option<Vec<PathBuf>> {
+    let mut dirs = Vec::new();
+    for pattern in patterns {
+        let joined = include_path(work_dir, pattern);
+        let dir = joined.parent()?;
+        let name = joined.file_name()?.to_str()?;
+        if dir.to_str()?.contains(['*', '?', '[']) || name.contains("**") {
+            return None;
+        }
+        if !dirs.iter().any(|seen| seen == dir) {
+            dirs.push(dir.to_path_buf());
+        }
+    }
+    Some(dirs)
+}
+
 /// Expand the base config's `include` glob patterns into an ordered list of
 /// fragment paths. Relative patterns resolve against `work_dir`. Patterns are
 /// processed in order; each pattern's matches are sorted lexicographically.
@@ -648,11 +1012,7 @@ fn resolve_includes(
     seen.insert(base_path.to_path_buf());
 
     for pattern in patterns {
-        let joined = if Path::new(pattern).is_absolute() {
-            PathBuf::from(pattern)
-        } else {
-            work_dir.join(pattern)
-        };
+        let joined = include_path(work_dir, pattern);
         let joined = joined
             .to_str()
             .ok_or_else(|| anyhow::anyhow!("include pattern '{}' is not valid UTF-8", pattern))?;
@@ -682,7 +1042,156 @@ fn resolve_includes(
     Ok(paths)
 }
 
+/// A config file or include directory as `stat` sees it. Comparing stamps
+/// tells a warm start that nothing changed without reading any file.
+#[derive(Debug, PartialEq, Serialize, Deserialize)]
+struct Stamp {
+    path: PathBuf,
+    /// Size in bytes and mtime in nanoseconds since the epoch, or `None` when
+    /// the path does not exist, e.g. an include directory not created yet.
+    seen: Option<(u64, u128)>,
+}
+
+impl Stamp {
+    fn of(path: &Path) -> Result<Self> {
+        let seen = match fs::metadata(path) {
+            Ok(metadata) => {
+                let modified = metadata
+                    .modified()
+                    .with_context(|| format!("failed to read mtime of '{}'", path.display()))?;
+                Some((metadata.len(), nanos_since_epoch(modified)))
+            }
+            Err(e) if e.kind() == std::io::ErrorKind::NotFound => None,
+            Err(e) => {
+                return Err(e).with_context(|| format!("failed to stat '{}'", path.display()));
+            }
+        };
+        Ok(Stamp {
+            path: path.to_path_buf(),
+            seen,
+        })
+    }
+
+    /// Whether the path last changed before `settled`, in nanoseconds since
+    /// the epoch. See [`CACHE_SETTLE`].
+    fn is_settled(&self, settled: u128) -> bool {
+        self.seen.is_none_or(|(_, modified)| modified < settled)
+    }
+}
+
+fn nanos_since_epoch(time: SystemTime) -> u128 {
+    time.duration_since(UNIX_EPOCH)
+        .map_or(0, |elapsed| elapsed.as_nanos())
+}
+
+/// Contents of `CONFIG.cache`: the merged value tree of a config that passed
+/// validation, keyed by the leech2 version and the stamps of the files and
+/// include directories it was merged from. A warm start that finds the same
+/// stamps deserializes the tree directly, without reading the files, parsing
+/// TOML, resolving the include globs, merging or validating.
+#[derive(Serialize, Deserialize)]
+struct CachedConfig {
+    version: String,
+    /// The base file first, then each fragment in merge order, i.e. the
+    /// resolved include list.
+    sources: Vec<Stamp>,
+    /// Stamps of the directories the base file's `include` patterns glob in
+    /// (see [`include_dirs`]). While none of them changed, no fragment was
+    /// added or removed, so `sources` is still the resolved list. `None`
+    /// when the patterns must be resolved again on every load.
+    include_dirs: Option<Vec<Stamp>>,
+    /// The base file's `include` patterns, for resolving them again without
+    /// parsing the base file.
+    include: Vec<String>,
+    config: Value,
+}
+
+/// Load the config from the cache in the default state directory, if the
+/// cache exists and its stamps match the base file at `base_path`, its
+/// fragments and their include directories. Returns `None` on a miss; errors
+/// mean the cache is unusable and are for the caller to log.
+fn load_cached(work_dir: &Path, base_path: &Path) -> Result<Option<Config>> {
+    let path = work_dir.join(STATE_SUBDIR).join(CACHE_FILE);
+    let data = match fs::read(&path) {
+        Ok(data) => data,
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => return Ok(None),
+        Err(e) => {
+            return Err(e).with_context(|| format!("failed to read '{}'", path.display()));
+        }
+    };
+    let cached: CachedConfig = serde_json::from_slice(&data)
+        .with_context(|| format!("failed to parse '{}'", path.display()))?;
+    if cached.version != env!("CARGO_PKG_VERSION") {
+        log::debug!(
+            "Config cache was written by leech2 {}; reloading config",
+            cached.version
+        );
+        return Ok(None);
+    }
+
+    // A switch between config.toml and config.json changes the base path.
+    match cached.sources.first() {
+        Some(base) if base.path == base_path => {}
+        _ => return Ok(None),
+    }
+
+    match &cached.include_dirs {
+        Some(dirs) => {
+            for dir in dirs {
+                if Stamp::of(&dir.path)? != *dir {
+                    log::debug!(
+                        "Include directory '{}' changed since the config was cached",
+                        dir.path.display()
+                    );
+                    return Ok(None);
+                }
+            }
+        }
+        None => {
+            let paths = resolve_includes(work_dir, &cached.include, base_path)?;
+            let cached_paths = cached.sources.iter().skip(1).map(|source| &source.path);
+            if !paths.iter().eq(cached_paths) {
+                log::debug!("Config fragments changed since the config was cached");
+                return Ok(None);
+            }
+        }
+    }
+
+    for source in &cached.sources {
+        if Stamp::of(&source.path)? != *source {
+            log::debug!(
+                "Config file '{}' changed since it was cached",
+                source.path.display()
+            );
+            return Ok(None);
+        }
+    }
+
+    let mut config: Config = serde_json::from_value(cached.config)
+        .with_context(|| format!("failed to build config from '{}'", path.display()))?;
+    config.work_dir = work_dir.to_path_buf();
+    config.compression.load_dictionaries(work_dir)?;
+    Ok(Some(config))
+}
+
 impl Config {
+    /// Resolve a name from a block, STATE or patch to the configured table
+    /// it belongs to: the table itself, or the table a `<table>#<index>`
+    /// partition name was split from. The index is not checked against the
+    /// current `partitions`, so partitions of an older layout still resolve.
+    pub fn table_of<'a>(&'a self, stored_name: &str) -> Option<(&'a str, &'a TableConfig)> {
+        if let Some((name, table)) = self.tables.get_key_value(stored_name) {
+            return Some((name.as_str(), table));
+        }
+        let (name, index) = stored_name.rsplit_once('#')?;
+        if index.is_empty() || !index.bytes().all(|b| b.is_ascii_digit()) {
+            return None;
+        }
+        self.tables
+            .get_key_value(name)
+            .map(|(name, table)| (name.as_str(), table))
+    }
+
     /// Directory holding state files, resolved from the optional `state-dir`
     /// config value: relative to `work_dir`, absolute as-is, or the `state`
     /// subdirectory of `work_dir` when unset.
@@ -712,7 +1221,19 @@ impl Config {
         Ok(state_dir)
     }
 
+    /// Load the config from `work_dir`, from the cache in the state directory
+    /// when none of the files it was merged from changed since, and refresh
+    /// the cache otherwise.
     pub fn load(work_dir: &Path) -> Result<Config> {
+        Self::load_with(work_dir, true)
+    }
+
+    /// Like [`Config::load`], but never writes the cache, for `lch --dry-run`.
+    pub fn load_read_only(work_dir: &Path) -> Result<Config> {
+        Self::load_with(work_dir, false)
+    }
+
+    fn load_with(work_dir: &Path, store_cache: bool) -> Result<Config> {
         let toml_path = work_dir.join("config.toml");
         let json_path = work_dir.join("config.json");
 
@@ -728,12 +1249,34 @@ impl Config {
             ),
         };
 
+        match load_cached(work_dir, &base_path) {
+            Ok(Some(config)) => {
+                log::debug!("Loaded cached config with {} tables", config.tables.len());
+                return Ok(config);
+            }
+            Ok(None) => {}
+            Err(e) => log::warn!("Ignoring unreadable config cache: {:#}", e),
+        }
+
+        // Every path is stamped before it is read, so an edit racing this
+        // load leaves a stale stamp, and the next load misses the cache.
+        let settled = nanos_since_epoch(SystemTime::now()).saturating_sub(CACHE_SETTLE.as_nanos());
+        let mut sources = vec![Stamp::of(&base_path)?];
+
         log::debug!("Parsing config from file '{}'...", base_path.display());
         let mut merged = parse_fragment(&base_path)?;
         let include_patterns = take_include_patterns(&mut merged, &base_path)?;
+        let dir_stamps = include_dirs(work_dir, &include_patterns)
+            .map(|dirs| {
+                dirs.into_iter()
+                    .map(|dir| Stamp::of(&dir))
+                    .collect::<Result<Vec<_>>>()
+            })
+            .transpose()?;
 
         for path in resolve_includes(work_dir, &include_patterns, &base_path)? {
             log::debug!("Merging config fragment '{}'...", path.display());
+            sources.push(Stamp::of(&path)?);
             let fragment = parse_fragment(&path)?;
             if fragment.get("include").is_some() {
                 bail!(
@@ -744,6 +1287,21 @@ impl Config {
             deep_merge(&mut merged, fragment);
         }
 
+        let is_settled = sources
+            .iter()
+            .chain(dir_stamps.iter().flatten())
+            .all(|stamp| stamp.is_settled(settled));
+        if store_cache && !is_settled {
+            log::debug!("Config files changed too recently to cache");
+        }
+        let cache = (store_cache && is_settled).then(|| CachedConfig {
+            version: env!("CARGO_PKG_VERSION").to_string(),
+            sources,
+            include_dirs: dir_stamps,
+            include: include_patterns,
+            config: merged.clone(),
+        });
+
         // `serde_path_to_error` prefixes the offending key path (e.g.
         // `truncate.max-age`) onto deserialization errors, which a plain
         // `serde_json::from_value` would otherwise drop.
@@ -752,10 +1310,35 @@ impl Config {
         config.work_dir = work_dir.to_path_buf();
 
         config.validate()?;
+        config.compression.load_dictionaries(work_dir)?;
+
+        if let Some(cache) = cache {
+            if let Err(e) = config.store_cache(&cache) {
+                log::warn!("Failed to store config cache: {:#}", e);
+            }
+        }
 
         log::debug!("Initialized config with {} tables", config.tables.len());
         Ok(config)
     }
+
+    /// Store `cache` in the state directory. Only the default state
+    /// directory can hold it, as a relocated one is not known before the
+    /// config is parsed. The directory is not created here, so the cache
+    /// appears with the first block.
+    fn store_cache(&self, cache: &CachedConfig) -> Result<()> {
+        let state_dir = self.state_dir();
+        if state_dir != self.work_dir.join(STATE_SUBDIR) || !state_dir.is_dir() {
+            return Ok(());
+        }
+        let data = serde_json::to_vec(cache).context("failed to encode config cache")?;
+        storage::store(&state_dir, CACHE_FILE, &data, self.file_mode, false)?;
+        log::debug!(
+            "Stored config cache '{}'",
+            state_dir.join(CACHE_FILE).display()
+        );
+        Ok(())
+    }
 }
 
 #[cfg(test)]
@@ -1353,6 +1936,264 @@ fields = [
         );
     }
 
+    #[test]
+    fn test_threads_defaults_to_1() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("config.toml"), minimal_config_with("")).unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.threads, 1);
+    }
+
+    #[test]
+    fn test_checkpoint_interval() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("config.toml"), minimal_config_with("")).unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.checkpoint_interval, 16);
+
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with("checkpoint-interval = 0"),
+        )
+        .unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.checkpoint_interval, 0);
+    }
+
+    #[test]
+    fn test_resident_state() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("config.toml"), minimal_config_with("")).unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert!(!config.resident_state);
+
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with("resident-state = true"),
+        )
+        .unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert!(config.resident_state);
+    }
+
+    /// Just enough of a trained zstd dictionary for its ID to be read.
+    fn dictionary_with_id(id: u32) -> Vec<u8> {
+        let mut data = vec![0x37, 0xA4, 0x30, 0xEC];
+        data.extend_from_slice(&id.to_le_bytes());
+        data.extend_from_slice(&[0; 64]);
+        data
+    }
+
+    #[test]
+    fn test_compression_dictionaries() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("current.dict"), dictionary_with_id(7)).unwrap();
+        fs::write(dir.path().join("old.dict"), dictionary_with_id(3)).unwrap();
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with(
+                "[compression]\ndictionary = \"current.dict\"\nprevious-dictionaries = [\"old.dict\"]\n",
+            ),
+        )
+        .unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.compression.loaded_dictionary.as_ref().unwrap().id, 7);
+        assert!(config.compression.dictionary_by_id(3).is_some());
+        assert!(config.compression.dictionary_by_id(5).is_none());
+    }
+
+    #[test]
+    fn test_compression_dictionary_rejects_untrained_or_duplicate() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("raw.dict"), b"just some bytes").unwrap();
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with("[compression]\ndictionary = \"raw.dict\"\n"),
+        )
+        .unwrap();
+        let err = Config::load(dir.path()).unwrap_err();
+        assert!(format!("{:#}", err).contains("not a trained zstd dictionary"));
+
+        fs::write(dir.path().join("a.dict"), dictionary_with_id(7)).unwrap();
+        fs::write(dir.path().join("b.dict"), dictionary_with_id(7)).unwrap();
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with(
+                "[compression]\ndictionary = \"a.dict\"\nprevious-dictionaries = [\"b.dict\"]\n",
+            ),
+        )
+        .unwrap();
+        let err = Config::load(dir.path()).unwrap_err();
+        assert!(format!("{:#}", err).contains("distinct IDs"));
+    }
+
+    #[test]
+    fn test_framed_patches() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("config.toml"), minimal_config_with("")).unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert!(!config.framed_patches);
+
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with("framed-patches = true"),
+        )
+        .unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert!(config.framed_patches);
+    }
+
+    #[test]
+    fn test_sql_batch_size() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("config.toml"), minimal_config_with("")).unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.sql.batch_size, 1);
+
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with("[sql]\nbatch-size = 500"),
+        )
+        .unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.sql.batch_size, 500);
+
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with("[sql]\nbatch-size = 0"),
+        )
+        .unwrap();
+        let err = Config::load(dir.path()).unwrap_err();
+        assert!(format!("{:#}", err).contains("sql.batch-size"));
+    }
+
+    #[test]
+    fn test_journal() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("config.toml"), minimal_config_with("")).unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert!(!config.journal.enable);
+        assert_eq!(config.journal.checkpoint_size, 4 * 1024 * 1024);
+
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with("[journal]\nenable = true\ncheckpoint-size = 65536"),
+        )
+        .unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert!(config.journal.enable);
+        assert_eq!(config.journal.checkpoint_size, 65536);
+    }
+
+    #[test]
+    fn test_stats_trace() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("config.toml"), minimal_config_with("")).unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert!(!config.stats.trace);
+
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with("[stats]\ntrace = true"),
+        )
+        .unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert!(config.stats.trace);
+        assert!(!config.stats.enable);
+    }
+
+    #[test]
+    fn test_threads_zero_rejected() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(
+            dir.path().join("config.toml"),
+            minimal_config_with("threads = 0"),
+        )
+        .unwrap();
+        let err = Config::load(dir.path()).expect_err("expected validation error");
+        assert!(format!("{:#}", err).contains("threads must be >= 1"));
+    }
+
+    #[test]
+    fn test_thread_safe_rejected_on_csv_table() {
+        let dir = tempfile::tempdir().unwrap();
+        let toml_input = r#"
+[tables.users]
+thread-safe = true
+fields = [
+    { name = "id", type = "NUMBER", primary-key = true },
+]
+
+[tables.users.csv]
+source = "users.csv"
+"#;
+        fs::write(dir.path().join("config.toml"), toml_input).unwrap();
+        let err = Config::load(dir.path()).expect_err("expected validation error");
+        assert!(format!("{:#}", err).contains("callback-backed"));
+    }
+
+    #[test]
+    fn test_partitions() {
+        let dir = tempfile::tempdir().unwrap();
+        let toml_input = r#"
+[tables.users]
+partitions = 4
+fields = [
+    { name = "id", type = "NUMBER", primary-key = true },
+]
+
+[tables.orders]
+fields = [
+    { name = "id", type = "NUMBER", primary-key = true },
+]
+"#;
+        fs::write(dir.path().join("config.toml"), toml_input).unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.tables["orders"].partitions, 1);
+        assert_eq!(config.tables["orders"].stored_names("orders"), ["orders"]);
+        assert_eq!(
+            config.tables["users"].stored_names("users"),
+            ["users#0", "users#1", "users#2", "users#3"]
+        );
+
+        assert_eq!(config.table_of("users").unwrap().0, "users");
+        assert_eq!(config.table_of("users#2").unwrap().0, "users");
+        // Partitions of an older layout still resolve.
+        assert_eq!(config.table_of("users#9").unwrap().0, "users");
+        assert_eq!(config.table_of("orders#0").unwrap().0, "orders");
+        assert!(config.table_of("users#").is_none());
+        assert!(config.table_of("users#x").is_none());
+        assert!(config.table_of("items#0").is_none());
+    }
+
+    #[test]
+    fn test_partitions_out_of_range_rejected() {
+        for partitions in ["0", "4097"] {
+            let dir = tempfile::tempdir().unwrap();
+            let toml_input = format!(
+                "[tables.users]\npartitions = {}\nfields = [\n    {{ name = \"id\", type = \"NUMBER\", primary-key = true }},\n]\n",
+                partitions
+            );
+            fs::write(dir.path().join("config.toml"), toml_input).unwrap();
+            let err = Config::load(dir.path()).expect_err("expected validation error");
+            assert!(format!("{:#}", err).contains("partitions must be between"));
+        }
+    }
+
+    #[test]
+    fn test_table_name_with_hash_rejected() {
+        let dir = tempfile::tempdir().unwrap();
+        let toml_input = r#"
+[tables."users#1"]
+fields = [
+    { name = "id", type = "NUMBER", primary-key = true },
+]
+"#;
+        fs::write(dir.path().join("config.toml"), toml_input).unwrap();
+        let err = Config::load(dir.path()).expect_err("expected validation error");
+        assert!(format!("{:#}", err).contains("reserved for partition names"));
+    }
+
     #[test]
     fn test_state_dir_defaults_to_subdir() {
         let dir = tempfile::tempdir().unwrap();
@@ -1628,4 +2469,203 @@ fields = [
         let config = Config::load(dir.path()).unwrap();
         assert!(config.tables.contains_key("users"));
     }
+
+    const CACHE_BASE: &str = r#"
+include = ["drop-in/*.toml"]
+
+[tables.users]
+fields = [
+    { name = "id", type = "NUMBER", primary-key = true },
+]
+"#;
+
+    const PRODUCTS: &str =
+        "[tables.products]\nfields = [{ name = \"sku\", type = \"TEXT\", primary-key = true }]\n";
+
+    /// Set the mtime of `path` to `age` seconds ago, past [`CACHE_SETTLE`].
+    /// Distinct ages give each edit its own mtime. Directories can only be
+    /// opened as files on Unix, hence the `cfg(unix)` on the tests below.
+    fn backdate(path: &Path, age: u64) {
+        let modified = SystemTime::now() - Duration::from_secs(age);
+        fs::File::open(path)
+            .unwrap()
+            .set_modified(modified)
+            .unwrap();
+    }
+
+    /// Write the base config and an empty `drop-in` directory, with the
+    /// state directory the cache lives in.
+    fn cache_work_dir(base: &str) -> tempfile::TempDir {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("config.toml"), base).unwrap();
+        fs::create_dir(dir.path().join("drop-in")).unwrap();
+        fs::create_dir(dir.path().join(STATE_SUBDIR)).unwrap();
+        backdate(&dir.path().join("config.toml"), 100);
+        backdate(&dir.path().join("drop-in"), 100);
+        dir
+    }
+
+    /// Rewrite the `threads` value stored in the cache, leaving its stamps
+    /// alone, so a load that returns it must have come from the cache.
+    fn tamper_cache(work_dir: &Path, threads: usize) {
+        let path = work_dir.join(STATE_SUBDIR).join(CACHE_FILE);
+        let mut cached: CachedConfig = serde_json::from_slice(&fs::read(&path).unwrap()).unwrap();
+        cached.config["threads"] = threads.into();
+        fs::write(&path, serde_json::to_vec(&cached).unwrap()).unwrap();
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_cache_serves_warm_load() {
+        let dir = cache_work_dir(CACHE_BASE);
+        let fragment = dir.path().join("drop-in/extra.toml");
+        fs::write(&fragment, PRODUCTS).unwrap();
+        backdate(&fragment, 100);
+        backdate(&dir.path().join("drop-in"), 100);
+
+        let cache_path = dir.path().join(STATE_SUBDIR).join(CACHE_FILE);
+        Config::load_read_only(dir.path()).unwrap();
+        assert!(!cache_path.exists());
+        Config::load(dir.path()).unwrap();
+        let cached: CachedConfig = serde_json::from_slice(&fs::read(&cache_path).unwrap()).unwrap();
+        assert_eq!(cached.sources.len(), 2);
+        assert_eq!(cached.include_dirs.map(|dirs| dirs.len()), Some(1));
+
+        tamper_cache(dir.path(), 977);
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.threads, 977);
+        assert!(config.tables.contains_key("users"));
+        assert!(config.tables.contains_key("products"));
+        assert_eq!(config.work_dir, dir.path());
+    }
+
+    #[test]
+    fn test_cache_not_stored_for_recent_files() {
+        let dir = tempfile::tempdir().unwrap();
+        fs::write(dir.path().join("config.toml"), CACHE_BASE).unwrap();
+        fs::create_dir(dir.path().join(STATE_SUBDIR)).unwrap();
+        Config::load(dir.path()).unwrap();
+        assert!(!dir.path().join(STATE_SUBDIR).join(CACHE_FILE).exists());
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_cache_invalidated_by_changed_files() {
+        let dir = cache_work_dir(CACHE_BASE);
+        let fragment = dir.path().join("drop-in/extra.toml");
+        Config::load(dir.path()).unwrap();
+
+        // A new fragment matched by an include pattern.
+        tamper_cache(dir.path(), 977);
+        fs::write(&fragment, PRODUCTS).unwrap();
+        backdate(&fragment, 90);
+        backdate(&dir.path().join("drop-in"), 90);
+        let config = Config::load(dir.path()).unwrap();
+        assert_ne!(config.threads, 977);
+        assert!(config.tables.contains_key("products"));
+
+        // An edited fragment of the same size, told apart by its mtime.
+        tamper_cache(dir.path(), 977);
+        fs::write(&fragment, PRODUCTS.replace("products", "customer")).unwrap();
+        backdate(&fragment, 80);
+        let config = Config::load(dir.path()).unwrap();
+        assert_ne!(config.threads, 977);
+        assert!(config.tables.contains_key("customer"));
+        assert!(!config.tables.contains_key("products"));
+
+        // A removed fragment.
+        tamper_cache(dir.path(), 977);
+        fs::remove_file(&fragment).unwrap();
+        backdate(&dir.path().join("drop-in"), 70);
+        let config = Config::load(dir.path()).unwrap();
+        assert_ne!(config.threads, 977);
+        assert!(!config.tables.contains_key("customer"));
+
+        // An edited base file.
+        tamper_cache(dir.path(), 977);
+        fs::write(
+            dir.path().join("config.toml"),
+            format!("threads = 3\n{}", CACHE_BASE),
+        )
+        .unwrap();
+        backdate(&dir.path().join("config.toml"), 60);
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.threads, 3);
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_cache_resolves_wildcard_directories_again() {
+        let dir = cache_work_dir(&CACHE_BASE.replace("drop-in/*.toml", "drop-in/*/extra.toml"));
+        let first = dir.path().join("drop-in/a");
+        fs::create_dir(&first).unwrap();
+        fs::write(first.join("extra.toml"), PRODUCTS).unwrap();
+        backdate(&first.join("extra.toml"), 100);
+        backdate(&first, 100);
+        backdate(&dir.path().join("drop-in"), 100);
+        Config::load(dir.path()).unwrap();
+        tamper_cache(dir.path(), 977);
+
+        // Unchanged files still load from the cache.
+        let config = Config::load(dir.path()).unwrap();
+        assert_eq!(config.threads, 977);
+
+        // A fragment in a new directory is found by resolving the pattern
+        // again, as no include directory is stamped for it.
+        let second = dir.path().join("drop-in/b");
+        fs::create_dir(&second).unwrap();
+        fs::write(
+            second.join("extra.toml"),
+            "[tables.orders]\nfields = [{ name = \"id\", type = \"NUMBER\", primary-key = true }]\n",
+        )
+        .unwrap();
+        let config = Config::load(dir.path()).unwrap();
+        assert_ne!(config.threads, 977);
+        assert!(config.tables.contains_key("orders"));
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_unreadable_cache_falls_back_to_files() {
+        let dir = cache_work_dir(CACHE_BASE);
+        let cache_path = dir.path().join(STATE_SUBDIR).join(CACHE_FILE);
+        fs::write(&cache_path, b"not json").unwrap();
+
+        let config = Config::load(dir.path()).unwrap();
+        assert!(config.tables.contains_key("users"));
+        // The broken cache was replaced.
+        let cached: CachedConfig = serde_json::from_slice(&fs::read(&cache_path).unwrap()).unwrap();
+        assert_eq!(cached.sources.len(), 1);
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_cache_not_stored_for_relocated_state_dir() {
+        let dir = cache_work_dir(&format!("state-dir = \"elsewhere\"\n{}", CACHE_BASE));
+        fs::create_dir(dir.path().join("elsewhere")).unwrap();
+        Config::load(dir.path()).unwrap();
+        assert!(!dir.path().join(STATE_SUBDIR).join(CACHE_FILE).exists());
+        assert!(!dir.path().join("elsewhere").join(CACHE_FILE).exists());
+    }
+
+    #[test]
+    fn test_include_dirs() {
+        let work_dir = Path::new("/work");
+        let patterns = |patterns: &[&str]| -> Vec<String> {
+            patterns.iter().map(|pattern| pattern.to_string()).collect()
+        };
+        assert_eq!(
+            include_dirs(
+                work_dir,
+                &patterns(&["conf.d/*.toml", "conf.d/*.json", "extra.toml"])
+            ),
+            Some(vec![PathBuf::from("/work/conf.d"), PathBuf::from("/work")])
+        );
+        assert_eq!(
+            include_dirs(work_dir, &patterns(&["conf.d/*/x.toml"])),
+            None
+        );
+        assert_eq!(include_dirs(work_dir, &patterns(&["conf.d/**"])), None);
+        assert_eq!(include_dirs(work_dir, &[]), Some(Vec::new()));
+    }
 }
@@ -1,17 +1,21 @@
+use std::cmp::Ordering;
 use std::collections::HashMap;
 use std::fmt;
+use std::sync::Mutex;
 
 use anyhow::{Context, Result, bail};
 
 use crate::cell::Cell;
 use crate::cell::display_proto_cells;
-use crate::proto::delta::Delta as ProtoDelta;
 use crate::record::RecordMap;
 use crate::record::decode_proto_records;
 use crate::state::State;
-use crate::table::Table;
+use crate::table::{SortedTable, Table};
 use crate::update::UpdateMap;
 use crate::update::decode_proto_updates;
+use crate::utils::parallel_map;
+
+pub use crate::proto::delta::Delta as ProtoDelta;
 
 /// Delta represents the changes to a single table between two states.
 #[derive(Debug, Clone, PartialEq)]
@@ -312,127 +316,193 @@ impl Delta {
 
     /// Compute deltas between a previous and current state.
     ///
+    /// Convenience wrapper around [`Delta::compute_sorted`] for a previous
+    /// state that is already materialized as a [`State`].
+    pub fn compute(
+        previous_state: Option<State>,
+        current_state: &State,
+        threads: usize,
+    ) -> HashMap<String, Option<Delta>> {
+        let previous_tables = previous_state
+            .map(|state| {
+                state
+                    .tables
+                    .into_iter()
+                    .map(|(name, table)| (name, SortedTable::from(table)))
+                    .collect()
+            })
+            .unwrap_or_default();
+        Self::compute_sorted(previous_tables, current_state, threads)
+    }
+
+    /// Compute deltas between a previous state, given as key-sorted tables
+    /// (see [`State::load_sorted`]), and the current state.
+    ///
     /// Returns `None` for tables whose field layout changed (columns
     /// added/removed/reordered), since positional record values are
     /// not comparable across different layouts.  Callers should treat
     /// `None` as "use full state instead of a delta".
-    pub fn compute(
-        previous_state: Option<State>,
+    ///
+    /// Previous records are consumed: deleted records and the old side of
+    /// updates are moved into the delta rather than cloned. Tables are
+    /// diffed independently of each other on a pool of at most `threads`
+    /// workers.
+    pub fn compute_sorted(
+        previous_tables: HashMap<String, SortedTable>,
         current_state: &State,
+        threads: usize,
     ) -> HashMap<String, Option<Delta>> {
-        let mut deltas = HashMap::new();
+        let deltas = Mutex::new(HashMap::new());
+        Self::compute_sorted_with(previous_tables, current_state, threads, |name, delta| {
+            deltas
+                .lock()
+                .unwrap_or_else(|e| e.into_inner())
+                .insert(name, delta);
+        });
+        deltas.into_inner().unwrap_or_else(|e| e.into_inner())
+    }
 
+    /// Like [`Delta::compute_sorted`], but hand each table's delta to `sink`
+    /// as soon as it is computed instead of collecting them. `sink` runs on
+    /// the worker that diffed the table, concurrently with the diffs of the
+    /// other tables, so a table's delta can be encoded and dropped while the
+    /// rest are still being computed. Unchanged tables are not passed on.
+    pub fn compute_sorted_with<F>(
+        mut previous_tables: HashMap<String, SortedTable>,
+        current_state: &State,
+        threads: usize,
+        sink: F,
+    ) where
+        F: Fn(String, Option<Delta>) + Sync,
+    {
         // Process tables in current state
-        for (table_name, current_table) in &current_state.tables {
-            let previous_table = previous_state
-                .as_ref()
-                .and_then(|state| state.tables.get(table_name));
-
-            // If the field layout changed, a meaningful delta cannot be computed.
-            if let Some(previous_table) = previous_table
-                && (previous_table.primary_key_names != current_table.primary_key_names
-                    || previous_table.subsidiary_value_names
-                        != current_table.subsidiary_value_names)
-            {
-                log::warn!(
-                    "Table '{}': field layout changed, will use full state",
-                    table_name
-                );
-                deltas.insert(table_name.clone(), None);
-                continue;
-            }
-
-            let (inserts, deletes, updates) = Self::diff_table(previous_table, current_table);
-
-            log::trace!(
-                "Table '{}': {} inserts, {} deletes, {} updates",
-                table_name,
-                inserts.len(),
-                deletes.len(),
-                updates.len()
-            );
+        let jobs: Vec<(&String, &Table, Option<SortedTable>)> = current_state
+            .tables
+            .iter()
+            .map(|(name, table)| (name, table, previous_tables.remove(name)))
+            .collect();
+        parallel_map(
+            jobs,
+            threads,
+            |(table_name, current_table, previous_table)| {
+                if let Some(delta) = Self::diff_one(table_name, previous_table, current_table) {
+                    sink(table_name.clone(), delta);
+                }
+            },
+        );
 
-            // Skip tables with no changes
-            if inserts.is_empty() && deletes.is_empty() && updates.is_empty() {
+        // Tables only in previous state: all records are deletes
+        for (table_name, table) in previous_tables {
+            // Skip empty tables
+            if table.records.is_empty() {
                 continue;
             }
 
-            deltas.insert(
-                table_name.clone(),
+            sink(
+                table_name,
                 Some(Delta {
-                    primary_key_names: current_table.primary_key_names.clone(),
-                    subsidiary_value_names: current_table.subsidiary_value_names.clone(),
-                    inserts,
-                    deletes,
-                    updates,
+                    primary_key_names: table.primary_key_names,
+                    subsidiary_value_names: table.subsidiary_value_names,
+                    inserts: RecordMap::default(),
+                    deletes: table.records.into_iter().collect(),
+                    updates: UpdateMap::default(),
                 }),
             );
         }
+    }
 
-        // Tables only in previous state: all records are deletes
-        if let Some(ref previous_state) = previous_state {
-            for (table_name, table) in &previous_state.tables {
-                // Skip empty tables
-                if table.records.is_empty() {
-                    continue;
-                }
+    /// Diff a single table. Returns `None` when the table is unchanged,
+    /// `Some(None)` when its field layout changed, and `Some(Some(delta))`
+    /// otherwise.
+    fn diff_one(
+        table_name: &str,
+        previous_table: Option<SortedTable>,
+        current_table: &Table,
+    ) -> Option<Option<Delta>> {
+        // If the field layout changed, a meaningful delta cannot be computed.
+        if let Some(previous_table) = &previous_table
+            && (previous_table.primary_key_names != current_table.primary_key_names
+                || previous_table.subsidiary_value_names != current_table.subsidiary_value_names)
+        {
+            log::warn!(
+                "Table '{}': field layout changed, will use full state",
+                table_name
+            );
+            return Some(None);
+        }
 
-                // Skip if table exists in current state (this is already handled above)
-                if current_state.tables.contains_key(table_name) {
-                    continue;
-                }
+        let previous_records = previous_table
+            .map(|table| table.records)
+            .unwrap_or_default();
+        let (inserts, deletes, updates) = Self::diff_table(previous_records, current_table);
+
+        log::trace!(
+            "Table '{}': {} inserts, {} deletes, {} updates",
+            table_name,
+            inserts.len(),
+            deletes.len(),
+            updates.len()
+        );
 
-                deltas.insert(
-                    table_name.clone(),
-                    Some(Delta {
-                        primary_key_names: table.primary_key_names.clone(),
-                        subsidiary_value_names: table.subsidiary_value_names.clone(),
-                        inserts: HashMap::new(),
-                        deletes: table.records.clone(),
-                        updates: HashMap::new(),
-                    }),
-                );
-            }
+        // Skip tables with no changes
+        if inserts.is_empty() && deletes.is_empty() && updates.is_empty() {
+            return None;
         }
 
-        deltas
+        Some(Some(Delta {
+            primary_key_names: current_table.primary_key_names.clone(),
+            subsidiary_value_names: current_table.subsidiary_value_names.clone(),
+            inserts,
+            deletes,
+            updates,
+        }))
     }
 
+    /// Diff key-sorted previous records against the current table in a single
+    /// merge pass over both key sequences. Only the current side is cloned
+    /// (it lives on as the next STATE); previous records are moved.
     fn diff_table(
-        previous_table: Option<&Table>,
+        previous_records: Vec<(Vec<Cell>, Vec<Cell>)>,
         current_table: &Table,
     ) -> (RecordMap, RecordMap, UpdateMap) {
-        let mut deletes = HashMap::new();
-        let mut updates = HashMap::new();
-
-        let Some(previous_table) = previous_table else {
-            // No previous table: all records are inserts
-            let inserts = current_table.records.clone();
-            return (inserts, deletes, updates);
-        };
-
-        let mut inserts = HashMap::new();
-
-        // Keys in previous but not current -> deletes
-        for (key, value) in &previous_table.records {
-            if !current_table.records.contains_key(key) {
-                deletes.insert(key.clone(), value.clone());
+        let mut inserts = RecordMap::default();
+        let mut deletes = RecordMap::default();
+        let mut updates = UpdateMap::default();
+
+        let mut current_records: Vec<(&Vec<Cell>, &Vec<Cell>)> =
+            current_table.records.iter().collect();
+        current_records.sort_unstable_by(|a, b| a.0.cmp(b.0));
+
+        let mut previous_records = previous_records.into_iter().peekable();
+        for (key, current_value) in current_records {
+            // Previous keys sorting before `key` no longer exist.
+            let mut previous_value = None;
+            while let Some((previous_key, _)) = previous_records.peek() {
+                let ordering = previous_key.cmp(key);
+                if ordering == Ordering::Greater {
+                    break;
+                }
+                let Some((previous_key, value)) = previous_records.next() else {
+                    break;
+                };
+                if ordering == Ordering::Equal {
+                    previous_value = Some(value);
+                    break;
+                }
+                deletes.insert(previous_key, value);
             }
-        }
 
-        // Keys in current but not previous -> inserts
-        // Keys in both with different values -> updates
-        for (key, current_value) in &current_table.records {
-            match previous_table.records.get(key) {
+            match previous_value {
                 None => {
                     inserts.insert(key.clone(), current_value.clone());
                 }
-                Some(previous_value) if previous_value != current_value => {
-                    updates.insert(key.clone(), (previous_value.clone(), current_value.clone()));
+                Some(previous_value) if previous_value != *current_value => {
+                    updates.insert(key.clone(), (previous_value, current_value.clone()));
                 }
                 _ => {} // Same value, skip
             }
         }
+        deletes.extend(previous_records);
 
         (inserts, deletes, updates)
     }
@@ -464,7 +534,7 @@ mod tests {
         );
         let current = State { tables };
 
-        let deltas = Delta::compute(None, &current);
+        let deltas = Delta::compute(None, &current, 1);
 
         assert_eq!(deltas.len(), 1);
         let delta = deltas.get("users").unwrap().as_ref().unwrap();
@@ -487,7 +557,7 @@ mod tests {
             tables: HashMap::new(),
         };
 
-        let deltas = Delta::compute(Some(previous), &current);
+        let deltas = Delta::compute(Some(previous), &current, 1);
 
         assert_eq!(deltas.len(), 1);
         let delta = deltas.get("old_table").unwrap().as_ref().unwrap();
@@ -496,6 +566,36 @@ mod tests {
         assert_eq!(delta.updates.len(), 0);
     }
 
+    /// Diffing on a worker pool yields exactly the serial result, including
+    /// unchanged tables being skipped.
+    #[test]
+    fn test_compute_parallel_matches_serial() {
+        let mut previous_tables = HashMap::new();
+        let mut current_tables = HashMap::new();
+        for i in 0..8 {
+            let name = format!("table_{}", i);
+            previous_tables.insert(name.clone(), make_table(&[(&["1"], &["a"])]));
+            let current = if i % 2 == 0 {
+                make_table(&[(&["1"], &["b"]), (&["2"], &["c"])])
+            } else {
+                make_table(&[(&["1"], &["a"])])
+            };
+            current_tables.insert(name, current);
+        }
+        let previous_state = State {
+            tables: previous_tables,
+        };
+        let current_state = State {
+            tables: current_tables,
+        };
+
+        let serial = Delta::compute(Some(previous_state.clone()), &current_state, 1);
+        let parallel = Delta::compute(Some(previous_state), &current_state, 4);
+
+        assert_eq!(serial.len(), 4);
+        assert_eq!(serial, parallel);
+    }
+
     #[test]
     fn test_table_in_both_states_mixed_changes() {
         let mut previous_tables = HashMap::new();
@@ -524,7 +624,7 @@ mod tests {
             tables: current_tables,
         };
 
-        let deltas = Delta::compute(Some(previous_state), &current_state);
+        let deltas = Delta::compute(Some(previous_state), &current_state, 1);
 
         assert_eq!(deltas.len(), 1);
         let delta = deltas.get("users").unwrap().as_ref().unwrap();
@@ -559,7 +659,7 @@ mod tests {
             tables: current_tables,
         };
 
-        let deltas = Delta::compute(Some(previous_state), &current_state);
+        let deltas = Delta::compute(Some(previous_state), &current_state, 1);
 
         assert_eq!(deltas.len(), 3);
 
@@ -590,7 +690,7 @@ mod tests {
             tables: HashMap::new(),
         };
 
-        let deltas = Delta::compute(Some(previous_state), &current_state);
+        let deltas = Delta::compute(Some(previous_state), &current_state, 1);
         assert_eq!(deltas.len(), 0);
     }
 
@@ -622,7 +722,7 @@ mod tests {
             tables: current_tables,
         };
 
-        let deltas = Delta::compute(Some(previous_state), &current_state);
+        let deltas = Delta::compute(Some(previous_state), &current_state, 1);
 
         // Only the changed table should have a delta
         assert_eq!(deltas.len(), 1);
@@ -638,7 +738,7 @@ mod tests {
             Table {
                 primary_key_names: vec!["id".to_string()],
                 subsidiary_value_names: vec!["name".to_string()],
-                records: HashMap::from([(text_cells(&["1"]), text_cells(&["alice"]))]),
+                records: RecordMap::from_iter([(text_cells(&["1"]), text_cells(&["alice"]))]),
             },
         );
         let previous_state = State {
@@ -651,7 +751,7 @@ mod tests {
             Table {
                 primary_key_names: vec!["id".to_string()],
                 subsidiary_value_names: vec!["name".to_string(), "email".to_string()],
-                records: HashMap::from([(
+                records: RecordMap::from_iter([(
                     text_cells(&["1"]),
                     text_cells(&["alice", "alice@example.com"]),
                 )]),
@@ -661,7 +761,7 @@ mod tests {
             tables: current_tables,
         };
 
-        let deltas = Delta::compute(Some(previous_state), &current_state);
+        let deltas = Delta::compute(Some(previous_state), &current_state, 1);
 
         assert_eq!(deltas.len(), 1);
         assert!(deltas.get("users").unwrap().is_none());
@@ -693,7 +793,7 @@ mod tests {
             tables: current_tables,
         };
 
-        let deltas = Delta::compute(Some(previous_state), &current_state);
+        let deltas = Delta::compute(Some(previous_state), &current_state, 1);
 
         let delta = deltas.get("orders").unwrap().as_ref().unwrap();
         assert_eq!(delta.inserts.len(), 1);
@@ -722,9 +822,9 @@ mod tests {
         Delta {
             primary_key_names: vec![],
             subsidiary_value_names: vec![],
-            inserts: HashMap::new(),
-            deletes: HashMap::new(),
-            updates: HashMap::new(),
+            inserts: RecordMap::default(),
+            deletes: RecordMap::default(),
+            updates: UpdateMap::default(),
         }
     }
 
@@ -1254,16 +1354,16 @@ mod tests {
         let mut parent_delta = Delta {
             primary_key_names: vec!["id".to_string()],
             subsidiary_value_names: vec!["name".to_string()],
-            inserts: HashMap::new(),
-            deletes: HashMap::new(),
-            updates: HashMap::new(),
+            inserts: RecordMap::default(),
+            deletes: RecordMap::default(),
+            updates: UpdateMap::default(),
         };
         let child_delta = Delta {
             primary_key_names: vec!["id".to_string()],
             subsidiary_value_names: vec!["email".to_string()],
-            inserts: HashMap::new(),
-            deletes: HashMap::new(),
-            updates: HashMap::new(),
+            inserts: RecordMap::default(),
+            deletes: RecordMap::default(),
+            updates: UpdateMap::default(),
         };
 
         let merged_delta = parent_delta.merge(child_delta);
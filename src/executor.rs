@@ -0,0 +1,259 @@
+//! Worker pool behind the asynchronous C API.
+//!
+//! Every `Config` owns an [`Executor`] with a fixed number of worker threads,
+//! one unless the handle was created with `lch_init_async`. The threads are
+//! spawned on the first submitted task, so synchronous-only callers never pay
+//! for them. Tasks run in submission order on whichever worker is free, and
+//! each reports its outcome through the completion callback it was submitted
+//! with. A task can be cancelled until a worker picks it up; once started, it
+//! runs to completion. `lch_deinit` shuts the executor down first, which
+//! waits for every submitted task, so no task outlives its `Config`.
+
+use std::sync::atomic::{AtomicU8, Ordering};
+use std::sync::mpsc::{self, Receiver, Sender};
+use std::sync::{Arc, Mutex};
+use std::thread::JoinHandle;
+
+use anyhow::{Context, Result, bail};
+
+use crate::utils::join_logging_panics;
+
+type Job = Box<dyn FnOnce() + Send>;
+
+/// Lifecycle of a submitted [`Task`].
+const PENDING: u8 = 0;
+const RUNNING: u8 = 1;
+const CANCELLED: u8 = 2;
+const FINISHED: u8 = 3;
+
+/// Cancel handle of one submitted task, shared between the caller (as an
+/// `lch_task_t`) and the worker that runs it.
+#[derive(Debug, Default)]
+pub struct Task {
+    state: AtomicU8,
+}
+
+impl Task {
+    /// Cancel the task if no worker has started it yet. Returns whether it
+    /// was cancelled; a task that is running or finished is left alone.
+    pub fn cancel(&self) -> bool {
+        self.state
+            .compare_exchange(PENDING, CANCELLED, Ordering::AcqRel, Ordering::Acquire)
+            .is_ok()
+    }
+}
+
+/// The running worker threads and the queue feeding them.
+struct Pool {
+    sender: Sender<Job>,
+    workers: Vec<JoinHandle<()>>,
+}
+
+#[derive(Default)]
+struct Slot {
+    pool: Option<Pool>,
+    shut_down: bool,
+}
+
+/// A fixed-size pool of worker threads running submitted tasks.
+pub struct Executor {
+    size: usize,
+    slot: Mutex<Slot>,
+}
+
+impl Default for Executor {
+    fn default() -> Self {
+        Executor::new(1)
+    }
+}
+
+impl std::fmt::Debug for Executor {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "Executor({} workers)", self.size)
+    }
+}
+
+impl Executor {
+    /// An executor with `size` worker threads, at least one.
+    pub fn new(size: usize) -> Self {
+        Executor {
+            size: size.max(1),
+            slot: Mutex::new(Slot::default()),
+        }
+    }
+
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    /// Queue `run` as a task and return its cancel handle. A worker calls
+    /// `run` if the task is still pending when it is picked up, and
+    /// `cancelled` in its place otherwise, so exactly one of the two is
+    /// called.
+    pub fn submit(
+        &self,
+        run: impl FnOnce() + Send + 'static,
+        cancelled: impl FnOnce() + Send + 'static,
+    ) -> Result<Arc<Task>> {
+        let task = Arc::new(Task::default());
+        let handle = Arc::clone(&task);
+        let job: Job = Box::new(move || {
+            let started = handle
+                .state
+                .compare_exchange(PENDING, RUNNING, Ordering::AcqRel, Ordering::Acquire)
+                .is_ok();
+            if started {
+                run();
+                handle.state.store(FINISHED, Ordering::Release);
+            } else {
+                cancelled();
+            }
+        });
+
+        let mut slot = self.slot.lock().unwrap_or_else(|e| e.into_inner());
+        if slot.shut_down {
+            bail!("executor is shut down");
+        }
+        if slot.pool.is_none() {
+            slot.pool = Some(self.spawn()?);
+        }
+        let Some(pool) = &slot.pool else {
+            bail!("executor has no workers");
+        };
+        if pool.sender.send(job).is_err() {
+            bail!("executor workers have exited");
+        }
+        Ok(task)
+    }
+
+    fn spawn(&self) -> Result<Pool> {
+        let (sender, receiver) = mpsc::channel::<Job>();
+        let receiver = Arc::new(Mutex::new(receiver));
+        let mut workers = Vec::with_capacity(self.size);
+        for i in 0..self.size {
+            let receiver = Arc::clone(&receiver);
+            let worker = std::thread::Builder::new()
+                .name(format!("lch-worker-{}", i))
+                .spawn(move || work(&receiver))
+                .context("failed to spawn executor worker")?;
+            workers.push(worker);
+        }
+        log::debug!("Started executor with {} worker(s)", self.size);
+        Ok(Pool { sender, workers })
+    }
+
+    /// Stop accepting tasks and wait for every submitted one to finish.
+    /// Later calls are no-ops.
+    pub fn shutdown(&self) {
+        let pool = {
+            let mut slot = self.slot.lock().unwrap_or_else(|e| e.into_inner());
+            slot.shut_down = true;
+            slot.pool.take()
+        };
+        if let Some(pool) = pool {
+            // Closing the queue lets the workers exit once it is drained.
+            drop(pool.sender);
+            for worker in pool.workers {
+                join_logging_panics(worker, "Executor worker");
+            }
+            log::debug!("Stopped executor");
+        }
+    }
+}
+
+impl Drop for Executor {
+    fn drop(&mut self) {
+        self.shutdown();
+    }
+}
+
+/// Worker loop: run queued jobs until the queue is closed and drained. A
+/// panicking job is logged and does not take the worker down with it.
+fn work(receiver: &Mutex<Receiver<Job>>) {
+    loop {
+        let job = receiver.lock().unwrap_or_else(|e| e.into_inner()).recv();
+        let Ok(job) = job else {
+            break;
+        };
+        if std::panic::catch_unwind(std::panic::AssertUnwindSafe(job)).is_err() {
+            log::error!("Executor task panicked");
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::AtomicUsize;
+    use std::sync::mpsc::channel;
+
+    #[test]
+    fn test_submit_runs_tasks() {
+        let executor = Executor::new(4);
+        let count = Arc::new(AtomicUsize::new(0));
+        let tasks: Vec<Arc<Task>> = (0..16)
+            .map(|_| {
+                let count = Arc::clone(&count);
+                executor
+                    .submit(
+                        move || {
+                            count.fetch_add(1, Ordering::SeqCst);
+                        },
+                        || {},
+                    )
+                    .unwrap()
+            })
+            .collect();
+        executor.shutdown();
+        assert_eq!(count.load(Ordering::SeqCst), 16);
+        // Finished tasks can no longer be cancelled.
+        assert!(tasks.iter().all(|task| !task.cancel()));
+        assert!(executor.submit(|| {}, || {}).is_err());
+    }
+
+    #[test]
+    fn test_cancel_pending_task() {
+        let executor = Executor::new(1);
+        let (release, blocked) = channel::<()>();
+        let (started_sender, started) = channel::<()>();
+        let first = executor
+            .submit(
+                move || {
+                    started_sender.send(()).unwrap();
+                    blocked.recv().unwrap();
+                },
+                || {},
+            )
+            .unwrap();
+        started.recv().unwrap();
+
+        let (outcome_sender, outcome) = channel::<&'static str>();
+        let cancelled_sender = outcome_sender.clone();
+        let second = executor
+            .submit(
+                move || outcome_sender.send("ran").unwrap(),
+                move || cancelled_sender.send("cancelled").unwrap(),
+            )
+            .unwrap();
+
+        // The first task is running and can no longer be cancelled.
+        assert!(!first.cancel());
+        assert!(second.cancel());
+        assert!(!second.cancel());
+        release.send(()).unwrap();
+        executor.shutdown();
+        assert_eq!(outcome.recv().unwrap(), "cancelled");
+    }
+
+    #[test]
+    fn test_panicking_task_keeps_worker() {
+        let executor = Executor::new(1);
+        executor.submit(|| panic!("intentional"), || {}).unwrap();
+        let (sender, receiver) = channel();
+        executor
+            .submit(move || sender.send(42).unwrap(), || {})
+            .unwrap();
+        executor.shutdown();
+        assert_eq!(receiver.recv().unwrap(), 42);
+    }
+}
@@ -7,7 +7,10 @@
 
 use std::ffi::{CStr, c_char, c_int};
 
+use anyhow::{Result, bail};
+
 use crate::cell::Cell;
+use crate::sql::{CellRef, Operation, Statement};
 
 /// `LCH_SUCCESS` from `leech2.h`.
 pub const SUCCESS: i32 = 0;
@@ -21,6 +24,10 @@ pub const END_OF_TABLE: i32 = 1;
 /// further fields.
 pub const SKIP_RECORD: i32 = 2;
 
+/// `LCH_CANCELLED` from `leech2.h`. Completion-callback status: the task was
+/// cancelled before it started.
+pub const CANCELLED: i32 = 3;
+
 /// `LCH_VALUE_NULL` from `leech2.h`. Cell kind tag.
 pub const VALUE_NULL: c_int = 0;
 /// `LCH_VALUE_TEXT` from `leech2.h`. Cell kind tag.
@@ -30,6 +37,15 @@ const VALUE_NUMBER: c_int = 2;
 /// `LCH_VALUE_BOOLEAN` from `leech2.h`. Cell kind tag.
 const VALUE_BOOLEAN: c_int = 3;
 
+/// `LCH_OP_CLEAR` from `leech2.h`. Statement operation tag.
+const OP_CLEAR: c_int = 0;
+/// `LCH_OP_DELETE` from `leech2.h`. Statement operation tag.
+const OP_DELETE: c_int = 1;
+/// `LCH_OP_INSERT` from `leech2.h`. Statement operation tag.
+const OP_INSERT: c_int = 2;
+/// `LCH_OP_UPDATE` from `leech2.h`. Statement operation tag.
+const OP_UPDATE: c_int = 3;
+
 /// `LCH_LOG_ERROR` from `leech2.h`. Log level passed to `lch_log_callback_t`.
 pub const LOG_ERROR: i32 = 1;
 /// `LCH_LOG_WARN` from `leech2.h`. Log level passed to `lch_log_callback_t`.
@@ -90,6 +106,30 @@ pub unsafe fn cstr_arg(fn_name: &str, arg_name: &str, ptr: *const c_char) -> Opt
     }
 }
 
+/// A raw pointer handed to an executor task. Raw pointers are not `Send`;
+/// the C caller guarantees, per the documentation of each asynchronous
+/// function, that the pointee stays valid and may be used from a worker
+/// thread until the task's completion callback has returned. Read it through
+/// [`SendPtr::get`], so closures capture the wrapper rather than the field.
+pub struct SendPtr<T>(pub *mut T);
+
+// SAFETY: see the type documentation.
+unsafe impl<T> Send for SendPtr<T> {}
+
+impl<T> Clone for SendPtr<T> {
+    fn clone(&self) -> Self {
+        *self
+    }
+}
+
+impl<T> Copy for SendPtr<T> {}
+
+impl<T> SendPtr<T> {
+    pub fn get(&self) -> *mut T {
+        self.0
+    }
+}
+
 /// ABI-compatible mirror of `lch_buffer_t` from `leech2.h`. An owned byte
 /// buffer handed across the FFI boundary; freed with `lch_buffer_free`.
 #[repr(C)]
@@ -136,7 +176,7 @@ pub unsafe fn cell_from_ffi(fn_name: &str, cell: &FfiCell) -> Option<Cell> {
         VALUE_TEXT => {
             let ptr = unsafe { cell.payload.text };
             let s = unsafe { cstr_arg(fn_name, "cell.text", ptr) }?;
-            Some(Cell::Text(s))
+            Some(Cell::Text(s.into()))
         }
         VALUE_NUMBER => match Cell::number(unsafe { cell.payload.number }) {
             Ok(cell) => Some(cell),
@@ -156,3 +196,112 @@ pub unsafe fn cell_from_ffi(fn_name: &str, cell: &FfiCell) -> Option<Cell> {
         }
     }
 }
+
+impl From<Operation> for c_int {
+    fn from(operation: Operation) -> Self {
+        match operation {
+            Operation::Clear => OP_CLEAR,
+            Operation::Delete => OP_DELETE,
+            Operation::Insert => OP_INSERT,
+            Operation::Update => OP_UPDATE,
+        }
+    }
+}
+
+/// ABI-compatible mirror of `lch_statement_t` from `leech2.h`. Built by
+/// [`StatementBuffers::marshal`]; every pointer refers into those buffers.
+#[repr(C)]
+pub struct FfiStatement {
+    pub op: c_int,
+    pub table: *const c_char,
+    pub sql: *const c_char,
+    pub columns: *const *const c_char,
+    pub params: *const FfiCell,
+    pub num_params: usize,
+}
+
+/// Storage behind the [`FfiStatement`] handed to a `lch_statement_cb_t`.
+/// Reused across statements, so binding a patch does not allocate per row
+/// once the buffers have grown to the largest statement.
+#[derive(Default)]
+pub struct StatementBuffers {
+    /// Null-terminated copies of the table name, SQL, column names and text
+    /// parameters, back to back.
+    strings: Vec<u8>,
+    columns: Vec<*const c_char>,
+    params: Vec<FfiCell>,
+}
+
+impl StatementBuffers {
+    /// Append a null-terminated copy of `s` and return a pointer to it. The
+    /// caller reserves room up front, so earlier pointers stay valid.
+    fn push_str(&mut self, s: &str) -> Result<*const c_char> {
+        if s.as_bytes().contains(&0) {
+            bail!("{:?} contains a NUL byte", s);
+        }
+        let offset = self.strings.len();
+        self.strings.extend_from_slice(s.as_bytes());
+        self.strings.push(0);
+        Ok(self.strings.as_ptr().wrapping_add(offset).cast::<c_char>())
+    }
+
+    /// Copy `statement` into the buffers and return its C mirror, valid
+    /// until the next call or until the buffers are dropped.
+    pub fn marshal(&mut self, statement: &Statement) -> Result<FfiStatement> {
+        let text_len = |s: &str| s.len() + 1;
+        let needed = text_len(statement.table)
+            + text_len(statement.sql)
+            + statement.columns.iter().map(|c| text_len(c)).sum::<usize>()
+            + statement
+                .params
+                .iter()
+                .map(|param| match param {
+                    CellRef::Text(s) => text_len(s),
+                    _ => 0,
+                })
+                .sum::<usize>();
+        self.strings.clear();
+        self.strings.reserve(needed);
+        self.columns.clear();
+        self.params.clear();
+
+        let table = self.push_str(statement.table)?;
+        let sql = self.push_str(statement.sql)?;
+        for column in statement.columns {
+            let ptr = self.push_str(column)?;
+            self.columns.push(ptr);
+        }
+        for param in statement.params {
+            let cell = match *param {
+                CellRef::Null => FfiCell {
+                    kind: VALUE_NULL,
+                    payload: FfiCellPayload { number: 0.0 },
+                },
+                CellRef::Text(s) => FfiCell {
+                    kind: VALUE_TEXT,
+                    payload: FfiCellPayload {
+                        text: self.push_str(s)?,
+                    },
+                },
+                CellRef::Number(number) => FfiCell {
+                    kind: VALUE_NUMBER,
+                    payload: FfiCellPayload { number },
+                },
+                CellRef::Boolean(boolean) => FfiCell {
+                    kind: VALUE_BOOLEAN,
+                    payload: FfiCellPayload { boolean },
+                },
+            };
+            self.params.push(cell);
+        }
+
+        Ok(FfiStatement {
+            op: c_int::from(statement.operation),
+            table,
+            sql,
+            columns: self.columns.as_ptr(),
+            params: self.params.as_ptr(),
+            num_params: self.params.len(),
+        })
+    }
+}
@@ -2,7 +2,7 @@ use std::path::Path;
 
 use anyhow::{Context, Result};
 
-use crate::storage;
+use crate::storage::{self, Transaction};
 use crate::utils::GENESIS_HASH;
 
 const HEAD_FILE: &str = "HEAD";
@@ -22,6 +22,11 @@ pub fn load(work_dir: &Path, mode: u32) -> Result<String> {
     Ok(hash)
 }
 
+/// Add the write of HEAD pointing to `hash` to `transaction`.
+pub fn stage(transaction: &mut Transaction, hash: &str) {
+    transaction.store(HEAD_FILE, hash.as_bytes().to_vec());
+}
+
 pub fn store(work_dir: &Path, hash: &str, mode: u32, dry_run: bool) -> Result<()> {
     storage::store(work_dir, HEAD_FILE, hash.as_bytes(), mode, dry_run)?;
     log::debug!("Updated head to '{:.7}...'", hash);
@@ -1,18 +1,30 @@
 use std::ffi::{CStr, CString, c_char, c_void};
 use std::path::PathBuf;
 
+use std::sync::Arc;
+
+use anyhow::{Context, Result, bail};
+
+use crate::executor::{Executor, Task};
 use crate::ffi::{
-    FAILURE, FfiBuffer, FfiCell, SUCCESS, cell_from_ffi, cstr_arg, ffi_guard, null_arg,
+    CANCELLED, FAILURE, FfiBuffer, FfiCell, FfiStatement, SUCCESS, SendPtr, StatementBuffers,
+    cell_from_ffi, cstr_arg, ffi_guard, null_arg,
 };
 
 pub mod block;
 mod callbacks;
 pub mod cell;
+pub mod chain;
+mod checkpoint;
+pub mod coalesce;
 pub mod config;
 pub mod delta;
+mod executor;
 mod ffi;
 pub mod head;
 mod logger;
+pub mod merge;
+pub mod pack;
 pub mod patch;
 mod proto;
 pub mod record;
@@ -22,6 +34,7 @@ pub mod state;
 pub mod stats;
 pub mod storage;
 pub mod table;
+pub mod trace;
 pub mod truncate;
 pub mod update;
 pub mod utils;
@@ -90,16 +103,47 @@ pub unsafe extern "C" fn lch_init(work_dir: *const c_char) -> *mut config::Confi
     })
 }
 
+/// Like `lch_init`, but sizes the executor behind the asynchronous
+/// functions with `workers` threads.
+///
+/// # Safety
+/// `work_dir` must be a valid, non-null, null-terminated C string.
+/// Returns a config handle on success, or NULL on failure.
+/// The caller must free the returned handle with `lch_deinit`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_init_async(
+    work_dir: *const c_char,
+    workers: usize,
+) -> *mut config::Config {
+    ffi_guard("lch_init_async", std::ptr::null_mut(), || {
+        if workers == 0 {
+            log::error!("lch_init_async(): Bad argument: workers must be at least 1");
+            return std::ptr::null_mut();
+        }
+        let config = unsafe { lch_init(work_dir) };
+        if !config.is_null() {
+            let executor = Executor::new(workers);
+            log::debug!("lch_init_async(workers={})", executor.size());
+            unsafe { (*config).executor = executor };
+        }
+        config
+    })
+}
+
 /// # Safety
 /// `config` must be a valid pointer returned by `lch_init`, or NULL (no-op).
 /// After calling this function, the config pointer is invalid and must not be used.
+/// Must not be called from a completion callback of an asynchronous task.
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn lch_deinit(config: *mut config::Config) {
     ffi_guard("lch_deinit", (), || {
         if !config.is_null() {
-            // `Drop for Config` joins any background truncation thread, so
-            // this call blocks until truncation has finished.
+            // Wait for the asynchronous tasks while the config is still
+            // shared with them, then free it. `Drop for Config` joins any
+            // background truncation thread, so this call blocks until
+            // truncation has finished.
             unsafe {
+                (*config).executor.shutdown();
                 drop(Box::from_raw(config));
             }
         }
@@ -155,26 +199,11 @@ pub unsafe extern "C" fn lch_patch_create(
 
         let config = unsafe { &*config };
 
-        let state_dir = match config.ensure_state_dir() {
-            Ok(dir) => dir,
-            Err(e) => {
-                log::error!("lch_patch_create(): {:#}", e);
-                return FAILURE;
-            }
-        };
-
-        let hash = if last_known.is_null() {
-            match reported::load(&state_dir, config.file_mode) {
-                Ok(Some(hash)) => hash,
-                Ok(None) => utils::GENESIS_HASH.to_string(),
-                Err(e) => {
-                    log::error!("lch_patch_create(): Failed to load REPORTED: {:#}", e);
-                    return FAILURE;
-                }
-            }
+        let last_known = if last_known.is_null() {
+            None
         } else {
             match unsafe { CStr::from_ptr(last_known) }.to_str() {
-                Ok(hash) => hash.to_string(),
+                Ok(hash) => Some(hash.to_string()),
                 Err(e) => {
                     log::error!("lch_patch_create(): Bad argument: {e}");
                     return FAILURE;
@@ -182,30 +211,35 @@ pub unsafe extern "C" fn lch_patch_create(
             }
         };
 
-        let patch = match patch::Patch::create(config, &hash) {
-            Ok(patch) => patch,
-            Err(e) => {
-                log::error!("lch_patch_create(): {:#}", e);
-                return FAILURE;
+        match create_patch(config, last_known.as_deref()) {
+            Ok(buf) => {
+                unsafe { *out = buf.into() };
+                SUCCESS
             }
-        };
-
-        let buf = match wire::encode_patch(config, &patch) {
-            Ok(buf) => buf,
             Err(e) => {
-                log::error!("lch_patch_create(): Failed to encode patch: {:#}", e);
-                return FAILURE;
+                log::error!("lch_patch_create(): {:#}", e);
+                FAILURE
             }
-        };
-
-        stats::finalize_patch_create(config);
-
-        unsafe { *out = buf.into() };
-
-        SUCCESS
+        }
     })
 }
 
+/// Create and encode the patch from `last_known`, or from the REPORTED hash
+/// (genesis if there is none) when it is `None`.
+fn create_patch(config: &config::Config, last_known: Option<&str>) -> Result<Vec<u8>> {
+    let state_dir = config.ensure_state_dir()?;
+    let hash = match last_known {
+        Some(hash) => hash.to_string(),
+        None => reported::load(&state_dir, config.file_mode)
+            .context("Failed to load REPORTED")?
+            .unwrap_or_else(|| utils::GENESIS_HASH.to_string()),
+    };
+    let patch = patch::Patch::create(config, &hash)?;
+    let buf = wire::encode_patch(config, &patch).context("Failed to encode patch")?;
+    stats::finalize_patch_create(config);
+    Ok(buf)
+}
+
 /// # Safety
 /// `config` must be a valid, non-null pointer returned by `lch_init`.
 /// `patch` must be a valid, non-null pointer to an `lch_buffer_t` whose `data`
@@ -236,39 +270,151 @@ pub unsafe extern "C" fn lch_patch_to_sql(
         }
         let data = unsafe { std::slice::from_raw_parts(patch_buf.data, patch_buf.len) };
 
-        let patch = match wire::decode_patch(data) {
-            Ok(patch) => patch,
+        match patch_sql(config, data) {
+            Ok(sql) => {
+                unsafe { *out = sql.map_or(std::ptr::null_mut(), CString::into_raw) };
+                SUCCESS
+            }
             Err(e) => {
-                log::error!("lch_patch_to_sql(): Failed to decode patch: {:#}", e);
-                return FAILURE;
+                log::error!("lch_patch_to_sql(): {:#}", e);
+                FAILURE
             }
+        }
+    })
+}
+
+/// Decode the encoded patch `data` and render it as SQL. `None` when the
+/// patch has no actionable changes. A framed patch is converted chunk by
+/// chunk, without reassembling it first.
+fn patch_sql(config: &config::Config, data: &[u8]) -> Result<Option<CString>> {
+    let mut sql = String::new();
+    let statements = sql::emit_encoded_patch_sql(config, data, |statement| {
+        sql.push_str(statement);
+        Ok(())
+    })?;
+    if statements == 0 {
+        return Ok(None);
+    }
+    let sql = CString::new(sql).context("Failed to create CString")?;
+    Ok(Some(sql))
+}
+
+/// # Safety
+/// `config` must be a valid, non-null pointer returned by `lch_init`.
+/// `patch` must be a valid, non-null pointer to an `lch_buffer_t` whose `data`
+/// field points to `len` bytes previously returned by `lch_patch_create` or
+/// `lch_patch_inject`.
+/// `callback` must be a valid function pointer; it is invoked with
+/// `usr_data` on the calling thread, once per statement.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_patch_to_sql_stream(
+    config: *const config::Config,
+    patch: *const FfiBuffer,
+    callback: Option<unsafe extern "C" fn(*const c_char, usize, *mut c_void) -> i32>,
+    usr_data: *mut c_void,
+) -> i32 {
+    ffi_guard("lch_patch_to_sql_stream", FAILURE, || {
+        if null_arg("lch_patch_to_sql_stream", "config", config) {
+            return FAILURE;
+        }
+        if null_arg("lch_patch_to_sql_stream", "patch", patch) {
+            return FAILURE;
+        }
+        let Some(callback) = callback else {
+            log::error!("lch_patch_to_sql_stream(): Bad argument: callback cannot be NULL");
+            return FAILURE;
         };
 
-        let sql = match sql::patch_to_sql(config, &patch) {
-            Ok(Some(sql)) => sql,
-            Ok(None) => {
-                unsafe { *out = std::ptr::null_mut() };
-                return SUCCESS;
+        let config = unsafe { &*config };
+        let patch_buf = unsafe { &*patch };
+        if null_arg("lch_patch_to_sql_stream", "patch->data", patch_buf.data) {
+            return FAILURE;
+        }
+        let data = unsafe { std::slice::from_raw_parts(patch_buf.data, patch_buf.len) };
+
+        // Each statement is copied into one reused, null-terminated buffer so
+        // the callback receives a C string without a per-statement allocation.
+        let mut statement_buf: Vec<u8> = Vec::new();
+        let result = sql::emit_encoded_patch_sql(config, data, |statement| {
+            if statement.as_bytes().contains(&0) {
+                bail!("SQL statement contains a NUL byte");
             }
-            Err(e) => {
-                log::error!("lch_patch_to_sql(): {:#}", e);
-                return FAILURE;
+            statement_buf.clear();
+            statement_buf.extend_from_slice(statement.as_bytes());
+            statement_buf.push(0);
+            let ret = unsafe {
+                callback(
+                    statement_buf.as_ptr().cast::<c_char>(),
+                    statement.len(),
+                    usr_data,
+                )
+            };
+            if ret != SUCCESS {
+                bail!("callback aborted with code {}", ret);
             }
-        };
+            Ok(())
+        });
 
-        let cstr = match CString::new(sql) {
-            Ok(cstr) => cstr,
+        match result {
+            Ok(_) => SUCCESS,
             Err(e) => {
-                log::error!("lch_patch_to_sql(): Failed to create CString: {:#}", e);
-                return FAILURE;
+                log::error!("lch_patch_to_sql_stream(): {:#}", e);
+                FAILURE
             }
+        }
+    })
+}
+
+/// # Safety
+/// `config` must be a valid, non-null pointer returned by `lch_init`.
+/// `patch` must be a valid, non-null pointer to an `lch_buffer_t` whose `data`
+/// field points to `len` bytes previously returned by `lch_patch_create` or
+/// `lch_patch_inject`.
+/// `callback` must be a valid function pointer; it is invoked with
+/// `usr_data` on the calling thread, once per statement.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_patch_to_statements(
+    config: *const config::Config,
+    patch: *const FfiBuffer,
+    callback: Option<unsafe extern "C" fn(*const FfiStatement, *mut c_void) -> i32>,
+    usr_data: *mut c_void,
+) -> i32 {
+    ffi_guard("lch_patch_to_statements", FAILURE, || {
+        if null_arg("lch_patch_to_statements", "config", config) {
+            return FAILURE;
+        }
+        if null_arg("lch_patch_to_statements", "patch", patch) {
+            return FAILURE;
+        }
+        let Some(callback) = callback else {
+            log::error!("lch_patch_to_statements(): Bad argument: callback cannot be NULL");
+            return FAILURE;
         };
 
-        unsafe {
-            *out = cstr.into_raw();
+        let config = unsafe { &*config };
+        let patch_buf = unsafe { &*patch };
+        if null_arg("lch_patch_to_statements", "patch->data", patch_buf.data) {
+            return FAILURE;
         }
+        let data = unsafe { std::slice::from_raw_parts(patch_buf.data, patch_buf.len) };
 
-        SUCCESS
+        let mut buffers = StatementBuffers::default();
+        let result = sql::emit_encoded_patch_statements(config, data, |statement| {
+            let ffi_statement = buffers.marshal(statement)?;
+            let ret = unsafe { callback(&ffi_statement, usr_data) };
+            if ret != SUCCESS {
+                bail!("callback aborted with code {}", ret);
+            }
+            Ok(())
+        });
+
+        match result {
+            Ok(_) => SUCCESS,
+            Err(e) => {
+                log::error!("lch_patch_to_statements(): {:#}", e);
+                FAILURE
+            }
+        }
     })
 }
 
@@ -318,7 +464,7 @@ pub unsafe extern "C" fn lch_patch_inject(
         }
         let data = unsafe { std::slice::from_raw_parts(in_buf.data, in_buf.len) };
 
-        let mut patch = match wire::decode_patch(data) {
+        let mut patch = match wire::decode_patch_with(config, data) {
             Ok(patch) => patch,
             Err(e) => {
                 log::error!("lch_patch_inject(): Failed to decode patch: {:#}", e);
@@ -345,6 +491,286 @@ pub unsafe extern "C" fn lch_patch_inject(
     })
 }
 
+/// Decode the encoded patches `buffers`, oldest first, coalesce them and
+/// encode the result.
+///
+/// # Safety
+/// The non-null `data` of each buffer must point to `len` readable bytes.
+unsafe fn coalesce_patches(config: &config::Config, buffers: &[FfiBuffer]) -> Result<Vec<u8>> {
+    let mut patches = Vec::with_capacity(buffers.len());
+    for (index, buf) in buffers.iter().enumerate() {
+        if buf.data.is_null() {
+            bail!("Bad argument: patches[{}].data cannot be NULL", index);
+        }
+        let data = unsafe { std::slice::from_raw_parts(buf.data, buf.len) };
+        let patch = wire::decode_patch_with(config, data)
+            .with_context(|| format!("Failed to decode patches[{}]", index))?;
+        patches.push(patch);
+    }
+    let patch = coalesce::coalesce(config, patches)?;
+    wire::encode_patch(config, &patch).context("Failed to encode patch")
+}
+
+/// # Safety
+/// `config` must be a valid, non-null pointer returned by `lch_init`.
+/// `patches` must be a valid, non-null pointer to `num_patches` `lch_buffer_t`s,
+/// each holding an encoded patch as for `lch_patch_to_sql`.
+/// `out` must be a valid, non-null pointer to an `lch_buffer_t`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_patch_coalesce(
+    config: *const config::Config,
+    patches: *const FfiBuffer,
+    num_patches: usize,
+    out: *mut FfiBuffer,
+) -> i32 {
+    ffi_guard("lch_patch_coalesce", FAILURE, || {
+        if null_arg("lch_patch_coalesce", "config", config) {
+            return FAILURE;
+        }
+        if null_arg("lch_patch_coalesce", "patches", patches) {
+            return FAILURE;
+        }
+        if null_arg("lch_patch_coalesce", "out", out) {
+            return FAILURE;
+        }
+
+        let config = unsafe { &*config };
+        let buffers = unsafe { std::slice::from_raw_parts(patches, num_patches) };
+
+        match unsafe { coalesce_patches(config, buffers) } {
+            Ok(buf) => {
+                unsafe { *out = buf.into() };
+                SUCCESS
+            }
+            Err(e) => {
+                log::error!("lch_patch_coalesce(): {:#}", e);
+                FAILURE
+            }
+        }
+    })
+}
+
+/// Completion callback of `lch_block_create_async`.
+type BlockDoneFn = unsafe extern "C" fn(i32, *mut c_void);
+/// Completion callback of `lch_patch_create_async`.
+type PatchDoneFn = unsafe extern "C" fn(i32, FfiBuffer, *mut c_void);
+/// Completion callback of `lch_patch_to_sql_async`.
+type SqlDoneFn = unsafe extern "C" fn(i32, *mut c_char, *mut c_void);
+
+/// Queue a task on the executor of `config` and hand its cancel handle to
+/// C. `run` and `cancelled` each invoke the completion callback; a worker
+/// calls exactly one of them. Returns NULL, and calls neither, if the task
+/// could not be queued.
+fn submit_task(
+    fn_name: &str,
+    config: &config::Config,
+    run: impl FnOnce() + Send + 'static,
+    cancelled: impl FnOnce() + Send + 'static,
+) -> *mut Arc<Task> {
+    match config.executor.submit(run, cancelled) {
+        Ok(task) => Box::into_raw(Box::new(task)),
+        Err(e) => {
+            log::error!("{}(): {:#}", fn_name, e);
+            std::ptr::null_mut()
+        }
+    }
+}
+
+/// # Safety
+/// `config` must be a valid, non-null pointer returned by `lch_init` or
+/// `lch_init_async`.
+/// `callbacks` may be NULL, or a valid pointer to an `lch_callbacks_t` as for
+/// `lch_block_create`. The bundle and its `usr_data` must remain valid until
+/// `done` has been called, and its callbacks are invoked on an executor
+/// thread.
+/// `done` must be a valid function pointer; it is invoked with `usr_data` on
+/// an executor thread, exactly once, unless NULL is returned.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_block_create_async(
+    config: *const config::Config,
+    callbacks: *const callbacks::Callbacks,
+    done: Option<BlockDoneFn>,
+    usr_data: *mut c_void,
+) -> *mut Arc<Task> {
+    ffi_guard("lch_block_create_async", std::ptr::null_mut(), || {
+        if null_arg("lch_block_create_async", "config", config) {
+            return std::ptr::null_mut();
+        }
+        let Some(done) = done else {
+            log::error!("lch_block_create_async(): Bad argument: done cannot be NULL");
+            return std::ptr::null_mut();
+        };
+
+        let shared_config = SendPtr(config.cast_mut());
+        let shared_callbacks = SendPtr(callbacks.cast_mut());
+        let shared_usr_data = SendPtr(usr_data);
+        let run = move || {
+            let status = unsafe { lch_block_create(shared_config.get(), shared_callbacks.get()) };
+            unsafe { done(status, shared_usr_data.get()) };
+        };
+        let cancelled = move || unsafe { done(CANCELLED, shared_usr_data.get()) };
+        submit_task(
+            "lch_block_create_async",
+            unsafe { &*config },
+            run,
+            cancelled,
+        )
+    })
+}
+
+/// # Safety
+/// `config` must be a valid, non-null pointer returned by `lch_init` or
+/// `lch_init_async`.
+/// `last_known` must be a valid, null-terminated C string, or NULL, as for
+/// `lch_patch_create`. It is copied before this function returns.
+/// `done` must be a valid function pointer; it is invoked with `usr_data` on
+/// an executor thread, exactly once, unless NULL is returned.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_patch_create_async(
+    config: *const config::Config,
+    last_known: *const c_char,
+    done: Option<PatchDoneFn>,
+    usr_data: *mut c_void,
+) -> *mut Arc<Task> {
+    ffi_guard("lch_patch_create_async", std::ptr::null_mut(), || {
+        if null_arg("lch_patch_create_async", "config", config) {
+            return std::ptr::null_mut();
+        }
+        let Some(done) = done else {
+            log::error!("lch_patch_create_async(): Bad argument: done cannot be NULL");
+            return std::ptr::null_mut();
+        };
+        let last_known = if last_known.is_null() {
+            None
+        } else {
+            match unsafe { cstr_arg("lch_patch_create_async", "last_known", last_known) } {
+                Some(hash) => Some(hash),
+                None => return std::ptr::null_mut(),
+            }
+        };
+
+        let shared_config = SendPtr(config.cast_mut());
+        let shared_usr_data = SendPtr(usr_data);
+        let empty = || FfiBuffer {
+            data: std::ptr::null_mut(),
+            len: 0,
+        };
+        let run = move || {
+            let result = ffi_guard("lch_patch_create_async", None, || {
+                let config = unsafe { &*shared_config.get() };
+                match create_patch(config, last_known.as_deref()) {
+                    Ok(buf) => Some(buf),
+                    Err(e) => {
+                        log::error!("lch_patch_create_async(): {:#}", e);
+                        None
+                    }
+                }
+            });
+            match result {
+                Some(buf) => unsafe { done(SUCCESS, buf.into(), shared_usr_data.get()) },
+                None => unsafe { done(FAILURE, empty(), shared_usr_data.get()) },
+            }
+        };
+        let cancelled = move || unsafe { done(CANCELLED, empty(), shared_usr_data.get()) };
+        submit_task(
+            "lch_patch_create_async",
+            unsafe { &*config },
+            run,
+            cancelled,
+        )
+    })
+}
+
+/// # Safety
+/// `config` must be a valid, non-null pointer returned by `lch_init` or
+/// `lch_init_async`.
+/// `patch` must be a valid, non-null pointer to an `lch_buffer_t` as for
+/// `lch_patch_to_sql`. Its bytes are copied before this function returns.
+/// `done` must be a valid function pointer; it is invoked with `usr_data` on
+/// an executor thread, exactly once, unless NULL is returned.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_patch_to_sql_async(
+    config: *const config::Config,
+    patch: *const FfiBuffer,
+    done: Option<SqlDoneFn>,
+    usr_data: *mut c_void,
+) -> *mut Arc<Task> {
+    ffi_guard("lch_patch_to_sql_async", std::ptr::null_mut(), || {
+        if null_arg("lch_patch_to_sql_async", "config", config) {
+            return std::ptr::null_mut();
+        }
+        if null_arg("lch_patch_to_sql_async", "patch", patch) {
+            return std::ptr::null_mut();
+        }
+        let Some(done) = done else {
+            log::error!("lch_patch_to_sql_async(): Bad argument: done cannot be NULL");
+            return std::ptr::null_mut();
+        };
+        let patch_buf = unsafe { &*patch };
+        if null_arg("lch_patch_to_sql_async", "patch->data", patch_buf.data) {
+            return std::ptr::null_mut();
+        }
+        let data = unsafe { std::slice::from_raw_parts(patch_buf.data, patch_buf.len) }.to_vec();
+
+        let shared_config = SendPtr(config.cast_mut());
+        let shared_usr_data = SendPtr(usr_data);
+        let run = move || {
+            let result = ffi_guard("lch_patch_to_sql_async", Err(()), || {
+                let config = unsafe { &*shared_config.get() };
+                patch_sql(config, &data).map_err(|e| {
+                    log::error!("lch_patch_to_sql_async(): {:#}", e);
+                })
+            });
+            match result {
+                Ok(sql) => {
+                    let sql = sql.map_or(std::ptr::null_mut(), CString::into_raw);
+                    unsafe { done(SUCCESS, sql, shared_usr_data.get()) }
+                }
+                Err(()) => unsafe { done(FAILURE, std::ptr::null_mut(), shared_usr_data.get()) },
+            }
+        };
+        let cancelled =
+            move || unsafe { done(CANCELLED, std::ptr::null_mut(), shared_usr_data.get()) };
+        submit_task(
+            "lch_patch_to_sql_async",
+            unsafe { &*config },
+            run,
+            cancelled,
+        )
+    })
+}
+
+/// # Safety
+/// `task` must be a valid, non-null pointer returned by one of the
+/// asynchronous functions and not yet passed to `lch_task_free`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_task_cancel(task: *const Arc<Task>) -> i32 {
+    ffi_guard("lch_task_cancel", FAILURE, || {
+        if null_arg("lch_task_cancel", "task", task) {
+            return FAILURE;
+        }
+        if unsafe { &*task }.cancel() {
+            SUCCESS
+        } else {
+            FAILURE
+        }
+    })
+}
+
+/// # Safety
+/// `task` must be NULL (no-op) or a pointer returned by one of the
+/// asynchronous functions. Freeing the handle does not cancel the task.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_task_free(task: *mut Arc<Task>) {
+    ffi_guard("lch_task_free", (), || {
+        if !task.is_null() {
+            unsafe {
+                drop(Box::from_raw(task));
+            }
+        }
+    })
+}
+
 /// # Safety
 /// `ptr` must be null or a pointer to a null-terminated C string previously
 /// returned by the library (e.g. from `lch_patch_to_sql` or `lch_patch_hash`).
@@ -359,6 +785,54 @@ pub unsafe extern "C" fn lch_string_free(ptr: *mut c_char) {
     })
 }
 
+/// Decode the patch in `patch` (with the zstd dictionary of `config`, if
+/// given) and write its head hash to `out` as a caller-owned C string.
+unsafe fn write_patch_hash(
+    function: &str,
+    config: Option<&config::Config>,
+    patch: *const FfiBuffer,
+    out: *mut *mut c_char,
+) -> i32 {
+    if null_arg(function, "patch", patch) {
+        return FAILURE;
+    }
+    if null_arg(function, "out", out) {
+        return FAILURE;
+    }
+
+    let patch_buf = unsafe { &*patch };
+    if null_arg(function, "patch->data", patch_buf.data) {
+        return FAILURE;
+    }
+    let data = unsafe { std::slice::from_raw_parts(patch_buf.data, patch_buf.len) };
+
+    let decoded = match config {
+        Some(config) => wire::decode_patch_with(config, data),
+        None => wire::decode_patch(data),
+    };
+    let patch = match decoded {
+        Ok(patch) => patch,
+        Err(e) => {
+            log::error!("{}(): Failed to decode patch: {:#}", function, e);
+            return FAILURE;
+        }
+    };
+
+    let cstr = match CString::new(patch.head) {
+        Ok(cstr) => cstr,
+        Err(e) => {
+            log::error!("{}(): Failed to create CString: {:#}", function, e);
+            return FAILURE;
+        }
+    };
+
+    unsafe {
+        *out = cstr.into_raw();
+    }
+
+    SUCCESS
+}
+
 /// # Safety
 /// `patch` must be a valid, non-null pointer to an `lch_buffer_t` whose `data`
 /// field points to `len` bytes previously returned by `lch_patch_create` or
@@ -368,41 +842,26 @@ pub unsafe extern "C" fn lch_string_free(ptr: *mut c_char) {
 /// release with `lch_string_free`.
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn lch_patch_hash(patch: *const FfiBuffer, out: *mut *mut c_char) -> i32 {
-    ffi_guard("lch_patch_hash", FAILURE, || {
-        if null_arg("lch_patch_hash", "patch", patch) {
-            return FAILURE;
-        }
-        if null_arg("lch_patch_hash", "out", out) {
-            return FAILURE;
-        }
+    ffi_guard("lch_patch_hash", FAILURE, || unsafe {
+        write_patch_hash("lch_patch_hash", None, patch, out)
+    })
+}
 
-        let patch_buf = unsafe { &*patch };
-        if null_arg("lch_patch_hash", "patch->data", patch_buf.data) {
+/// # Safety
+/// `config` must be a valid, non-null pointer returned by `lch_init`.
+/// `patch` and `out` as for `lch_patch_hash`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn lch_patch_hash_with(
+    config: *const config::Config,
+    patch: *const FfiBuffer,
+    out: *mut *mut c_char,
+) -> i32 {
+    ffi_guard("lch_patch_hash_with", FAILURE, || {
+        if null_arg("lch_patch_hash_with", "config", config) {
             return FAILURE;
         }
-        let data = unsafe { std::slice::from_raw_parts(patch_buf.data, patch_buf.len) };
-
-        let patch = match wire::decode_patch(data) {
-            Ok(patch) => patch,
-            Err(e) => {
-                log::error!("lch_patch_hash(): Failed to decode patch: {:#}", e);
-                return FAILURE;
-            }
-        };
-
-        let cstr = match CString::new(patch.head) {
-            Ok(cstr) => cstr,
-            Err(e) => {
-                log::error!("lch_patch_hash(): Failed to create CString: {:#}", e);
-                return FAILURE;
-            }
-        };
-
-        unsafe {
-            *out = cstr.into_raw();
-        }
-
-        SUCCESS
+        let config = unsafe { &*config };
+        unsafe { write_patch_hash("lch_patch_hash_with", Some(config), patch, out) }
     })
 }
 
@@ -431,7 +890,7 @@ pub unsafe extern "C" fn lch_patch_applied(
         }
         let data = unsafe { std::slice::from_raw_parts(patch_buf.data, patch_buf.len) };
 
-        let patch = match wire::decode_patch(data) {
+        let patch = match wire::decode_patch_with(config, data) {
             Ok(p) => p,
             Err(e) => {
                 log::error!("lch_patch_applied(): Failed to decode patch: {:#}", e);
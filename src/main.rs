@@ -1,11 +1,14 @@
+use std::collections::BTreeMap;
 use std::io::{IsTerminal, Write};
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 use std::process::{Command as ProcessCommand, ExitCode, Stdio};
+use std::time::{Duration, SystemTime};
 
 use anyhow::{Context, Result, bail};
 use clap::{Parser, Subcommand};
 use leech2::block::Block;
 use leech2::cell::{Kind, parse_typed_cell};
+use leech2::chain::ChainIndex;
 use leech2::config::Config;
 use leech2::utils::{GENESIS_HASH, format_timestamp};
 
@@ -67,6 +70,12 @@ enum Cmd {
         #[command(subcommand)]
         command: StatsCmd,
     },
+    /// Create a block whenever a CSV source changes, keeping state in memory
+    Watch {
+        /// Polling interval in milliseconds
+        #[arg(long, default_value_t = 1000)]
+        interval: u64,
+    },
 }
 
 #[derive(Subcommand)]
@@ -137,7 +146,7 @@ fn resolve_ref(
         (Some(_), Some(_)) => bail!("cannot specify both a hash prefix and -n"),
         (Some(reference), None) => {
             let state_dir = config.ensure_state_dir()?;
-            leech2::storage::resolve_hash_prefix(&state_dir, reference)
+            leech2::storage::resolve_hash_prefix(&state_dir, reference, config.file_mode)
         }
         (None, Some(num_blocks)) => {
             let state_dir = config.ensure_state_dir()?;
@@ -152,6 +161,7 @@ fn resolve_ref(
 
 fn walk_back(work_dir: &std::path::Path, num_blocks: u32, mode: u32) -> Result<String> {
     let mut hash = leech2::head::load(work_dir, mode)?;
+    let index = ChainIndex::load(work_dir, mode);
     for i in 0..num_blocks {
         if hash == GENESIS_HASH {
             bail!(
@@ -160,7 +170,7 @@ fn walk_back(work_dir: &std::path::Path, num_blocks: u32, mode: u32) -> Result<S
                 i
             );
         }
-        hash = Block::load_header(work_dir, &hash, mode)?.parent;
+        hash = index.header(work_dir, &hash, mode)?.parent;
     }
     Ok(hash)
 }
@@ -199,6 +209,57 @@ fn cmd_block_create(config: &Config) -> Result<()> {
     Ok(())
 }
 
+/// Size and modification time of every CSV source, keyed by table name,
+/// with `None` for a source that cannot be stat'ed. `cmd_watch` compares it
+/// between polls to decide whether a new block is worth creating.
+type SourceSignature = BTreeMap<String, Option<(u64, SystemTime)>>;
+
+fn source_signature(config: &Config) -> SourceSignature {
+    config
+        .tables
+        .iter()
+        .filter_map(|(name, table)| {
+            let csv = table.csv.as_ref()?;
+            let stat = std::fs::metadata(config.work_dir.join(&csv.source))
+                .ok()
+                .and_then(|metadata| Some((metadata.len(), metadata.modified().ok()?)));
+            Some((name.clone(), stat))
+        })
+        .collect()
+}
+
+/// Create a block now, then poll the CSV sources every `interval` and create
+/// another one whenever any of them changed. The config keeps the previous
+/// state in memory, so each block only parses and diffs the changed tables.
+/// A failed block creation is reported and retried on the next change. Runs
+/// until the process is interrupted.
+fn cmd_watch(config: &Config, interval: Duration) -> Result<()> {
+    if let Some(name) = config
+        .tables
+        .iter()
+        .find_map(|(name, table)| table.csv.is_none().then_some(name))
+    {
+        bail!(
+            "cannot watch table '{}': only CSV-backed tables can be watched",
+            name
+        );
+    }
+
+    let mut signature = source_signature(config);
+    cmd_block_create(config)?;
+    loop {
+        std::thread::sleep(interval);
+        let current = source_signature(config);
+        if current == signature {
+            continue;
+        }
+        signature = current;
+        if let Err(e) = cmd_block_create(config) {
+            eprintln!("error: {:#}", e);
+        }
+    }
+}
+
 fn cmd_patch_create(
     config: &Config,
     reference: Option<&str>,
@@ -244,9 +305,15 @@ fn cmd_block_log(config: &Config) -> Result<String> {
         bail!("no blocks exist yet");
     }
 
+    let index = ChainIndex::load(&state_dir, config.file_mode);
     let mut output = String::new();
     loop {
-        let block = match Block::load(&state_dir, &hash, config.file_mode) {
+        // The index may still list blocks truncated since it was last
+        // rewritten, so the stored block decides where the chain ends.
+        if !Block::is_stored(&state_dir, &hash, config.file_mode) {
+            break;
+        }
+        let block = match index.summary(&state_dir, &hash, config.file_mode) {
             Ok(block) => block,
             Err(_) => break, // block was truncated, end of reachable chain
         };
@@ -257,7 +324,7 @@ fn cmd_block_log(config: &Config) -> Result<String> {
             .map(format_timestamp)
             .unwrap_or_else(|| "N/A".to_string());
 
-        let table_names: Vec<&str> = block.payload.keys().map(|name| name.as_str()).collect();
+        let table_names: Vec<&str> = block.tables.keys().map(|name| name.as_str()).collect();
         let tables_str = if table_names.is_empty() {
             "no changes".to_string()
         } else {
@@ -268,7 +335,7 @@ fn cmd_block_log(config: &Config) -> Result<String> {
             "block {}  {}  ({} tables: {})\n",
             hash,
             timestamp,
-            block.payload.len(),
+            block.tables.len(),
             tables_str
         ));
 
@@ -295,7 +362,7 @@ fn load_patch(config: &Config) -> Result<leech2::patch::Patch> {
     let state_dir = config.ensure_state_dir()?;
     let data = leech2::storage::load(&state_dir, PATCH_FILE, config.file_mode)?
         .context("no patch file found, run `lch patch create` first")?;
-    leech2::wire::decode_patch(&data).context("failed to decode patch")
+    leech2::wire::decode_patch_with(config, &data).context("failed to decode patch")
 }
 
 fn cmd_patch_show(config: &Config) -> Result<String> {
@@ -394,14 +461,25 @@ fn print_with_pager(content: &str) {
     let _ = child.wait();
 }
 
+/// Load the config for a command. `--dry-run` also leaves the config cache
+/// alone, like every other file in the state directory.
+fn load_config(work_dir: &Path, dry_run: bool) -> Result<Config> {
+    let mut config = if dry_run {
+        Config::load_read_only(work_dir)?
+    } else {
+        Config::load(work_dir)?
+    };
+    config.dry_run = dry_run;
+    Ok(config)
+}
+
 fn run(cli: Cli) -> Result<()> {
     let work_dir = work_dir(&cli);
 
     match &cli.command {
         Cmd::Init => cmd_init(&work_dir)?,
         Cmd::Block { command } => {
-            let mut config = Config::load(&work_dir)?;
-            config.dry_run = cli.dry_run;
+            let config = load_config(&work_dir, cli.dry_run)?;
             match command {
                 BlockCmd::Create => cmd_block_create(&config)?,
                 BlockCmd::Show { reference, n } => {
@@ -415,8 +493,7 @@ fn run(cli: Cli) -> Result<()> {
             }
         }
         Cmd::Patch { command } => {
-            let mut config = Config::load(&work_dir)?;
-            config.dry_run = cli.dry_run;
+            let config = load_config(&work_dir, cli.dry_run)?;
             match command {
                 PatchCmd::Create { reference, n } => {
                     cmd_patch_create(&config, reference.as_deref(), *n)?;
@@ -441,11 +518,16 @@ fn run(cli: Cli) -> Result<()> {
             }
         }
         Cmd::Stats { command } => {
-            let config = Config::load(&work_dir)?;
+            let config = load_config(&work_dir, cli.dry_run)?;
             match command {
                 StatsCmd::Show => cmd_stats_show(&config)?,
             }
         }
+        Cmd::Watch { interval } => {
+            let mut config = load_config(&work_dir, cli.dry_run)?;
+            config.resident_state = true;
+            cmd_watch(&config, Duration::from_millis(*interval))?;
+        }
     }
 
     Ok(())
@@ -489,4 +571,23 @@ mod tests {
         assert!(csv.header);
         assert!(config.stats.enable, "init template must enable stats");
     }
+
+    #[test]
+    fn source_signature_tracks_csv_changes() {
+        let work_dir = tempfile::tempdir().unwrap();
+        std::fs::write(work_dir.path().join("config.toml"), INIT_CONFIG_TEMPLATE).unwrap();
+        let csv_path = work_dir.path().join("products.csv");
+        std::fs::write(&csv_path, "id,name,price\n1,Widget,9.99\n").unwrap();
+
+        let config = Config::load(work_dir.path()).unwrap();
+        let before = source_signature(&config);
+        assert!(before["products"].is_some());
+        assert_eq!(before, source_signature(&config));
+
+        std::fs::write(&csv_path, "id,name,price\n1,Widget,9.99\n2,Gadget,4.50\n").unwrap();
+        assert_ne!(before, source_signature(&config));
+
+        std::fs::remove_file(&csv_path).unwrap();
+        assert!(source_signature(&config)["products"].is_none());
+    }
 }
@@ -0,0 +1,1364 @@
+//! Delta merging for patch consolidation.
+//!
+//! [`MergedDelta`] applies the rules of DELTA_MERGING_RULES.md like
+//! [`Delta::merge`](crate::delta::Delta::merge), but is built for folding a
+//! long chain of block deltas:
+//!
+//! - Block deltas are merged straight from their proto form. Only the cells
+//!   a merge needs are decoded, and text goes through one [`Interner`] per
+//!   consolidation, so a key changed in many blocks is stored once.
+//! - All changes of a table live in one map keyed by primary key, so each
+//!   child entry costs one lookup. The key is decoded into a reused buffer
+//!   and only copied when it is new. Entries that cancel out stay in the map
+//!   as [`Change::Unchanged`], keeping their key for later blocks.
+//! - Updates are kept sparse: only changed columns, with their old and new
+//!   values. Merging two updates walks their column lists, so a column that
+//!   keeps churning in a wide table costs the same as in a narrow one.
+//!
+//! Because unchanged columns are not kept, the consistency checks of rules
+//! 14 and 15 only compare the columns an update changed.
+//!
+//! A merge error normally fails the whole table. Partitions of a partitioned
+//! table set [`MergedDelta::isolate_conflicts`] instead: the offending key
+//! becomes a [`Change::Conflict`] and the rest of the partition keeps
+//! merging, so only that partition has to be replaced from the current state.
+//!
+//! [`CoalescedDelta::from_patch_proto`] merges the deltas of patches instead of
+//! blocks, for coalescing queued patches on the hub. Patch deltas carry no
+//! delete values and no old values of updates, so the rules that compare
+//! them merge without the comparison (see [`Change::then_patch`]).
+
+use std::cmp::Ordering;
+use std::collections::HashMap;
+use std::collections::hash_map::RandomState;
+use std::hash::{BuildHasher, BuildHasherDefault};
+
+use anyhow::{Context, Result, anyhow, bail};
+
+use crate::cell::{Cell, Interner};
+use crate::checkpoint::DeltaCounts;
+use crate::proto::cell::Cell as ProtoCell;
+use crate::proto::cell::cell::Kind as ProtoKind;
+use crate::proto::delta::Delta as ProtoDelta;
+use crate::proto::record::{Keys as ProtoKeys, Record as ProtoRecord};
+use crate::proto::update::Update as ProtoUpdate;
+use crate::utils::{FastHasher, parallel_map};
+
+/// Minimum number of child entries before [`MergedDelta::merge_sharded`]
+/// splits a merge across threads.
+const MIN_SHARDED_MERGE_ENTRIES: usize = 4096;
+
+/// Decode `proto`, taking text from `interner`.
+fn decode_cell(proto: ProtoCell, interner: &mut Interner) -> Result<Cell> {
+    match proto.kind {
+        Some(ProtoKind::Text(s)) => Ok(interner.text(&s)),
+        kind => Cell::try_from(ProtoCell { kind }),
+    }
+}
+
+fn decode_cells(protos: Vec<ProtoCell>, interner: &mut Interner) -> Result<Vec<Cell>> {
+    let mut cells = Vec::with_capacity(protos.len());
+    for proto in protos {
+        cells.push(decode_cell(proto, interner)?);
+    }
+    Ok(cells)
+}
+
+fn encode_cells(cells: Vec<Cell>) -> Vec<ProtoCell> {
+    cells.into_iter().map(Into::into).collect()
+}
+
+fn copy_cells(cells: &[Cell]) -> Vec<ProtoCell> {
+    cells.iter().cloned().map(Into::into).collect()
+}
+
+/// Check that the `changed_indices` of an update are ascending and in range
+/// for a table with `num_values` subsidiary columns.
+fn check_columns(changed_indices: &[u32], num_values: usize) -> Result<()> {
+    for (index, pair) in changed_indices.windows(2).enumerate() {
+        if pair[0] >= pair[1] {
+            bail!(
+                "update: changed_indices[{}] = {} is not ascending",
+                index + 1,
+                pair[1]
+            );
+        }
+    }
+    if let Some(&last) = changed_indices.last()
+        && last as usize >= num_values
+    {
+        bail!(
+            "update: changed index {} is out of range (table has {} columns)",
+            last,
+            num_values
+        );
+    }
+    Ok(())
+}
+
+/// The changed columns of an update, in ascending column order, with their
+/// values before and after.
+#[derive(Debug, Clone, PartialEq)]
+pub(crate) struct SparseUpdate {
+    columns: Vec<u32>,
+    old: Vec<Cell>,
+    new: Vec<Cell>,
+}
+
+impl SparseUpdate {
+    /// The columns where `old` and `new` differ.
+    fn diff(old: Vec<Cell>, new: Vec<Cell>) -> Result<Self> {
+        if old.len() != new.len() {
+            bail!(
+                "value length mismatch: {} old vs {} new cells",
+                old.len(),
+                new.len()
+            );
+        }
+        let mut update = SparseUpdate {
+            columns: Vec::new(),
+            old: Vec::new(),
+            new: Vec::new(),
+        };
+        for (column, (old, new)) in old.into_iter().zip(new).enumerate() {
+            if old != new {
+                update.columns.push(column as u32);
+                update.old.push(old);
+                update.new.push(new);
+            }
+        }
+        Ok(update)
+    }
+
+    /// Decode a wire update of a table with `num_values` subsidiary columns.
+    /// Dense updates (as stored in blocks) are compared column by column and
+    /// only the cells of changed columns are decoded. Sparse updates must
+    /// carry old values, as checkpoints store them.
+    fn decode(proto: ProtoUpdate, num_values: usize, interner: &mut Interner) -> Result<Self> {
+        let ProtoUpdate {
+            changed_indices,
+            old_value,
+            new_value,
+            ..
+        } = proto;
+
+        if changed_indices.is_empty() {
+            if old_value.len() != num_values || new_value.len() != num_values {
+                bail!(
+                    "update: old_value/new_value have {}/{} entries, expected {}",
+                    old_value.len(),
+                    new_value.len(),
+                    num_values
+                );
+            }
+            let mut update = SparseUpdate {
+                columns: Vec::new(),
+                old: Vec::new(),
+                new: Vec::new(),
+            };
+            for (column, (old, new)) in old_value.into_iter().zip(new_value).enumerate() {
+                if old != new {
+                    update.columns.push(column as u32);
+                    update.old.push(decode_cell(old, interner)?);
+                    update.new.push(decode_cell(new, interner)?);
+                }
+            }
+            return Ok(update);
+        }
+
+        let num_changed = changed_indices.len();
+        if old_value.len() != num_changed || new_value.len() != num_changed {
+            bail!(
+                "update: old_value/new_value have {}/{} entries, expected {}",
+                old_value.len(),
+                new_value.len(),
+                num_changed
+            );
+        }
+        check_columns(&changed_indices, num_values)?;
+        Ok(SparseUpdate {
+            columns: changed_indices,
+            old: decode_cells(old_value, interner)?,
+            new: decode_cells(new_value, interner)?,
+        })
+    }
+
+    /// Decode the update of a patch delta, which carries no old values: the
+    /// new values of the changed columns, or the full new row when
+    /// `changed_indices` is empty. The result has no old values either.
+    fn decode_patch(
+        proto: ProtoUpdate,
+        num_values: usize,
+        interner: &mut Interner,
+    ) -> Result<Self> {
+        let ProtoUpdate {
+            changed_indices,
+            new_value,
+            ..
+        } = proto;
+
+        if changed_indices.is_empty() {
+            if new_value.len() != num_values {
+                bail!(
+                    "update: new_value has {} entries, expected {}",
+                    new_value.len(),
+                    num_values
+                );
+            }
+            return Ok(SparseUpdate::full(decode_cells(new_value, interner)?));
+        }
+
+        if new_value.len() != changed_indices.len() {
+            bail!(
+                "update: new_value has {} entries, expected {}",
+                new_value.len(),
+                changed_indices.len()
+            );
+        }
+        check_columns(&changed_indices, num_values)?;
+        Ok(SparseUpdate {
+            columns: changed_indices,
+            old: Vec::new(),
+            new: decode_cells(new_value, interner)?,
+        })
+    }
+
+    /// An update writing every column of the row `new`, with no old values.
+    fn full(new: Vec<Cell>) -> Self {
+        SparseUpdate {
+            columns: (0..new.len() as u32).collect(),
+            old: Vec::new(),
+            new,
+        }
+    }
+
+    /// Whether `value`, a full row, shows every column this update changed
+    /// at its new value.
+    fn is_applied_in(&self, value: &[Cell]) -> bool {
+        self.columns
+            .iter()
+            .zip(&self.new)
+            .all(|(&column, new)| value.get(column as usize) == Some(new))
+    }
+
+    /// Write the new values into the full row `value`.
+    fn apply(self, value: &mut [Cell]) -> Result<()> {
+        for (column, new) in self.columns.into_iter().zip(self.new) {
+            let Some(cell) = value.get_mut(column as usize) else {
+                bail!(
+                    "column {} is out of range (row has {} values)",
+                    column,
+                    value.len()
+                );
+            };
+            *cell = new;
+        }
+        Ok(())
+    }
+
+    /// Write the old values into the full row `value`.
+    fn revert(self, mut value: Vec<Cell>) -> Vec<Cell> {
+        for (column, old) in self.columns.into_iter().zip(self.old) {
+            if let Some(cell) = value.get_mut(column as usize) {
+                *cell = old;
+            }
+        }
+        value
+    }
+
+    /// The update `self` followed by `child` (rules 15a/15b). Each column
+    /// `child` changes must be at the value `self` left it at. Columns that
+    /// end up at their original value are dropped.
+    fn then(self, child: SparseUpdate, key: &[Cell]) -> Result<Self> {
+        let mut merged = SparseUpdate {
+            columns: Vec::with_capacity(self.columns.len() + child.columns.len()),
+            old: Vec::with_capacity(self.columns.len() + child.columns.len()),
+            new: Vec::with_capacity(self.columns.len() + child.columns.len()),
+        };
+        let mut parent = self
+            .columns
+            .into_iter()
+            .zip(self.old.into_iter().zip(self.new))
+            .peekable();
+        let mut child = child
+            .columns
+            .into_iter()
+            .zip(child.old.into_iter().zip(child.new))
+            .peekable();
+        loop {
+            let ordering = match (parent.peek(), child.peek()) {
+                (Some((p, _)), Some((c, _))) => p.cmp(c),
+                (Some(_), None) => Ordering::Less,
+                (None, Some(_)) => Ordering::Greater,
+                (None, None) => break,
+            };
+            let (column, (old, new)) = match ordering {
+                Ordering::Less => parent.next(),
+                Ordering::Greater => child.next(),
+                Ordering::Equal => match (parent.next(), child.next()) {
+                    (Some((column, (old, parent_new))), Some((_, (child_old, child_new)))) => {
+                        if parent_new != child_old {
+                            bail!(
+                                "rule 15 conflict: parent's update of key {:?} \
+                                 leaves column {} at {:?}, but child's update \
+                                 expects {:?}",
+                                key,
+                                column,
+                                parent_new,
+                                child_old
+                            );
+                        }
+                        Some((column, (old, child_new)))
+                    }
+                    _ => None,
+                },
+            }
+            .context("column lists ended early")?;
+            if old != new {
+                merged.columns.push(column);
+                merged.old.push(old);
+                merged.new.push(new);
+            }
+        }
+        Ok(merged)
+    }
+
+    /// The update `self` followed by `child`, without old values: every
+    /// column changed by either ends at its last new value. Unlike
+    /// [`SparseUpdate::then`] nothing is checked and no column is dropped.
+    fn overwrite(self, child: SparseUpdate) -> Self {
+        let mut merged = SparseUpdate {
+            columns: Vec::with_capacity(self.columns.len() + child.columns.len()),
+            old: Vec::new(),
+            new: Vec::with_capacity(self.columns.len() + child.columns.len()),
+        };
+        let mut parent = self.columns.into_iter().zip(self.new).peekable();
+        let mut child = child.columns.into_iter().zip(child.new).peekable();
+        loop {
+            let next = match (parent.peek(), child.peek()) {
+                (Some((p, _)), Some((c, _))) => match p.cmp(c) {
+                    Ordering::Less => parent.next(),
+                    Ordering::Greater => child.next(),
+                    Ordering::Equal => {
+                        parent.next();
+                        child.next()
+                    }
+                },
+                (Some(_), None) => parent.next(),
+                (None, Some(_)) => child.next(),
+                (None, None) => break,
+            };
+            if let Some((column, new)) = next {
+                merged.columns.push(column);
+                merged.new.push(new);
+            }
+        }
+        merged
+    }
+
+    /// Wire form for a patch: only the new values of changed columns, or
+    /// the full new row when every column changed (as `sparse_encode` does).
+    fn into_patch_proto(self, key: Vec<Cell>, num_values: usize) -> ProtoUpdate {
+        let changed_indices = if self.columns.len() == num_values {
+            Vec::new()
+        } else {
+            self.columns
+        };
+        ProtoUpdate {
+            key: encode_cells(key),
+            changed_indices,
+            old_value: Vec::new(),
+            new_value: encode_cells(self.new),
+        }
+    }
+
+    /// Wire form for a checkpoint: changed columns with old and new values,
+    /// which [`SparseUpdate::decode`] reads back.
+    fn to_checkpoint_proto(&self, key: &[Cell]) -> ProtoUpdate {
+        ProtoUpdate {
+            key: copy_cells(key),
+            changed_indices: self.columns.clone(),
+            old_value: copy_cells(&self.old),
+            new_value: copy_cells(&self.new),
+        }
+    }
+}
+
+/// The net change of one primary key across the merged blocks.
+#[derive(Debug, Clone, PartialEq)]
+pub(crate) enum Change {
+    Insert(Vec<Cell>),
+    Delete(Vec<Cell>),
+    Update(SparseUpdate),
+    /// The changes cancelled out (or the key was never changed).
+    Unchanged,
+    /// The changes contradict each other, so the key's net change is
+    /// unknown. Absorbs every later change of the key.
+    Conflict,
+}
+
+/// `merged`, or [`Change::Conflict`] in place of a merge error when
+/// `isolate_conflicts` is set.
+fn isolate(merged: Result<Change>, isolate_conflicts: bool, key: &[Cell]) -> Result<Change> {
+    match merged {
+        Err(e) if isolate_conflicts => {
+            log::debug!("Isolating merge conflict of key {:?}: {:#}", key, e);
+            Ok(Change::Conflict)
+        }
+        merged => merged,
+    }
+}
+
+impl Change {
+    /// The change `parent` followed by `child`, for the same key.
+    fn then(parent: Change, child: Change, key: &[Cell]) -> Result<Change> {
+        let merged = match (parent, child) {
+            (Change::Unchanged, child) => {
+                // Rules 1-3: pass through
+                log::trace!("Rules 1-3: child passes through for key {:?}", key);
+                child
+            }
+            (parent, Change::Unchanged) => parent,
+            (Change::Conflict, _) | (_, Change::Conflict) => Change::Conflict,
+            (Change::Insert(_), Change::Insert(_)) => {
+                bail!("rule 5: key {:?} inserted in both blocks", key)
+            }
+            (Change::Delete(delete_value), Change::Insert(insert_value)) => {
+                if delete_value == insert_value {
+                    log::trace!("Rule 9a: delete + insert cancel out for key {:?}", key);
+                    Change::Unchanged
+                } else {
+                    log::trace!("Rule 9b: delete + insert becomes update for key {:?}", key);
+                    let update = SparseUpdate::diff(delete_value, insert_value)
+                        .with_context(|| format!("rule 9b: key {:?}", key))?;
+                    Change::Update(update)
+                }
+            }
+            (Change::Update(_), Change::Insert(_)) => bail!(
+                "rule 13: key {:?} updated in parent, inserted in child",
+                key
+            ),
+            (Change::Insert(_), Change::Delete(_)) => {
+                log::trace!("Rule 6: insert + delete cancel out for key {:?}", key);
+                Change::Unchanged
+            }
+            (Change::Delete(_), Change::Delete(_)) => {
+                bail!("rule 10: key {:?} deleted in both blocks", key)
+            }
+            (Change::Update(update), Change::Delete(delete_value)) => {
+                if !update.is_applied_in(&delete_value) {
+                    bail!(
+                        "rule 14b: key {:?} updated to {:?} in parent, but deleted with {:?}",
+                        key,
+                        update.new,
+                        delete_value
+                    );
+                }
+                log::trace!("Rule 14a: update + delete becomes delete for key {:?}", key);
+                Change::Delete(update.revert(delete_value))
+            }
+            (Change::Insert(mut insert_value), Change::Update(update)) => {
+                log::trace!("Rule 7: insert + update becomes insert for key {:?}", key);
+                update
+                    .apply(&mut insert_value)
+                    .with_context(|| format!("rule 7: key {:?}", key))?;
+                Change::Insert(insert_value)
+            }
+            (Change::Delete(_), Change::Update(_)) => {
+                bail!("rule 11: key {:?} deleted in parent, updated in child", key)
+            }
+            (Change::Update(parent), Change::Update(child)) => {
+                let merged = parent.then(child, key)?;
+                if merged.columns.is_empty() {
+                    log::trace!("Rule 15b: update + update cancel out for key {:?}", key);
+                    Change::Unchanged
+                } else {
+                    log::trace!("Rule 15a: update + update merged for key {:?}", key);
+                    Change::Update(merged)
+                }
+            }
+        };
+        Ok(merged)
+    }
+
+    /// [`Change::then`] for the deltas of patches, whose deletes carry no
+    /// values and whose updates carry no old values. The rules that compare
+    /// those values merge without them: delete + insert (rule 9) becomes an
+    /// update of every column, update + delete (rule 14) a delete, and
+    /// update + update (rule 15) keeps the last new value of each column. A
+    /// row that ends at its old values through rule 9a or 15b is not
+    /// recognized and stays an update.
+    fn then_patch(parent: Change, child: Change, key: &[Cell]) -> Result<Change> {
+        let merged = match (parent, child) {
+            (Change::Delete(_), Change::Insert(insert_value)) => {
+                log::trace!("Rule 9: delete + insert becomes update for key {:?}", key);
+                Change::Update(SparseUpdate::full(insert_value))
+            }
+            (Change::Update(_), Change::Delete(_)) => {
+                log::trace!("Rule 14: update + delete becomes delete for key {:?}", key);
+                Change::Delete(Vec::new())
+            }
+            (Change::Update(parent), Change::Update(child)) => {
+                log::trace!("Rule 15: update + update merged for key {:?}", key);
+                Change::Update(parent.overwrite(child))
+            }
+            (parent, child) => Change::then(parent, child, key)?,
+        };
+        Ok(merged)
+    }
+}
+
+/// `parent` followed by `child` under the rules for block deltas, or for
+/// patch deltas when `patch_form` is set.
+fn merge_changes(parent: Change, child: Change, key: &[Cell], patch_form: bool) -> Result<Change> {
+    if patch_form {
+        Change::then_patch(parent, child, key)
+    } else {
+        Change::then(parent, child, key)
+    }
+}
+
+#[derive(Debug, Clone)]
+struct Entry {
+    change: Change,
+    /// The [`MergedDelta::generation`] that last changed this entry.
+    generation: u64,
+}
+
+/// Consolidation of one table's deltas across consecutive blocks.
+///
+/// The changes are keyed with [`FastHasher`] by default, which is only safe
+/// for keys from the host's own tables. Keys from peers go through a
+/// [`CoalescedDelta`] instead.
+#[derive(Debug, Clone, Default)]
+pub struct MergedDelta<S = BuildHasherDefault<FastHasher>> {
+    pub primary_key_names: Vec<String>,
+    pub subsidiary_value_names: Vec<String>,
+    changes: HashMap<Vec<Cell>, Entry, S>,
+    /// Number of wire deltas merged in. Every entry of a block delta is
+    /// tagged with it, so a key that appears twice in one block is caught.
+    generation: u64,
+    /// Reused buffer for decoding the key of the next child entry.
+    scratch: Vec<Cell>,
+    /// Turn merge errors into [`Change::Conflict`] entries for the keys they
+    /// hit instead of failing the merge.
+    pub isolate_conflicts: bool,
+    /// The merged deltas are patch deltas, see
+    /// [`CoalescedDelta::from_patch_proto`].
+    patch_form: bool,
+}
+
+/// Coalescing of patch deltas, started by [`CoalescedDelta::from_patch_proto`]. Their
+/// keys come from agents, so the changes are keyed with the randomly seeded
+/// SipHash of the standard library: a crafted patch cannot make them collide.
+pub type CoalescedDelta = MergedDelta<RandomState>;
+
+impl<S: BuildHasher + Clone + Send> PartialEq for MergedDelta<S> {
+    fn eq(&self, other: &Self) -> bool {
+        self.primary_key_names == other.primary_key_names
+            && self.subsidiary_value_names == other.subsidiary_value_names
+            && self.live().count() == other.live().count()
+            && self
+                .live()
+                .all(|(key, change)| other.get(key) == Some(change))
+    }
+}
+
+impl MergedDelta {
+    /// Start a consolidation from the wire delta `proto`, e.g. the first
+    /// block of a range or a stored checkpoint.
+    pub fn from_proto(proto: ProtoDelta, interner: &mut Interner) -> Result<Self> {
+        let mut merged = Self {
+            primary_key_names: proto.primary_key_names.clone(),
+            subsidiary_value_names: proto.subsidiary_value_names.clone(),
+            ..Default::default()
+        };
+        merged.merge_proto(proto, interner)?;
+        Ok(merged)
+    }
+}
+
+impl CoalescedDelta {
+    /// Start a coalescing of patch deltas from the delta `proto` of the
+    /// oldest patch. Every delta merged in later must be a patch delta too.
+    /// The result has no delete values or old values of updates, so it only
+    /// makes a patch again ([`MergedDelta::into_patch_proto`]), not a
+    /// checkpoint.
+    pub fn from_patch_proto(proto: ProtoDelta, interner: &mut Interner) -> Result<Self> {
+        let mut merged = Self {
+            primary_key_names: proto.primary_key_names.clone(),
+            subsidiary_value_names: proto.subsidiary_value_names.clone(),
+            patch_form: true,
+            ..Default::default()
+        };
+        merged.merge_proto(proto, interner)?;
+        Ok(merged)
+    }
+}
+
+impl<S: BuildHasher + Clone + Send> MergedDelta<S> {
+    /// The entries that still change something.
+    fn live(&self) -> impl Iterator<Item = (&Vec<Cell>, &Change)> {
+        self.changes
+            .iter()
+            .filter(|(_, entry)| entry.change != Change::Unchanged)
+            .map(|(key, entry)| (key, &entry.change))
+    }
+
+    /// The net change of `key`, if it has one.
+    pub(crate) fn get(&self, key: &[Cell]) -> Option<&Change> {
+        self.changes
+            .get(key)
+            .map(|entry| &entry.change)
+            .filter(|change| **change != Change::Unchanged)
+    }
+
+    /// Number of net inserts, updates and deletes.
+    pub(crate) fn counts(&self) -> DeltaCounts {
+        let mut counts = DeltaCounts::default();
+        for (_, change) in self.live() {
+            match change {
+                Change::Insert(_) => counts.inserts += 1,
+                Change::Update(_) => counts.updates += 1,
+                Change::Delete(_) => counts.deletes += 1,
+                Change::Unchanged | Change::Conflict => {}
+            }
+        }
+        counts
+    }
+
+    /// Number of keys whose changes conflicted.
+    pub fn num_conflicts(&self) -> usize {
+        self.live()
+            .filter(|(_, change)| **change == Change::Conflict)
+            .count()
+    }
+
+    /// Mark the keys of `keys` as conflicted, e.g. when loading a checkpoint
+    /// that recorded them (see [`MergedDelta::conflicts_proto`]).
+    pub fn mark_conflicts(&mut self, keys: ProtoKeys, interner: &mut Interner) -> Result<()> {
+        for record in keys.records {
+            let key = decode_cells(record.key, interner)?;
+            self.changes.insert(
+                key,
+                Entry {
+                    change: Change::Conflict,
+                    generation: self.generation,
+                },
+            );
+        }
+        Ok(())
+    }
+
+    /// The keys of every entry that still changes something, conflicted or
+    /// not: the rows a replacement of the table from its current state has to
+    /// clear besides the current ones.
+    pub fn into_keys(self) -> impl Iterator<Item = Vec<Cell>> {
+        self.changes
+            .into_iter()
+            .filter(|(_, entry)| entry.change != Change::Unchanged)
+            .map(|(key, _)| key)
+    }
+
+    fn check_fields(
+        &self,
+        primary_key_names: &[String],
+        subsidiary_value_names: &[String],
+    ) -> Result<()> {
+        if self.primary_key_names != primary_key_names
+            || self.subsidiary_value_names != subsidiary_value_names
+        {
+            bail!(
+                "field mismatch (parent primary_key={:?} subsidiary={:?} vs child primary_key={:?} subsidiary={:?})",
+                self.primary_key_names,
+                self.subsidiary_value_names,
+                primary_key_names,
+                subsidiary_value_names
+            );
+        }
+        Ok(())
+    }
+
+    /// Merge the wire delta of the next block into this consolidation. On
+    /// error the consolidation is left partially merged and must not be
+    /// used.
+    pub fn merge_proto(&mut self, child: ProtoDelta, interner: &mut Interner) -> Result<()> {
+        self.check_fields(&child.primary_key_names, &child.subsidiary_value_names)?;
+        self.generation += 1;
+        let num_values = child.subsidiary_value_names.len();
+
+        for record in child.inserts {
+            let value = decode_cells(record.value, interner)?;
+            self.merge_wire_entry(record.key, Change::Insert(value), interner)
+                .context("failed to merge inserts")?;
+        }
+        for record in child.deletes {
+            let value = decode_cells(record.value, interner)?;
+            self.merge_wire_entry(record.key, Change::Delete(value), interner)
+                .context("failed to merge deletes")?;
+        }
+        for mut update in child.updates {
+            let key = std::mem::take(&mut update.key);
+            let update = if self.patch_form {
+                SparseUpdate::decode_patch(update, num_values, interner)?
+            } else {
+                SparseUpdate::decode(update, num_values, interner)?
+            };
+            let change = if update.columns.is_empty() {
+                Change::Unchanged
+            } else {
+                Change::Update(update)
+            };
+            self.merge_wire_entry(key, change, interner)
+                .context("failed to merge updates")?;
+        }
+        Ok(())
+    }
+
+    fn merge_wire_entry(
+        &mut self,
+        key: Vec<ProtoCell>,
+        change: Change,
+        interner: &mut Interner,
+    ) -> Result<()> {
+        let mut scratch = std::mem::take(&mut self.scratch);
+        scratch.clear();
+        for cell in key {
+            scratch.push(decode_cell(cell, interner)?);
+        }
+        let generation = self.generation;
+        let isolate_conflicts = self.isolate_conflicts;
+        let patch_form = self.patch_form;
+        let result = match self.changes.get_mut(scratch.as_slice()) {
+            Some(entry) if entry.generation == generation => {
+                let repeated = Err(anyhow!(
+                    "delta key {:?} appears more than once in one block",
+                    scratch
+                ));
+                isolate(repeated, isolate_conflicts, &scratch).map(|merged| entry.change = merged)
+            }
+            Some(entry) => {
+                entry.generation = generation;
+                let parent = std::mem::replace(&mut entry.change, Change::Unchanged);
+                let merged = merge_changes(parent, change, &scratch, patch_form);
+                isolate(merged, isolate_conflicts, &scratch).map(|merged| entry.change = merged)
+            }
+            None => {
+                self.changes
+                    .insert(scratch.clone(), Entry { change, generation });
+                Ok(())
+            }
+        };
+        self.scratch = scratch;
+        result
+    }
+
+    /// Merge `child`, the consolidation of the blocks right after this one's.
+    pub fn merge(&mut self, child: Self) -> Result<()> {
+        self.check_fields(&child.primary_key_names, &child.subsidiary_value_names)?;
+        let isolate_conflicts = self.isolate_conflicts;
+        let patch_form = self.patch_form;
+        for (key, entry) in child.changes {
+            if entry.change == Change::Unchanged {
+                continue;
+            }
+            match self.changes.get_mut(&key) {
+                Some(parent) => {
+                    let change = std::mem::replace(&mut parent.change, Change::Unchanged);
+                    let merged = merge_changes(change, entry.change, &key, patch_form);
+                    parent.change = isolate(merged, isolate_conflicts, &key)?;
+                }
+                None => {
+                    self.changes.insert(
+                        key,
+                        Entry {
+                            change: entry.change,
+                            generation: self.generation,
+                        },
+                    );
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// Like [`MergedDelta::merge`], but splits both sides into `threads`
+    /// shards by primary-key hash and merges them concurrently. Every rule
+    /// looks at a single key, so the result is the same. Small children (and
+    /// `threads <= 1`) are merged on the calling thread.
+    pub fn merge_sharded(&mut self, child: Self, threads: usize) -> Result<()> {
+        if threads <= 1 || child.changes.len() < MIN_SHARDED_MERGE_ENTRIES {
+            return self.merge(child);
+        }
+        self.check_fields(&child.primary_key_names, &child.subsidiary_value_names)?;
+
+        // Both sides are split by the parent's hasher, so a key lands in the
+        // same shard on either side even when their maps are seeded apart.
+        let hasher = self.changes.hasher().clone();
+        let parent_shards = self.take_shards(threads);
+        let pairs: Vec<_> = parent_shards
+            .into_iter()
+            .zip(child.into_shards(threads, &hasher))
+            .collect();
+        let merged = parallel_map(pairs, threads, |(mut parent, child)| {
+            parent.merge(child).map(|()| parent)
+        });
+        for shard in merged {
+            self.changes.extend(shard?.changes);
+        }
+        Ok(())
+    }
+
+    fn take_shards(&mut self, shards: usize) -> Vec<Self> {
+        let hasher = self.changes.hasher().clone();
+        let delta = Self {
+            primary_key_names: self.primary_key_names.clone(),
+            subsidiary_value_names: self.subsidiary_value_names.clone(),
+            changes: std::mem::replace(&mut self.changes, HashMap::with_hasher(hasher.clone())),
+            generation: self.generation,
+            scratch: Vec::new(),
+            isolate_conflicts: self.isolate_conflicts,
+            patch_form: self.patch_form,
+        };
+        delta.into_shards(shards, &hasher)
+    }
+
+    /// Split the entries into `shards` deltas by their hash under `hasher`,
+    /// which the shards' maps use too.
+    fn into_shards(self, shards: usize, hasher: &S) -> Vec<Self> {
+        // Pick the shard from the high bits: the maps inside each shard index
+        // buckets by the low bits of the same hash, which would otherwise be
+        // constant within a shard.
+        let shard_of =
+            |key: &Vec<Cell>| ((u128::from(hasher.hash_one(key)) * shards as u128) >> 64) as usize;
+        let mut result: Vec<Self> = (0..shards)
+            .map(|_| Self {
+                primary_key_names: self.primary_key_names.clone(),
+                subsidiary_value_names: self.subsidiary_value_names.clone(),
+                changes: HashMap::with_capacity_and_hasher(
+                    self.changes.len() / shards,
+                    hasher.clone(),
+                ),
+                generation: self.generation,
+                scratch: Vec::new(),
+                isolate_conflicts: self.isolate_conflicts,
+                patch_form: self.patch_form,
+            })
+            .collect();
+        for (key, entry) in self.changes {
+            result[shard_of(&key)].changes.insert(key, entry);
+        }
+        result
+    }
+
+    /// Wire form for a patch: deletes without values and sparse updates
+    /// without old values. Conflicted keys are left out; a table with
+    /// conflicts has to be replaced instead (see [`MergedDelta::into_keys`]).
+    pub fn into_patch_proto(self) -> ProtoDelta {
+        let num_values = self.subsidiary_value_names.len();
+        let mut proto = ProtoDelta {
+            primary_key_names: self.primary_key_names,
+            subsidiary_value_names: self.subsidiary_value_names,
+            ..Default::default()
+        };
+        for (key, entry) in self.changes {
+            match entry.change {
+                Change::Insert(value) => proto.inserts.push(ProtoRecord {
+                    key: encode_cells(key),
+                    value: encode_cells(value),
+                }),
+                Change::Delete(_) => proto.deletes.push(ProtoRecord {
+                    key: encode_cells(key),
+                    value: Vec::new(),
+                }),
+                Change::Update(update) => {
+                    proto.updates.push(update.into_patch_proto(key, num_values))
+                }
+                Change::Unchanged | Change::Conflict => {}
+            }
+        }
+        proto
+    }
+
+    /// Wire form for a checkpoint: full delete values and sparse updates
+    /// with old values, so later merges can continue from it. Conflicted
+    /// keys are stored separately, see [`MergedDelta::conflicts_proto`].
+    pub fn to_checkpoint_proto(&self) -> ProtoDelta {
+        let mut proto = ProtoDelta {
+            primary_key_names: self.primary_key_names.clone(),
+            subsidiary_value_names: self.subsidiary_value_names.clone(),
+            ..Default::default()
+        };
+        for (key, change) in self.live() {
+            match change {
+                Change::Insert(value) => proto.inserts.push(ProtoRecord {
+                    key: copy_cells(key),
+                    value: copy_cells(value),
+                }),
+                Change::Delete(value) => proto.deletes.push(ProtoRecord {
+                    key: copy_cells(key),
+                    value: copy_cells(value),
+                }),
+                Change::Update(update) => proto.updates.push(update.to_checkpoint_proto(key)),
+                Change::Unchanged | Change::Conflict => {}
+            }
+        }
+        proto
+    }
+
+    /// The conflicted keys for a checkpoint, or `None` when there are none.
+    pub fn conflicts_proto(&self) -> Option<ProtoKeys> {
+        let records: Vec<ProtoRecord> = self
+            .live()
+            .filter(|(_, change)| **change == Change::Conflict)
+            .map(|(key, _)| ProtoRecord {
+                key: copy_cells(key),
+                value: Vec::new(),
+            })
+            .collect();
+        (!records.is_empty()).then_some(ProtoKeys { records })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cell::text_proto_cells;
+    use crate::delta::Delta;
+
+    type Row<'a> = (&'a str, &'a [&'a str]);
+
+    fn delta(inserts: &[Row], updates: &[(&str, &[&str], &[&str])], deletes: &[Row]) -> ProtoDelta {
+        let record = |&(key, value): &Row| ProtoRecord {
+            key: text_proto_cells(&[key]),
+            value: text_proto_cells(value),
+        };
+        ProtoDelta {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: vec!["name".to_string(), "role".to_string()],
+            inserts: inserts.iter().map(record).collect(),
+            deletes: deletes.iter().map(record).collect(),
+            updates: updates
+                .iter()
+                .map(|&(key, old, new)| ProtoUpdate {
+                    key: text_proto_cells(&[key]),
+                    changed_indices: Vec::new(),
+                    old_value: text_proto_cells(old),
+                    new_value: text_proto_cells(new),
+                })
+                .collect(),
+        }
+    }
+
+    fn merge_all(blocks: Vec<ProtoDelta>) -> Result<MergedDelta> {
+        let mut interner = Interner::new();
+        let mut blocks = blocks.into_iter();
+        let first = blocks.next().unwrap_or_default();
+        let mut merged = MergedDelta::from_proto(first, &mut interner)?;
+        for block in blocks {
+            merged.merge_proto(block, &mut interner)?;
+        }
+        Ok(merged)
+    }
+
+    /// The patch form `Patch::create` produced before `MergedDelta`: merge
+    /// with [`Delta::merge`], then strip delete values and sparse-encode.
+    fn reference_patch(blocks: Vec<ProtoDelta>) -> ProtoDelta {
+        let mut blocks = blocks.into_iter();
+        let mut merged = Delta::try_from(blocks.next().unwrap()).unwrap();
+        for block in blocks {
+            merged.merge(Delta::try_from(block).unwrap()).unwrap();
+        }
+        let mut proto = ProtoDelta::from(merged);
+        for delete in &mut proto.deletes {
+            delete.value.clear();
+        }
+        for update in &mut proto.updates {
+            update.sparse_encode();
+        }
+        proto
+    }
+
+    /// `proto` with its entries in key order, for comparisons.
+    fn sorted(mut proto: ProtoDelta) -> ProtoDelta {
+        proto
+            .inserts
+            .sort_by_key(|record| format!("{:?}", record.key));
+        proto
+            .deletes
+            .sort_by_key(|record| format!("{:?}", record.key));
+        proto
+            .updates
+            .sort_by_key(|update| format!("{:?}", update.key));
+        proto
+    }
+
+    fn sample_blocks() -> Vec<ProtoDelta> {
+        vec![
+            delta(
+                &[("1", &["Alice", "user"]), ("2", &["Bob", "user"])],
+                &[("3", &["Carol", "user"], &["Carol", "admin"])],
+                &[("4", &["Dave", "user"])],
+            ),
+            delta(
+                &[("4", &["Dave", "admin"]), ("5", &["Erin", "user"])],
+                &[
+                    ("1", &["Alice", "user"], &["Alicia", "user"]),
+                    ("3", &["Carol", "admin"], &["Caroline", "admin"]),
+                ],
+                &[("2", &["Bob", "user"])],
+            ),
+            delta(
+                &[("6", &["Frank", "user"])],
+                &[
+                    ("3", &["Caroline", "admin"], &["Carol", "user"]),
+                    ("4", &["Dave", "admin"], &["David", "admin"]),
+                ],
+                &[("5", &["Erin", "user"])],
+            ),
+        ]
+    }
+
+    #[test]
+    fn test_merge_proto_matches_delta_merge() {
+        let merged = merge_all(sample_blocks()).unwrap();
+        let patch = sorted(merged.into_patch_proto());
+        assert_eq!(patch, sorted(reference_patch(sample_blocks())));
+
+        // 1: insert + update = insert; 2, 3, 5: cancel out; 4: delete +
+        // insert + update = update of both columns; 6: insert.
+        assert_eq!(patch.inserts.len(), 2);
+        assert_eq!(patch.updates.len(), 1);
+        assert!(patch.deletes.is_empty());
+        assert_eq!(
+            patch.updates[0].new_value,
+            text_proto_cells(&["David", "admin"])
+        );
+        assert!(patch.updates[0].changed_indices.is_empty());
+    }
+
+    #[test]
+    fn test_merge_patch_deltas() {
+        // Each block on its own, as the patch shipping only that block.
+        let patches: Vec<ProtoDelta> = sample_blocks()
+            .into_iter()
+            .map(|block| merge_all(vec![block]).unwrap().into_patch_proto())
+            .collect();
+        assert!(patches.iter().all(|patch| {
+            patch.deletes.iter().all(|delete| delete.value.is_empty())
+                && patch
+                    .updates
+                    .iter()
+                    .all(|update| update.old_value.is_empty())
+        }));
+
+        let mut interner = Interner::new();
+        let mut patches = patches.into_iter();
+        let mut merged =
+            CoalescedDelta::from_patch_proto(patches.next().unwrap(), &mut interner).unwrap();
+        for patch in patches {
+            merged.merge_proto(patch, &mut interner).unwrap();
+        }
+        let patch = sorted(merged.into_patch_proto());
+
+        // 1: insert + update = insert; 2, 5: cancel out; 6: insert. Without
+        // old values 3 cannot be seen to cancel out and 4 (delete + insert +
+        // update) cannot be narrowed, so both update every column.
+        assert_eq!(
+            patch
+                .inserts
+                .iter()
+                .map(|r| r.value.clone())
+                .collect::<Vec<_>>(),
+            [
+                text_proto_cells(&["Alicia", "user"]),
+                text_proto_cells(&["Frank", "user"])
+            ]
+        );
+        assert!(patch.deletes.is_empty());
+        assert_eq!(patch.updates.len(), 2);
+        assert!(patch.updates.iter().all(|u| u.changed_indices.is_empty()));
+        assert_eq!(
+            patch.updates[0].new_value,
+            text_proto_cells(&["Carol", "user"])
+        );
+        assert_eq!(
+            patch.updates[1].new_value,
+            text_proto_cells(&["David", "admin"])
+        );
+
+        // The rules that need no old values still reject contradictions.
+        let mut merged = CoalescedDelta::from_patch_proto(
+            delta(&[("1", &["Alice", "user"])], &[], &[]),
+            &mut interner,
+        )
+        .unwrap();
+        let err = merged
+            .merge_proto(delta(&[("1", &["Alice", "user"])], &[], &[]), &mut interner)
+            .unwrap_err();
+        assert!(format!("{:#}", err).contains("rule 5"), "{:#}", err);
+    }
+
+    #[test]
+    fn test_merge_keeps_only_changed_columns() {
+        let columns = 100;
+        let names: Vec<String> = (0..columns).map(|i| format!("c{}", i)).collect();
+        let row = |seventh: &str| {
+            let mut value = vec!["x"; columns];
+            value[7] = seventh;
+            text_proto_cells(&value)
+        };
+        let update = |old: &str, new: &str| ProtoDelta {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: names.clone(),
+            updates: vec![ProtoUpdate {
+                key: text_proto_cells(&["1"]),
+                changed_indices: Vec::new(),
+                old_value: row(old),
+                new_value: row(new),
+            }],
+            ..Default::default()
+        };
+        let blocks: Vec<ProtoDelta> = (0..50)
+            .map(|i| update(&i.to_string(), &(i + 1).to_string()))
+            .collect();
+
+        let merged = merge_all(blocks).unwrap();
+        let Some(Change::Update(sparse)) = merged.get(&[Cell::from("1")]) else {
+            panic!("expected an update");
+        };
+        assert_eq!(sparse.columns, vec![7]);
+        assert_eq!(sparse.old, vec![Cell::from("0")]);
+        assert_eq!(sparse.new, vec![Cell::from("50")]);
+
+        let patch = merged.into_patch_proto();
+        assert_eq!(patch.updates[0].changed_indices, vec![7]);
+        assert_eq!(patch.updates[0].new_value, text_proto_cells(&["50"]));
+        assert!(patch.updates[0].old_value.is_empty());
+    }
+
+    #[test]
+    fn test_merge_update_update_cancels_then_insert_passes_through() {
+        let blocks = vec![
+            delta(&[], &[("1", &["Alice", "user"], &["Alice", "admin"])], &[]),
+            delta(&[], &[("1", &["Alice", "admin"], &["Alice", "user"])], &[]),
+        ];
+        let mut merged = merge_all(blocks).unwrap();
+        assert!(merged.get(&[Cell::from("1")]).is_none());
+        assert_eq!(merged.counts(), DeltaCounts::default());
+
+        merged
+            .merge_proto(
+                delta(&[], &[], &[("1", &["Alice", "user"])]),
+                &mut Interner::new(),
+            )
+            .unwrap();
+        assert_eq!(
+            merged.get(&[Cell::from("1")]),
+            Some(&Change::Delete(vec![
+                Cell::from("Alice"),
+                Cell::from("user")
+            ]))
+        );
+    }
+
+    #[test]
+    fn test_merge_rule_errors() {
+        let cases = [
+            (
+                vec![
+                    delta(&[("1", &["Alice", "user"])], &[], &[]),
+                    delta(&[("1", &["Alice", "user"])], &[], &[]),
+                ],
+                "rule 5",
+            ),
+            (
+                vec![
+                    delta(&[], &[], &[("1", &["Alice", "user"])]),
+                    delta(&[], &[("1", &["Alice", "user"], &["Alice", "admin"])], &[]),
+                ],
+                "rule 11",
+            ),
+            (
+                vec![
+                    delta(&[], &[("1", &["Alice", "user"], &["Alice", "admin"])], &[]),
+                    delta(&[], &[], &[("1", &["Alice", "user"])]),
+                ],
+                "rule 14b",
+            ),
+            (
+                vec![
+                    delta(&[], &[("1", &["Alice", "user"], &["Alice", "admin"])], &[]),
+                    delta(&[], &[("1", &["Alice", "guest"], &["Alice", "user"])], &[]),
+                ],
+                "rule 15 conflict",
+            ),
+        ];
+        for (blocks, expected) in cases {
+            let err = merge_all(blocks).unwrap_err();
+            let msg = format!("{:#}", err);
+            assert!(msg.contains(expected), "expected {expected}, got: {msg}");
+        }
+    }
+
+    #[test]
+    fn test_merge_isolates_conflicts() {
+        let mut interner = Interner::new();
+        let first = delta(
+            &[("1", &["Alice", "user"]), ("2", &["Bob", "user"])],
+            &[],
+            &[],
+        );
+        let mut merged = MergedDelta::from_proto(first, &mut interner).unwrap();
+        merged.isolate_conflicts = true;
+
+        // Key 1 is inserted twice (rule 5); key 2 merges as usual.
+        let second = delta(
+            &[("1", &["Alice", "user"])],
+            &[("2", &["Bob", "user"], &["Bob", "admin"])],
+            &[],
+        );
+        merged.merge_proto(second, &mut interner).unwrap();
+        // A conflicted key absorbs later changes.
+        let third = delta(&[], &[], &[("1", &["Alice", "user"])]);
+        merged.merge_proto(third, &mut interner).unwrap();
+
+        assert_eq!(merged.get(&[Cell::from("1")]), Some(&Change::Conflict));
+        assert_eq!(
+            merged.get(&[Cell::from("2")]),
+            Some(&Change::Insert(vec![
+                Cell::from("Bob"),
+                Cell::from("admin")
+            ]))
+        );
+        assert_eq!(merged.num_conflicts(), 1);
+
+        // Conflicts are stored next to the checkpoint delta and read back.
+        let keys = merged.conflicts_proto().unwrap();
+        let mut loaded =
+            MergedDelta::from_proto(merged.to_checkpoint_proto(), &mut interner).unwrap();
+        loaded.mark_conflicts(keys, &mut interner).unwrap();
+        assert_eq!(loaded, merged);
+
+        // The patch form leaves the conflicted key out.
+        let proto = merged.clone().into_patch_proto();
+        assert_eq!(proto.inserts.len(), 1);
+        assert!(proto.deletes.is_empty());
+        let mut keys: Vec<Vec<Cell>> = merged.into_keys().collect();
+        keys.sort();
+        assert_eq!(keys, [vec![Cell::from("1")], vec![Cell::from("2")]]);
+    }
+
+    #[test]
+    fn test_merge_proto_rejects_repeated_key() {
+        let block = delta(
+            &[("1", &["Alice", "user"])],
+            &[],
+            &[("1", &["Alice", "user"])],
+        );
+        let err = MergedDelta::from_proto(block, &mut Interner::new()).unwrap_err();
+        assert!(
+            format!("{:#}", err).contains("more than once in one block"),
+            "got: {:#}",
+            err
+        );
+    }
+
+    #[test]
+    fn test_checkpoint_proto_round_trip() {
+        let merged = merge_all(sample_blocks()).unwrap();
+        let proto = merged.to_checkpoint_proto();
+        let loaded = MergedDelta::from_proto(proto, &mut Interner::new()).unwrap();
+        assert_eq!(loaded, merged);
+
+        // Resuming from the checkpoint gives the same result as merging the
+        // whole chain at once.
+        let mut resumed = loaded;
+        let next = delta(&[], &[("6", &["Frank", "user"], &["Frank", "admin"])], &[]);
+        resumed
+            .merge_proto(next.clone(), &mut Interner::new())
+            .unwrap();
+        let mut blocks = sample_blocks();
+        blocks.push(next);
+        assert_eq!(resumed, merge_all(blocks).unwrap());
+    }
+
+    #[test]
+    fn test_merge_sharded_matches_merge() {
+        let mut interner = Interner::new();
+        let keys: Vec<String> = (0..MIN_SHARDED_MERGE_ENTRIES * 2)
+            .map(|i| i.to_string())
+            .collect();
+        let parent_rows: Vec<Row> = keys
+            .iter()
+            .map(|key| (key.as_str(), &["a", "b"][..]))
+            .collect();
+        let child_updates: Vec<(&str, &[&str], &[&str])> = keys
+            .iter()
+            .step_by(2)
+            .map(|key| (key.as_str(), &["a", "b"][..], &["a", "c"][..]))
+            .collect();
+        let parent = MergedDelta::from_proto(delta(&parent_rows, &[], &[]), &mut interner).unwrap();
+        let child =
+            MergedDelta::from_proto(delta(&[], &child_updates, &[]), &mut interner).unwrap();
+
+        let mut sequential = parent.clone();
+        sequential.merge(child.clone()).unwrap();
+        let mut sharded = parent;
+        sharded.merge_sharded(child, 4).unwrap();
+
+        assert_eq!(sharded, sequential);
+        assert_eq!(sharded.counts().inserts, MIN_SHARDED_MERGE_ENTRIES * 2);
+    }
+
+    #[test]
+    fn test_merge_sharded_with_seeded_hashers() {
+        // Two coalesced deltas have differently seeded maps; sharding must
+        // still pair up the same keys.
+        let mut interner = Interner::new();
+        let keys: Vec<String> = (0..MIN_SHARDED_MERGE_ENTRIES * 2)
+            .map(|i| i.to_string())
+            .collect();
+        let rows: Vec<Row> = keys
+            .iter()
+            .map(|key| (key.as_str(), &["a", "b"][..]))
+            .collect();
+        let mut parent =
+            CoalescedDelta::from_patch_proto(delta(&rows, &[], &[]), &mut interner).unwrap();
+        let child = CoalescedDelta::from_patch_proto(
+            ProtoDelta {
+                deletes: rows
+                    .iter()
+                    .map(|&(key, _)| ProtoRecord {
+                        key: text_proto_cells(&[key]),
+                        value: Vec::new(),
+                    })
+                    .collect(),
+                ..delta(&[], &[], &[])
+            },
+            &mut interner,
+        )
+        .unwrap();
+
+        parent.merge_sharded(child, 4).unwrap();
+        assert_eq!(parent.counts(), DeltaCounts::default());
+    }
+
+    #[test]
+    fn test_merge_sharded_propagates_rule_errors() {
+        let mut interner = Interner::new();
+        let keys: Vec<String> = (0..MIN_SHARDED_MERGE_ENTRIES * 2)
+            .map(|i| i.to_string())
+            .collect();
+        let rows: Vec<Row> = keys
+            .iter()
+            .map(|key| (key.as_str(), &["a", "b"][..]))
+            .collect();
+        let mut parent = MergedDelta::from_proto(delta(&rows, &[], &[]), &mut interner).unwrap();
+        // Every key is inserted again (rule 5).
+        let child = MergedDelta::from_proto(delta(&rows, &[], &[]), &mut interner).unwrap();
+
+        let err = parent.merge_sharded(child, 4).unwrap_err();
+        assert!(format!("{:#}", err).contains("rule 5"), "{:#}", err);
+    }
+}
@@ -0,0 +1,484 @@
+//! Packfiles of old blocks.
+//!
+//! With `[truncate] pack-after` set, truncation moves the blocks behind the
+//! newest `pack-after` blocks of the chain out of their loose files into one
+//! pack, so a long history costs two files instead of two per block (the
+//! block and its lock file). The pack is a data file, `PACK.<generation>`,
+//! holding one zstd frame per block, and the index `PACK.idx`, which names the
+//! generation and lists the packed blocks sorted by hash, each with the offset
+//! and length of its frame. Index entries have a fixed width, so lookups and
+//! prefix resolution are binary searches that read a few entries instead of
+//! listing the directory.
+//!
+//! Removing packed blocks only rewrites the index; their frames stay behind
+//! as dead bytes. Once the dead bytes outweigh the live ones, the live frames
+//! are copied into the data file of the next generation. Replacing the index
+//! is the commit point of every update, and the data file it points at is
+//! never modified other than by appending, so a crash at any step leaves a
+//! readable pack.
+//!
+//! All pack files are guarded by the `PACK` lock: shared for reads, exclusive
+//! for updates, which only run under the chain lock.
+
+use std::collections::HashSet;
+use std::fs::{self, File};
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::path::Path;
+
+use anyhow::{Context, Result, bail};
+
+use crate::storage;
+use crate::utils::{compute_hash, is_hex_hash};
+
+const PACK_LOCK_NAME: &str = "PACK";
+const INDEX_FILE: &str = "PACK.idx";
+const INDEX_MAGIC: &[u8; 8] = b"LCHPACK\0";
+const INDEX_VERSION: u32 = 1;
+/// Magic, version and generation.
+const INDEX_HEADER_LEN: u64 = 16;
+/// Hash (40 hex characters), offset, length and decoded size.
+const INDEX_ENTRY_LEN: u64 = 56;
+
+fn data_file_name(generation: u32) -> String {
+    format!("PACK.{}", generation)
+}
+
+/// One packed block: its zstd frame is `length` bytes at `offset` in the
+/// data file and decodes to `size` bytes.
+#[derive(Debug, Clone, PartialEq, Eq)]
+struct PackEntry {
+    hash: String,
+    offset: u64,
+    length: u32,
+    size: u32,
+}
+
+impl PackEntry {
+    fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(self.hash.as_bytes());
+        buf.extend_from_slice(&self.offset.to_le_bytes());
+        buf.extend_from_slice(&self.length.to_le_bytes());
+        buf.extend_from_slice(&self.size.to_le_bytes());
+    }
+
+    fn decode(data: &[u8; INDEX_ENTRY_LEN as usize]) -> Result<Self> {
+        let hash = std::str::from_utf8(&data[..40])
+            .ok()
+            .filter(|hash| is_hex_hash(hash))
+            .context("corrupt pack index entry")?;
+        let (offset, rest) = data[40..].split_at(8);
+        let (length, size) = rest.split_at(4);
+        Ok(PackEntry {
+            hash: hash.to_string(),
+            offset: u64::from_le_bytes(offset.try_into()?),
+            length: u32::from_le_bytes(length.try_into()?),
+            size: u32::from_le_bytes(size.try_into()?),
+        })
+    }
+}
+
+/// An open pack index. Entries are read on demand, so a lookup costs a binary
+/// search over the file rather than reading all of it.
+struct Index {
+    file: File,
+    generation: u32,
+    len: u64,
+}
+
+impl Index {
+    /// Open the index of the pack in `work_dir`. The caller holds the `PACK`
+    /// lock. Returns `None` when nothing has been packed yet.
+    fn open(work_dir: &Path) -> Result<Option<Self>> {
+        let path = work_dir.join(INDEX_FILE);
+        let mut file = match File::open(&path) {
+            Ok(file) => file,
+            Err(e) if e.kind() == std::io::ErrorKind::NotFound => return Ok(None),
+            Err(e) => {
+                return Err(e).with_context(|| format!("failed to open '{}'", path.display()));
+            }
+        };
+        let size = file
+            .metadata()
+            .with_context(|| format!("failed to stat '{}'", path.display()))?
+            .len();
+        let mut header = [0u8; INDEX_HEADER_LEN as usize];
+        file.read_exact(&mut header)
+            .with_context(|| format!("failed to read header of '{}'", path.display()))?;
+        if &header[..8] != INDEX_MAGIC {
+            bail!("'{}' is not a pack index", path.display());
+        }
+        let version = u32::from_le_bytes([header[8], header[9], header[10], header[11]]);
+        if version != INDEX_VERSION {
+            bail!(
+                "unsupported pack index version {} in '{}'",
+                version,
+                path.display()
+            );
+        }
+        let generation = u32::from_le_bytes([header[12], header[13], header[14], header[15]]);
+        if (size - INDEX_HEADER_LEN) % INDEX_ENTRY_LEN != 0 {
+            bail!("'{}' is truncated", path.display());
+        }
+        Ok(Some(Index {
+            file,
+            generation,
+            len: (size - INDEX_HEADER_LEN) / INDEX_ENTRY_LEN,
+        }))
+    }
+
+    fn entry(&mut self, position: u64) -> Result<PackEntry> {
+        let mut data = [0u8; INDEX_ENTRY_LEN as usize];
+        self.file
+            .seek(SeekFrom::Start(
+                INDEX_HEADER_LEN + position * INDEX_ENTRY_LEN,
+            ))
+            .and_then(|_| self.file.read_exact(&mut data))
+            .context("failed to read pack index entry")?;
+        PackEntry::decode(&data)
+    }
+
+    /// Position of the first entry whose hash is not less than `key`.
+    fn lower_bound(&mut self, key: &str) -> Result<u64> {
+        let (mut low, mut high) = (0, self.len);
+        while low < high {
+            let middle = low + (high - low) / 2;
+            if self.entry(middle)?.hash.as_str() < key {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        Ok(low)
+    }
+
+    fn find(&mut self, hash: &str) -> Result<Option<PackEntry>> {
+        let position = self.lower_bound(hash)?;
+        if position == self.len {
+            return Ok(None);
+        }
+        let entry = self.entry(position)?;
+        Ok((entry.hash == hash).then_some(entry))
+    }
+
+    fn entries(&mut self) -> Result<Vec<PackEntry>> {
+        (0..self.len).map(|position| self.entry(position)).collect()
+    }
+}
+
+/// Load the packed block `hash` into `buf` (cleared first). Returns `false`
+/// if the block is not packed. The decoded block is checked against its
+/// hash, so a damaged pack fails loudly instead of yielding a wrong block.
+pub fn load_into(work_dir: &Path, hash: &str, mode: u32, buf: &mut Vec<u8>) -> Result<bool> {
+    buf.clear();
+    let _lock = storage::acquire_lock(work_dir, PACK_LOCK_NAME, false, mode)?;
+    let Some(mut index) = Index::open(work_dir)? else {
+        return Ok(false);
+    };
+    let Some(entry) = index.find(hash)? else {
+        return Ok(false);
+    };
+
+    let path = work_dir.join(data_file_name(index.generation));
+    let mut file =
+        File::open(&path).with_context(|| format!("failed to open '{}'", path.display()))?;
+    let mut frame = vec![0u8; entry.length as usize];
+    file.seek(SeekFrom::Start(entry.offset))
+        .and_then(|_| file.read_exact(&mut frame))
+        .with_context(|| format!("failed to read block '{:.7}...' from pack", hash))?;
+    *buf = zstd::bulk::decompress(&frame, entry.size as usize)
+        .with_context(|| format!("failed to decompress block '{:.7}...' from pack", hash))?;
+    if compute_hash(buf) != hash {
+        bail!("packed block '{:.7}...' does not match its hash", hash);
+    }
+    log::trace!(
+        "Loaded {} bytes of block '{:.7}...' from pack",
+        buf.len(),
+        hash
+    );
+    Ok(true)
+}
+
+/// Whether block `hash` is packed.
+pub fn contains(work_dir: &Path, hash: &str, mode: u32) -> Result<bool> {
+    let _lock = storage::acquire_lock(work_dir, PACK_LOCK_NAME, false, mode)?;
+    match Index::open(work_dir)? {
+        Some(mut index) => Ok(index.find(hash)?.is_some()),
+        None => Ok(false),
+    }
+}
+
+/// Hashes of all packed blocks.
+pub fn hashes(work_dir: &Path, mode: u32) -> Result<HashSet<String>> {
+    let _lock = storage::acquire_lock(work_dir, PACK_LOCK_NAME, false, mode)?;
+    match Index::open(work_dir)? {
+        Some(mut index) => Ok(index.entries()?.into_iter().map(|e| e.hash).collect()),
+        None => Ok(HashSet::new()),
+    }
+}
+
+/// Up to `limit` hashes of packed blocks starting with `prefix`, in order.
+pub fn matching_prefix(
+    work_dir: &Path,
+    prefix: &str,
+    limit: usize,
+    mode: u32,
+) -> Result<Vec<String>> {
+    let _lock = storage::acquire_lock(work_dir, PACK_LOCK_NAME, false, mode)?;
+    let Some(mut index) = Index::open(work_dir)? else {
+        return Ok(Vec::new());
+    };
+    let mut matches = Vec::new();
+    let mut position = index.lower_bound(prefix)?;
+    while position < index.len && matches.len() < limit {
+        let entry = index.entry(position)?;
+        if !entry.hash.starts_with(prefix) {
+            break;
+        }
+        matches.push(entry.hash);
+        position += 1;
+    }
+    Ok(matches)
+}
+
+/// Add the loose blocks `add` to the pack and drop the packed blocks `remove`
+/// from it. Must be called under the chain lock. Returns the hashes that were
+/// packed; their loose files can be removed once this returns, since the new
+/// index is durable by then. Blocks that are already packed or have no loose
+/// file are left out. Nothing is written when `dry_run` is set.
+pub(crate) fn update(
+    work_dir: &Path,
+    add: &[String],
+    remove: &HashSet<String>,
+    mode: u32,
+    dry_run: bool,
+) -> Result<Vec<String>> {
+    // Read and compress the loose blocks before taking the pack lock, so
+    // that no block lock is ever taken while it is held.
+    let mut frames = Vec::with_capacity(add.len());
+    for hash in add {
+        let Some(data) = storage::load(work_dir, hash, mode)? else {
+            continue;
+        };
+        // Level 0 selects the zstd default.
+        let frame = zstd::bulk::compress(&data, 0)
+            .with_context(|| format!("failed to compress block '{:.7}...'", hash))?;
+        frames.push((hash.clone(), frame, data.len()));
+    }
+
+    let _lock = storage::acquire_lock(work_dir, PACK_LOCK_NAME, true, mode)?;
+    let (generation, mut entries) = match Index::open(work_dir)? {
+        Some(mut index) => (index.generation, index.entries()?),
+        None => (0, Vec::new()),
+    };
+    let packed: HashSet<String> = entries.iter().map(|entry| entry.hash.clone()).collect();
+    frames.retain(|(hash, _, _)| !packed.contains(hash));
+    let removed_before = entries.len();
+    entries.retain(|entry| !remove.contains(&entry.hash));
+    let num_removed = removed_before - entries.len();
+
+    if frames.is_empty() && num_removed == 0 {
+        return Ok(Vec::new());
+    }
+    if dry_run {
+        eprintln!(
+            "Would have packed {} block(s) and dropped {} packed block(s)",
+            frames.len(),
+            num_removed
+        );
+        return Ok(frames.into_iter().map(|(hash, _, _)| hash).collect());
+    }
+
+    let data_path = work_dir.join(data_file_name(generation));
+    let data_len = match fs::metadata(&data_path) {
+        Ok(metadata) => metadata.len(),
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => 0,
+        Err(e) => {
+            return Err(e).with_context(|| format!("failed to stat '{}'", data_path.display()));
+        }
+    };
+    let live_len: u64 = entries.iter().map(|entry| u64::from(entry.length)).sum();
+    let compact = data_len - live_len.min(data_len) > live_len;
+
+    let (generation, mut file, mut offset) = if compact {
+        let next = generation.wrapping_add(1);
+        let path = work_dir.join(data_file_name(next));
+        let mut file = storage::create_file(&path, mode)
+            .with_context(|| format!("failed to create '{}'", path.display()))?;
+        let mut source = File::open(&data_path)
+            .with_context(|| format!("failed to open '{}'", data_path.display()))?;
+        let mut offset = 0;
+        for entry in &mut entries {
+            let mut frame = vec![0u8; entry.length as usize];
+            source
+                .seek(SeekFrom::Start(entry.offset))
+                .and_then(|_| source.read_exact(&mut frame))
+                .and_then(|_| file.write_all(&frame))
+                .with_context(|| format!("failed to copy '{:.7}...' into new pack", entry.hash))?;
+            entry.offset = offset;
+            offset += u64::from(entry.length);
+        }
+        log::info!("Compacted pack from {} to {} bytes", data_len, offset);
+        (next, file, offset)
+    } else {
+        let file = storage::open_for_append(&data_path, mode)
+            .with_context(|| format!("failed to open '{}' for appending", data_path.display()))?;
+        (generation, file, data_len)
+    };
+
+    let mut packed_hashes = Vec::with_capacity(frames.len());
+    for (hash, frame, size) in frames {
+        file.write_all(&frame)
+            .with_context(|| format!("failed to write block '{:.7}...' to pack", hash))?;
+        entries.push(PackEntry {
+            hash: hash.clone(),
+            offset,
+            length: u32::try_from(frame.len()).context("packed block too large")?,
+            size: u32::try_from(size).context("packed block too large")?,
+        });
+        offset += frame.len() as u64;
+        packed_hashes.push(hash);
+    }
+    file.sync_all().context("failed to sync pack")?;
+    drop(file);
+
+    entries.sort_by(|a, b| a.hash.cmp(&b.hash));
+    let mut index =
+        Vec::with_capacity((INDEX_HEADER_LEN + entries.len() as u64 * INDEX_ENTRY_LEN) as usize);
+    index.extend_from_slice(INDEX_MAGIC);
+    index.extend_from_slice(&INDEX_VERSION.to_le_bytes());
+    index.extend_from_slice(&generation.to_le_bytes());
+    for entry in &entries {
+        entry.encode(&mut index);
+    }
+    storage::replace_file(work_dir, INDEX_FILE, &index, mode)?;
+
+    if compact {
+        let _ = fs::remove_file(&data_path);
+    }
+    log::info!(
+        "Packed {} block(s), dropped {} packed block(s), {} in pack",
+        packed_hashes.len(),
+        num_removed,
+        entries.len()
+    );
+    Ok(packed_hashes)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn write_block(dir: &Path, data: &[u8]) -> String {
+        let hash = compute_hash(data);
+        storage::store(dir, &hash, data, 0o600, false).unwrap();
+        hash
+    }
+
+    #[test]
+    fn test_update_then_load() {
+        let dir = tempfile::tempdir().unwrap();
+        let first = write_block(dir.path(), b"first block");
+        let second = write_block(dir.path(), b"second block");
+
+        let packed = update(
+            dir.path(),
+            &[first.clone(), second.clone()],
+            &HashSet::new(),
+            0o600,
+            false,
+        )
+        .unwrap();
+        assert_eq!(packed, [first.clone(), second.clone()]);
+        // Packing again is a no-op.
+        let again = update(dir.path(), &[first.clone()], &HashSet::new(), 0o600, false).unwrap();
+        assert!(again.is_empty());
+
+        let mut buf = Vec::new();
+        assert!(load_into(dir.path(), &second, 0o600, &mut buf).unwrap());
+        assert_eq!(buf, b"second block");
+        assert!(contains(dir.path(), &first, 0o600).unwrap());
+        assert!(!load_into(dir.path(), &"0".repeat(40), 0o600, &mut buf).unwrap());
+        assert_eq!(hashes(dir.path(), 0o600).unwrap().len(), 2);
+    }
+
+    #[test]
+    #[cfg(unix)]
+    fn test_update_applies_file_mode() {
+        use std::os::unix::fs::PermissionsExt;
+        let dir = tempfile::tempdir().unwrap();
+        let hash = write_block(dir.path(), b"first block");
+        update(dir.path(), &[hash], &HashSet::new(), 0o600, false).unwrap();
+
+        // The first pack file is created through the append path. 0o600 has
+        // no group/other bits, so the result is independent of the umask.
+        let data_mode = fs::metadata(dir.path().join(data_file_name(0)))
+            .unwrap()
+            .permissions()
+            .mode()
+            & 0o777;
+        assert_eq!(data_mode, 0o600);
+    }
+
+    #[test]
+    fn test_matching_prefix() {
+        let dir = tempfile::tempdir().unwrap();
+        let hashes: Vec<String> = (0..8)
+            .map(|i| write_block(dir.path(), format!("block {}", i).as_bytes()))
+            .collect();
+        update(dir.path(), &hashes, &HashSet::new(), 0o600, false).unwrap();
+
+        for hash in &hashes {
+            assert_eq!(
+                matching_prefix(dir.path(), &hash[..10], 2, 0o600).unwrap(),
+                [hash.clone()]
+            );
+        }
+        assert_eq!(matching_prefix(dir.path(), "", 2, 0o600).unwrap().len(), 2);
+    }
+
+    #[test]
+    fn test_remove_rewrites_index_and_compacts() {
+        let dir = tempfile::tempdir().unwrap();
+        let hashes: Vec<String> = (0..4)
+            .map(|i| write_block(dir.path(), format!("block number {}", i).as_bytes()))
+            .collect();
+        update(dir.path(), &hashes, &HashSet::new(), 0o600, false).unwrap();
+
+        // Dropping one block leaves its frame behind as dead bytes.
+        let remove: HashSet<String> = [hashes[0].clone()].into();
+        update(dir.path(), &[], &remove, 0o600, false).unwrap();
+        assert!(dir.path().join(data_file_name(0)).exists());
+        assert!(!contains(dir.path(), &hashes[0], 0o600).unwrap());
+
+        // Once the dead bytes outweigh the live ones, the pack is compacted.
+        let remove: HashSet<String> = [hashes[1].clone(), hashes[2].clone()].into();
+        update(dir.path(), &[], &remove, 0o600, false).unwrap();
+        assert!(!dir.path().join(data_file_name(0)).exists());
+        assert!(dir.path().join(data_file_name(1)).exists());
+        let mut buf = Vec::new();
+        assert!(load_into(dir.path(), &hashes[3], 0o600, &mut buf).unwrap());
+        assert_eq!(buf, b"block number 3");
+    }
+
+    #[test]
+    fn test_load_detects_corruption() {
+        let dir = tempfile::tempdir().unwrap();
+        let hash = write_block(dir.path(), b"some block");
+        update(dir.path(), &[hash.clone()], &HashSet::new(), 0o600, false).unwrap();
+
+        let replacement = zstd::bulk::compress(b"other data", 0).unwrap();
+        fs::write(dir.path().join(data_file_name(0)), replacement).unwrap();
+
+        let result = load_into(dir.path(), &hash, 0o600, &mut Vec::new());
+        assert!(result.is_err());
+    }
+
+    #[test]
+    fn test_dry_run_writes_nothing() {
+        let dir = tempfile::tempdir().unwrap();
+        let hash = write_block(dir.path(), b"some block");
+        let packed = update(dir.path(), &[hash.clone()], &HashSet::new(), 0o600, true).unwrap();
+        assert_eq!(packed, [hash]);
+        assert!(!dir.path().join(INDEX_FILE).exists());
+    }
+}
@@ -10,12 +10,16 @@ use prost::Message;
 use prost_types::Timestamp;
 
 use crate::block::Block;
-use crate::cell::{Cell, parse_typed_cell};
-use crate::config::{Config, InjectedFieldConfig};
-use crate::delta::Delta;
+use crate::cell::{Cell, Interner, parse_typed_cell};
+use crate::chain::ChainIndex;
+use crate::checkpoint::{self, Checkpoint, DeltaCounts};
+use crate::config::{Config, InjectedFieldConfig, TableConfig};
 use crate::head;
+use crate::merge::MergedDelta;
+use crate::proto::checkpoint::Checkpoint as ProtoCheckpoint;
 use crate::proto::delta::Delta as ProtoDelta;
 use crate::proto::injected::Field;
+use crate::proto::record::{Keys as ProtoKeys, Record as ProtoRecord};
 use crate::proto::state::State as ProtoState;
 use crate::proto::table::Table as ProtoTable;
 use crate::stats::{self, Stage, StageStats};
@@ -73,6 +77,12 @@ impl fmt::Display for Patch {
         write!(f, "\n  Blocks: {}", self.num_blocks)?;
         fmt_payload(&self.deltas, "Deltas", f)?;
         fmt_payload(&self.states, "States", f)?;
+        if !self.replaced_keys.is_empty() {
+            write!(f, "\n  Replaced keys ({}):", self.replaced_keys.len())?;
+            for (name, keys) in &self.replaced_keys {
+                write!(f, "\n    '{}' {} key(s)", name, keys.records.len())?;
+            }
+        }
         if self.deltas.is_empty() && self.states.is_empty() {
             write!(f, "\n  Payload: None")?;
         }
@@ -80,47 +90,64 @@ impl fmt::Display for Patch {
     }
 }
 
+/// The blocks a consolidation still has to merge.
+struct BlockRange {
+    /// Timestamp of the head block.
+    created: Option<Timestamp>,
+    /// Hashes of the blocks to merge, newest-first.
+    hashes: Vec<String>,
+    /// True when the walk stopped at the checkpoint tip rather than at
+    /// `last_known`, i.e. the blocks up to the tip are already merged.
+    resumed: bool,
+}
+
 /// Load the head block header and walk the chain back to (but not including)
-/// `last_known`, collecting block hashes. Only the block header is decoded
-/// per block, avoiding the heavier full-payload parse. Returns the head
-/// block's timestamp and the hashes in newest-first order. If `head` matches
+/// `last_known`, collecting block hashes. Parent pointers come from the
+/// `BLOCKS` index; blocks it does not cover fall back to decoding only the
+/// block header, avoiding the heavier full-payload parse. If `head` matches
 /// `last_known`, returns an empty hash list.
+///
+/// When `checkpoint_tip` is reached first, the walk stops there instead: the
+/// chain is immutable, so the checkpoint already covers everything between
+/// that tip and `last_known`.
 fn collect_block_hashes(
     work_dir: &Path,
     head: &str,
     last_known: &str,
+    checkpoint_tip: Option<&str>,
     mode: u32,
-) -> Result<(Option<Timestamp>, Vec<String>)> {
-    let block = Block::load_header(work_dir, head, mode)?;
+) -> Result<BlockRange> {
+    let index = ChainIndex::load(work_dir, mode);
+    let block = index.header(work_dir, head, mode)?;
     let created = block.created;
+    let is_tip = |hash: &str| checkpoint_tip == Some(hash);
 
-    if head == last_known {
-        return Ok((created, Vec::new()));
+    if head == last_known || is_tip(head) {
+        return Ok(BlockRange {
+            created,
+            hashes: Vec::new(),
+            resumed: head != last_known,
+        });
     }
 
     let mut hashes = vec![head.to_string()];
     let mut parent = block.parent;
 
-    while parent != GENESIS_HASH && parent != last_known {
+    while parent != GENESIS_HASH && parent != last_known && !is_tip(&parent) {
         hashes.push(parent.clone());
-        parent = Block::load_header(work_dir, &parent, mode)?.parent;
+        parent = index.header(work_dir, &parent, mode)?.parent;
     }
 
-    if parent != last_known {
+    let resumed = is_tip(&parent);
+    if parent != last_known && !resumed {
         bail!("block '{}' not found in chain", last_known);
     }
 
-    Ok((created, hashes))
-}
-
-/// Running tally of how many entries of each kind a table contributed
-/// across the blocks in a consolidation run, before the merge collapses
-/// them. Used to log the pre -> post reduction.
-#[derive(Clone, Copy, Default)]
-struct DeltaCounts {
-    inserts: usize,
-    updates: usize,
-    deletes: usize,
+    Ok(BlockRange {
+        created,
+        hashes,
+        resumed,
+    })
 }
 
 /// Merge a single block's deltas into per-table running results. Blocks are
@@ -130,12 +157,15 @@ struct DeltaCounts {
 /// simply extracts the block's deltas.
 ///
 /// Tables whose layout changed (delta is `None`) or whose merge failed are
-/// added to `skipped_tables` and fall back to full state.
+/// added to `skipped_tables` and fall back to full state. Partitions isolate
+/// their merge conflicts instead (see [`is_partition`]).
 fn merge_block_deltas(
+    config: &Config,
     block: Block,
-    merged_deltas: &mut HashMap<String, Delta>,
+    merged_deltas: &mut HashMap<String, MergedDelta>,
     skipped_tables: &mut HashSet<String>,
     pre_counts: &mut HashMap<String, DeltaCounts>,
+    interner: &mut Interner,
 ) {
     for (table_name, payload) in block.payload {
         if skipped_tables.contains(&table_name) {
@@ -159,19 +189,86 @@ fn merge_block_deltas(
         counts.updates += proto_delta.updates.len();
         counts.deletes += proto_delta.deletes.len();
 
-        let result = Delta::try_from(proto_delta).and_then(|child| {
-            match merged_deltas.remove(&table_name) {
-                Some(mut parent) => {
-                    parent.merge(child)?;
-                    Ok(parent)
-                }
-                None => Ok(child),
-            }
-        });
+        let result = match merged_deltas.get_mut(&table_name) {
+            Some(parent) => parent.merge_proto(proto_delta, interner),
+            None => MergedDelta::from_proto(proto_delta, interner).map(|mut delta| {
+                delta.isolate_conflicts = is_partition(config, &table_name);
+                merged_deltas.insert(table_name.clone(), delta);
+            }),
+        };
+
+        if let Err(e) = result {
+            log::warn!(
+                "Merge failed for table '{}', falling back to full state: {}",
+                table_name,
+                e
+            );
+            merged_deltas.remove(&table_name);
+            skipped_tables.insert(table_name);
+        }
+    }
+}
+
+/// Number of blocks per worker thread that a parallel consolidation loads
+/// and reduces at once. Bounds memory to one window of blocks rather than the
+/// whole tail, while leaving every worker a few merges per tree level.
+const PARALLEL_MERGE_BLOCKS_PER_THREAD: usize = 4;
+
+/// Whether `table_name` is a partition of a partitioned table. A merge
+/// conflict in a partition only marks the keys it hit, and the partition is
+/// then replaced on its own rather than the whole table.
+fn is_partition(config: &Config, table_name: &str) -> bool {
+    config
+        .table_of(table_name)
+        .is_some_and(|(name, _)| name != table_name)
+}
+
+/// Consolidation of the single block `hash`.
+fn block_range(config: &Config, hash: &str, block: Block) -> Checkpoint {
+    let mut range = Checkpoint {
+        tip: hash.to_string(),
+        num_blocks: 1,
+        ..Default::default()
+    };
+    merge_block_deltas(
+        config,
+        block,
+        &mut range.deltas,
+        &mut range.skipped_tables,
+        &mut range.counts,
+        &mut Interner::new(),
+    );
+    range
+}
 
+/// Extend the consolidation `older` with `newer`, which covers the blocks
+/// right after `older.tip`. This is [`merge_block_deltas`] for whole ranges:
+/// a table skipped on either side stays skipped, and a table whose merge
+/// fails is skipped from then on. Large table merges are sharded across
+/// `threads` workers.
+fn merge_ranges(older: &mut Checkpoint, newer: Checkpoint, threads: usize) {
+    for table_name in newer.skipped_tables {
+        older.deltas.remove(&table_name);
+        older.skipped_tables.insert(table_name);
+    }
+    for (table_name, counts) in newer.counts {
+        let total = older.counts.entry(table_name).or_default();
+        total.inserts += counts.inserts;
+        total.updates += counts.updates;
+        total.deletes += counts.deletes;
+    }
+
+    for (table_name, child) in newer.deltas {
+        if older.skipped_tables.contains(&table_name) {
+            continue;
+        }
+        let result = match older.deltas.remove(&table_name) {
+            Some(mut parent) => parent.merge_sharded(child, threads).map(|()| parent),
+            None => Ok(child),
+        };
         match result {
             Ok(delta) => {
-                merged_deltas.insert(table_name, delta);
+                older.deltas.insert(table_name, delta);
             }
             Err(e) => {
                 log::warn!(
@@ -179,11 +276,73 @@ fn merge_block_deltas(
                     table_name,
                     e
                 );
-                merged_deltas.remove(&table_name);
-                skipped_tables.insert(table_name);
+                older.skipped_tables.insert(table_name);
             }
         }
     }
+
+    older.tip = newer.tip;
+    older.num_blocks += newer.num_blocks;
+}
+
+/// Reduce consecutive consolidations, oldest first, to one by merging
+/// adjacent pairs concurrently until a single range is left. The merge rules
+/// are associative over consecutive ranges, so the result is the same as
+/// folding them in order.
+fn reduce_ranges(mut ranges: Vec<Checkpoint>, threads: usize) -> Checkpoint {
+    while ranges.len() > 1 {
+        let mut pairs = Vec::with_capacity(ranges.len() / 2);
+        let mut unpaired = None;
+        let mut iter = ranges.into_iter();
+        while let Some(older) = iter.next() {
+            match iter.next() {
+                Some(newer) => pairs.push((older, newer)),
+                None => unpaired = Some(older),
+            }
+        }
+
+        // Near the root only a few (but large) pairs remain; hand the idle
+        // workers to their table merges instead.
+        let shard_threads = (threads / pairs.len()).max(1);
+        ranges = utils::parallel_map(pairs, threads, |(mut older, newer)| {
+            merge_ranges(&mut older, newer, shard_threads);
+            older
+        });
+        ranges.extend(unpaired);
+    }
+    ranges.pop().unwrap_or_default()
+}
+
+/// Merge the blocks `hashes` (newest first) into `progress` on
+/// `config.threads` workers. Blocks are loaded concurrently and tree-reduced
+/// one window at a time, and each reduced window is appended to `progress`,
+/// so the result is the same as the sequential oldest-first merge.
+fn merge_blocks_parallel(
+    config: &Config,
+    work_dir: &Path,
+    hashes: &[String],
+    progress: &mut Checkpoint,
+) -> Result<()> {
+    let threads = config.threads;
+    let mode = config.file_mode;
+    let oldest_first: Vec<&String> = hashes.iter().rev().collect();
+    let window = threads * PARALLEL_MERGE_BLOCKS_PER_THREAD;
+    for (index, chunk) in oldest_first.chunks(window).enumerate() {
+        log::trace!(
+            "Merging blocks {}-{}/{} on {} threads",
+            index * window + 1,
+            index * window + chunk.len(),
+            hashes.len(),
+            threads
+        );
+        let ranges = utils::parallel_map(chunk.to_vec(), threads, |hash| {
+            Block::load(work_dir, hash, mode).map(|block| block_range(config, hash, block))
+        })
+        .into_iter()
+        .collect::<Result<Vec<_>>>()?;
+        merge_ranges(progress, reduce_ranges(ranges, threads), threads);
+    }
+    Ok(())
 }
 
 type ConsolidateResult = (
@@ -191,80 +350,257 @@ type ConsolidateResult = (
     u32,
     HashMap<String, ProtoDelta>,
     HashMap<String, ProtoTable>,
+    HashMap<String, ProtoKeys>,
 );
 
+/// Remove table `name` from `index` and return its contents, joining the
+/// partitions of a partitioned table into one. Returns `None` when the
+/// table, or one of its partitions, is not part of the state.
+fn take_whole_table(
+    config: &Config,
+    index: &mut ProtoState,
+    work_dir: &Path,
+    name: &str,
+    mode: u32,
+) -> Result<Option<ProtoTable>> {
+    let stored_names = match config.tables.get(name) {
+        Some(table_config) => table_config.stored_names(name),
+        None => vec![name.to_string()],
+    };
+    let mut whole: Option<ProtoTable> = None;
+    for stored_name in stored_names {
+        let Some(table) = index.take_table(work_dir, &stored_name, mode)? else {
+            return Ok(None);
+        };
+        match &mut whole {
+            Some(whole) => whole.records.extend(table.records),
+            None => whole = Some(table),
+        }
+    }
+    Ok(whole)
+}
+
+/// Join the partitions among `tables` into whole tables, keyed by table
+/// name, for a full-state patch.
+fn join_partitions(
+    config: &Config,
+    tables: HashMap<String, ProtoTable>,
+) -> HashMap<String, ProtoTable> {
+    let mut joined: HashMap<String, ProtoTable> = HashMap::with_capacity(tables.len());
+    for (stored_name, table) in tables {
+        let name = config
+            .table_of(&stored_name)
+            .map_or(stored_name.as_str(), |(name, _)| name)
+            .to_string();
+        match joined.get_mut(&name) {
+            Some(whole) => whole.records.extend(table.records),
+            None => {
+                joined.insert(name, table);
+            }
+        }
+    }
+    joined
+}
+
+/// The rows the state `partition` of a partition with merge conflicts
+/// replaces: its current keys, plus every other key `merged` changed, whose
+/// row may still exist on the receiver.
+fn replaced_keys(partition: &ProtoTable, merged: MergedDelta) -> Result<ProtoKeys> {
+    let mut changed: HashSet<Vec<Cell>> = merged.into_keys().collect();
+    let mut records = Vec::with_capacity(partition.records.len() + changed.len());
+    for record in &partition.records {
+        let key = record
+            .key
+            .iter()
+            .map(Cell::try_from)
+            .collect::<Result<Vec<Cell>>>()?;
+        changed.remove(&key);
+        records.push(ProtoRecord {
+            key: record.key.clone(),
+            value: Vec::new(),
+        });
+    }
+    records.extend(changed.into_iter().map(|key| ProtoRecord {
+        key: key.into_iter().map(Into::into).collect(),
+        value: Vec::new(),
+    }));
+    Ok(ProtoKeys { records })
+}
+
 fn try_consolidate(
+    config: &Config,
     work_dir: &Path,
     head: &str,
     last_known: &str,
-    mode: u32,
 ) -> Result<ConsolidateResult> {
-    let (created, block_hashes) = collect_block_hashes(work_dir, head, last_known, mode)?;
-
-    if block_hashes.is_empty() {
-        return Ok((created, 0, HashMap::new(), HashMap::new()));
+    let mode = config.file_mode;
+    let checkpoint = match config.checkpoint_interval {
+        0 => None,
+        _ => Checkpoint::load(work_dir, last_known, mode),
+    };
+    let range = collect_block_hashes(
+        work_dir,
+        head,
+        last_known,
+        checkpoint
+            .as_ref()
+            .map(|checkpoint| checkpoint.tip.as_str()),
+        mode,
+    )?;
+
+    // Resume from the checkpoint when the walk reached its tip; otherwise
+    // (e.g. a stale checkpoint from a rewritten chain) merge from scratch.
+    let mut progress = match checkpoint {
+        Some(checkpoint) if range.resumed => {
+            log::info!(
+                "Resuming consolidation from checkpoint '{:.7}...' ({} block(s) merged)",
+                checkpoint.tip,
+                checkpoint.num_blocks
+            );
+            checkpoint
+        }
+        _ => Checkpoint::default(),
+    };
+    let tail_blocks = range.hashes.len() as u32;
+    let num_blocks = progress.num_blocks + tail_blocks;
+
+    if num_blocks == 0 {
+        return Ok((
+            range.created,
+            0,
+            HashMap::new(),
+            HashMap::new(),
+            HashMap::new(),
+        ));
     }
 
-    let num_blocks = block_hashes.len() as u32;
-
-    // Load blocks one at a time oldest-first, merging deltas incrementally.
-    // Only one block's payload and the per-table running results are in
-    // memory at a time.
-    let mut merged_deltas: HashMap<String, Delta> = HashMap::new();
-    let mut skipped_tables: HashSet<String> = HashSet::new();
-    let mut pre_counts: HashMap<String, DeltaCounts> = HashMap::new();
+    // The checkpoint may predate a change of `partitions`.
+    for (table_name, delta) in &mut progress.deltas {
+        delta.isolate_conflicts = is_partition(config, table_name);
+    }
 
-    for (index, hash) in block_hashes.iter().rev().enumerate() {
-        log::trace!(
-            "Merging block {}/{}: '{:.7}...'",
-            index + 1,
-            num_blocks,
-            hash
-        );
-        let block = Block::load(work_dir, hash, mode)?;
-        merge_block_deltas(
-            block,
-            &mut merged_deltas,
-            &mut skipped_tables,
-            &mut pre_counts,
-        );
+    if config.threads > 1 {
+        merge_blocks_parallel(config, work_dir, &range.hashes, &mut progress)?;
+    } else {
+        // Load blocks one at a time oldest-first, merging deltas
+        // incrementally. Only one block's payload and the per-table running
+        // results are in memory at a time, and every block file is read into
+        // the same buffer.
+        let mut block_buf = Vec::new();
+        let mut interner = Interner::new();
+        for (index, hash) in range.hashes.iter().rev().enumerate() {
+            log::trace!(
+                "Merging block {}/{}: '{:.7}...'",
+                index + 1,
+                tail_blocks,
+                hash
+            );
+            let block = Block::load_with_buffer(work_dir, hash, mode, &mut block_buf)?;
+            merge_block_deltas(
+                config,
+                block,
+                &mut progress.deltas,
+                &mut progress.skipped_tables,
+                &mut progress.counts,
+                &mut interner,
+            );
+        }
+    }
+    if let Some(newest) = range.hashes.into_iter().next() {
+        progress.tip = newest;
+    }
+    progress.num_blocks = num_blocks;
+
+    // Persist the merged range once enough new blocks went into it, so the
+    // next patch from the same reference only merges the blocks after HEAD.
+    // The checkpoint keeps the full delete values and the old values of
+    // updates that later merges need; the patch drops them.
+    if config.checkpoint_interval > 0
+        && tail_blocks >= config.checkpoint_interval
+        && let Err(e) = checkpoint::store(
+            work_dir,
+            last_known,
+            &ProtoCheckpoint::from(&progress),
+            mode,
+            config.dry_run,
+        )
+    {
+        log::warn!("Failed to store merge checkpoint (non-fatal): {:#}", e);
     }
+    let Checkpoint {
+        deltas: merged_deltas,
+        skipped_tables,
+        counts: pre_counts,
+        ..
+    } = progress;
 
-    // Load state for per-table size comparison and fallback.
-    let state_tables = match ProtoState::load(work_dir, mode)? {
-        Some(state) => state.tables,
-        None => HashMap::new(),
-    };
+    // Load the state index for per-table size comparison and fallback. Only
+    // the tables that actually end up as full state are read from disk.
+    let mut state_index = ProtoState::load_index(work_dir, mode)?.unwrap_or_default();
 
     let mut result_deltas = HashMap::new();
     let mut result_states = HashMap::new();
+    let mut result_replaced_keys = HashMap::new();
 
     // Skipped tables fall back to full state. If the STATE file can't satisfy
     // one (e.g. STATE was deleted), bail so the caller falls back to a
     // full-state patch for the whole set, rather than emitting a patch that
-    // silently omits a table whose layout changed.
+    // silently omits a table whose layout changed. A skipped partition takes
+    // its whole table with it, under the table's name.
+    let mut whole_tables = HashSet::new();
     for table_name in &skipped_tables {
-        let state_table = state_tables.get(table_name).with_context(|| {
-            format!(
-                "table '{}' needs full state (layout changed) but is not in the STATE file",
-                table_name
-            )
-        })?;
-        log::info!("Table '{}': using full state (layout changed)", table_name);
-        result_states.insert(table_name.clone(), state_table.clone());
+        let name = config
+            .table_of(table_name)
+            .map_or(table_name.as_str(), |(name, _)| name);
+        if !whole_tables.insert(name) {
+            continue;
+        }
+        let state_table = take_whole_table(config, &mut state_index, work_dir, name, mode)?
+            .with_context(|| {
+                format!(
+                    "table '{}' needs full state (layout changed) but is not in the STATE file",
+                    name
+                )
+            })?;
+        log::info!("Table '{}': using full state (layout changed)", name);
+        result_states.insert(name.to_string(), state_table);
     }
 
     for (table_name, merged) in merged_deltas {
-        let mut merged_delta = ProtoDelta::from(merged);
-
-        // Strip data the receiver doesn't need.
-        for delete in &mut merged_delta.deletes {
-            delete.value.clear();
+        let name = config
+            .table_of(&table_name)
+            .map_or(table_name.as_str(), |(name, _)| name);
+        if whole_tables.contains(name) {
+            continue;
         }
-        for update in &mut merged_delta.updates {
-            update.sparse_encode();
+
+        // A partition with conflicting keys is replaced from its current
+        // state: the rows of its current keys and of every key it changed are
+        // removed, then the current rows loaded.
+        let conflicts = merged.num_conflicts();
+        if conflicts > 0 {
+            let state_table = state_index
+                .take_table(work_dir, &table_name, mode)?
+                .with_context(|| {
+                    format!(
+                        "partition '{}' needs full state (merge conflict) but is not in the STATE file",
+                        table_name
+                    )
+                })?;
+            log::warn!(
+                "Partition '{}': {} conflicting key(s), using full state of the partition",
+                table_name,
+                conflicts
+            );
+            result_replaced_keys.insert(table_name.clone(), replaced_keys(&state_table, merged)?);
+            result_states.insert(table_name, state_table);
+            continue;
         }
 
+        // Only what the receiver needs: deletes without values, updates
+        // with the new values of changed columns.
+        let merged_delta = merged.into_patch_proto();
+
         let pre = pre_counts.get(&table_name).copied().unwrap_or_default();
         log::info!(
             "Table '{}': consolidated {} block(s); inserts {}->{}, updates {}->{}, deletes {}->{}",
@@ -278,22 +614,31 @@ fn try_consolidate(
             merged_delta.deletes.len(),
         );
 
-        // Per-table size comparison: use full state if it's smaller.
-        if let Some(state_table) = state_tables.get(&table_name)
-            && state_table.encoded_len() < merged_delta.encoded_len()
+        // Per-table size comparison: use full state if it's smaller. Not for
+        // partitions, whose state would also have to carry replaced keys.
+        if !is_partition(config, &table_name)
+            && let Some(state_size) = state_index.table_size(&table_name)
+            && state_size < merged_delta.encoded_len() as u64
+            && let Some(state_table) = state_index.take_table(work_dir, &table_name, mode)?
         {
             log::info!(
                 "Table '{}': using full state (smaller than consolidated delta)",
                 table_name
             );
-            result_states.insert(table_name, state_table.clone());
+            result_states.insert(table_name, state_table);
             continue;
         }
 
         result_deltas.insert(table_name, merged_delta);
     }
 
-    Ok((created, num_blocks, result_deltas, result_states))
+    Ok((
+        range.created,
+        num_blocks,
+        result_deltas,
+        result_states,
+        result_replaced_keys,
+    ))
 }
 
 /// Build the injected-field list from config, converting each entry to its
@@ -311,24 +656,96 @@ fn build_injected_fields(config: &Config) -> Result<Vec<Field>> {
 /// `num_blocks` so it matches the framing of the actual patch. Used as the
 /// baseline for measuring how many bytes delta merging saved on the wire; when
 /// the actual patch is itself full state, this makes the saving exactly zero.
+///
+/// Computed from the STATE index alone: every segment reference records the
+/// encoded size of its table, so no table is loaded or decoded.
 fn full_state_size(config: &Config, num_blocks: u32) -> Result<u64> {
     let state_dir = config.ensure_state_dir()?;
-    let head = head::load(&state_dir, config.file_mode)?;
-    let injected_fields = build_injected_fields(config)?;
-    let mut patch = full_state_patch(&state_dir, &head, injected_fields, config.file_mode)?;
-    patch.num_blocks = num_blocks;
-    Ok(patch.encoded_len() as u64)
+    let mode = config.file_mode;
+    let head = head::load(&state_dir, mode)?;
+    let index = ProtoState::load_index(&state_dir, mode)?
+        .context("no STATE file found for full state patch")?;
+    let created = Block::load_header(&state_dir, &head, mode)
+        .ok()
+        .and_then(|header| header.created);
+    let frame = Patch {
+        head,
+        created,
+        injected_fields: build_injected_fields(config)?,
+        num_blocks,
+        deltas: HashMap::new(),
+        states: HashMap::new(),
+        replaced_keys: HashMap::new(),
+    };
+
+    let mut size = frame.encoded_len() as u64;
+    // A full-state patch joins partitions into their table, which lists the
+    // field names once rather than once per partition.
+    let mut joined: HashMap<&str, u64> = HashMap::new();
+    let inline_tables = index
+        .tables
+        .keys()
+        .filter(|name| !index.segments.contains_key(*name));
+    for name in index.segments.keys().chain(inline_tables) {
+        let Some(table_size) = index.table_size(name) else {
+            continue;
+        };
+        match config.table_of(name) {
+            Some((table, table_config)) if table != name => {
+                let header_len = table_header_len(table_config);
+                let records_len = table_size.saturating_sub(header_len);
+                *joined.entry(table).or_insert(header_len) += records_len;
+            }
+            _ => size += state_entry_len(name, table_size),
+        }
+    }
+    for (table, table_size) in joined {
+        size += state_entry_len(table, table_size);
+    }
+    Ok(size)
 }
 
+/// Encoded length of the field-name lists at the start of every encoded
+/// table of `table_config`: one length-delimited string per field.
+fn table_header_len(table_config: &TableConfig) -> u64 {
+    table_config
+        .fields
+        .iter()
+        .map(|field| {
+            let len = field.name.len();
+            (1 + prost::length_delimiter_len(len) + len) as u64
+        })
+        .sum()
+}
+
+/// Encoded length of one entry in a patch's `states` map: table `name`
+/// whose encoded `table.Table` is `table_size` bytes. Map entries are
+/// length-delimited messages with the name as field 1 and the table as
+/// field 2, and every tag involved fits in a single byte. Like any proto3
+/// field, an empty table is omitted from its entry.
+fn state_entry_len(name: &str, table_size: u64) -> u64 {
+    let key_len = 1 + prost::length_delimiter_len(name.len()) + name.len();
+    let value_len = match table_size {
+        0 => 0,
+        _ => 1 + prost::length_delimiter_len(table_size as usize) + table_size as usize,
+    };
+    let entry_len = key_len + value_len;
+    (1 + prost::length_delimiter_len(entry_len) + entry_len) as u64
+}
+
+/// A patch carrying the full current state of every table. Partitioned
+/// tables are joined back into whole tables, so the receiver replaces every
+/// row of them.
 fn full_state_patch(
+    config: &Config,
     work_dir: &Path,
     head: &str,
     injected_fields: Vec<Field>,
     mode: u32,
 ) -> Result<Patch> {
-    let created = Block::load(work_dir, head, mode)
+    let created = Block::load_header(work_dir, head, mode)
         .ok()
-        .and_then(|block| block.created);
+        .and_then(|header| header.created);
     let state =
         ProtoState::load(work_dir, mode)?.context("no STATE file found for full state patch")?;
     let patch = Patch {
@@ -337,7 +754,8 @@ fn full_state_patch(
         injected_fields,
         num_blocks: 0,
         deltas: HashMap::new(),
-        states: state.tables,
+        states: join_partitions(config, state.tables),
+        replaced_keys: HashMap::new(),
     };
     log::info!("Consolidated patch:\n{}", patch);
     Ok(patch)
@@ -387,7 +805,9 @@ impl Patch {
         let state_dir = config.ensure_state_dir()?;
         let file_mode = config.file_mode;
 
-        let resolved = crate::storage::resolve_hash_prefix(&state_dir, last_known);
+        crate::storage::recover_journal(&state_dir, file_mode, config.dry_run)
+            .context("failed to recover journal")?;
+        let resolved = crate::storage::resolve_hash_prefix(&state_dir, last_known, file_mode);
 
         let head = head::load(&state_dir, file_mode)?;
 
@@ -401,6 +821,7 @@ impl Patch {
                 num_blocks: 0,
                 deltas: HashMap::new(),
                 states: HashMap::new(),
+                replaced_keys: HashMap::new(),
             };
             log::info!("Consolidated patch:\n{}", patch);
             return Ok(patch);
@@ -413,23 +834,23 @@ impl Patch {
             Ok(hash) if hash != GENESIS_HASH => hash,
             Ok(_) => {
                 log::info!("Reference is genesis, producing full state patch");
-                return full_state_patch(&state_dir, &head, injected_fields, file_mode);
+                return full_state_patch(config, &state_dir, &head, injected_fields, file_mode);
             }
             Err(e) => {
                 log::warn!(
                     "Reference block not found, producing full state patch: {}",
                     e
                 );
-                return full_state_patch(&state_dir, &head, injected_fields, file_mode);
+                return full_state_patch(config, &state_dir, &head, injected_fields, file_mode);
             }
         };
 
-        let (created, num_blocks, deltas, states) =
-            match try_consolidate(&state_dir, &head, &last_known, file_mode) {
+        let (created, num_blocks, deltas, states, replaced_keys) =
+            match try_consolidate(config, &state_dir, &head, &last_known) {
                 Ok(result) => result,
                 Err(e) => {
                     log::warn!("Consolidation failed, falling back to full state: {}", e);
-                    return full_state_patch(&state_dir, &head, injected_fields, file_mode);
+                    return full_state_patch(config, &state_dir, &head, injected_fields, file_mode);
                 }
             };
 
@@ -440,6 +861,7 @@ impl Patch {
             num_blocks,
             deltas,
             states,
+            replaced_keys,
         };
 
         log::info!("Consolidated patch:\n{}", patch);
@@ -486,6 +908,10 @@ impl Patch {
 #[cfg(test)]
 mod tests {
     use super::*;
+    use crate::cell::text_proto_cells;
+    use crate::merge::Change;
+    use crate::proto::record::Record as ProtoRecord;
+    use crate::proto::update::Update as ProtoUpdate;
 
     fn empty_patch() -> Patch {
         Patch {
@@ -495,6 +921,7 @@ mod tests {
             num_blocks: 0,
             deltas: HashMap::new(),
             states: HashMap::new(),
+            replaced_keys: HashMap::new(),
         }
     }
 
@@ -598,4 +1025,139 @@ mod tests {
         let _ = patch.inject_field("foo", Cell::Null);
         assert!(patch.injected_fields.is_empty());
     }
+
+    /// A consolidation of a single block whose 'users' delta applies `inserts`,
+    /// `updates` and `deletes`, and that optionally changed the layout of
+    /// 'orders'.
+    fn range(
+        tip: &str,
+        inserts: &[(&str, &str)],
+        updates: &[(&str, &str, &str)],
+        deletes: &[(&str, &str)],
+        orders_layout_changed: bool,
+    ) -> Checkpoint {
+        let cells = |value: &str| text_proto_cells(&[value]);
+        let record = |&(key, value): &(&str, &str)| ProtoRecord {
+            key: cells(key),
+            value: cells(value),
+        };
+        let proto = ProtoDelta {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: vec!["name".to_string()],
+            inserts: inserts.iter().map(record).collect(),
+            deletes: deletes.iter().map(record).collect(),
+            updates: updates
+                .iter()
+                .map(|&(key, old, new)| ProtoUpdate {
+                    key: cells(key),
+                    changed_indices: Vec::new(),
+                    old_value: cells(old),
+                    new_value: cells(new),
+                })
+                .collect(),
+        };
+        let delta = MergedDelta::from_proto(proto, &mut Interner::new()).unwrap();
+        let mut range = Checkpoint {
+            tip: tip.to_string(),
+            num_blocks: 1,
+            ..Default::default()
+        };
+        range.deltas.insert("users".to_string(), delta);
+        if orders_layout_changed {
+            range.skipped_tables.insert("orders".to_string());
+        }
+        range
+    }
+
+    fn sample_ranges() -> Vec<Checkpoint> {
+        vec![
+            range("b1", &[("1", "Alice")], &[], &[], false),
+            range(
+                "b2",
+                &[("2", "Bob")],
+                &[("1", "Alice", "Alicia")],
+                &[],
+                false,
+            ),
+            range("b3", &[], &[], &[("1", "Alicia")], true),
+            range("b4", &[("1", "Carol")], &[], &[("2", "Bob")], false),
+            range(
+                "b5",
+                &[("3", "Dave")],
+                &[("1", "Carol", "Caroline")],
+                &[],
+                false,
+            ),
+        ]
+    }
+
+    #[test]
+    fn test_reduce_ranges_matches_sequential_fold() {
+        let mut folded = Checkpoint::default();
+        for range in sample_ranges() {
+            merge_ranges(&mut folded, range, 1);
+        }
+        let reduced = reduce_ranges(sample_ranges(), 2);
+
+        assert_eq!(reduced, folded);
+        assert_eq!(reduced.tip, "b5");
+        assert_eq!(reduced.num_blocks, 5);
+        assert!(reduced.skipped_tables.contains("orders"));
+        let users = &reduced.deltas["users"];
+        assert_eq!(
+            users.counts(),
+            DeltaCounts {
+                inserts: 2,
+                updates: 0,
+                deletes: 0,
+            }
+        );
+        assert_eq!(
+            users.get(&[Cell::from("1")]),
+            Some(&Change::Insert(vec![Cell::from("Caroline")]))
+        );
+    }
+
+    #[test]
+    fn test_merge_ranges_skips_table_on_merge_failure() {
+        let mut older = range("b1", &[("1", "Alice")], &[], &[], false);
+        merge_ranges(&mut older, range("b2", &[("1", "Bob")], &[], &[], false), 1);
+        assert!(older.deltas.is_empty());
+        assert!(older.skipped_tables.contains("users"));
+
+        merge_ranges(
+            &mut older,
+            range("b3", &[("2", "Carol")], &[], &[], false),
+            1,
+        );
+        assert!(older.deltas.is_empty());
+        assert_eq!(older.tip, "b3");
+        assert_eq!(older.num_blocks, 3);
+    }
+
+    #[test]
+    fn test_state_entry_len_matches_encoding() {
+        let table = ProtoTable {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: vec!["name".to_string()],
+            ..Default::default()
+        };
+        let long_name = "t".repeat(200);
+        for (name, table) in [
+            ("users", table.clone()),
+            ("empty", ProtoTable::default()),
+            (long_name.as_str(), table),
+        ] {
+            let mut patch = empty_patch();
+            let frame_len = patch.encoded_len() as u64;
+            let table_size = table.encoded_len() as u64;
+            patch.states.insert(name.to_string(), table);
+            assert_eq!(
+                patch.encoded_len() as u64,
+                frame_len + state_entry_len(name, table_size),
+                "table '{}'",
+                name
+            );
+        }
+    }
 }
@@ -26,6 +26,15 @@ pub mod update {
 pub mod block {
     include!(concat!(env!("OUT_DIR"), "/block.rs"));
 }
+pub mod checkpoint {
+    include!(concat!(env!("OUT_DIR"), "/checkpoint.rs"));
+}
+pub mod journal {
+    include!(concat!(env!("OUT_DIR"), "/journal.rs"));
+}
+pub mod wire {
+    include!(concat!(env!("OUT_DIR"), "/wire.rs"));
+}
 // The `Cell` message's oneof generates a nested `cell` submodule, which
 // triggers clippy's `module_inception` lint. The collision is inherent to
 // how prost names oneof submodules and not worth working around.
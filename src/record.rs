@@ -1,4 +1,3 @@
-use std::collections::HashMap;
 use std::fmt;
 
 use anyhow::Result;
@@ -6,8 +5,9 @@ use anyhow::Result;
 use crate::cell::Cell;
 use crate::cell::{decode_proto_cells, display_proto_cells};
 use crate::proto::record::Record as ProtoRecord;
+use crate::utils::FastHashMap;
 
-pub type RecordMap = HashMap<Vec<Cell>, Vec<Cell>>;
+pub type RecordMap = FastHashMap<Vec<Cell>, Vec<Cell>>;
 
 /// One row of a table, split into key and value halves.
 ///
@@ -71,9 +71,9 @@ impl fmt::Display for Record {
     }
 }
 
-/// Decode a `Vec<ProtoRecord>` into a `HashMap` keyed by each record's key.
-pub fn decode_proto_records(protos: Vec<ProtoRecord>) -> Result<HashMap<Vec<Cell>, Vec<Cell>>> {
-    let mut records = HashMap::with_capacity(protos.len());
+/// Decode a `Vec<ProtoRecord>` into a [`RecordMap`] keyed by each record's key.
+pub fn decode_proto_records(protos: Vec<ProtoRecord>) -> Result<RecordMap> {
+    let mut records = RecordMap::with_capacity_and_hasher(protos.len(), Default::default());
     for proto in protos {
         let record = Record::try_from(proto)?;
         records.insert(record.key, record.value);
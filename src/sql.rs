@@ -1,17 +1,23 @@
 use std::collections::{HashMap, HashSet};
+use std::fmt::{self, Write as _};
+use std::io::Write;
+use std::time::Instant;
 
 use anyhow::{Context, Result, anyhow, bail};
 
 use crate::cell::{Cell, Kind};
 use crate::config::{Config, FieldConfig};
 use crate::proto::cell::Cell as ProtoCell;
+use crate::proto::cell::cell::Kind as ProtoKind;
 use crate::proto::delta::Delta as ProtoDelta;
 use crate::proto::injected::Field as ProtoInjectedField;
 use crate::proto::patch::Patch as ProtoPatch;
-use crate::proto::record::Record as ProtoRecord;
+use crate::proto::record::{Keys as ProtoKeys, Record as ProtoRecord};
 use crate::proto::table::Table as ProtoTable;
 use crate::proto::update::Update as ProtoUpdate;
-use crate::utils::validate_field_name;
+use crate::trace::{self, SqlTrace};
+use crate::utils::{parallel_map, validate_field_name};
+use crate::wire::{self, PatchChunk, PatchReader};
 
 /// Schema information for a single table, derived from the wire-declared
 /// field lists. Column ordering follows the wire (i.e. the agent's
@@ -50,9 +56,8 @@ impl<'a> TableSchema<'a> {
         config: &'a Config,
         table_name: &str,
     ) -> Result<Self> {
-        let table_config = config
-            .tables
-            .get(table_name)
+        let (_, table_config) = config
+            .table_of(table_name)
             .with_context(|| format!("table '{}' not found in config", table_name))?;
 
         let field_configs: HashMap<&str, &FieldConfig> = table_config
@@ -141,12 +146,75 @@ impl<'a> TableSchema<'a> {
     }
 }
 
+/// A borrowed view of a wire cell, validated like [`Cell`] but referencing
+/// the decoded patch instead of copying text out of it. SQL rendering escapes
+/// each value straight from the patch through this view, and
+/// [`emit_patch_statements`] binds it as a statement parameter.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum CellRef<'a> {
+    Null,
+    Text(&'a str),
+    Boolean(bool),
+    Number(f64),
+}
+
+impl<'a> TryFrom<&'a ProtoCell> for CellRef<'a> {
+    type Error = anyhow::Error;
+
+    fn try_from(proto: &'a ProtoCell) -> Result<Self> {
+        match &proto.kind {
+            Some(ProtoKind::Null(())) => Ok(CellRef::Null),
+            Some(ProtoKind::Text(s)) => Ok(CellRef::Text(s)),
+            Some(ProtoKind::Boolean(b)) => Ok(CellRef::Boolean(*b)),
+            // Same rejection of NaN/infinity and zero normalization as Cell.
+            Some(ProtoKind::Number(n)) => match Cell::number(*n)? {
+                Cell::Number(n) => Ok(CellRef::Number(n)),
+                other => bail!("internal error: number decoded as {}", other),
+            },
+            None => bail!("Cell message has no kind set"),
+        }
+    }
+}
+
+impl<'a> From<&'a Cell> for CellRef<'a> {
+    fn from(cell: &'a Cell) -> Self {
+        match cell {
+            Cell::Null => CellRef::Null,
+            Cell::Text(s) => CellRef::Text(s),
+            Cell::Boolean(b) => CellRef::Boolean(*b),
+            Cell::Number(n) => CellRef::Number(*n),
+        }
+    }
+}
+
+impl CellRef<'_> {
+    pub fn kind(&self) -> Kind {
+        match self {
+            CellRef::Null => Kind::Null,
+            CellRef::Text(_) => Kind::Text,
+            CellRef::Boolean(_) => Kind::Boolean,
+            CellRef::Number(_) => Kind::Number,
+        }
+    }
+}
+
+impl fmt::Display for CellRef<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            CellRef::Null => write!(f, "NULL"),
+            CellRef::Text(s) => write!(f, "{:?}", s),
+            CellRef::Boolean(b) => write!(f, "{}", b),
+            CellRef::Number(n) => write!(f, "{}", n),
+        }
+    }
+}
+
 /// Validate that a wire cell's variant agrees with the field's declared
 /// type. `Null` is accepted on any non-primary-key field; a primary-key cell
 /// with the value `NULL` is rejected here, since a patch decoded from an
 /// untrusted peer can carry a NULL key cell that the producing agent's load
 /// path would have rejected.
-fn check_value_matches_field(value: &Cell, field: &FieldConfig) -> Result<()> {
+fn check_value_matches_field(value: &CellRef, field: &FieldConfig) -> Result<()> {
     if value.kind() == Kind::Null {
         if field.primary_key {
             bail!("field '{}': primary-key value must not be NULL", field.name);
@@ -165,6 +233,17 @@ fn check_value_matches_field(value: &Cell, field: &FieldConfig) -> Result<()> {
     Ok(())
 }
 
+/// Decode a wire cell for column `name` and check it against the hub config.
+fn field_literal<'a>(
+    proto_value: &'a ProtoCell,
+    name: &str,
+    schema: &TableSchema,
+) -> Result<CellRef<'a>> {
+    let value = CellRef::try_from(proto_value).with_context(|| format!("field '{}'", name))?;
+    check_value_matches_field(&value, schema.field_config(name)?)?;
+    Ok(value)
+}
+
 /// A static field injected into all SQL output (resolved from proto).
 struct InjectedField {
     name: String,
@@ -205,42 +284,147 @@ impl TryFrom<&ProtoInjectedField> for InjectedField {
     }
 }
 
-impl InjectedField {
-    fn where_clause(&self) -> String {
-        format!(
-            "{} = {}",
-            quote_identifier(&self.name),
-            quote_literal(&self.value)
-        )
+/// Append `name` to `buf` as a double-quoted SQL identifier, escaping
+/// embedded double quotes.
+fn push_identifier(buf: &mut String, name: &str) {
+    buf.push('"');
+    for (i, part) in name.split('"').enumerate() {
+        if i > 0 {
+            buf.push_str("\"\"");
+        }
+        buf.push_str(part);
     }
+    buf.push('"');
+}
 
-    fn quoted_column(&self) -> String {
-        quote_identifier(&self.name)
+/// Append `value` to `buf` as a SQL literal.
+fn push_literal(buf: &mut String, value: CellRef) {
+    match value {
+        CellRef::Null => buf.push_str("NULL"),
+        CellRef::Text(s) => {
+            buf.push('\'');
+            for (i, part) in s.split('\'').enumerate() {
+                if i > 0 {
+                    buf.push_str("''");
+                }
+                buf.push_str(part);
+            }
+            buf.push('\'');
+        }
+        CellRef::Boolean(true) => buf.push_str("TRUE"),
+        CellRef::Boolean(false) => buf.push_str("FALSE"),
+        // Formatting into a String cannot fail.
+        CellRef::Number(n) => {
+            let _ = write!(buf, "{}", n);
+        }
     }
+}
 
-    fn quoted_value(&self) -> String {
-        quote_literal(&self.value)
-    }
+/// Append `"name" = value` to `buf`.
+fn push_assignment(buf: &mut String, name: &str, value: CellRef) {
+    push_identifier(buf, name);
+    buf.push_str(" = ");
+    push_literal(buf, value);
 }
 
 /// Double-quote a SQL identifier, escaping embedded double quotes.
 pub fn quote_identifier(name: &str) -> String {
-    format!("\"{}\"", name.replace('"', "\"\""))
+    let mut buf = String::with_capacity(name.len() + 2);
+    push_identifier(&mut buf, name);
+    buf
 }
 
 /// Format a `Cell` as a SQL literal.
 pub fn quote_literal(value: &Cell) -> String {
-    match value {
-        Cell::Null => "NULL".to_string(),
-        Cell::Text(s) => format!("'{}'", s.replace('\'', "''")),
-        Cell::Boolean(true) => "TRUE".to_string(),
-        Cell::Boolean(false) => "FALSE".to_string(),
-        Cell::Number(n) => n.to_string(),
+    let mut buf = String::new();
+    push_literal(&mut buf, CellRef::from(value));
+    buf
+}
+
+/// Renders statements one at a time into a reused buffer and hands each
+/// completed statement to a sink, so memory stays bounded by the largest
+/// statement rather than the whole patch.
+struct StatementWriter<'s> {
+    buf: String,
+    sink: &'s mut dyn FnMut(&str) -> Result<()>,
+    statements: usize,
+}
+
+impl StatementWriter<'_> {
+    /// Terminate the statement in the buffer, pass it to the sink, and clear
+    /// the buffer for the next one.
+    fn finish(&mut self) -> Result<()> {
+        self.buf.push_str(";\n");
+        log::trace!("{}", self.buf.trim_end());
+        (self.sink)(&self.buf)?;
+        self.buf.clear();
+        self.statements += 1;
+        Ok(())
+    }
+}
+
+/// The parts of a table's statements that are the same for every row,
+/// rendered once per table.
+struct TableFragments {
+    quoted_table: String,
+    /// `INSERT INTO <table> (<columns>) VALUES `.
+    insert_prefix: String,
+    /// Injected values joined by commas, leading every INSERT row; empty
+    /// without injected fields.
+    injected_values: String,
+    /// Injected-field conditions joined by `AND`; empty without injected
+    /// fields.
+    injected_where: String,
+}
+
+impl TableFragments {
+    fn new(table_name: &str, schema: &TableSchema, injected_fields: &[InjectedField]) -> Self {
+        let quoted_table = quote_identifier(table_name);
+
+        let mut insert_prefix = format!("INSERT INTO {} (", quoted_table);
+        let columns = injected_fields
+            .iter()
+            .map(|injected| injected.name.as_str())
+            .chain(schema.primary_key_names.iter().map(String::as_str))
+            .chain(schema.subsidiary_value_names.iter().map(String::as_str));
+        for (i, name) in columns.enumerate() {
+            if i > 0 {
+                insert_prefix.push_str(", ");
+            }
+            push_identifier(&mut insert_prefix, name);
+        }
+        insert_prefix.push_str(") VALUES ");
+
+        let mut injected_values = String::new();
+        let mut injected_where = String::new();
+        for (i, injected) in injected_fields.iter().enumerate() {
+            if i > 0 {
+                injected_values.push_str(", ");
+                injected_where.push_str(" AND ");
+            }
+            push_literal(&mut injected_values, CellRef::from(&injected.value));
+            push_assignment(
+                &mut injected_where,
+                &injected.name,
+                CellRef::from(&injected.value),
+            );
+        }
+
+        TableFragments {
+            quoted_table,
+            insert_prefix,
+            injected_values,
+            injected_where,
+        }
+    }
+
+    fn has_injected(&self) -> bool {
+        !self.injected_where.is_empty()
     }
 }
 
-/// Convert key + value proto-cell slices into a list of SQL literal strings.
-fn format_row(key: &[ProtoCell], value: &[ProtoCell], schema: &TableSchema) -> Result<Vec<String>> {
+/// Reject a primary key whose cell count disagrees with the schema.
+fn check_primary_key_len(key: &[ProtoCell], schema: &TableSchema) -> Result<()> {
     if key.len() != schema.primary_key_names.len() {
         bail!(
             "primary key field count mismatch: got {} values, expected {}",
@@ -248,6 +432,39 @@ fn format_row(key: &[ProtoCell], value: &[ProtoCell], schema: &TableSchema) -> R
             schema.primary_key_names.len()
         );
     }
+    Ok(())
+}
+
+/// Append `cells`, the values of the columns `names`, to `buf` as
+/// comma-separated SQL literals, starting with a separator when `separate`
+/// is set.
+fn push_literals(
+    buf: &mut String,
+    cells: &[ProtoCell],
+    names: &[String],
+    schema: &TableSchema,
+    separate: bool,
+) -> Result<()> {
+    for (i, (proto_value, name)) in cells.iter().zip(names).enumerate() {
+        if i > 0 || separate {
+            buf.push_str(", ");
+        }
+        push_literal(buf, field_literal(proto_value, name, schema)?);
+    }
+    Ok(())
+}
+
+/// Append the key + value proto cells of a row to `buf` as comma-separated
+/// SQL literals, following the injected values already in `buf` when
+/// `after_injected` is set.
+fn push_row(
+    buf: &mut String,
+    key: &[ProtoCell],
+    value: &[ProtoCell],
+    schema: &TableSchema,
+    after_injected: bool,
+) -> Result<()> {
+    check_primary_key_len(key, schema)?;
     if value.len() != schema.subsidiary_value_names.len() {
         bail!(
             "subsidiary field count mismatch: got {} values, expected {}",
@@ -256,266 +473,1068 @@ fn format_row(key: &[ProtoCell], value: &[ProtoCell], schema: &TableSchema) -> R
         );
     }
 
-    let mut literals = Vec::with_capacity(key.len() + value.len());
-    for (proto_value, name) in key.iter().zip(schema.primary_key_names) {
-        let v = Cell::try_from(proto_value).with_context(|| format!("field '{}'", name))?;
-        check_value_matches_field(&v, schema.field_config(name)?)?;
-        literals.push(quote_literal(&v));
-    }
-    for (proto_value, name) in value.iter().zip(schema.subsidiary_value_names) {
-        let v = Cell::try_from(proto_value).with_context(|| format!("field '{}'", name))?;
-        check_value_matches_field(&v, schema.field_config(name)?)?;
-        literals.push(quote_literal(&v));
-    }
-    Ok(literals)
+    push_literals(buf, key, schema.primary_key_names, schema, after_injected)?;
+    push_literals(
+        buf,
+        value,
+        schema.subsidiary_value_names,
+        schema,
+        after_injected || !key.is_empty(),
+    )
 }
 
-/// Generate DELETE statements for a list of records.
+/// Generate DELETE statements for a list of records, removing up to
+/// `batch_size` keys per statement.
 fn emit_deletes(
     records: &[ProtoRecord],
     schema: &TableSchema,
-    injected_fields: &[InjectedField],
-    quoted_table: &str,
-    out: &mut String,
+    fragments: &TableFragments,
+    batch_size: usize,
+    writer: &mut StatementWriter,
 ) -> Result<()> {
-    for record in records {
-        let where_clause = primary_key_where_clause(&record.key, schema, injected_fields)
-            .with_context(|| format!("key {:?}", record.key))?;
-        out.push_str(&format!(
-            "DELETE FROM {} WHERE {};\n",
-            quoted_table, where_clause
-        ));
+    for batch in records.chunks(batch_size.max(1)) {
+        writer.buf.push_str("DELETE FROM ");
+        writer.buf.push_str(&fragments.quoted_table);
+        writer.buf.push_str(" WHERE ");
+        match batch {
+            [record] => push_primary_key_where(&mut writer.buf, &record.key, schema, fragments)
+                .with_context(|| format!("key {:?}", record.key))?,
+            _ => push_primary_key_in(&mut writer.buf, batch, schema, fragments)?,
+        }
+        writer.finish()?;
     }
     Ok(())
 }
 
-/// Generate INSERT statements for a list of records.
+/// Generate INSERT statements for a list of records, with up to
+/// `batch_size` rows in each statement's VALUES list.
 fn emit_inserts(
     records: &[ProtoRecord],
     schema: &TableSchema,
-    injected_fields: &[InjectedField],
-    quoted_table: &str,
-    out: &mut String,
+    fragments: &TableFragments,
+    batch_size: usize,
+    writer: &mut StatementWriter,
 ) -> Result<()> {
-    if records.is_empty() {
-        return Ok(());
-    }
-
-    let mut column_parts: Vec<String> =
-        Vec::with_capacity(schema.primary_key_names.len() + schema.subsidiary_value_names.len());
-    for name in schema
-        .primary_key_names
-        .iter()
-        .chain(schema.subsidiary_value_names)
-    {
-        column_parts.push(quote_identifier(name));
-    }
-
-    let injected_columns: Vec<String> = injected_fields.iter().map(|f| f.quoted_column()).collect();
-    column_parts.splice(..0, injected_columns);
-    let columns = column_parts.join(", ");
-
-    // Injected values are static across the entire patch, so compute once.
-    let injected_values: Vec<String> = injected_fields.iter().map(|f| f.quoted_value()).collect();
-
-    for record in records {
-        let mut literals = format_row(&record.key, &record.value, schema)
+    for batch in records.chunks(batch_size.max(1)) {
+        writer.buf.push_str(&fragments.insert_prefix);
+        for (i, record) in batch.iter().enumerate() {
+            if i > 0 {
+                writer.buf.push_str(", ");
+            }
+            writer.buf.push('(');
+            writer.buf.push_str(&fragments.injected_values);
+            push_row(
+                &mut writer.buf,
+                &record.key,
+                &record.value,
+                schema,
+                fragments.has_injected(),
+            )
             .with_context(|| format!("key {:?}", record.key))?;
-        literals.splice(..0, injected_values.iter().cloned());
-        out.push_str(&format!(
-            "INSERT INTO {} ({}) VALUES ({});\n",
-            quoted_table,
-            columns,
-            literals.join(", ")
-        ));
+            writer.buf.push(')');
+        }
+        writer.finish()?;
     }
-
     Ok(())
 }
 
-/// Format a single UPDATE statement.
-fn format_update(
+/// Append a single UPDATE statement to `buf`.
+fn push_update(
+    buf: &mut String,
     update: &ProtoUpdate,
-    subsidiary_names: &[String],
     schema: &TableSchema,
-    injected_fields: &[InjectedField],
-    quoted_table: &str,
-) -> Result<String> {
+    fragments: &TableFragments,
+) -> Result<()> {
     // Sparse updates list changed column indices explicitly; full
     // updates (empty changed_indices) include all subsidiary columns.
-    let indices: Vec<u32> = if update.changed_indices.is_empty() {
-        (0..subsidiary_names.len() as u32).collect()
+    let subsidiary_names = schema.subsidiary_value_names;
+    let expected = if update.changed_indices.is_empty() {
+        subsidiary_names.len()
     } else {
-        update.changed_indices.clone()
+        update.changed_indices.len()
     };
 
-    if indices.len() != update.new_value.len() {
+    if expected != update.new_value.len() {
         bail!(
             "update new_value count mismatch: got {} values, expected {}",
             update.new_value.len(),
-            indices.len()
+            expected
         );
     }
+    if expected == 0 {
+        bail!("update has no SET assignments — would emit an empty SET clause");
+    }
 
-    let mut set_parts = Vec::new();
-    for (&index, proto_value) in indices.iter().zip(update.new_value.iter()) {
-        let name = subsidiary_names.get(index as usize).ok_or_else(|| {
+    buf.push_str("UPDATE ");
+    buf.push_str(&fragments.quoted_table);
+    buf.push_str(" SET ");
+    for (position, proto_value) in update.new_value.iter().enumerate() {
+        let index = match update.changed_indices.get(position) {
+            Some(&index) => index as usize,
+            None => position,
+        };
+        let name = subsidiary_names.get(index).ok_or_else(|| {
             anyhow!(
                 "changed_indices entry {} is out of range (table has {} subsidiary columns)",
                 index,
                 subsidiary_names.len()
             )
         })?;
-        let value = Cell::try_from(proto_value).with_context(|| format!("field '{}'", name))?;
-        check_value_matches_field(&value, schema.field_config(name)?)?;
-        set_parts.push(format!(
-            "{} = {}",
-            quote_identifier(name),
-            quote_literal(&value)
-        ));
-    }
-
-    if set_parts.is_empty() {
-        bail!("update has no SET assignments — would emit an empty SET clause");
+        if position > 0 {
+            buf.push_str(", ");
+        }
+        push_assignment(buf, name, field_literal(proto_value, name, schema)?);
     }
 
-    let where_clause = primary_key_where_clause(&update.key, schema, injected_fields)?;
-
-    Ok(format!(
-        "UPDATE {} SET {} WHERE {};\n",
-        quoted_table,
-        set_parts.join(", "),
-        where_clause
-    ))
+    buf.push_str(" WHERE ");
+    push_primary_key_where(buf, &update.key, schema, fragments)
 }
 
 /// Generate UPDATE statements for a list of updates.
 fn emit_updates(
     updates: &[ProtoUpdate],
     schema: &TableSchema,
-    injected_fields: &[InjectedField],
-    quoted_table: &str,
-    out: &mut String,
+    fragments: &TableFragments,
+    writer: &mut StatementWriter,
 ) -> Result<()> {
     for update in updates {
-        let stmt = format_update(
-            update,
-            schema.subsidiary_value_names,
-            schema,
-            injected_fields,
-            quoted_table,
-        )
-        .with_context(|| format!("key {:?}", update.key))?;
-        out.push_str(&stmt);
+        push_update(&mut writer.buf, update, schema, fragments)
+            .with_context(|| format!("key {:?}", update.key))?;
+        writer.finish()?;
     }
-
     Ok(())
 }
 
-/// Build a WHERE clause from primary key values and injected fields.
-fn primary_key_where_clause(
+/// Append a WHERE condition built from primary key values and injected
+/// fields to `buf`.
+fn push_primary_key_where(
+    buf: &mut String,
     key: &[ProtoCell],
     schema: &TableSchema,
+    fragments: &TableFragments,
+) -> Result<()> {
+    check_primary_key_len(key, schema)?;
+
+    for (i, (proto_value, name)) in key.iter().zip(schema.primary_key_names).enumerate() {
+        if i > 0 {
+            buf.push_str(" AND ");
+        }
+        push_assignment(buf, name, field_literal(proto_value, name, schema)?);
+    }
+    if fragments.has_injected() {
+        if !key.is_empty() {
+            buf.push_str(" AND ");
+        }
+        buf.push_str(&fragments.injected_where);
+    }
+    Ok(())
+}
+
+/// Append a WHERE condition matching the primary keys of all `records`
+/// (`"id" IN (...)`, or a row-value `("a", "b") IN ((...), ...)` for
+/// composite keys), scoped by the injected fields, to `buf`.
+fn push_primary_key_in(
+    buf: &mut String,
+    records: &[ProtoRecord],
+    schema: &TableSchema,
+    fragments: &TableFragments,
+) -> Result<()> {
+    let composite = schema.primary_key_names.len() > 1;
+    if composite {
+        buf.push('(');
+    }
+    for (i, name) in schema.primary_key_names.iter().enumerate() {
+        if i > 0 {
+            buf.push_str(", ");
+        }
+        push_identifier(buf, name);
+    }
+    if composite {
+        buf.push(')');
+    }
+
+    buf.push_str(" IN (");
+    for (i, record) in records.iter().enumerate() {
+        if i > 0 {
+            buf.push_str(", ");
+        }
+        if composite {
+            buf.push('(');
+        }
+        check_primary_key_len(&record.key, schema)
+            .and_then(|()| push_literals(buf, &record.key, schema.primary_key_names, schema, false))
+            .with_context(|| format!("key {:?}", record.key))?;
+        if composite {
+            buf.push(')');
+        }
+    }
+    buf.push(')');
+
+    if fragments.has_injected() {
+        buf.push_str(" AND ");
+        buf.push_str(&fragments.injected_where);
+    }
+    Ok(())
+}
+
+/// The SQL table the patch entry `table_name` is written to: the table a
+/// partition belongs to, or the table itself.
+fn target_table<'a>(config: &'a Config, table_name: &'a str) -> &'a str {
+    config
+        .table_of(table_name)
+        .map_or(table_name, |(name, _)| name)
+}
+
+/// The rows to clear before loading the state of `table_name`: `None` to
+/// clear the whole table, or the replaced keys of a partition. A partition's
+/// state without replaced keys is rejected, since clearing the table would
+/// drop the rows of its other partitions.
+fn replaced_rows<'p>(
+    config: &Config,
+    table_name: &str,
+    replaced_keys: Option<&'p ProtoKeys>,
+) -> Result<Option<&'p [ProtoRecord]>> {
+    match replaced_keys {
+        Some(keys) => Ok(Some(&keys.records)),
+        None if target_table(config, table_name) != table_name => {
+            bail!("state of partition '{}' has no replaced keys", table_name)
+        }
+        None => Ok(None),
+    }
+}
+
+/// Generate SQL statements for a delta (DELETE/INSERT/UPDATE).
+fn delta_to_sql(
+    config: &Config,
+    table_name: &str,
+    delta: &ProtoDelta,
     injected_fields: &[InjectedField],
+    writer: &mut StatementWriter,
+) -> Result<()> {
+    let schema = TableSchema::resolve(
+        &delta.primary_key_names,
+        &delta.subsidiary_value_names,
+        config,
+        table_name,
+    )?;
+    schema.reject_injected_collisions(injected_fields, table_name)?;
+    let fragments = TableFragments::new(target_table(config, table_name), &schema, injected_fields);
+
+    let batch_size = config.sql.batch_size;
+    emit_deletes(&delta.deletes, &schema, &fragments, batch_size, writer)
+        .with_context(|| format!("table '{table_name}'"))?;
+    emit_inserts(&delta.inserts, &schema, &fragments, batch_size, writer)
+        .with_context(|| format!("table '{table_name}'"))?;
+    emit_updates(&delta.updates, &schema, &fragments, writer)
+        .with_context(|| format!("table '{table_name}'"))?;
+
+    Ok(())
+}
+
+/// Generate SQL statements for a single table's full state (TRUNCATE/DELETE +
+/// INSERT). The state of a partition deletes its `replaced_keys` instead of
+/// clearing the table. Without `clear`, only the INSERTs are generated: the
+/// rows were cleared with an earlier chunk of a framed patch.
+fn state_table_to_sql(
+    config: &Config,
+    table_name: &str,
+    table: &ProtoTable,
+    replaced_keys: Option<&ProtoKeys>,
+    clear: bool,
+    injected_fields: &[InjectedField],
+    writer: &mut StatementWriter,
+) -> Result<()> {
+    let schema = TableSchema::resolve(
+        &table.primary_key_names,
+        &table.subsidiary_value_names,
+        config,
+        table_name,
+    )?;
+    schema.reject_injected_collisions(injected_fields, table_name)?;
+    let fragments = TableFragments::new(target_table(config, table_name), &schema, injected_fields);
+
+    if clear {
+        match replaced_rows(config, table_name, replaced_keys)? {
+            Some(records) => {
+                emit_deletes(records, &schema, &fragments, config.sql.batch_size, writer)
+                    .with_context(|| format!("table '{table_name}'"))?
+            }
+            None => {
+                if fragments.has_injected() {
+                    writer.buf.push_str("DELETE FROM ");
+                    writer.buf.push_str(&fragments.quoted_table);
+                    writer.buf.push_str(" WHERE ");
+                    writer.buf.push_str(&fragments.injected_where);
+                } else {
+                    writer.buf.push_str("TRUNCATE ");
+                    writer.buf.push_str(&fragments.quoted_table);
+                }
+                writer.finish()?;
+            }
+        }
+    }
+
+    emit_inserts(
+        &table.records,
+        &schema,
+        &fragments,
+        config.sql.batch_size,
+        writer,
+    )
+    .with_context(|| format!("table '{table_name}'"))?;
+
+    Ok(())
+}
+
+/// One table's payload in a patch: the unit SQL generation is split into.
+#[derive(Clone, Copy)]
+enum TablePayload<'p> {
+    Delta(&'p ProtoDelta),
+    /// A full state, with the replaced keys when it is a partition's.
+    State(&'p ProtoTable, Option<&'p ProtoKeys>),
+    /// Further records of a full state whose rows an earlier chunk of a
+    /// framed patch cleared.
+    MoreState(&'p ProtoTable),
+}
+
+/// The tables of `patch` in emission order: deltas, then full states, each
+/// sorted by table name so the output does not depend on map order.
+fn table_payloads(patch: &ProtoPatch) -> Vec<(&str, TablePayload<'_>)> {
+    let mut deltas: Vec<_> = patch
+        .deltas
+        .iter()
+        .map(|(name, delta)| (name.as_str(), TablePayload::Delta(delta)))
+        .collect();
+    deltas.sort_unstable_by_key(|(name, _)| *name);
+    let mut states: Vec<_> = patch
+        .states
+        .iter()
+        .map(|(name, table)| {
+            let replaced_keys = patch.replaced_keys.get(name);
+            (name.as_str(), TablePayload::State(table, replaced_keys))
+        })
+        .collect();
+    states.sort_unstable_by_key(|(name, _)| *name);
+    deltas.extend(states);
+    deltas
+}
+
+/// Generate SQL statements for one table of a patch.
+fn table_to_sql(
+    config: &Config,
+    table_name: &str,
+    payload: TablePayload,
+    injected_fields: &[InjectedField],
+    writer: &mut StatementWriter,
+) -> Result<()> {
+    match payload {
+        TablePayload::Delta(delta) => {
+            delta_to_sql(config, table_name, delta, injected_fields, writer)
+        }
+        TablePayload::State(table, replaced_keys) => state_table_to_sql(
+            config,
+            table_name,
+            table,
+            replaced_keys,
+            true,
+            injected_fields,
+            writer,
+        ),
+        TablePayload::MoreState(table) => state_table_to_sql(
+            config,
+            table_name,
+            table,
+            None,
+            false,
+            injected_fields,
+            writer,
+        ),
+    }
+}
+
+/// Walk the chunks of a framed patch, passing each table payload to
+/// `convert` as it arrives, together with the patch's injected fields. A full
+/// state clears its rows with its first chunk only. A partition's replaced
+/// keys carry no column names, so they are held, keys only, until its first
+/// state chunk names the key columns.
+///
+/// Returns the head of the patch.
+fn convert_framed_patch(
+    chunks: impl IntoIterator<Item = Result<PatchChunk>>,
+    mut convert: impl FnMut(&str, TablePayload<'_>, &[InjectedField]) -> Result<()>,
 ) -> Result<String> {
-    if key.len() != schema.primary_key_names.len() {
-        bail!(
-            "primary key field count mismatch: got {} values, expected {}",
-            key.len(),
-            schema.primary_key_names.len()
+    let mut head = None;
+    let mut injected_fields = Vec::new();
+    let mut replaced_keys: HashMap<String, ProtoKeys> = HashMap::new();
+    let mut states = HashSet::new();
+    for chunk in chunks {
+        match chunk? {
+            PatchChunk::Header(header) => {
+                if head.is_some() {
+                    bail!("framed patch has more than one header");
+                }
+                for proto_field in &header.injected_fields {
+                    injected_fields.push(InjectedField::try_from(proto_field)?);
+                }
+                head = Some(header.head);
+            }
+            _ if head.is_none() => bail!("framed patch does not start with a header"),
+            PatchChunk::Delta(table, delta) => {
+                convert(&table, TablePayload::Delta(&delta), &injected_fields)?
+            }
+            PatchChunk::ReplacedKeys(table, keys) => {
+                if states.contains(&table) {
+                    bail!("replaced keys of partition '{}' follow its state", table);
+                }
+                replaced_keys
+                    .entry(table)
+                    .or_default()
+                    .records
+                    .extend(keys.records);
+            }
+            PatchChunk::State(table, state) => {
+                if states.contains(&table) {
+                    convert(&table, TablePayload::MoreState(&state), &injected_fields)?;
+                } else {
+                    let keys = replaced_keys.remove(&table);
+                    let payload = TablePayload::State(&state, keys.as_ref());
+                    convert(&table, payload, &injected_fields)?;
+                    states.insert(table);
+                }
+            }
+        }
+    }
+    head.context("framed patch has no header")
+}
+
+/// A table's statements rendered ahead of emission by a worker thread.
+#[derive(Default)]
+struct RenderedTable {
+    sql: String,
+    /// End offset in `sql` of each statement.
+    ends: Vec<usize>,
+}
+
+/// Render one table's statements into a [`RenderedTable`].
+fn render_table(
+    config: &Config,
+    table_name: &str,
+    payload: TablePayload,
+    injected_fields: &[InjectedField],
+) -> Result<RenderedTable> {
+    let mut rendered = RenderedTable::default();
+    let mut collect = |statement: &str| -> Result<()> {
+        rendered.sql.push_str(statement);
+        rendered.ends.push(rendered.sql.len());
+        Ok(())
+    };
+    let mut writer = StatementWriter {
+        buf: String::new(),
+        sink: &mut collect,
+        statements: 0,
+    };
+    table_to_sql(config, table_name, payload, injected_fields, &mut writer)?;
+    Ok(rendered)
+}
+
+/// Convert a decoded patch to SQL, passing each statement to `sink` as soon
+/// as it is rendered. Every statement ends with `";\n"`, so concatenating
+/// them yields the same text as [`patch_to_sql`]. Statements are rendered
+/// into one reused buffer; the slice handed to `sink` is only valid for the
+/// duration of the call. An error from `sink` aborts the conversion.
+///
+/// Tables are emitted in a fixed order (deltas, then full states, each by
+/// table name), with each table's DELETEs, INSERTs and UPDATEs in turn. With
+/// `threads > 1` and several tables, up to `threads` tables at a time are
+/// rendered and validated in parallel and then emitted in that same order;
+/// the output is identical, but those tables' SQL is buffered in memory.
+///
+/// Returns the number of statements emitted.
+pub fn emit_patch_sql(
+    config: &Config,
+    patch: &ProtoPatch,
+    mut sink: impl FnMut(&str) -> Result<()>,
+) -> Result<usize> {
+    if patch.deltas.is_empty() && patch.states.is_empty() {
+        log::info!("Patch has no payload, nothing to convert");
+        return Ok(0);
+    }
+
+    let mut injected_fields = Vec::new();
+    for proto_field in &patch.injected_fields {
+        injected_fields.push(InjectedField::try_from(proto_field)?);
+    }
+
+    let started = Instant::now();
+    let mut trace = config
+        .stats
+        .trace
+        .then(|| SqlTrace::new("patch-sql", &patch.head));
+    let payloads = table_payloads(patch);
+    let mut writer = StatementWriter {
+        buf: String::new(),
+        sink: &mut sink,
+        statements: 0,
+    };
+
+    if config.threads <= 1 || payloads.len() <= 1 {
+        for (table_name, payload) in payloads {
+            let lap = Instant::now();
+            let before = writer.statements;
+            table_to_sql(config, table_name, payload, &injected_fields, &mut writer)?;
+            if let Some(trace) = &mut trace {
+                trace.add_table(table_name, writer.statements - before, lap.elapsed());
+            }
+        }
+    } else {
+        log::debug!(
+            "Rendering SQL for {} table(s) on {} thread(s)",
+            payloads.len(),
+            config.threads
         );
+        for window in payloads.chunks(config.threads) {
+            let rendered = parallel_map(window.to_vec(), config.threads, |(name, payload)| {
+                let lap = Instant::now();
+                render_table(config, name, payload, &injected_fields)
+                    .map(|table| (name, table, lap.elapsed()))
+            });
+            for table in rendered {
+                let (name, table, elapsed) = table?;
+                if let Some(trace) = &mut trace {
+                    trace.add_table(name, table.ends.len(), elapsed);
+                }
+                let mut start = 0;
+                for &end in &table.ends {
+                    (writer.sink)(&table.sql[start..end])?;
+                    writer.statements += 1;
+                    start = end;
+                }
+            }
+        }
+    }
+
+    if writer.statements == 0 {
+        log::info!("Patch produced no SQL statements");
+    } else {
+        log::info!("Converted patch to {} SQL statement(s)", writer.statements);
+    }
+    if let Some(mut trace) = trace {
+        trace.statements = writer.statements as u64;
+        trace.duration_ms = trace::ms(started.elapsed());
+        trace::record(config, &trace);
+    }
+    Ok(writer.statements)
+}
+
+/// Convert a decoded patch to SQL, streaming the statements to `out` as they
+/// are rendered instead of building the whole text in memory. See
+/// [`emit_patch_sql`]. `out` is not flushed.
+///
+/// Returns the number of statements written.
+pub fn write_patch_sql(config: &Config, patch: &ProtoPatch, out: &mut impl Write) -> Result<usize> {
+    emit_patch_sql(config, patch, |statement| {
+        out.write_all(statement.as_bytes())
+            .context("failed to write SQL statement")
+    })
+}
+
+/// Convert a decoded patch to SQL statements.
+///
+/// The returned SQL is not wrapped in a transaction. Callers that need
+/// atomicity should issue their own `BEGIN` / `COMMIT` (and may interleave
+/// additional statements, e.g. recording the last applied block hash).
+///
+/// Holds the full SQL text in memory; use [`write_patch_sql`] or
+/// [`emit_patch_sql`] for large patches.
+pub fn patch_to_sql(config: &Config, patch: &ProtoPatch) -> Result<Option<String>> {
+    let mut sql = String::new();
+    let statements = emit_patch_sql(config, patch, |statement| {
+        sql.push_str(statement);
+        Ok(())
+    })?;
+    if statements == 0 {
+        return Ok(None);
+    }
+    Ok(Some(sql))
+}
+
+/// Convert a framed patch to SQL one chunk at a time, as [`emit_patch_sql`]
+/// converts a decoded patch, so only the current chunk is held in memory.
+/// `chunks` is typically a [`wire::FramedDecoder`].
+///
+/// Tables and statements come in stream order. [`wire::patch_chunks`]
+/// sorts tables by name and slices each delta as its deletes, then inserts,
+/// then updates, so this is the order of [`emit_patch_sql`]: every DELETE
+/// of a table before any of its INSERTs, and those before its UPDATEs.
+/// Batched statements do not span chunks, so with `[sql] batch-size` above
+/// one, a table split across chunks may group its rows differently. The
+/// chunks are rendered on the calling thread whatever `threads` is.
+///
+/// Returns the number of statements emitted.
+pub fn emit_framed_patch_sql(
+    config: &Config,
+    chunks: impl IntoIterator<Item = Result<PatchChunk>>,
+    mut sink: impl FnMut(&str) -> Result<()>,
+) -> Result<usize> {
+    let started = Instant::now();
+    let mut trace = config.stats.trace.then(|| SqlTrace::new("patch-sql", ""));
+    let mut writer = StatementWriter {
+        buf: String::new(),
+        sink: &mut sink,
+        statements: 0,
+    };
+    let head = convert_framed_patch(chunks, |table_name, payload, injected_fields| {
+        let lap = Instant::now();
+        let before = writer.statements;
+        table_to_sql(config, table_name, payload, injected_fields, &mut writer)?;
+        if let Some(trace) = &mut trace {
+            trace.add_table(table_name, writer.statements - before, lap.elapsed());
+        }
+        Ok(())
+    })?;
+
+    if writer.statements == 0 {
+        log::info!("Patch produced no SQL statements");
+    } else {
+        log::info!("Converted patch to {} SQL statement(s)", writer.statements);
+    }
+    if let Some(mut trace) = trace {
+        trace.head = head;
+        trace.statements = writer.statements as u64;
+        trace.duration_ms = trace::ms(started.elapsed());
+        trace::record(config, &trace);
+    }
+    Ok(writer.statements)
+}
+
+/// Decode the encoded patch `data` as [`wire::decode_patch_with`] does and
+/// convert it to SQL. A framed patch is decompressed, decoded and converted
+/// chunk by chunk with [`emit_framed_patch_sql`], so memory stays bounded
+/// however large it is; an unframed one is decoded whole and converted with
+/// [`emit_patch_sql`].
+///
+/// Returns the number of statements emitted.
+pub fn emit_encoded_patch_sql(
+    config: &Config,
+    data: &[u8],
+    sink: impl FnMut(&str) -> Result<()>,
+) -> Result<usize> {
+    match wire::open_patch_with(config, data).context("failed to decode patch")? {
+        PatchReader::Framed(chunks) => emit_framed_patch_sql(config, chunks, sink),
+        PatchReader::Unframed(patch) => emit_patch_sql(config, &patch, sink),
+    }
+}
+
+/// The kind of change a [`Statement`] applies.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Operation {
+    /// Remove a table's rows before a full-state reload: `TRUNCATE`, or a
+    /// `DELETE` scoped by the injected fields.
+    Clear,
+    Delete,
+    Insert,
+    Update,
+}
+
+impl fmt::Display for Operation {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Operation::Clear => write!(f, "CLEAR"),
+            Operation::Delete => write!(f, "DELETE"),
+            Operation::Insert => write!(f, "INSERT"),
+            Operation::Update => write!(f, "UPDATE"),
+        }
+    }
+}
+
+/// One row operation of a patch as a parameterized statement. `sql` uses
+/// `$1`..`$n` placeholders, numbered in the order of `columns` and `params`,
+/// and has no trailing semicolon. Every operation of the same kind on the
+/// same table shares one `sql` text (updates: one per set of changed
+/// columns), so callers can prepare each distinct text once and bind the
+/// parameter rows to it.
+#[derive(Debug)]
+pub struct Statement<'a> {
+    pub operation: Operation,
+    pub table: &'a str,
+    pub sql: &'a str,
+    /// The column each parameter is bound to.
+    pub columns: &'a [&'a str],
+    pub params: &'a [CellRef<'a>],
+}
+
+impl fmt::Display for Statement<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{} '{}': {}", self.operation, self.table, self.sql)?;
+        for (i, (column, param)) in self.columns.iter().zip(self.params).enumerate() {
+            write!(f, "\n  ${} {} = {}", i + 1, column, param)?;
+        }
+        Ok(())
+    }
+}
+
+/// Append a `$n` placeholder to `buf`.
+fn push_placeholder(buf: &mut String, n: usize) {
+    // Formatting into a String cannot fail.
+    let _ = write!(buf, "${}", n);
+}
+
+/// Append `"name" = $n` conditions for `names`, numbered from `first` and
+/// joined by `separator`, to `buf`. Returns the next placeholder number.
+fn push_placeholder_assignments<'n>(
+    buf: &mut String,
+    names: impl IntoIterator<Item = &'n str>,
+    separator: &str,
+    first: usize,
+) -> usize {
+    let mut n = first;
+    for name in names {
+        if n > first {
+            buf.push_str(separator);
+        }
+        push_identifier(buf, name);
+        buf.push_str(" = ");
+        push_placeholder(buf, n);
+        n += 1;
+    }
+    n
+}
+
+/// Reused buffers for the parameterized statement being bound, and the sink
+/// completed statements are passed to.
+struct StatementBinder<'p, 's> {
+    sql: String,
+    columns: Vec<&'p str>,
+    params: Vec<CellRef<'p>>,
+    sink: &'s mut dyn FnMut(&Statement) -> Result<()>,
+    statements: usize,
+}
+
+impl<'p> StatementBinder<'p, '_> {
+    fn bind(&mut self, column: &'p str, value: CellRef<'p>) {
+        self.columns.push(column);
+        self.params.push(value);
+    }
+
+    /// Bind the cells of `key` to the primary-key columns.
+    fn bind_key(&mut self, key: &'p [ProtoCell], schema: &TableSchema<'p>) -> Result<()> {
+        check_primary_key_len(key, schema)?;
+        for (proto_value, name) in key.iter().zip(schema.primary_key_names) {
+            self.bind(name, field_literal(proto_value, name, schema)?);
+        }
+        Ok(())
+    }
+
+    fn bind_injected(&mut self, injected_fields: &'p [InjectedField]) {
+        for injected in injected_fields {
+            self.bind(&injected.name, CellRef::from(&injected.value));
+        }
+    }
+
+    /// Pass the bound parameters with `sql` to the sink and reset them for
+    /// the next statement.
+    fn finish(&mut self, operation: Operation, table: &str, sql: &str) -> Result<()> {
+        let statement = Statement {
+            operation,
+            table,
+            sql,
+            columns: &self.columns,
+            params: &self.params,
+        };
+        log::trace!("{}", statement);
+        (self.sink)(&statement)?;
+        self.columns.clear();
+        self.params.clear();
+        self.statements += 1;
+        Ok(())
+    }
+
+    /// Like [`finish`](Self::finish), with the SQL rendered into the
+    /// binder's own buffer.
+    fn finish_own_sql(&mut self, operation: Operation, table: &str) -> Result<()> {
+        let sql = std::mem::take(&mut self.sql);
+        let result = self.finish(operation, table, &sql);
+        self.sql = sql;
+        self.sql.clear();
+        result
+    }
+}
+
+/// A table's resolved schema together with the statement texts shared by
+/// all of its deletes and inserts.
+struct BoundTable<'p> {
+    name: &'p str,
+    schema: TableSchema<'p>,
+    injected_fields: &'p [InjectedField],
+    quoted_table: String,
+    delete_sql: String,
+    insert_sql: String,
+}
+
+impl<'p> BoundTable<'p> {
+    fn resolve(
+        config: &'p Config,
+        name: &'p str,
+        primary_key_names: &'p [String],
+        subsidiary_value_names: &'p [String],
+        injected_fields: &'p [InjectedField],
+    ) -> Result<Self> {
+        let schema = TableSchema::resolve(primary_key_names, subsidiary_value_names, config, name)?;
+        schema.reject_injected_collisions(injected_fields, name)?;
+        let name = target_table(config, name);
+        let quoted_table = quote_identifier(name);
+        let key_and_injected = || {
+            primary_key_names
+                .iter()
+                .map(String::as_str)
+                .chain(injected_fields.iter().map(|field| field.name.as_str()))
+        };
+
+        let mut delete_sql = format!("DELETE FROM {} WHERE ", quoted_table);
+        push_placeholder_assignments(&mut delete_sql, key_and_injected(), " AND ", 1);
+
+        let mut insert_sql = format!("INSERT INTO {} (", quoted_table);
+        let columns = injected_fields
+            .iter()
+            .map(|field| field.name.as_str())
+            .chain(primary_key_names.iter().map(String::as_str))
+            .chain(subsidiary_value_names.iter().map(String::as_str));
+        let mut count = 0;
+        for (i, column) in columns.enumerate() {
+            if i > 0 {
+                insert_sql.push_str(", ");
+            }
+            push_identifier(&mut insert_sql, column);
+            count += 1;
+        }
+        insert_sql.push_str(") VALUES (");
+        for n in 1..=count {
+            if n > 1 {
+                insert_sql.push_str(", ");
+            }
+            push_placeholder(&mut insert_sql, n);
+        }
+        insert_sql.push(')');
+
+        Ok(BoundTable {
+            name,
+            schema,
+            injected_fields,
+            quoted_table,
+            delete_sql,
+            insert_sql,
+        })
+    }
+
+    fn bind_deletes(
+        &self,
+        records: &'p [ProtoRecord],
+        binder: &mut StatementBinder<'p, '_>,
+    ) -> Result<()> {
+        for record in records {
+            binder
+                .bind_key(&record.key, &self.schema)
+                .with_context(|| format!("key {:?}", record.key))?;
+            binder.bind_injected(self.injected_fields);
+            binder.finish(Operation::Delete, self.name, &self.delete_sql)?;
+        }
+        Ok(())
     }
 
-    let mut where_parts = Vec::new();
-    for (proto_value, name) in key.iter().zip(schema.primary_key_names) {
-        let value = Cell::try_from(proto_value).with_context(|| format!("field '{}'", name))?;
-        check_value_matches_field(&value, schema.field_config(name)?)?;
-        where_parts.push(format!(
-            "{} = {}",
-            quote_identifier(name),
-            quote_literal(&value)
-        ));
-    }
-    for injected in injected_fields {
-        where_parts.push(injected.where_clause());
+    fn bind_inserts(
+        &self,
+        records: &'p [ProtoRecord],
+        binder: &mut StatementBinder<'p, '_>,
+    ) -> Result<()> {
+        let schema = &self.schema;
+        for record in records {
+            binder.bind_injected(self.injected_fields);
+            binder
+                .bind_key(&record.key, schema)
+                .and_then(|()| {
+                    if record.value.len() != schema.subsidiary_value_names.len() {
+                        bail!(
+                            "subsidiary field count mismatch: got {} values, expected {}",
+                            record.value.len(),
+                            schema.subsidiary_value_names.len()
+                        );
+                    }
+                    for (proto_value, name) in
+                        record.value.iter().zip(schema.subsidiary_value_names)
+                    {
+                        binder.bind(name, field_literal(proto_value, name, schema)?);
+                    }
+                    Ok(())
+                })
+                .with_context(|| format!("key {:?}", record.key))?;
+            binder.finish(Operation::Insert, self.name, &self.insert_sql)?;
+        }
+        Ok(())
     }
 
-    Ok(where_parts.join(" AND "))
-}
+    /// Bind one update: the changed columns, then the key and injected
+    /// fields for the WHERE clause.
+    fn bind_update(
+        &self,
+        update: &'p ProtoUpdate,
+        binder: &mut StatementBinder<'p, '_>,
+    ) -> Result<()> {
+        let schema = &self.schema;
+        let subsidiary_names = schema.subsidiary_value_names;
+        let expected = if update.changed_indices.is_empty() {
+            subsidiary_names.len()
+        } else {
+            update.changed_indices.len()
+        };
+        if expected != update.new_value.len() {
+            bail!(
+                "update new_value count mismatch: got {} values, expected {}",
+                update.new_value.len(),
+                expected
+            );
+        }
+        if expected == 0 {
+            bail!("update has no SET assignments — would emit an empty SET clause");
+        }
 
-/// Generate SQL statements for a delta (DELETE/INSERT/UPDATE).
-fn delta_to_sql(
-    config: &Config,
-    table_name: &str,
-    delta: &ProtoDelta,
-    injected_fields: &[InjectedField],
-    out: &mut String,
-) -> Result<()> {
-    let schema = TableSchema::resolve(
-        &delta.primary_key_names,
-        &delta.subsidiary_value_names,
-        config,
-        table_name,
-    )?;
-    schema.reject_injected_collisions(injected_fields, table_name)?;
-    let table = quote_identifier(table_name);
+        for (position, proto_value) in update.new_value.iter().enumerate() {
+            let index = match update.changed_indices.get(position) {
+                Some(&index) => index as usize,
+                None => position,
+            };
+            let name = subsidiary_names.get(index).ok_or_else(|| {
+                anyhow!(
+                    "changed_indices entry {} is out of range (table has {} subsidiary columns)",
+                    index,
+                    subsidiary_names.len()
+                )
+            })?;
+            binder.bind(name, field_literal(proto_value, name, schema)?);
+        }
+        let set_count = binder.columns.len();
+        binder.bind_key(&update.key, schema)?;
+        binder.bind_injected(self.injected_fields);
+
+        binder.sql.push_str("UPDATE ");
+        binder.sql.push_str(&self.quoted_table);
+        binder.sql.push_str(" SET ");
+        let next = push_placeholder_assignments(
+            &mut binder.sql,
+            binder.columns[..set_count].iter().copied(),
+            ", ",
+            1,
+        );
+        binder.sql.push_str(" WHERE ");
+        push_placeholder_assignments(
+            &mut binder.sql,
+            binder.columns[set_count..].iter().copied(),
+            " AND ",
+            next,
+        );
+        Ok(())
+    }
 
-    emit_deletes(&delta.deletes, &schema, injected_fields, &table, out)
-        .with_context(|| format!("table '{table_name}'"))?;
-    emit_inserts(&delta.inserts, &schema, injected_fields, &table, out)
-        .with_context(|| format!("table '{table_name}'"))?;
-    emit_updates(&delta.updates, &schema, injected_fields, &table, out)
-        .with_context(|| format!("table '{table_name}'"))?;
+    fn bind_updates(
+        &self,
+        updates: &'p [ProtoUpdate],
+        binder: &mut StatementBinder<'p, '_>,
+    ) -> Result<()> {
+        for update in updates {
+            self.bind_update(update, binder)
+                .with_context(|| format!("key {:?}", update.key))?;
+            binder.finish_own_sql(Operation::Update, self.name)?;
+        }
+        Ok(())
+    }
 
-    Ok(())
+    /// Bind the statement clearing the table before a full-state reload.
+    fn bind_clear(&self, binder: &mut StatementBinder<'p, '_>) -> Result<()> {
+        if self.injected_fields.is_empty() {
+            binder.sql.push_str("TRUNCATE ");
+            binder.sql.push_str(&self.quoted_table);
+        } else {
+            binder.sql.push_str("DELETE FROM ");
+            binder.sql.push_str(&self.quoted_table);
+            binder.sql.push_str(" WHERE ");
+            let names = self.injected_fields.iter().map(|field| field.name.as_str());
+            push_placeholder_assignments(&mut binder.sql, names, " AND ", 1);
+            binder.bind_injected(self.injected_fields);
+        }
+        binder.finish_own_sql(Operation::Clear, self.name)
+    }
 }
 
-/// Generate SQL statements for a single table's full state (TRUNCATE/DELETE + INSERT).
-fn state_table_to_sql(
-    config: &Config,
-    table_name: &str,
-    table: &ProtoTable,
-    injected_fields: &[InjectedField],
-    out: &mut String,
+/// Bind the parameterized statements for one table of a patch.
+fn bind_table<'p>(
+    config: &'p Config,
+    table_name: &'p str,
+    payload: TablePayload<'p>,
+    injected_fields: &'p [InjectedField],
+    binder: &mut StatementBinder<'p, '_>,
 ) -> Result<()> {
-    let schema = TableSchema::resolve(
-        &table.primary_key_names,
-        &table.subsidiary_value_names,
-        config,
-        table_name,
-    )?;
-    schema.reject_injected_collisions(injected_fields, table_name)?;
-    let quoted_table = quote_identifier(table_name);
-
-    if injected_fields.is_empty() {
-        out.push_str(&format!("TRUNCATE {};\n", quoted_table));
-    } else {
-        let mut conditions = Vec::new();
-        for injected in injected_fields {
-            conditions.push(injected.where_clause());
+    match payload {
+        TablePayload::Delta(delta) => {
+            let table = BoundTable::resolve(
+                config,
+                table_name,
+                &delta.primary_key_names,
+                &delta.subsidiary_value_names,
+                injected_fields,
+            )?;
+            table
+                .bind_deletes(&delta.deletes, binder)
+                .and_then(|()| table.bind_inserts(&delta.inserts, binder))
+                .and_then(|()| table.bind_updates(&delta.updates, binder))
+                .with_context(|| format!("table '{table_name}'"))
+        }
+        TablePayload::State(state, replaced_keys) => {
+            let table = BoundTable::resolve(
+                config,
+                table_name,
+                &state.primary_key_names,
+                &state.subsidiary_value_names,
+                injected_fields,
+            )?;
+            let cleared = match replaced_rows(config, table_name, replaced_keys)? {
+                Some(records) => table.bind_deletes(records, binder),
+                None => table.bind_clear(binder),
+            };
+            cleared
+                .and_then(|()| table.bind_inserts(&state.records, binder))
+                .with_context(|| format!("table '{table_name}'"))
+        }
+        TablePayload::MoreState(state) => {
+            let table = BoundTable::resolve(
+                config,
+                table_name,
+                &state.primary_key_names,
+                &state.subsidiary_value_names,
+                injected_fields,
+            )?;
+            table
+                .bind_inserts(&state.records, binder)
+                .with_context(|| format!("table '{table_name}'"))
         }
-        out.push_str(&format!(
-            "DELETE FROM {} WHERE {};\n",
-            quoted_table,
-            conditions.join(" AND ")
-        ));
     }
-
-    emit_inserts(&table.records, &schema, injected_fields, &quoted_table, out)
-        .with_context(|| format!("table '{table_name}'"))?;
-
-    Ok(())
 }
 
-/// Convert a decoded patch to SQL statements.
+/// Convert a decoded patch to parameterized statements, passing each row
+/// operation to `sink` as a [`Statement`] instead of rendering values into
+/// SQL text. Operations come in the same order as from [`emit_patch_sql`],
+/// one per row; `[sql] batch-size` does not apply, since callers bind rows
+/// to prepared statements themselves. The statement handed to `sink` is
+/// only valid for the duration of the call, and an error from `sink` aborts
+/// the conversion.
 ///
-/// The returned SQL is not wrapped in a transaction. Callers that need
-/// atomicity should issue their own `BEGIN` / `COMMIT` (and may interleave
-/// additional statements, e.g. recording the last applied block hash).
-pub fn patch_to_sql(config: &Config, patch: &ProtoPatch) -> Result<Option<String>> {
+/// Returns the number of statements emitted.
+pub fn emit_patch_statements(
+    config: &Config,
+    patch: &ProtoPatch,
+    mut sink: impl FnMut(&Statement) -> Result<()>,
+) -> Result<usize> {
     if patch.deltas.is_empty() && patch.states.is_empty() {
         log::info!("Patch has no payload, nothing to convert");
-        return Ok(None);
+        return Ok(0);
     }
 
     let mut injected_fields = Vec::new();
@@ -523,23 +1542,102 @@ pub fn patch_to_sql(config: &Config, patch: &ProtoPatch) -> Result<Option<String
         injected_fields.push(InjectedField::try_from(proto_field)?);
     }
 
-    let mut sql = String::new();
+    let mut binder = StatementBinder {
+        sql: String::new(),
+        columns: Vec::new(),
+        params: Vec::new(),
+        sink: &mut sink,
+        statements: 0,
+    };
 
-    for (table_name, delta) in &patch.deltas {
-        delta_to_sql(config, table_name, delta, &injected_fields, &mut sql)?;
+    let started = Instant::now();
+    let mut trace = config
+        .stats
+        .trace
+        .then(|| SqlTrace::new("patch-statements", &patch.head));
+    for (table_name, payload) in table_payloads(patch) {
+        let lap = Instant::now();
+        let before = binder.statements;
+        bind_table(config, table_name, payload, &injected_fields, &mut binder)?;
+        if let Some(trace) = &mut trace {
+            trace.add_table(table_name, binder.statements - before, lap.elapsed());
+        }
     }
 
-    for (table_name, table) in &patch.states {
-        state_table_to_sql(config, table_name, table, &injected_fields, &mut sql)?;
+    log::info!(
+        "Converted patch to {} parameterized statement(s)",
+        binder.statements
+    );
+    if let Some(mut trace) = trace {
+        trace.statements = binder.statements as u64;
+        trace.duration_ms = trace::ms(started.elapsed());
+        trace::record(config, &trace);
     }
+    Ok(binder.statements)
+}
 
-    if sql.is_empty() {
-        log::info!("Patch produced no SQL statements");
-        return Ok(None);
+/// Convert a framed patch to parameterized statements one chunk at a time,
+/// as [`emit_patch_statements`] converts a decoded patch. Statements come
+/// in the order described for [`emit_framed_patch_sql`].
+///
+/// Returns the number of statements emitted.
+pub fn emit_framed_patch_statements(
+    config: &Config,
+    chunks: impl IntoIterator<Item = Result<PatchChunk>>,
+    mut sink: impl FnMut(&Statement) -> Result<()>,
+) -> Result<usize> {
+    let started = Instant::now();
+    let mut trace = config
+        .stats
+        .trace
+        .then(|| SqlTrace::new("patch-statements", ""));
+    let mut statements = 0;
+    let head = convert_framed_patch(chunks, |table_name, payload, injected_fields| {
+        let lap = Instant::now();
+        // The bound parameters borrow from the chunk, which is dropped once
+        // converted, so every chunk gets its own binder.
+        let mut binder = StatementBinder {
+            sql: String::new(),
+            columns: Vec::new(),
+            params: Vec::new(),
+            sink: &mut sink,
+            statements: 0,
+        };
+        bind_table(config, table_name, payload, injected_fields, &mut binder)?;
+        statements += binder.statements;
+        if let Some(trace) = &mut trace {
+            trace.add_table(table_name, binder.statements, lap.elapsed());
+        }
+        Ok(())
+    })?;
+
+    log::info!(
+        "Converted patch to {} parameterized statement(s)",
+        statements
+    );
+    if let Some(mut trace) = trace {
+        trace.head = head;
+        trace.statements = statements as u64;
+        trace.duration_ms = trace::ms(started.elapsed());
+        trace::record(config, &trace);
     }
+    Ok(statements)
+}
 
-    log::info!("Converted patch to SQL:\n{}", sql);
-    Ok(Some(sql))
+/// Decode the encoded patch `data` and convert it to parameterized
+/// statements, chunk by chunk when it is framed. See
+/// [`emit_encoded_patch_sql`].
+///
+/// Returns the number of statements emitted.
+pub fn emit_encoded_patch_statements(
+    config: &Config,
+    data: &[u8],
+    sink: impl FnMut(&Statement) -> Result<()>,
+) -> Result<usize> {
+    match wire::open_patch_with(config, data).context("failed to decode patch")? {
+        PatchReader::Framed(chunks) => emit_framed_patch_statements(config, chunks, sink),
+        PatchReader::Unframed(patch) => emit_patch_statements(config, &patch, sink),
+    }
 }
 
 #[cfg(test)]
@@ -561,6 +1659,8 @@ mod tests {
                 })
                 .collect(),
             csv: None,
+            thread_safe: false,
+            partitions: 1,
         }
     }
 
@@ -575,6 +1675,7 @@ mod tests {
             num_blocks: 1,
             deltas,
             states: HashMap::new(),
+            replaced_keys: HashMap::new(),
         }
     }
 
@@ -787,18 +1888,20 @@ mod tests {
 
     #[test]
     fn test_check_value_matches_field_accepts_correct_types() {
-        check_value_matches_field(&Cell::Text("hello".into()), &make_field("name", Kind::Text))
+        check_value_matches_field(&CellRef::Text("hello"), &make_field("name", Kind::Text))
             .unwrap();
-        check_value_matches_field(&Cell::Number(2.5), &make_field("price", Kind::Number)).unwrap();
-        check_value_matches_field(&Cell::Boolean(true), &make_field("flag", Kind::Boolean))
+        check_value_matches_field(&CellRef::Number(2.5), &make_field("price", Kind::Number))
+            .unwrap();
+        check_value_matches_field(&CellRef::Boolean(true), &make_field("flag", Kind::Boolean))
             .unwrap();
     }
 
     #[test]
     fn test_check_value_matches_field_rejects_type_drift() {
         // Wire sends a Number into a column the hub config declared TEXT.
-        let err = check_value_matches_field(&Cell::Number(42.0), &make_field("note", Kind::Text))
-            .unwrap_err();
+        let err =
+            check_value_matches_field(&CellRef::Number(42.0), &make_field("note", Kind::Text))
+                .unwrap_err();
         let msg = format!("{:#}", err);
         assert!(msg.contains("does not match declared type"), "got: {msg}");
     }
@@ -806,7 +1909,7 @@ mod tests {
     #[test]
     fn test_check_value_matches_field_accepts_null() {
         // NULL is allowed on any non-primary-key field.
-        check_value_matches_field(&Cell::Null, &make_field("name", Kind::Text)).unwrap();
+        check_value_matches_field(&CellRef::Null, &make_field("name", Kind::Text)).unwrap();
     }
 
     #[test]
@@ -830,7 +1933,7 @@ mod tests {
             primary_key: true,
             ..Default::default()
         };
-        let err = check_value_matches_field(&Cell::Null, &field).unwrap_err();
+        let err = check_value_matches_field(&CellRef::Null, &field).unwrap_err();
         let msg = format!("{:#}", err);
         assert!(
             msg.contains("primary-key value must not be NULL"),
@@ -943,4 +2046,594 @@ mod tests {
             "got: {msg}"
         );
     }
+
+    /// A delta with one delete, insert and sparse update plus a state table,
+    /// carrying an injected field.
+    fn streaming_patch() -> (Config, ProtoPatch) {
+        let mut config = Config::default();
+        config.tables = HashMap::from([
+            (
+                "users".to_string(),
+                dummy_table(&[("id", true), ("name", false), ("note", false)]),
+            ),
+            ("hosts".to_string(), dummy_table(&[("name", true)])),
+        ]);
+
+        let mut delta = dummy_delta(&["id"], &["name", "note"]);
+        delta.deletes.push(ProtoRecord {
+            key: text_proto_cells(&["1"]),
+            value: vec![],
+        });
+        delta.inserts.push(ProtoRecord {
+            key: text_proto_cells(&["2"]),
+            value: text_proto_cells(&["O'Brien", "x"]),
+        });
+        delta.updates.push(ProtoUpdate {
+            key: text_proto_cells(&["3"]),
+            changed_indices: vec![1],
+            old_value: text_proto_cells(&["old"]),
+            new_value: text_proto_cells(&["new"]),
+        });
+        let mut patch = dummy_patch(HashMap::from([("users".to_string(), delta)]));
+        patch.states.insert(
+            "hosts".to_string(),
+            ProtoTable {
+                primary_key_names: vec!["name".to_string()],
+                subsidiary_value_names: vec![],
+                records: vec![ProtoRecord {
+                    key: text_proto_cells(&["db1"]),
+                    value: vec![],
+                }],
+            },
+        );
+        patch.injected_fields.push(ProtoInjectedField {
+            name: "host".to_string(),
+            value: Some(ProtoCell::from(Cell::Text("agent-1".into()))),
+        });
+        (config, patch)
+    }
+
+    #[test]
+    fn test_emit_patch_sql_renders_each_statement() {
+        let (config, patch) = streaming_patch();
+        let mut statements = Vec::new();
+        let count = emit_patch_sql(&config, &patch, |statement| {
+            statements.push(statement.to_string());
+            Ok(())
+        })
+        .unwrap();
+
+        assert_eq!(count, 5);
+        assert_eq!(
+            statements,
+            [
+                "DELETE FROM \"users\" WHERE \"id\" = '1' AND \"host\" = 'agent-1';\n",
+                "INSERT INTO \"users\" (\"host\", \"id\", \"name\", \"note\") \
+                 VALUES ('agent-1', '2', 'O''Brien', 'x');\n",
+                "UPDATE \"users\" SET \"note\" = 'new' WHERE \"id\" = '3' AND \"host\" = 'agent-1';\n",
+                "DELETE FROM \"hosts\" WHERE \"host\" = 'agent-1';\n",
+                "INSERT INTO \"hosts\" (\"host\", \"name\") VALUES ('agent-1', 'db1');\n",
+            ]
+        );
+    }
+
+    #[test]
+    fn test_write_patch_sql_matches_patch_to_sql() {
+        let (config, patch) = streaming_patch();
+        let mut out = Vec::new();
+        let count = write_patch_sql(&config, &patch, &mut out).unwrap();
+        assert_eq!(count, 5);
+
+        let sql = patch_to_sql(&config, &patch).unwrap().unwrap();
+        assert_eq!(String::from_utf8(out).unwrap(), sql);
+    }
+
+    #[test]
+    fn test_emit_patch_sql_stops_on_sink_error() {
+        let (config, patch) = streaming_patch();
+        let mut calls = 0;
+        let err = emit_patch_sql(&config, &patch, |_| {
+            calls += 1;
+            bail!("sink full")
+        })
+        .unwrap_err();
+        assert_eq!(calls, 1);
+        assert!(format!("{:#}", err).contains("sink full"));
+    }
+
+    #[test]
+    fn test_emit_patch_sql_empty_patch() {
+        let config = Config::default();
+        let patch = dummy_patch(HashMap::new());
+        let count = emit_patch_sql(&config, &patch, |_| bail!("unexpected statement")).unwrap();
+        assert_eq!(count, 0);
+        assert!(patch_to_sql(&config, &patch).unwrap().is_none());
+    }
+
+    fn collect_statements(config: &Config, patch: &ProtoPatch) -> Vec<String> {
+        let mut statements = Vec::new();
+        emit_patch_sql(config, patch, |statement| {
+            statements.push(statement.to_string());
+            Ok(())
+        })
+        .unwrap();
+        statements
+    }
+
+    #[test]
+    fn test_batched_inserts_and_deletes() {
+        let (mut config, mut patch) = streaming_patch();
+        config.sql.batch_size = 2;
+        let delta = patch.deltas.get_mut("users").unwrap();
+        for id in ["4", "5"] {
+            delta.deletes.push(ProtoRecord {
+                key: text_proto_cells(&[id]),
+                value: vec![],
+            });
+            delta.inserts.push(ProtoRecord {
+                key: text_proto_cells(&[id]),
+                value: text_proto_cells(&["n", "m"]),
+            });
+        }
+
+        let statements = collect_statements(&config, &patch);
+        assert_eq!(
+            &statements[..4],
+            [
+                "DELETE FROM \"users\" WHERE \"id\" IN ('1', '4') AND \"host\" = 'agent-1';\n",
+                "DELETE FROM \"users\" WHERE \"id\" = '5' AND \"host\" = 'agent-1';\n",
+                "INSERT INTO \"users\" (\"host\", \"id\", \"name\", \"note\") \
+                 VALUES ('agent-1', '2', 'O''Brien', 'x'), ('agent-1', '4', 'n', 'm');\n",
+                "INSERT INTO \"users\" (\"host\", \"id\", \"name\", \"note\") \
+                 VALUES ('agent-1', '5', 'n', 'm');\n",
+            ]
+        );
+    }
+
+    #[test]
+    fn test_batched_deletes_with_composite_key() {
+        let mut config = Config::default();
+        config.sql.batch_size = 10;
+        config.tables = HashMap::from([(
+            "t".to_string(),
+            dummy_table(&[("id", true), ("host", true), ("name", false)]),
+        )]);
+
+        let mut delta = dummy_delta(&["id", "host"], &["name"]);
+        for key in [["1", "a"], ["2", "b"]] {
+            delta.deletes.push(ProtoRecord {
+                key: text_proto_cells(&key),
+                value: text_proto_cells(&["x"]),
+            });
+        }
+        let patch = dummy_patch(HashMap::from([("t".to_string(), delta)]));
+
+        assert_eq!(
+            collect_statements(&config, &patch),
+            ["DELETE FROM \"t\" WHERE (\"id\", \"host\") IN (('1', 'a'), ('2', 'b'));\n"]
+        );
+    }
+
+    #[test]
+    fn test_batched_delete_rejects_short_primary_key() {
+        let mut config = Config::default();
+        config.sql.batch_size = 10;
+        config.tables = HashMap::from([(
+            "t".to_string(),
+            dummy_table(&[("id", true), ("host", true)]),
+        )]);
+
+        let mut delta = dummy_delta(&["id", "host"], &[]);
+        delta.deletes.push(ProtoRecord {
+            key: text_proto_cells(&["1", "a"]),
+            value: vec![],
+        });
+        delta.deletes.push(ProtoRecord {
+            key: text_proto_cells(&["2"]),
+            value: vec![],
+        });
+        let patch = dummy_patch(HashMap::from([("t".to_string(), delta)]));
+
+        let err = patch_to_sql(&config, &patch).unwrap_err();
+        assert!(
+            format!("{:#}", err).contains("primary key field count mismatch"),
+            "got: {err:#}"
+        );
+    }
+
+    /// Owned copy of a [`Statement`]: operation, table, SQL, columns and
+    /// rendered parameters.
+    type OwnedStatement = (Operation, String, String, Vec<String>, Vec<String>);
+
+    fn collect_bound(config: &Config, patch: &ProtoPatch) -> Vec<OwnedStatement> {
+        let mut statements = Vec::new();
+        emit_patch_statements(config, patch, |statement| {
+            statements.push((
+                statement.operation,
+                statement.table.to_string(),
+                statement.sql.to_string(),
+                statement.columns.iter().map(|c| c.to_string()).collect(),
+                statement.params.iter().map(|p| p.to_string()).collect(),
+            ));
+            Ok(())
+        })
+        .unwrap();
+        statements
+    }
+
+    fn owned(
+        operation: Operation,
+        table: &str,
+        sql: &str,
+        columns: &[&str],
+        params: &[&str],
+    ) -> OwnedStatement {
+        (
+            operation,
+            table.to_string(),
+            sql.to_string(),
+            columns.iter().map(|c| c.to_string()).collect(),
+            params.iter().map(|p| p.to_string()).collect(),
+        )
+    }
+
+    #[test]
+    fn test_emit_patch_statements_binds_rows() {
+        let (config, patch) = streaming_patch();
+        assert_eq!(
+            collect_bound(&config, &patch),
+            [
+                owned(
+                    Operation::Delete,
+                    "users",
+                    "DELETE FROM \"users\" WHERE \"id\" = $1 AND \"host\" = $2",
+                    &["id", "host"],
+                    &["\"1\"", "\"agent-1\""],
+                ),
+                owned(
+                    Operation::Insert,
+                    "users",
+                    "INSERT INTO \"users\" (\"host\", \"id\", \"name\", \"note\") \
+                     VALUES ($1, $2, $3, $4)",
+                    &["host", "id", "name", "note"],
+                    &["\"agent-1\"", "\"2\"", "\"O'Brien\"", "\"x\""],
+                ),
+                owned(
+                    Operation::Update,
+                    "users",
+                    "UPDATE \"users\" SET \"note\" = $1 WHERE \"id\" = $2 AND \"host\" = $3",
+                    &["note", "id", "host"],
+                    &["\"new\"", "\"3\"", "\"agent-1\""],
+                ),
+                owned(
+                    Operation::Clear,
+                    "hosts",
+                    "DELETE FROM \"hosts\" WHERE \"host\" = $1",
+                    &["host"],
+                    &["\"agent-1\""],
+                ),
+                owned(
+                    Operation::Insert,
+                    "hosts",
+                    "INSERT INTO \"hosts\" (\"host\", \"name\") VALUES ($1, $2)",
+                    &["host", "name"],
+                    &["\"agent-1\"", "\"db1\""],
+                ),
+            ]
+        );
+    }
+
+    #[test]
+    fn test_emit_patch_statements_without_injected_fields() {
+        let (config, mut patch) = streaming_patch();
+        patch.injected_fields.clear();
+        patch.deltas.clear();
+
+        let statements = collect_bound(&config, &patch);
+        assert_eq!(
+            statements[0],
+            owned(Operation::Clear, "hosts", "TRUNCATE \"hosts\"", &[], &[])
+        );
+        assert_eq!(
+            statements[1].2,
+            "INSERT INTO \"hosts\" (\"name\") VALUES ($1)"
+        );
+    }
+
+    #[test]
+    fn test_partition_state_replaces_its_keys() {
+        let (mut config, mut patch) = streaming_patch();
+        config.tables.get_mut("hosts").unwrap().partitions = 4;
+        config.sql.batch_size = 10;
+        patch.injected_fields.clear();
+        patch.deltas.clear();
+        let state = patch.states.remove("hosts").unwrap();
+        patch.states.insert("hosts#2".to_string(), state);
+        let keys = ProtoKeys {
+            records: ["db1", "db2"]
+                .into_iter()
+                .map(|key| ProtoRecord {
+                    key: text_proto_cells(&[key]),
+                    value: vec![],
+                })
+                .collect(),
+        };
+        patch.replaced_keys.insert("hosts#2".to_string(), keys);
+
+        assert_eq!(
+            collect_statements(&config, &patch),
+            [
+                "DELETE FROM \"hosts\" WHERE \"name\" IN ('db1', 'db2');\n",
+                "INSERT INTO \"hosts\" (\"name\") VALUES ('db1');\n",
+            ]
+        );
+        let bound = collect_bound(&config, &patch);
+        assert_eq!(
+            bound[0],
+            owned(
+                Operation::Delete,
+                "hosts",
+                "DELETE FROM \"hosts\" WHERE \"name\" = $1",
+                &["name"],
+                &["\"db1\""],
+            )
+        );
+        assert_eq!(bound.len(), 3);
+
+        // Without its replaced keys, a partition's state cannot be applied.
+        patch.replaced_keys.clear();
+        let err = patch_to_sql(&config, &patch).unwrap_err();
+        assert!(format!("{:#}", err).contains("has no replaced keys"));
+    }
+
+    #[test]
+    fn test_emit_patch_statements_rejects_wire_value_with_wrong_type() {
+        let mut table = dummy_table(&[("id", true), ("score", false)]);
+        table.fields[1].kind = Kind::Number;
+        let mut config = Config::default();
+        config.tables = HashMap::from([("t".to_string(), table)]);
+
+        let mut delta = dummy_delta(&["id"], &["score"]);
+        delta.inserts.push(ProtoRecord {
+            key: text_proto_cells(&["1"]),
+            value: text_proto_cells(&["not-a-number"]),
+        });
+        let patch = dummy_patch(HashMap::from([("t".to_string(), delta)]));
+
+        let err = emit_patch_statements(&config, &patch, |_| Ok(())).unwrap_err();
+        let msg = format!("{:#}", err);
+        assert!(msg.contains("does not match declared type"), "got: {msg}");
+    }
+
+    /// A patch with deltas and states for several tables, each with a few
+    /// rows, under config `users_N` / `hosts_N` names.
+    fn multi_table_patch(tables: usize) -> (Config, ProtoPatch) {
+        let mut config = Config::default();
+        let mut patch = dummy_patch(HashMap::new());
+        for t in 0..tables {
+            let name = format!("users_{t}");
+            config
+                .tables
+                .insert(name.clone(), dummy_table(&[("id", true), ("name", false)]));
+            let mut delta = dummy_delta(&["id"], &["name"]);
+            for row in 0..3 {
+                delta.inserts.push(ProtoRecord {
+                    key: text_proto_cells(&[&format!("{t}-{row}")]),
+                    value: text_proto_cells(&["Alice"]),
+                });
+            }
+            delta.deletes.push(ProtoRecord {
+                key: text_proto_cells(&["gone"]),
+                value: vec![],
+            });
+            patch.deltas.insert(name, delta);
+
+            let name = format!("hosts_{t}");
+            config
+                .tables
+                .insert(name.clone(), dummy_table(&[("name", true)]));
+            patch.states.insert(
+                name,
+                ProtoTable {
+                    primary_key_names: vec!["name".to_string()],
+                    subsidiary_value_names: vec![],
+                    records: vec![ProtoRecord {
+                        key: text_proto_cells(&[&format!("db{t}")]),
+                        value: vec![],
+                    }],
+                },
+            );
+        }
+        (config, patch)
+    }
+
+    #[test]
+    fn test_emit_patch_sql_parallel_matches_sequential() {
+        let (mut config, patch) = multi_table_patch(7);
+        let sequential = collect_statements(&config, &patch);
+        config.threads = 3;
+        let parallel = collect_statements(&config, &patch);
+        assert_eq!(parallel, sequential);
+
+        // Deltas come first, each table in name order with its DELETEs
+        // before its INSERTs; full states follow.
+        assert_eq!(
+            sequential[0],
+            "DELETE FROM \"users_0\" WHERE \"id\" = 'gone';\n"
+        );
+        assert!(sequential[1].starts_with("INSERT INTO \"users_0\""));
+        assert!(sequential[4].starts_with("DELETE FROM \"users_1\""));
+        assert_eq!(sequential[28], "TRUNCATE \"hosts_0\";\n");
+    }
+
+    #[test]
+    fn test_emit_patch_sql_parallel_reports_first_failing_table() {
+        let (mut config, mut patch) = multi_table_patch(4);
+        config.threads = 4;
+        for name in ["users_1", "users_3"] {
+            patch.deltas.get_mut(name).unwrap().inserts[0].value.clear();
+        }
+
+        let mut emitted = 0;
+        let err = emit_patch_sql(&config, &patch, |_| {
+            emitted += 1;
+            Ok(())
+        })
+        .unwrap_err();
+        let msg = format!("{:#}", err);
+        assert!(msg.contains("table 'users_1'"), "got: {msg}");
+        // Only users_0 precedes the failing table.
+        assert_eq!(emitted, 4);
+    }
+
+    fn collect_framed(config: &Config, patch: &ProtoPatch) -> Vec<String> {
+        let mut statements = Vec::new();
+        let chunks = wire::patch_chunks(patch).map(Ok);
+        emit_framed_patch_sql(config, chunks, |statement| {
+            statements.push(statement.to_string());
+            Ok(())
+        })
+        .unwrap();
+        statements
+    }
+
+    #[test]
+    fn test_emit_framed_patch_sql_matches_emit_patch_sql() {
+        let (config, patch) = multi_table_patch(3);
+        assert_eq!(
+            collect_framed(&config, &patch),
+            collect_statements(&config, &patch)
+        );
+
+        let (config, patch) = streaming_patch();
+        let mut bound: Vec<OwnedStatement> = Vec::new();
+        let count = emit_framed_patch_statements(
+            &config,
+            wire::patch_chunks(&patch).map(Ok),
+            |statement| {
+                bound.push((
+                    statement.operation,
+                    statement.table.to_string(),
+                    statement.sql.to_string(),
+                    statement.columns.iter().map(|c| c.to_string()).collect(),
+                    statement.params.iter().map(|p| p.to_string()).collect(),
+                ));
+                Ok(())
+            },
+        )
+        .unwrap();
+        assert_eq!(count, bound.len());
+        assert_eq!(bound, collect_bound(&config, &patch));
+    }
+
+    #[test]
+    fn test_emit_framed_patch_sql_keeps_delta_order_across_chunks() {
+        let (config, mut patch) = streaming_patch();
+        patch.states.clear();
+        let delta = patch.deltas.get_mut("users").unwrap();
+        for n in 0..wire::FRAME_RECORDS + 10 {
+            delta.inserts.push(ProtoRecord {
+                key: text_proto_cells(&[&format!("new-{n}")]),
+                value: text_proto_cells(&["name", "note"]),
+            });
+        }
+        for n in 0..20 {
+            delta.deletes.push(ProtoRecord {
+                key: text_proto_cells(&[&format!("old-{n}")]),
+                value: vec![],
+            });
+        }
+
+        let statements = collect_framed(&config, &patch);
+        assert!(wire::patch_chunks(&patch).count() > 2);
+        assert_eq!(statements, collect_statements(&config, &patch));
+        // Every DELETE precedes every INSERT, which precede the UPDATE.
+        let last_delete = statements
+            .iter()
+            .rposition(|s| s.starts_with("DELETE"))
+            .unwrap();
+        let first_insert = statements
+            .iter()
+            .position(|s| s.starts_with("INSERT"))
+            .unwrap();
+        assert!(last_delete < first_insert);
+        assert!(statements.last().unwrap().starts_with("UPDATE"));
+    }
+
+    #[test]
+    fn test_emit_framed_patch_sql_clears_state_once() {
+        let (mut config, mut patch) = streaming_patch();
+        config.sql.batch_size = 1;
+        patch.injected_fields.clear();
+        patch.deltas.clear();
+        let records = (0..wire::FRAME_RECORDS + 10)
+            .map(|n| ProtoRecord {
+                key: text_proto_cells(&[&format!("db{n}")]),
+                value: vec![],
+            })
+            .collect();
+        patch.states.get_mut("hosts").unwrap().records = records;
+
+        let statements = collect_framed(&config, &patch);
+        assert_eq!(statements.len(), 1 + wire::FRAME_RECORDS + 10);
+        assert_eq!(statements[0], "TRUNCATE \"hosts\";\n");
+        assert_eq!(
+            statements
+                .iter()
+                .filter(|s| s.starts_with("TRUNCATE"))
+                .count(),
+            1
+        );
+        assert_eq!(statements, collect_statements(&config, &patch));
+    }
+
+    #[test]
+    fn test_emit_framed_patch_sql_holds_replaced_keys_for_state() {
+        let (mut config, mut patch) = streaming_patch();
+        config.tables.get_mut("hosts").unwrap().partitions = 4;
+        patch.injected_fields.clear();
+        patch.deltas.clear();
+        let state = patch.states.remove("hosts").unwrap();
+        patch.states.insert("hosts#2".to_string(), state);
+        let keys = ProtoKeys {
+            records: vec![ProtoRecord {
+                key: text_proto_cells(&["db1"]),
+                value: vec![],
+            }],
+        };
+        patch.replaced_keys.insert("hosts#2".to_string(), keys);
+        assert_eq!(
+            collect_framed(&config, &patch),
+            collect_statements(&config, &patch)
+        );
+
+        // Without its replaced keys, a partition's state cannot be applied.
+        patch.replaced_keys.clear();
+        let chunks = wire::patch_chunks(&patch).map(Ok);
+        let err = emit_framed_patch_sql(&config, chunks, |_| Ok(())).unwrap_err();
+        assert!(format!("{:#}", err).contains("has no replaced keys"));
+    }
+
+    #[test]
+    fn test_emit_encoded_patch_sql_streams_framed_patches() {
+        let (mut config, patch) = multi_table_patch(2);
+        let expected = patch_to_sql(&config, &patch).unwrap().unwrap();
+        for (framed, compress) in [(false, false), (false, true), (true, false), (true, true)] {
+            config.framed_patches = framed;
+            config.compression.enable = compress;
+            let encoded = wire::encode_patch(&config, &patch).unwrap();
+            let mut sql = String::new();
+            emit_encoded_patch_sql(&config, &encoded, |statement| {
+                sql.push_str(statement);
+                Ok(())
+            })
+            .unwrap();
+            assert_eq!(sql, expected);
+            let count = emit_encoded_patch_statements(&config, &encoded, |_| Ok(())).unwrap();
+            assert_eq!(
+                count,
+                emit_patch_statements(&config, &patch, |_| Ok(())).unwrap()
+            );
+        }
+    }
 }
@@ -1,21 +1,88 @@
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::fmt;
 use std::path::Path;
+use std::time::{Duration, Instant};
 
-use anyhow::Result;
+use anyhow::{Context, Result};
 use prost::Message;
 
-use crate::callbacks::Callbacks;
+use crate::callbacks::{Callbacks, ThreadSafeCallbacks};
 use crate::config::{Config, TableConfig};
-use crate::storage;
-use crate::table::Table;
-use crate::utils::indent;
+use crate::storage::{self, Transaction};
+use crate::table::{SortedTable, SourceFingerprint, Table};
+use crate::utils::{compute_hash, indent, is_hex_hash, parallel_map};
 
 type ProtoState = crate::proto::state::State;
+type ProtoSegment = crate::proto::state::Segment;
+type ProtoSource = crate::proto::state::Source;
 type ProtoTable = crate::proto::table::Table;
 
 const STATE_FILE: &str = "STATE";
 
+/// File name prefix of per-table segments. The suffix is the SHA-1 of the
+/// segment's contents, so a segment is immutable once written.
+const SEGMENT_PREFIX: &str = "STATE.";
+
+fn segment_file_name(hash: &str) -> String {
+    format!("{}{}", SEGMENT_PREFIX, hash)
+}
+
+/// What [`State::compute`] learned about the CSV sources it looked at.
+#[derive(Debug, Default)]
+pub struct Sources {
+    /// Fingerprint of every CSV source that could be fingerprinted, keyed by
+    /// stored table name (every partition of a partitioned table carries its
+    /// source's fingerprint). Stored alongside the table's STATE segment.
+    pub fingerprints: HashMap<String, SourceFingerprint>,
+    /// Stored tables whose source matched the fingerprint in the previous
+    /// STATE. They were neither parsed nor added to the computed state; their
+    /// previous segment still describes them.
+    pub unchanged: HashSet<String>,
+    /// Time spent loading each table, including fingerprinting and skipped
+    /// sources, keyed by table name.
+    pub load_times: HashMap<String, Duration>,
+}
+
+/// The stored state kept in memory by the `resident-state` option: every
+/// table of the STATE written along with block `head`, in the sorted form
+/// diffs consume. `Block::create` uses it instead of decoding STATE segments
+/// as long as HEAD still points at `head`.
+#[derive(Debug)]
+pub(crate) struct ResidentState {
+    pub head: String,
+    pub tables: HashMap<String, SortedTable>,
+}
+
+impl ResidentState {
+    /// Take the tables kept in `config` if they belong to block `head`. The
+    /// slot is left empty either way; it is refilled once the next block is
+    /// committed.
+    pub fn take(config: &Config, head: &str) -> Option<HashMap<String, SortedTable>> {
+        let mut slot = config.resident.lock().unwrap_or_else(|e| e.into_inner());
+        let resident = slot.take()?;
+        if resident.head != head {
+            log::debug!(
+                "Resident state belongs to '{:.7}...' but HEAD is '{:.7}...', loading STATE",
+                resident.head,
+                head
+            );
+            return None;
+        }
+        log::debug!(
+            "Using resident state of '{:.7}...' ({} tables)",
+            head,
+            resident.tables.len()
+        );
+        Some(resident.tables)
+    }
+
+    /// Keep `tables` in `config` as the state stored with block `head`.
+    pub fn keep(config: &Config, head: String, tables: HashMap<String, SortedTable>) {
+        let mut slot = config.resident.lock().unwrap_or_else(|e| e.into_inner());
+        *slot = Some(ResidentState { head, tables });
+    }
+}
+
 /// State represents a snapshot of all tables at a point in time.
 #[derive(Debug, Clone, PartialEq)]
 pub struct State {
@@ -42,7 +109,32 @@ impl From<State> for ProtoState {
             .into_iter()
             .map(|(name, table)| (name, ProtoTable::from(table)))
             .collect();
-        ProtoState { tables }
+        ProtoState {
+            tables,
+            segments: HashMap::new(),
+        }
+    }
+}
+
+impl From<&SourceFingerprint> for ProtoSource {
+    fn from(fingerprint: &SourceFingerprint) -> Self {
+        ProtoSource {
+            size: fingerprint.size,
+            mtime_nanos: fingerprint.mtime_nanos,
+            content_hash: fingerprint.content_hash.clone(),
+            config_hash: fingerprint.config_hash.clone(),
+        }
+    }
+}
+
+impl From<ProtoSource> for SourceFingerprint {
+    fn from(proto: ProtoSource) -> Self {
+        SourceFingerprint {
+            size: proto.size,
+            mtime_nanos: proto.mtime_nanos,
+            content_hash: proto.content_hash,
+            config_hash: proto.config_hash,
+        }
     }
 }
 
@@ -57,20 +149,136 @@ impl fmt::Display for ProtoState {
 }
 
 impl ProtoState {
-    pub fn load(work_dir: &Path, mode: u32) -> Result<Option<Self>> {
+    /// Load the STATE index without resolving any segment. Use
+    /// [`ProtoState::table_size`] and [`ProtoState::take_table`] to inspect
+    /// and fetch individual tables.
+    pub fn load_index(work_dir: &Path, mode: u32) -> Result<Option<Self>> {
         let Some(data) = storage::load(work_dir, STATE_FILE, mode)? else {
             log::info!("No previous state found");
             return Ok(None);
         };
+        let index = ProtoState::decode(data.as_slice())?;
+        Ok(Some(index))
+    }
 
-        let proto_state = ProtoState::decode(data.as_slice())?;
-        log::debug!(
-            "Loaded previous state with {} tables",
-            proto_state.tables.len()
+    /// Load the STATE index and every table it references.
+    pub fn load(work_dir: &Path, mode: u32) -> Result<Option<Self>> {
+        let Some(index) = Self::load_index(work_dir, mode)? else {
+            return Ok(None);
+        };
+        index.resolve(work_dir, mode).map(Some)
+    }
+
+    /// Load every segment this index references, turning it into a state
+    /// whose tables are all inline.
+    pub fn resolve(mut self, work_dir: &Path, mode: u32) -> Result<Self> {
+        let mut segment_buf = Vec::new();
+        for (name, segment) in std::mem::take(&mut self.segments) {
+            let table = load_segment(work_dir, &name, &segment, mode, &mut segment_buf)?;
+            self.tables.insert(name, table);
+        }
+
+        log::debug!("Loaded previous state with {} tables", self.tables.len());
+        log::trace!("{}", self);
+        Ok(self)
+    }
+
+    /// Source fingerprints recorded in this index, keyed by table name. Only
+    /// tables whose segment file is still present are included, since a
+    /// matching fingerprint means the segment is reused as is.
+    pub fn source_fingerprints(&self, work_dir: &Path) -> HashMap<String, SourceFingerprint> {
+        self.segments
+            .iter()
+            .filter_map(|(name, segment)| {
+                let source = segment.source.clone()?;
+                work_dir
+                    .join(segment_file_name(&segment.hash))
+                    .exists()
+                    .then(|| (name.clone(), SourceFingerprint::from(source)))
+            })
+            .collect()
+    }
+
+    /// Encoded size of table `name`, read from the index without loading the
+    /// table itself.
+    pub fn table_size(&self, name: &str) -> Option<u64> {
+        if let Some(segment) = self.segments.get(name) {
+            return Some(segment.size);
+        }
+        self.tables
+            .get(name)
+            .map(|table| table.encoded_len() as u64)
+    }
+
+    /// Remove table `name` from this index and return its contents, loading
+    /// its segment from `work_dir` if needed. Returns `None` when the table is
+    /// not part of the state.
+    pub fn take_table(
+        &mut self,
+        work_dir: &Path,
+        name: &str,
+        mode: u32,
+    ) -> Result<Option<ProtoTable>> {
+        if let Some(segment) = self.segments.remove(name) {
+            return load_segment(work_dir, name, &segment, mode, &mut Vec::new()).map(Some);
+        }
+        Ok(self.tables.remove(name))
+    }
+}
+
+/// Load and decode the segment holding table `name`, reading the file into
+/// `buf` so that loading several segments reuses one allocation.
+fn load_segment(
+    work_dir: &Path,
+    name: &str,
+    segment: &ProtoSegment,
+    mode: u32,
+    buf: &mut Vec<u8>,
+) -> Result<ProtoTable> {
+    let file_name = segment_file_name(&segment.hash);
+    if !storage::load_into(work_dir, &file_name, mode, buf)? {
+        anyhow::bail!(
+            "state segment '{}' for table '{}' is missing",
+            file_name,
+            name
         );
-        log::trace!("{}", proto_state);
-        Ok(Some(proto_state))
     }
+    ProtoTable::decode(buf.as_slice())
+        .with_context(|| format!("failed to decode state segment for table '{}'", name))
+}
+
+/// Add removals of segment files referenced by neither `current` nor
+/// `previous` to `transaction`. The previous generation is kept so that a
+/// reader which loaded the old index just before it was replaced can still
+/// resolve its segments.
+fn remove_stale_segments(
+    transaction: &mut Transaction,
+    work_dir: &Path,
+    current: &ProtoState,
+    previous: &ProtoState,
+) -> Result<()> {
+    let referenced: HashSet<&str> = current
+        .segments
+        .values()
+        .chain(previous.segments.values())
+        .map(|segment| segment.hash.as_str())
+        .collect();
+
+    for entry in std::fs::read_dir(work_dir)? {
+        let entry = entry?;
+        let file_name = entry.file_name();
+        let Some(file_name) = file_name.to_str() else {
+            continue;
+        };
+        let Some(hash) = file_name.strip_prefix(SEGMENT_PREFIX) else {
+            continue;
+        };
+        if is_hex_hash(hash) && !referenced.contains(hash) {
+            log::debug!("Removing stale state segment '{}'", file_name);
+            transaction.remove(file_name);
+        }
+    }
+    Ok(())
 }
 
 impl State {
@@ -81,48 +289,293 @@ impl State {
         Ok(Some(State::try_from(proto)?))
     }
 
+    /// Load the previous snapshot for diffing. Unlike [`State::load`], each
+    /// table's records are kept in the sorted order STATE stores them in,
+    /// instead of being rehashed into a map.
+    pub fn load_sorted(work_dir: &Path, mode: u32) -> Result<Option<HashMap<String, SortedTable>>> {
+        let Some(index) = ProtoState::load_index(work_dir, mode)? else {
+            return Ok(None);
+        };
+        Self::sorted_from_index(index, work_dir, mode).map(Some)
+    }
+
+    /// Like [`State::load_sorted`], for an index the caller already loaded
+    /// (and possibly pruned of tables it does not need).
+    pub(crate) fn sorted_from_index(
+        index: ProtoState,
+        work_dir: &Path,
+        mode: u32,
+    ) -> Result<HashMap<String, SortedTable>> {
+        let proto = index.resolve(work_dir, mode)?;
+        let mut tables = HashMap::with_capacity(proto.tables.len());
+        for (name, proto_table) in proto.tables {
+            tables.insert(name, SortedTable::try_from(proto_table)?);
+        }
+        Ok(tables)
+    }
+
     /// Build a fresh snapshot of every table declared in `config`.
     ///
     /// Tables with a `[csv]` block are loaded from CSV exactly as before.
     /// Tables without a `[csv]` block are pulled through `callbacks`;
     /// reaching such a table with `callbacks == None` is an error.
-    pub fn compute(config: &Config, callbacks: Option<&Callbacks>) -> Result<Self> {
-        let mut tables: HashMap<String, Table> = HashMap::new();
+    ///
+    /// Callback-backed tables that are not marked `thread-safe` are drained
+    /// first, one at a time on the calling thread. CSV-backed tables and
+    /// `thread-safe` callback-backed tables are then loaded concurrently on a
+    /// pool of `config.threads` workers.
+    ///
+    /// A CSV source whose fingerprint equals its entry in `previous_sources`
+    /// is not parsed: the table is left out of the returned state and listed
+    /// in [`Sources::unchanged`] instead.
+    ///
+    /// A table with `partitions > 1` is split into its partitions (see
+    /// [`TableConfig::stored_names`]) by the worker that loaded it, and the
+    /// returned state holds the partitions in place of the table.
+    pub fn compute(
+        config: &Config,
+        callbacks: Option<&Callbacks>,
+        previous_sources: &HashMap<String, SourceFingerprint>,
+    ) -> Result<(Self, Sources)> {
+        let mut serial_jobs = Vec::new();
+        let mut parallel_jobs = Vec::new();
 
         for (name, table_config) in &config.tables {
-            let table = if table_config.csv.is_some() {
-                Table::load_from_csv(&config.work_dir, name, table_config)?
+            if table_config.csv.is_some() {
+                parallel_jobs.push((name, table_config, None));
+                continue;
+            }
+            let Some(cbs) = callbacks else {
+                anyhow::bail!(
+                    "table '{}' is callback-backed but no callbacks were provided",
+                    name
+                );
+            };
+            if table_config.thread_safe {
+                // SAFETY: the config declares this table's callbacks as safe
+                // to invoke from worker threads.
+                let shared = unsafe { ThreadSafeCallbacks::new(cbs) };
+                parallel_jobs.push((name, table_config, Some(shared)));
             } else {
-                let Some(cbs) = callbacks else {
-                    anyhow::bail!(
-                        "table '{}' is callback-backed but no callbacks were provided",
-                        name
-                    );
+                serial_jobs.push((name, table_config, cbs));
+            }
+        }
+
+        let mut tables: HashMap<String, Table> = HashMap::with_capacity(config.tables.len());
+
+        let mut sources = Sources::default();
+        for (name, table_config, cbs) in serial_jobs {
+            let start = Instant::now();
+            let table = load_from_callback(name, table_config, cbs)?;
+            tables.extend(partition(name, table_config, table));
+            sources.load_times.insert(name.clone(), start.elapsed());
+        }
+
+        let loaded = parallel_map(
+            parallel_jobs,
+            config.threads,
+            |(name, table_config, shared)| {
+                let start = Instant::now();
+                let loaded = match shared {
+                    Some(shared) => load_from_callback(name, table_config, shared.get())
+                        .map(|table| Loaded::Tables(partition(name, table_config, table), None)),
+                    None => load_from_csv(
+                        &config.work_dir,
+                        name,
+                        table_config,
+                        previous_fingerprint(previous_sources, name, table_config),
+                    ),
                 };
-                load_from_callback(name, table_config, cbs)?
-            };
-            tables.insert(name.clone(), table);
+                (name, table_config, loaded, start.elapsed())
+            },
+        );
+
+        for (name, table_config, loaded, elapsed) in loaded {
+            sources.load_times.insert(name.clone(), elapsed);
+            match loaded? {
+                Loaded::Tables(stored, fingerprint) => {
+                    for (stored_name, table) in stored {
+                        if let Some(fingerprint) = &fingerprint {
+                            sources
+                                .fingerprints
+                                .insert(stored_name.clone(), fingerprint.clone());
+                        }
+                        tables.insert(stored_name, table);
+                    }
+                }
+                Loaded::Unchanged(fingerprint) => {
+                    for stored_name in table_config.stored_names(name) {
+                        sources
+                            .fingerprints
+                            .insert(stored_name.clone(), fingerprint.clone());
+                        sources.unchanged.insert(stored_name);
+                    }
+                }
+            }
         }
 
         let state = State { tables };
-        log::debug!("Computed current state from {} tables", state.tables.len());
+        log::debug!(
+            "Computed current state from {} tables ({} with unchanged sources skipped)",
+            state.tables.len(),
+            sources.unchanged.len()
+        );
         log::trace!("{}", ProtoState::from(state.clone()));
-        Ok(state)
+        Ok((state, sources))
     }
 
-    pub fn store(&self, work_dir: &Path, mode: u32, dry_run: bool) -> Result<()> {
-        let proto_state = ProtoState::from(self.clone());
-        let mut buf = Vec::new();
-        proto_state.encode(&mut buf)?;
-        storage::store(work_dir, STATE_FILE, &buf, mode, dry_run)?;
+    /// Persist this snapshot. Each table is written to its own
+    /// content-addressed segment, and the STATE file becomes an index of
+    /// segments. A segment that already exists on disk is re-referenced
+    /// rather than rewritten. Tables named in `unchanged` are known to equal
+    /// the stored previous state, so their previous segment is reused without
+    /// even encoding them. Each segment records the source fingerprint from
+    /// `sources`, and the tables [`State::compute`] skipped keep their
+    /// previous segment unchanged.
+    pub fn store(
+        &self,
+        work_dir: &Path,
+        mode: u32,
+        dry_run: bool,
+        unchanged: &HashSet<String>,
+        sources: &Sources,
+    ) -> Result<()> {
+        let mut transaction = Transaction::default();
+        self.stage(&mut transaction, work_dir, mode, unchanged, sources)?;
+        transaction.apply(work_dir, mode, dry_run)
+    }
+
+    /// Like [`State::store`], but adds the segment and STATE writes to
+    /// `transaction` instead of storing them, so `Block::create` can commit
+    /// them together with the block and HEAD.
+    pub fn stage(
+        &self,
+        transaction: &mut Transaction,
+        work_dir: &Path,
+        mode: u32,
+        unchanged: &HashSet<String>,
+        sources: &Sources,
+    ) -> Result<()> {
+        let previous = ProtoState::load_index(work_dir, mode)?.unwrap_or_default();
+
+        let mut segments = HashMap::with_capacity(self.tables.len() + sources.unchanged.len());
+        let mut num_written = 0;
+        for name in &sources.unchanged {
+            let Some(segment) = previous.segments.get(name) else {
+                anyhow::bail!(
+                    "table '{}' was skipped but has no segment in the previous state",
+                    name
+                );
+            };
+            segments.insert(name.clone(), segment.clone());
+        }
+        for (name, table) in &self.tables {
+            let source = sources.fingerprints.get(name).map(ProtoSource::from);
+            if unchanged.contains(name)
+                && let Some(segment) = previous.segments.get(name)
+                && work_dir.join(segment_file_name(&segment.hash)).exists()
+            {
+                let mut segment = segment.clone();
+                segment.source = source;
+                segments.insert(name.clone(), segment);
+                continue;
+            }
+
+            let encoded = ProtoTable::from(table.clone()).encode_to_vec();
+            let segment = ProtoSegment {
+                hash: compute_hash(&encoded),
+                size: encoded.len() as u64,
+                source,
+            };
+            let file_name = segment_file_name(&segment.hash);
+            if !work_dir.join(&file_name).exists() {
+                transaction.store(&file_name, encoded);
+                num_written += 1;
+            }
+            segments.insert(name.clone(), segment);
+        }
+
+        let index = ProtoState {
+            tables: HashMap::new(),
+            segments,
+        };
+        transaction.store(STATE_FILE, index.encode_to_vec());
+        remove_stale_segments(transaction, work_dir, &index, &previous)?;
+
         log::debug!(
-            "Updated previous state to current state with {} tables",
-            self.tables.len()
+            "Staged current state with {} tables ({} segments to write)",
+            index.segments.len(),
+            num_written
         );
         Ok(())
     }
 }
 
+/// Outcome of loading one table in [`State::compute`].
+enum Loaded {
+    /// The table was loaded, as the tables it is stored as (see
+    /// [`partition`]), along with its source fingerprint if it has one.
+    Tables(Vec<(String, Table)>, Option<SourceFingerprint>),
+    /// The CSV source matched the previous fingerprint and was not parsed.
+    Unchanged(SourceFingerprint),
+}
+
+/// Split `table` into the tables it is stored as: itself under `name`, or
+/// its partitions under their partition names.
+fn partition(name: &str, table_config: &TableConfig, table: Table) -> Vec<(String, Table)> {
+    if !table_config.is_partitioned() {
+        return vec![(name.to_string(), table)];
+    }
+    table_config
+        .stored_names(name)
+        .into_iter()
+        .zip(table.into_partitions(table_config.partitions))
+        .collect()
+}
+
+/// The fingerprint the previous STATE recorded for the source of table
+/// `name`. A partitioned table only has one when every one of its current
+/// partitions recorded the same fingerprint, so a table whose partitions are
+/// not all stored is parsed again.
+fn previous_fingerprint<'a>(
+    previous_sources: &'a HashMap<String, SourceFingerprint>,
+    name: &str,
+    table_config: &TableConfig,
+) -> Option<&'a SourceFingerprint> {
+    let mut stored_names = table_config.stored_names(name).into_iter();
+    let first = previous_sources.get(&stored_names.next()?)?;
+    stored_names
+        .all(|stored_name| previous_sources.get(&stored_name) == Some(first))
+        .then_some(first)
+}
+
+/// Load a CSV-backed table unless its source fingerprint equals `previous`.
+fn load_from_csv(
+    work_dir: &Path,
+    name: &str,
+    table_config: &TableConfig,
+    previous: Option<&SourceFingerprint>,
+) -> Result<Loaded> {
+    let fingerprint = SourceFingerprint::of_csv(work_dir, table_config)
+        .with_context(|| format!("failed to fingerprint source of table '{}'", name))?;
+    if let Some(fingerprint) = fingerprint {
+        if previous == Some(&fingerprint) {
+            log::debug!(
+                "Table '{}': CSV source unchanged since the previous block, skipping",
+                name
+            );
+            return Ok(Loaded::Unchanged(fingerprint));
+        }
+        let table = Table::load_from_csv(work_dir, name, table_config)?;
+        return Ok(Loaded::Tables(
+            partition(name, table_config, table),
+            Some(fingerprint),
+        ));
+    }
+    let table = Table::load_from_csv(work_dir, name, table_config)?;
+    Ok(Loaded::Tables(partition(name, table_config, table), None))
+}
+
 /// Wrap `Table::load_from_callbacks` with the begin/end lifecycle: `table_end`
 /// always fires when `table_begin` succeeded, including on the error path, so
 /// the caller's per-table resources (a DB cursor, a buffer) can always be
@@ -156,3 +609,272 @@ fn load_from_callback(
     end_result?;
     Ok(table)
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cell::text_cells;
+
+    fn make_table(rows: &[(&str, &str)]) -> Table {
+        Table {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: vec!["name".to_string()],
+            records: rows
+                .iter()
+                .map(|(key, value)| (text_cells(&[*key]), text_cells(&[*value])))
+                .collect(),
+        }
+    }
+
+    fn make_state(tables: &[(&str, Table)]) -> State {
+        State {
+            tables: tables
+                .iter()
+                .map(|(name, table)| (name.to_string(), table.clone()))
+                .collect(),
+        }
+    }
+
+    fn segment_files(work_dir: &Path) -> HashSet<String> {
+        std::fs::read_dir(work_dir)
+            .unwrap()
+            .map(|entry| entry.unwrap().file_name().into_string().unwrap())
+            .filter(|name| name.strip_prefix(SEGMENT_PREFIX).is_some_and(is_hex_hash))
+            .collect()
+    }
+
+    #[test]
+    fn test_store_writes_one_segment_per_table() {
+        let dir = tempfile::tempdir().unwrap();
+        let state = make_state(&[
+            ("users", make_table(&[("1", "alice")])),
+            ("groups", make_table(&[("1", "admin")])),
+        ]);
+        state
+            .store(
+                dir.path(),
+                0o600,
+                false,
+                &HashSet::new(),
+                &Sources::default(),
+            )
+            .unwrap();
+
+        assert_eq!(segment_files(dir.path()).len(), 2);
+        let loaded = State::load(dir.path(), 0o600).unwrap().unwrap();
+        assert_eq!(loaded, state);
+    }
+
+    #[test]
+    fn test_take_table_loads_single_segment() {
+        let dir = tempfile::tempdir().unwrap();
+        let users = make_table(&[("1", "alice")]);
+        let state = make_state(&[
+            ("users", users.clone()),
+            ("groups", make_table(&[("1", "admin")])),
+        ]);
+        state
+            .store(
+                dir.path(),
+                0o600,
+                false,
+                &HashSet::new(),
+                &Sources::default(),
+            )
+            .unwrap();
+
+        let mut index = ProtoState::load_index(dir.path(), 0o600).unwrap().unwrap();
+        assert!(index.tables.is_empty());
+        let expected = ProtoTable::from(users);
+        assert_eq!(
+            index.table_size("users"),
+            Some(expected.encoded_len() as u64)
+        );
+        let table = index.take_table(dir.path(), "users", 0o600).unwrap();
+        assert_eq!(table, Some(expected));
+        assert!(
+            index
+                .take_table(dir.path(), "missing", 0o600)
+                .unwrap()
+                .is_none()
+        );
+    }
+
+    #[test]
+    fn test_store_keeps_previous_generation_of_segments() {
+        let dir = tempfile::tempdir().unwrap();
+        let groups = make_table(&[("1", "admin")]);
+        let no_change = HashSet::new();
+
+        make_state(&[
+            ("users", make_table(&[("1", "a")])),
+            ("groups", groups.clone()),
+        ])
+        .store(dir.path(), 0o600, false, &no_change, &Sources::default())
+        .unwrap();
+        let first = segment_files(dir.path());
+
+        make_state(&[
+            ("users", make_table(&[("1", "b")])),
+            ("groups", groups.clone()),
+        ])
+        .store(dir.path(), 0o600, false, &no_change, &Sources::default())
+        .unwrap();
+        let second = segment_files(dir.path());
+        // The unchanged table is re-referenced; the old users segment stays
+        // around for readers of the previous index.
+        assert_eq!(second.len(), 3);
+        assert!(first.is_subset(&second));
+
+        make_state(&[("users", make_table(&[("1", "c")])), ("groups", groups)])
+            .store(dir.path(), 0o600, false, &no_change, &Sources::default())
+            .unwrap();
+        let third = segment_files(dir.path());
+        assert_eq!(third.len(), 3);
+        assert!(!first.is_subset(&third));
+    }
+
+    #[test]
+    fn test_store_reuses_unchanged_segment() {
+        let dir = tempfile::tempdir().unwrap();
+        let state = make_state(&[("users", make_table(&[("1", "alice")]))]);
+        state
+            .store(
+                dir.path(),
+                0o600,
+                false,
+                &HashSet::new(),
+                &Sources::default(),
+            )
+            .unwrap();
+        let before = ProtoState::load_index(dir.path(), 0o600).unwrap().unwrap();
+
+        let unchanged = HashSet::from(["users".to_string()]);
+        state
+            .store(dir.path(), 0o600, false, &unchanged, &Sources::default())
+            .unwrap();
+        let after = ProtoState::load_index(dir.path(), 0o600).unwrap().unwrap();
+        assert_eq!(before.segments, after.segments);
+    }
+
+    fn set_age(path: &Path, age: std::time::Duration) {
+        let file = std::fs::File::options().write(true).open(path).unwrap();
+        file.set_modified(std::time::SystemTime::now() - age)
+            .unwrap();
+    }
+
+    #[test]
+    fn test_compute_skips_csv_with_unchanged_source() {
+        let dir = tempfile::tempdir().unwrap();
+        let toml_input = r#"
+[tables.users]
+fields = [
+    { name = "id", type = "NUMBER", primary-key = true },
+    { name = "name", type = "TEXT" },
+]
+
+[tables.users.csv]
+source = "users.csv"
+"#;
+        std::fs::write(dir.path().join("config.toml"), toml_input).unwrap();
+        let csv_path = dir.path().join("users.csv");
+        std::fs::write(&csv_path, "1,alice\n").unwrap();
+        let an_hour = std::time::Duration::from_secs(3600);
+        set_age(&csv_path, an_hour);
+        let config = Config::load(dir.path()).unwrap();
+
+        let (state, sources) = State::compute(&config, None, &HashMap::new()).unwrap();
+        assert!(state.tables.contains_key("users"));
+        assert!(sources.unchanged.is_empty());
+        state
+            .store(dir.path(), 0o600, false, &HashSet::new(), &sources)
+            .unwrap();
+
+        let index = ProtoState::load_index(dir.path(), 0o600).unwrap().unwrap();
+        let previous = index.source_fingerprints(dir.path());
+        assert_eq!(previous, sources.fingerprints);
+        let (state, sources) = State::compute(&config, None, &previous).unwrap();
+        assert!(state.tables.is_empty());
+        assert!(sources.unchanged.contains("users"));
+        assert!(sources.load_times.contains_key("users"));
+
+        // Same size and mtime but different bytes: the content hash catches it.
+        std::fs::write(&csv_path, "1,ALICE\n").unwrap();
+        set_age(&csv_path, an_hour);
+        let (state, sources) = State::compute(&config, None, &previous).unwrap();
+        assert!(state.tables.contains_key("users"));
+        assert!(sources.unchanged.is_empty());
+    }
+
+    #[test]
+    fn test_compute_does_not_fingerprint_freshly_written_csv() {
+        let dir = tempfile::tempdir().unwrap();
+        let toml_input = r#"
+[tables.users]
+fields = [{ name = "id", type = "NUMBER", primary-key = true }]
+
+[tables.users.csv]
+source = "users.csv"
+trust-mtime = true
+"#;
+        std::fs::write(dir.path().join("config.toml"), toml_input).unwrap();
+        std::fs::write(dir.path().join("users.csv"), "1\n").unwrap();
+        let config = Config::load(dir.path()).unwrap();
+
+        let (state, sources) = State::compute(&config, None, &HashMap::new()).unwrap();
+        assert!(state.tables.contains_key("users"));
+        assert!(sources.fingerprints.is_empty());
+    }
+
+    #[test]
+    fn test_store_keeps_segment_of_skipped_table() {
+        let dir = tempfile::tempdir().unwrap();
+        let state = make_state(&[("users", make_table(&[("1", "alice")]))]);
+        state
+            .store(
+                dir.path(),
+                0o600,
+                false,
+                &HashSet::new(),
+                &Sources::default(),
+            )
+            .unwrap();
+        let before = ProtoState::load_index(dir.path(), 0o600).unwrap().unwrap();
+
+        let sources = Sources {
+            fingerprints: HashMap::new(),
+            unchanged: HashSet::from(["users".to_string()]),
+            load_times: HashMap::new(),
+        };
+        make_state(&[])
+            .store(dir.path(), 0o600, false, &HashSet::new(), &sources)
+            .unwrap();
+        let after = ProtoState::load_index(dir.path(), 0o600).unwrap().unwrap();
+        assert_eq!(before.segments, after.segments);
+    }
+
+    #[test]
+    fn test_load_inline_tables_from_legacy_state() {
+        let dir = tempfile::tempdir().unwrap();
+        let state = make_state(&[("users", make_table(&[("1", "alice")]))]);
+        let legacy = ProtoState::from(state.clone()).encode_to_vec();
+        storage::store(dir.path(), STATE_FILE, &legacy, 0o600, false).unwrap();
+
+        let loaded = State::load(dir.path(), 0o600).unwrap().unwrap();
+        assert_eq!(loaded, state);
+
+        // Storing over a legacy file switches it to segments.
+        loaded
+            .store(
+                dir.path(),
+                0o600,
+                false,
+                &HashSet::new(),
+                &Sources::default(),
+            )
+            .unwrap();
+        let index = ProtoState::load_index(dir.path(), 0o600).unwrap().unwrap();
+        assert!(index.tables.is_empty());
+        assert_eq!(index.segments.len(), 1);
+    }
+}
@@ -1,30 +1,50 @@
 //! Locked file I/O for the work directory.
 //!
-//! Each named resource (`HEAD`, `STATE`, `REPORTED`, individual block hashes)
+//! Each named resource (`HEAD`, `STATE`, `REPORTED`, `BLOCKS`, individual block hashes)
 //! has its own `.<name>.lock` file used for per-file flock-based
 //! synchronization. The `chain` lock additionally serializes multi-step
 //! chain-mutation sequences in `Block::create` and `truncate::run`.
 //!
+//! # Journal
+//!
+//! A [`Transaction`] groups the files one block commit touches (the block,
+//! its state segments, `STATE` and `HEAD`). Without the journal each file is
+//! stored on its own, with an fsync of the file and of the directory. With
+//! the journal enabled the whole transaction is appended to `JOURNAL` as one
+//! checksummed record and fsynced once; the files are then written without
+//! syncing. Until the next checkpoint the journal is the durable copy, and
+//! [`recover_journal`] restores whatever a crash lost from it.
+//!
 //! # Lock ordering
 //!
 //! When more than one lock is held at the same time, acquire the `chain`
 //! lock first; per-file locks (`HEAD`, `STATE`, `REPORTED`, individual block
 //! hashes) must be taken only inside the chain-locked region, never the
 //! other way around. Violating this ordering risks ABBA deadlock between
-//! `Block::create` and `truncate::run`.
+//! `Block::create` and `truncate::run`. The `JOURNAL` lock counts as a
+//! per-file lock and is held while the journaled files are written.
 
+use std::collections::BTreeMap;
+use std::fmt;
 use std::fs::{self, File, OpenOptions};
 use std::io::{Read, Write};
 use std::path::Path;
 
 use anyhow::{Context, Result, bail};
+use prost::Message;
 
-use crate::utils::GENESIS_HASH;
+use crate::pack;
+use crate::proto::journal::{
+    Commit as ProtoJournalCommit, Entry as ProtoJournalEntry, Record as ProtoJournalRecord,
+};
+use crate::utils::{GENESIS_HASH, compute_hash};
+
+const JOURNAL_FILE: &str = "JOURNAL";
 
 /// Create (or truncate) a file at `path` with the given Unix permission
 /// `mode`. Behaves like `File::create` (write + create + truncate) plus an
 /// explicit mode; the mode is ignored on non-Unix platforms.
-fn create_file(path: &Path, mode: u32) -> std::io::Result<File> {
+pub(crate) fn create_file(path: &Path, mode: u32) -> std::io::Result<File> {
     let mut options = OpenOptions::new();
     options.write(true).create(true).truncate(true);
     #[cfg(unix)]
@@ -37,6 +57,44 @@ fn create_file(path: &Path, mode: u32) -> std::io::Result<File> {
     options.open(path)
 }
 
+/// Open a file at `path` for appending, creating it with Unix permission
+/// `mode` if needed.
+pub(crate) fn open_for_append(path: &Path, mode: u32) -> std::io::Result<File> {
+    let mut options = OpenOptions::new();
+    options.append(true).create(true);
+    #[cfg(unix)]
+    {
+        use std::os::unix::fs::OpenOptionsExt;
+        options.mode(mode);
+    }
+    #[cfg(not(unix))]
+    let _ = mode;
+    options.open(path)
+}
+
+/// Fsync the work directory so renames, creations and removals in it are
+/// durable. Per fsync(2), an fsync of a file does not flush its directory
+/// entry; without this a rename can be lost on power loss even though the
+/// file's contents made it to disk. Unix only: opening a directory handle
+/// for fsync is a POSIX idiom, and on Windows File::open on a directory
+/// fails with ERROR_ACCESS_DENIED.
+fn sync_dir(work_dir: &Path) -> Result<()> {
+    #[cfg(unix)]
+    {
+        let dir = File::open(work_dir).with_context(|| {
+            format!(
+                "failed to open work directory '{}' for fsync",
+                work_dir.display()
+            )
+        })?;
+        dir.sync_all()
+            .with_context(|| format!("failed to fsync work directory '{}'", work_dir.display()))?;
+    }
+    #[cfg(not(unix))]
+    let _ = work_dir;
+    Ok(())
+}
+
 /// Acquires a lock on a separate `.<name>.lock` file for inter-process
 /// synchronization. Returns the lock file handle; the lock is released when
 /// the handle is dropped. Use `exclusive = true` to serialize multi-step
@@ -86,9 +144,28 @@ pub fn store(work_dir: &Path, name: &str, data: &[u8], mode: u32, dry_run: bool)
 
     fs::create_dir_all(work_dir)
         .with_context(|| format!("failed to create work directory '{}'", work_dir.display()))?;
+    write_file(work_dir, name, data, mode, true)
+}
 
+/// Writes `data` to `name` in the work directory under its exclusive lock,
+/// through a temp file and an atomic rename. With `sync` set, the temp file
+/// is fsynced before the rename and the directory after it, so the write is
+/// durable on return. Journaled commits pass `sync = false`: the journal
+/// record already holds the data.
+fn write_file(work_dir: &Path, name: &str, data: &[u8], mode: u32, sync: bool) -> Result<()> {
     let _lock = acquire_lock(work_dir, name, true, mode)?;
+    write_unlocked(work_dir, name, data, mode, sync)
+}
 
+/// Durably replaces `name` in the work directory with `data`, like
+/// [`store`], for files guarded by another lock the caller already holds
+/// (e.g. the pack index under the `PACK` lock).
+pub(crate) fn replace_file(work_dir: &Path, name: &str, data: &[u8], mode: u32) -> Result<()> {
+    write_unlocked(work_dir, name, data, mode, true)
+}
+
+/// The temp file and rename of [`write_file`], without taking a lock.
+fn write_unlocked(work_dir: &Path, name: &str, data: &[u8], mode: u32, sync: bool) -> Result<()> {
     // Write to temp file, then atomic rename for crash safety.
     let tmp_path = work_dir.join(format!("{}.tmp", name));
     let path = work_dir.join(name);
@@ -102,8 +179,10 @@ pub fn store(work_dir: &Path, name: &str, data: &[u8], mode: u32, dry_run: bool)
     let _tmp_cleanup = TmpCleanup(&tmp_path);
     file.write_all(data)
         .with_context(|| format!("failed to write to '{}'", tmp_path.display()))?;
-    file.sync_all()
-        .with_context(|| format!("failed to sync temp file '{}'", tmp_path.display()))?;
+    if sync {
+        file.sync_all()
+            .with_context(|| format!("failed to sync temp file '{}'", tmp_path.display()))?;
+    }
     drop(file);
 
     fs::rename(&tmp_path, &path).with_context(|| {
@@ -114,29 +193,48 @@ pub fn store(work_dir: &Path, name: &str, data: &[u8], mode: u32, dry_run: bool)
         )
     })?;
 
-    // Fsync the parent directory so the rename is durable. Per fsync(2),
-    // an fsync of the file does not flush its directory entry; without
-    // this the rename can be lost on power loss even though the file's
-    // contents made it to disk. Unix only: opening a directory handle
-    // for fsync is a POSIX idiom, and on Windows File::open on a
-    // directory fails with ERROR_ACCESS_DENIED.
-    #[cfg(unix)]
-    {
-        let dir = File::open(work_dir).with_context(|| {
-            format!(
-                "failed to open work directory '{}' for fsync",
-                work_dir.display()
-            )
-        })?;
-        dir.sync_all()
-            .with_context(|| format!("failed to fsync work directory '{}'", work_dir.display()))?;
+    if sync {
+        sync_dir(work_dir)?;
     }
 
-    // _lock dropped here, releasing exclusive lock.
     log::trace!("Stored {} bytes to '{}'", data.len(), path.display());
     Ok(())
 }
 
+/// Appends `data` to a file in the work directory under an exclusive lock,
+/// creating the file with permission bits `mode` if needed. Unlike [`store`]
+/// this is not atomic: a crash can leave a partial record at the end, so
+/// only use it for files whose readers tolerate a torn tail. With `sync`
+/// set the file is fsynced before returning; otherwise a crash may also lose
+/// the whole append. Nothing is written when `dry_run` is set.
+pub fn append(
+    work_dir: &Path,
+    name: &str,
+    data: &[u8],
+    mode: u32,
+    sync: bool,
+    dry_run: bool,
+) -> Result<()> {
+    if dry_run {
+        return Ok(());
+    }
+
+    let _lock = acquire_lock(work_dir, name, true, mode)?;
+    let path = work_dir.join(name);
+
+    let mut file = open_for_append(&path, mode)
+        .with_context(|| format!("failed to open '{}' for appending", path.display()))?;
+    file.write_all(data)
+        .with_context(|| format!("failed to append to '{}'", path.display()))?;
+    if sync {
+        file.sync_all()
+            .with_context(|| format!("failed to sync '{}'", path.display()))?;
+    }
+
+    log::trace!("Appended {} bytes to '{}'", data.len(), path.display());
+    Ok(())
+}
+
 /// Removes a file from the work directory using an exclusive lock. `mode`
 /// sets the Unix permission bits of the lock file if it must be created. When
 /// `dry_run` is set, nothing is removed; the intended removal is reported
@@ -177,18 +275,65 @@ pub fn remove(work_dir: &Path, name: &str, mode: u32, dry_run: bool) -> Result<(
 /// Loads data from a file in the work directory with a shared lock. `mode`
 /// sets the Unix permission bits of the lock file if it must be created.
 pub fn load(work_dir: &Path, name: &str, mode: u32) -> Result<Option<Vec<u8>>> {
+    let mut data = Vec::new();
+    if !load_into(work_dir, name, mode, &mut data)? {
+        return Ok(None);
+    }
+    Ok(Some(data))
+}
+
+/// Like [`load`], but reads into `buf` (cleared first) instead of a fresh
+/// allocation, so a caller loading many files in a row (blocks during
+/// consolidation, state segments) can reuse one buffer. Returns `false` if
+/// the file does not exist.
+pub fn load_into(work_dir: &Path, name: &str, mode: u32, buf: &mut Vec<u8>) -> Result<bool> {
+    buf.clear();
+    let Some((mut file, _lock)) = open_locked(work_dir, name, mode)? else {
+        return Ok(false);
+    };
     let path = work_dir.join(name);
+    file.read_to_end(buf)
+        .with_context(|| format!("failed to read from '{}'", path.display()))?;
+    log::trace!("Loaded {} bytes from '{}'", buf.len(), path.display());
+    Ok(true)
+}
 
-    let _lock = acquire_lock(work_dir, name, false, mode)?;
+/// Loads at most the first `limit` bytes of a file in the work directory
+/// with a shared lock. Used to decode small leading fields (e.g. a block
+/// header) without reading the rest of the file. A result shorter than
+/// `limit` is the whole file.
+pub fn load_prefix(
+    work_dir: &Path,
+    name: &str,
+    mode: u32,
+    limit: usize,
+) -> Result<Option<Vec<u8>>> {
+    let Some((file, _lock)) = open_locked(work_dir, name, mode)? else {
+        return Ok(None);
+    };
+    let path = work_dir.join(name);
+    let mut data = Vec::with_capacity(limit);
+    file.take(limit as u64)
+        .read_to_end(&mut data)
+        .with_context(|| format!("failed to read from '{}'", path.display()))?;
+    log::trace!(
+        "Loaded {} prefix bytes from '{}'",
+        data.len(),
+        path.display()
+    );
+    Ok(Some(data))
+}
+
+/// Opens a file in the work directory for reading under a shared lock.
+/// Returns the file together with the lock handle; keep the handle alive
+/// until the read is done.
+fn open_locked(work_dir: &Path, name: &str, mode: u32) -> Result<Option<(File, File)>> {
+    let path = work_dir.join(name);
+
+    let lock = acquire_lock(work_dir, name, false, mode)?;
 
     match File::open(&path) {
-        Ok(mut file) => {
-            let mut data = Vec::new();
-            file.read_to_end(&mut data)
-                .with_context(|| format!("failed to read from '{}'", path.display()))?;
-            log::trace!("Loaded {} bytes from '{}'", data.len(), path.display());
-            Ok(Some(data))
-        }
+        Ok(file) => Ok(Some((file, lock))),
         Err(e) if e.kind() == std::io::ErrorKind::NotFound => {
             log::trace!("File '{}' does not exist", path.display());
             Ok(None)
@@ -197,7 +342,10 @@ pub fn load(work_dir: &Path, name: &str, mode: u32) -> Result<Option<Vec<u8>>> {
     }
 }
 
-pub fn resolve_hash_prefix(work_dir: &Path, prefix: &str) -> Result<String> {
+/// Resolve `prefix` to the hash of a stored block, loose or packed, or to
+/// the genesis hash. `mode` sets the Unix permission bits of the pack lock
+/// file if it must be created.
+pub fn resolve_hash_prefix(work_dir: &Path, prefix: &str, mode: u32) -> Result<String> {
     let mut matches: Vec<String> = Vec::new();
 
     if GENESIS_HASH.starts_with(prefix) {
@@ -218,6 +366,12 @@ pub fn resolve_hash_prefix(work_dir: &Path, prefix: &str) -> Result<String> {
         }
     }
 
+    // A block is packed and loose at once while truncation is moving it into
+    // the pack, so duplicates are dropped.
+    matches.extend(pack::matching_prefix(work_dir, prefix, 2, mode)?);
+    matches.sort();
+    matches.dedup();
+
     match matches.as_slice() {
         [] => bail!("no block found matching prefix '{}'", prefix),
         [single] => Ok(single.clone()),
@@ -230,6 +384,301 @@ pub fn resolve_hash_prefix(work_dir: &Path, prefix: &str) -> Result<String> {
     }
 }
 
+impl fmt::Display for ProtoJournalEntry {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        if self.remove {
+            write!(f, "'{}' (remove)", self.name)
+        } else {
+            write!(f, "'{}' ({} bytes)", self.name, self.data.len())
+        }
+    }
+}
+
+impl fmt::Display for ProtoJournalCommit {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "Journal commit:")?;
+        for entry in &self.entries {
+            write!(f, "\n  {}", entry)?;
+        }
+        Ok(())
+    }
+}
+
+impl fmt::Display for ProtoJournalRecord {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "Journal record: {} bytes, checksum {:.7}...",
+            self.commit.len(),
+            self.checksum
+        )
+    }
+}
+
+/// The files written and removed by one commit, applied in the order they
+/// were added. See the module-level journal note for how it is committed.
+#[derive(Debug, Default)]
+pub struct Transaction {
+    entries: Vec<ProtoJournalEntry>,
+}
+
+impl Transaction {
+    /// Add a write of `data` to the file `name`.
+    pub fn store(&mut self, name: &str, data: Vec<u8>) {
+        self.entries.push(ProtoJournalEntry {
+            name: name.to_string(),
+            data,
+            remove: false,
+        });
+    }
+
+    /// Add a removal of the file `name`.
+    pub fn remove(&mut self, name: &str) {
+        self.entries.push(ProtoJournalEntry {
+            name: name.to_string(),
+            data: Vec::new(),
+            remove: true,
+        });
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    /// Apply the entries one by one with [`store`] and [`remove`], so every
+    /// write is fsynced on its own. A journal left by earlier journaled
+    /// commits is checkpointed first; otherwise a later recovery would roll
+    /// these writes back to the journaled contents. When `dry_run` is set,
+    /// the intended writes and removals are reported instead.
+    pub fn apply(self, work_dir: &Path, mode: u32, dry_run: bool) -> Result<()> {
+        if !dry_run && !journal_is_empty(work_dir) {
+            let _lock = acquire_lock(work_dir, JOURNAL_FILE, true, mode)?;
+            replay_journal(work_dir, mode, false, true)?;
+        }
+        for entry in self.entries {
+            if entry.remove {
+                remove(work_dir, &entry.name, mode, dry_run)?;
+            } else {
+                store(work_dir, &entry.name, &entry.data, mode, dry_run)?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Append the entries to `JOURNAL` as a single record, fsync it once, and
+    /// then apply them without syncing. Once the journal has grown to
+    /// `checkpoint_size` bytes, the journaled files are fsynced and the
+    /// journal is emptied. When `dry_run` is set this behaves like
+    /// [`Transaction::apply`].
+    pub fn commit_journaled(
+        self,
+        work_dir: &Path,
+        checkpoint_size: u64,
+        mode: u32,
+        dry_run: bool,
+    ) -> Result<()> {
+        if dry_run {
+            return self.apply(work_dir, mode, true);
+        }
+        if self.entries.is_empty() {
+            return Ok(());
+        }
+
+        fs::create_dir_all(work_dir)
+            .with_context(|| format!("failed to create work directory '{}'", work_dir.display()))?;
+        let _lock = acquire_lock(work_dir, JOURNAL_FILE, true, mode)?;
+
+        let commit = ProtoJournalCommit {
+            entries: self.entries,
+        };
+        let journal_size = append_journal_record(work_dir, &commit, mode)?;
+        for entry in &commit.entries {
+            if entry.remove {
+                remove(work_dir, &entry.name, mode, false)?;
+            } else {
+                write_file(work_dir, &entry.name, &entry.data, mode, false)?;
+            }
+        }
+        log::debug!(
+            "Committed {} journaled file(s), journal is now {} bytes",
+            commit.entries.len(),
+            journal_size
+        );
+
+        if journal_size >= checkpoint_size {
+            replay_journal(work_dir, mode, false, true)?;
+        }
+        Ok(())
+    }
+}
+
+/// Whether `work_dir` has no journal records, i.e. nothing to recover.
+pub fn journal_is_empty(work_dir: &Path) -> bool {
+    fs::metadata(work_dir.join(JOURNAL_FILE)).map_or(true, |metadata| metadata.len() == 0)
+}
+
+/// Bring the work directory up to date with the journal, restoring any file
+/// that a crash lost or tore since the last checkpoint. Takes the `chain`
+/// lock, so it must not be called while holding it. Cheap when the journal
+/// is empty, which is always the case unless journaled commits are enabled.
+/// When `dry_run` is set, the restores are reported instead.
+pub fn recover_journal(work_dir: &Path, mode: u32, dry_run: bool) -> Result<()> {
+    if journal_is_empty(work_dir) {
+        return Ok(());
+    }
+    let _chain_lock = acquire_lock(work_dir, "chain", true, mode)?;
+    let _lock = acquire_lock(work_dir, JOURNAL_FILE, true, mode)?;
+    replay_journal(work_dir, mode, dry_run, false)
+}
+
+/// Append `commit` to the journal as one checksummed record and fsync it.
+/// Returns the size of the journal afterwards. The caller holds the journal
+/// lock.
+fn append_journal_record(work_dir: &Path, commit: &ProtoJournalCommit, mode: u32) -> Result<u64> {
+    let encoded = commit.encode_to_vec();
+    let record = ProtoJournalRecord {
+        checksum: compute_hash(&encoded),
+        commit: encoded,
+    };
+
+    let path = work_dir.join(JOURNAL_FILE);
+    let created = !path.exists();
+    let mut file = open_for_append(&path, mode)
+        .with_context(|| format!("failed to open '{}' for appending", path.display()))?;
+    file.write_all(&record.encode_length_delimited_to_vec())
+        .with_context(|| format!("failed to append to '{}'", path.display()))?;
+    file.sync_data()
+        .with_context(|| format!("failed to sync '{}'", path.display()))?;
+    // The journal is emptied at checkpoints but never removed, so its
+    // directory entry only has to be made durable once.
+    if created {
+        sync_dir(work_dir)?;
+    }
+
+    let size = file
+        .metadata()
+        .with_context(|| format!("failed to stat '{}'", path.display()))?
+        .len();
+    log::trace!("{}", record);
+    Ok(size)
+}
+
+/// Read the journal records, oldest first. The second value tells whether
+/// the journal ends in a torn or corrupt record, which is dropped: its commit
+/// never completed. The caller holds the journal lock, so the file is read
+/// directly rather than through [`load`], whose shared lock would block on it.
+fn read_journal(work_dir: &Path) -> Result<(Vec<ProtoJournalCommit>, bool)> {
+    let path = work_dir.join(JOURNAL_FILE);
+    let data = match fs::read(&path) {
+        Ok(data) => data,
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => return Ok((Vec::new(), false)),
+        Err(e) => {
+            return Err(e).with_context(|| format!("failed to read '{}'", path.display()));
+        }
+    };
+
+    let mut commits = Vec::new();
+    let mut rest = data.as_slice();
+    while !rest.is_empty() {
+        let remaining = rest.len();
+        match decode_journal_record(&mut rest) {
+            Ok(commit) => commits.push(commit),
+            Err(e) => {
+                log::warn!(
+                    "Ignoring {} trailing byte(s) of {}: {:#}",
+                    remaining,
+                    JOURNAL_FILE,
+                    e
+                );
+                return Ok((commits, true));
+            }
+        }
+    }
+    Ok((commits, false))
+}
+
+fn decode_journal_record(buf: &mut &[u8]) -> Result<ProtoJournalCommit> {
+    let record = ProtoJournalRecord::decode_length_delimited(buf)
+        .context("failed to decode journal record")?;
+    if compute_hash(&record.commit) != record.checksum {
+        bail!("journal record checksum mismatch");
+    }
+    ProtoJournalCommit::decode(record.commit.as_slice()).context("failed to decode journal commit")
+}
+
+/// Whether the file `name` currently holds `expected`, where `None` means
+/// the file should not exist.
+fn matches_journal(work_dir: &Path, name: &str, expected: Option<&[u8]>) -> Result<bool> {
+    let path = work_dir.join(name);
+    match fs::read(&path) {
+        Ok(data) => Ok(expected == Some(data.as_slice())),
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => Ok(expected.is_none()),
+        Err(e) => Err(e).with_context(|| format!("failed to read '{}'", path.display())),
+    }
+}
+
+/// Replay the journal: every file a record wrote or removed is brought to
+/// the state the newest record left it in, skipping files that already
+/// match. The journaled files are then fsynced and the journal emptied when
+/// `checkpoint` is set, when anything had to be restored, or when the journal
+/// ends in a torn record (later appends must not land behind it). The caller
+/// holds the `chain` and journal locks.
+fn replay_journal(work_dir: &Path, mode: u32, dry_run: bool, checkpoint: bool) -> Result<()> {
+    let (commits, torn) = read_journal(work_dir)?;
+
+    // Later records win; `None` marks a file that ends up removed.
+    let mut files: BTreeMap<String, Option<Vec<u8>>> = BTreeMap::new();
+    for commit in commits {
+        for entry in commit.entries {
+            let data = (!entry.remove).then_some(entry.data);
+            files.insert(entry.name, data);
+        }
+    }
+
+    let mut restored = 0;
+    for (name, data) in &files {
+        if matches_journal(work_dir, name, data.as_deref())? {
+            continue;
+        }
+        if !dry_run {
+            log::info!("Restoring '{}' from the journal", name);
+        }
+        match data {
+            Some(data) => store(work_dir, name, data, mode, dry_run)?,
+            None => remove(work_dir, name, mode, dry_run)?,
+        }
+        restored += 1;
+    }
+
+    if dry_run || !(checkpoint || torn || restored > 0) {
+        return Ok(());
+    }
+
+    for name in files
+        .iter()
+        .filter(|(_, data)| data.is_some())
+        .map(|(name, _)| name)
+    {
+        let path = work_dir.join(name);
+        File::open(&path)
+            .and_then(|file| file.sync_all())
+            .with_context(|| format!("failed to sync '{}'", path.display()))?;
+    }
+    sync_dir(work_dir)?;
+
+    let path = work_dir.join(JOURNAL_FILE);
+    create_file(&path, mode)
+        .and_then(|file| file.sync_all())
+        .with_context(|| format!("failed to empty '{}'", path.display()))?;
+    log::debug!(
+        "Checkpointed {} with {} file(s), {} restored",
+        JOURNAL_FILE,
+        files.len(),
+        restored
+    );
+    Ok(())
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -317,13 +766,171 @@ mod tests {
         assert!(result.is_err());
     }
 
+    #[test]
+    fn test_append_extends_file() {
+        let dir = tempdir().unwrap();
+        append(dir.path(), "log", b"abc", 0o600, true, false).unwrap();
+        append(dir.path(), "log", b"def", 0o600, false, false).unwrap();
+        append(dir.path(), "log", b"ghi", 0o600, true, true).unwrap();
+        assert_eq!(load(dir.path(), "log", 0o600).unwrap().unwrap(), b"abcdef");
+    }
+
+    fn journaled(entries: &[(&str, Option<&[u8]>)]) -> Transaction {
+        let mut transaction = Transaction::default();
+        for (name, data) in entries {
+            match data {
+                Some(data) => transaction.store(name, data.to_vec()),
+                None => transaction.remove(name),
+            }
+        }
+        transaction
+    }
+
+    #[test]
+    fn test_journaled_commit_applies_and_records() {
+        let dir = tempdir().unwrap();
+        journaled(&[("a", Some(b"one")), ("HEAD", Some(b"h1"))])
+            .commit_journaled(dir.path(), u64::MAX, 0o600, false)
+            .unwrap();
+
+        assert_eq!(fs::read(dir.path().join("a")).unwrap(), b"one");
+        assert_eq!(fs::read(dir.path().join("HEAD")).unwrap(), b"h1");
+        assert!(!journal_is_empty(dir.path()));
+        let (commits, torn) = read_journal(dir.path()).unwrap();
+        assert_eq!(commits.len(), 1);
+        assert_eq!(commits[0].entries.len(), 2);
+        assert!(!torn);
+    }
+
+    #[test]
+    fn test_recover_journal_restores_lost_files() {
+        let dir = tempdir().unwrap();
+        journaled(&[("a", Some(b"one")), ("HEAD", Some(b"h1"))])
+            .commit_journaled(dir.path(), u64::MAX, 0o600, false)
+            .unwrap();
+        journaled(&[("b", Some(b"two")), ("a", None), ("HEAD", Some(b"h2"))])
+            .commit_journaled(dir.path(), u64::MAX, 0o600, false)
+            .unwrap();
+
+        // Simulate a crash that lost the unsynced writes of the last commit.
+        fs::remove_file(dir.path().join("b")).unwrap();
+        fs::write(dir.path().join("a"), b"one").unwrap();
+        fs::write(dir.path().join("HEAD"), b"").unwrap();
+
+        recover_journal(dir.path(), 0o600, false).unwrap();
+        assert_eq!(fs::read(dir.path().join("b")).unwrap(), b"two");
+        assert_eq!(fs::read(dir.path().join("HEAD")).unwrap(), b"h2");
+        assert!(!dir.path().join("a").exists());
+        assert!(journal_is_empty(dir.path()));
+    }
+
+    #[test]
+    fn test_recover_journal_keeps_journal_when_intact() {
+        let dir = tempdir().unwrap();
+        journaled(&[("a", Some(b"one"))])
+            .commit_journaled(dir.path(), u64::MAX, 0o600, false)
+            .unwrap();
+
+        recover_journal(dir.path(), 0o600, false).unwrap();
+        assert!(!journal_is_empty(dir.path()));
+    }
+
+    #[test]
+    fn test_recover_journal_drops_torn_record() {
+        let dir = tempdir().unwrap();
+        journaled(&[("a", Some(b"one"))])
+            .commit_journaled(dir.path(), u64::MAX, 0o600, false)
+            .unwrap();
+        let torn = ProtoJournalRecord {
+            commit: ProtoJournalCommit {
+                entries: vec![ProtoJournalEntry {
+                    name: "a".to_string(),
+                    data: b"two".to_vec(),
+                    remove: false,
+                }],
+            }
+            .encode_to_vec(),
+            checksum: "0".repeat(40),
+        };
+        append(
+            dir.path(),
+            JOURNAL_FILE,
+            &torn.encode_length_delimited_to_vec(),
+            0o600,
+            true,
+            false,
+        )
+        .unwrap();
+
+        recover_journal(dir.path(), 0o600, false).unwrap();
+        assert_eq!(fs::read(dir.path().join("a")).unwrap(), b"one");
+        assert!(journal_is_empty(dir.path()));
+    }
+
+    #[test]
+    fn test_journal_checkpoints_at_size() {
+        let dir = tempdir().unwrap();
+        journaled(&[("a", Some(b"one"))])
+            .commit_journaled(dir.path(), 1, 0o600, false)
+            .unwrap();
+        assert_eq!(fs::read(dir.path().join("a")).unwrap(), b"one");
+        assert!(journal_is_empty(dir.path()));
+    }
+
+    #[test]
+    fn test_apply_checkpoints_pending_journal() {
+        let dir = tempdir().unwrap();
+        journaled(&[("HEAD", Some(b"h1"))])
+            .commit_journaled(dir.path(), u64::MAX, 0o600, false)
+            .unwrap();
+        journaled(&[("HEAD", Some(b"h2"))])
+            .apply(dir.path(), 0o600, false)
+            .unwrap();
+        assert!(journal_is_empty(dir.path()));
+
+        // A later recovery must not roll HEAD back to the journaled value.
+        recover_journal(dir.path(), 0o600, false).unwrap();
+        assert_eq!(fs::read(dir.path().join("HEAD")).unwrap(), b"h2");
+    }
+
+    #[test]
+    fn test_load_into_reuses_buffer() {
+        let dir = tempdir().unwrap();
+        store(dir.path(), "a", b"first file", 0o600, false).unwrap();
+        store(dir.path(), "b", b"second", 0o600, false).unwrap();
+
+        let mut buf = Vec::new();
+        assert!(load_into(dir.path(), "a", 0o600, &mut buf).unwrap());
+        assert_eq!(buf, b"first file");
+        assert!(load_into(dir.path(), "b", 0o600, &mut buf).unwrap());
+        assert_eq!(buf, b"second");
+        assert!(!load_into(dir.path(), "missing", 0o600, &mut buf).unwrap());
+        assert!(buf.is_empty());
+    }
+
+    #[test]
+    fn test_load_prefix_caps_read() {
+        let dir = tempdir().unwrap();
+        store(dir.path(), "a", b"0123456789", 0o600, false).unwrap();
+
+        let prefix = load_prefix(dir.path(), "a", 0o600, 4).unwrap().unwrap();
+        assert_eq!(prefix, b"0123");
+        let whole = load_prefix(dir.path(), "a", 0o600, 64).unwrap().unwrap();
+        assert_eq!(whole, b"0123456789");
+        assert!(
+            load_prefix(dir.path(), "missing", 0o600, 4)
+                .unwrap()
+                .is_none()
+        );
+    }
+
     #[test]
     fn test_resolve_hash_prefix_exact_match() {
         let dir = tempdir().unwrap();
         let hash = "abcdef1234567890abcdef1234567890abcdef12";
         File::create(dir.path().join(hash)).unwrap();
 
-        let result = resolve_hash_prefix(dir.path(), "abcdef").unwrap();
+        let result = resolve_hash_prefix(dir.path(), "abcdef", 0o600).unwrap();
         assert_eq!(result, hash);
     }
 
@@ -333,7 +940,7 @@ mod tests {
         let hash = "abcdef1234567890abcdef1234567890abcdef12";
         File::create(dir.path().join(hash)).unwrap();
 
-        let result = resolve_hash_prefix(dir.path(), hash).unwrap();
+        let result = resolve_hash_prefix(dir.path(), hash, 0o600).unwrap();
         assert_eq!(result, hash);
     }
 
@@ -343,7 +950,7 @@ mod tests {
         let hash = "abcdef1234567890abcdef1234567890abcdef12";
         File::create(dir.path().join(hash)).unwrap();
 
-        let result = resolve_hash_prefix(dir.path(), "ffffff");
+        let result = resolve_hash_prefix(dir.path(), "ffffff", 0o600);
         assert!(result.is_err());
     }
 
@@ -353,7 +960,7 @@ mod tests {
         File::create(dir.path().join("abcdef1234567890abcdef1234567890abcdef12")).unwrap();
         File::create(dir.path().join("abcdef5678901234567890abcdef1234567890ab")).unwrap();
 
-        let result = resolve_hash_prefix(dir.path(), "abcdef");
+        let result = resolve_hash_prefix(dir.path(), "abcdef", 0o600);
         assert!(result.is_err());
     }
 
@@ -361,7 +968,7 @@ mod tests {
     fn test_resolve_hash_prefix_genesis_hash() {
         let dir = tempdir().unwrap();
 
-        let result = resolve_hash_prefix(dir.path(), "00000").unwrap();
+        let result = resolve_hash_prefix(dir.path(), "00000", 0o600).unwrap();
         assert_eq!(result, GENESIS_HASH);
     }
 
@@ -373,7 +980,34 @@ mod tests {
         // Right length but contains non-hex characters
         File::create(dir.path().join("abcdef1234567890abcdef1234567890abcdefGH")).unwrap();
 
-        let result = resolve_hash_prefix(dir.path(), "abcdef");
+        let result = resolve_hash_prefix(dir.path(), "abcdef", 0o600);
         assert!(result.is_err());
     }
+
+    #[test]
+    fn test_resolve_hash_prefix_finds_packed_blocks() {
+        let dir = tempdir().unwrap();
+        let data = b"packed block";
+        let hash = compute_hash(data);
+        store(dir.path(), &hash, data, 0o600, false).unwrap();
+        pack::update(
+            dir.path(),
+            &[hash.clone()],
+            &Default::default(),
+            0o600,
+            false,
+        )
+        .unwrap();
+
+        // Loose and packed at once still resolves to a single block.
+        assert_eq!(
+            resolve_hash_prefix(dir.path(), &hash[..8], 0o600).unwrap(),
+            hash
+        );
+        remove(dir.path(), &hash, 0o600, false).unwrap();
+        assert_eq!(
+            resolve_hash_prefix(dir.path(), &hash[..8], 0o600).unwrap(),
+            hash
+        );
+    }
 }
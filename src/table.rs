@@ -1,14 +1,16 @@
-use std::collections::HashMap;
+use std::collections::hash_map::Entry;
 use std::fmt;
 use std::fs::File;
 use std::path::Path;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
 
 use anyhow::{Context, Result};
 
-use crate::callbacks::{CellResult, TableCallbacks};
-use crate::cell::{Cell, Kind, display_proto_cells, parse_boolean, parse_typed_cell};
+use crate::callbacks::{BatchResult, CellResult, TableCallbacks};
+use crate::cell::{Cell, Interner, Kind, display_proto_cells, parse_boolean, parse_typed_cell};
 use crate::config::{CsvConfig, FieldConfig, TableConfig};
-use crate::record::decode_proto_records;
+use crate::record::{Record, RecordMap, decode_proto_records};
+use crate::utils::{compute_hash, compute_reader_hash};
 
 type ProtoTable = crate::proto::table::Table;
 
@@ -27,6 +29,82 @@ struct CanonicalLayout<'a> {
     subsidiary: CanonicalColumns<'a>,
 }
 
+/// Sources modified less than this long before they are fingerprinted are
+/// not fingerprinted at all: a rewrite landing in the same timestamp tick
+/// could otherwise keep both size and mtime and go unnoticed.
+const RACY_MTIME_WINDOW: Duration = Duration::from_secs(2);
+
+/// Rows requested per `read_batch` call for callback-backed tables.
+const CALLBACK_BATCH_ROWS: usize = 1024;
+
+/// Identity of a CSV source file at the time its table was loaded. STATE
+/// records it per table, and a later block that computes an equal
+/// fingerprint reuses the stored table instead of parsing the file again.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct SourceFingerprint {
+    /// File size in bytes.
+    pub size: u64,
+    /// Modification time in nanoseconds since the Unix epoch.
+    pub mtime_nanos: u64,
+    /// SHA-1 of the file contents; empty when `csv.trust-mtime` is set.
+    pub content_hash: String,
+    /// SHA-1 of the table configuration, so that editing fields, sentinels or
+    /// filters forces a reload even though the file did not change.
+    pub config_hash: String,
+}
+
+impl SourceFingerprint {
+    /// Fingerprint the CSV source of a table. Returns `None` for
+    /// callback-backed tables and for sources too recently modified to be
+    /// trusted (see [`RACY_MTIME_WINDOW`]); such tables are simply parsed.
+    pub fn of_csv(work_dir: &Path, config: &TableConfig) -> Result<Option<Self>> {
+        let Some(csv) = config.csv.as_ref() else {
+            return Ok(None);
+        };
+        let path = work_dir.join(&csv.source);
+        let mut file =
+            File::open(&path).with_context(|| format!("failed to open '{}'", path.display()))?;
+        file.lock_shared()
+            .with_context(|| format!("failed to acquire shared lock on '{}'", path.display()))?;
+        let metadata = file
+            .metadata()
+            .with_context(|| format!("failed to stat '{}'", path.display()))?;
+        let modified = metadata
+            .modified()
+            .with_context(|| format!("failed to read mtime of '{}'", path.display()))?;
+
+        // A modification time in the future reads as zero age, so it is never
+        // trusted either.
+        let age = SystemTime::now()
+            .duration_since(modified)
+            .unwrap_or_default();
+        let Ok(since_epoch) = modified.duration_since(UNIX_EPOCH) else {
+            return Ok(None);
+        };
+        if age < RACY_MTIME_WINDOW {
+            log::debug!(
+                "CSV source '{}' was modified too recently to fingerprint",
+                path.display()
+            );
+            return Ok(None);
+        }
+
+        let content_hash = if csv.trust_mtime {
+            String::new()
+        } else {
+            compute_reader_hash(&mut file)
+                .with_context(|| format!("failed to hash '{}'", path.display()))?
+        };
+
+        Ok(Some(Self {
+            size: metadata.len(),
+            mtime_nanos: u64::try_from(since_epoch.as_nanos()).unwrap_or(u64::MAX),
+            content_hash,
+            config_hash: compute_hash(format!("{:?}", config).as_bytes()),
+        }))
+    }
+}
+
 /// A table with records stored in a hash map for efficient lookup.
 #[derive(Debug, Clone, PartialEq)]
 pub struct Table {
@@ -35,7 +113,7 @@ pub struct Table {
     /// The subsidiary (non-key) field names, in tuple order.
     pub subsidiary_value_names: Vec<String>,
     /// Map from primary key values to subsidiary values.
-    pub records: HashMap<Vec<Cell>, Vec<Cell>>,
+    pub records: RecordMap,
 }
 
 impl TryFrom<ProtoTable> for Table {
@@ -51,14 +129,101 @@ impl TryFrom<ProtoTable> for Table {
     }
 }
 
+/// Records are emitted sorted by primary key, so STATE (and state payloads)
+/// are deterministic and can be read back as a [`SortedTable`] without
+/// re-sorting.
 impl From<Table> for ProtoTable {
     fn from(table: Table) -> Self {
-        let records = table.records.into_iter().map(Into::into).collect();
+        let records = SortedTable::from(table);
         ProtoTable {
+            primary_key_names: records.primary_key_names,
+            subsidiary_value_names: records.subsidiary_value_names,
+            records: records.records.into_iter().map(Into::into).collect(),
+        }
+    }
+}
+
+/// FNV-1a offset basis and prime, for [`partition_of`].
+const FNV_OFFSET: u64 = 0xcbf2_9ce4_8422_2325;
+const FNV_PRIME: u64 = 0x0000_0100_0000_01b3;
+
+fn fnv1a(hash: u64, bytes: &[u8]) -> u64 {
+    bytes.iter().fold(hash, |hash, &b| {
+        (hash ^ u64::from(b)).wrapping_mul(FNV_PRIME)
+    })
+}
+
+/// Partition of a table with `partitions` partitions that the record keyed by
+/// `key` belongs to. The hash covers a fixed encoding of each cell (kind tag,
+/// then payload) and not [`std::hash::Hash`], whose output may change between
+/// Rust releases: a record must land in the same partition on every run, or
+/// it would show up as deleted from one partition and inserted into another.
+pub fn partition_of(key: &[Cell], partitions: u32) -> u32 {
+    let mut hash = FNV_OFFSET;
+    for cell in key {
+        hash = match cell {
+            Cell::Null => fnv1a(hash, &[0]),
+            Cell::Boolean(b) => fnv1a(fnv1a(hash, &[1]), &[u8::from(*b)]),
+            Cell::Number(n) => fnv1a(fnv1a(hash, &[2]), &n.to_bits().to_le_bytes()),
+            Cell::Text(s) => {
+                let hash = fnv1a(fnv1a(hash, &[3]), &(s.len() as u64).to_le_bytes());
+                fnv1a(hash, s.as_bytes())
+            }
+        };
+    }
+    (hash % u64::from(partitions.max(1))) as u32
+}
+
+/// A table with records held in a vector sorted by primary key.
+///
+/// Used for the previous side of a diff: its records are only ever visited
+/// once, in key order, so decoding STATE straight into a vector avoids
+/// building (and rehashing every key into) the map of a [`Table`].
+#[derive(Debug, Clone, PartialEq)]
+pub struct SortedTable {
+    /// The primary-key field names, in tuple order.
+    pub primary_key_names: Vec<String>,
+    /// The subsidiary (non-key) field names, in tuple order.
+    pub subsidiary_value_names: Vec<String>,
+    /// `(key, value)` pairs in ascending key order.
+    pub records: Vec<(Vec<Cell>, Vec<Cell>)>,
+}
+
+impl SortedTable {
+    fn sort(&mut self) {
+        // Already-sorted input (every STATE written since records were
+        // stored in key order) is detected in a single linear pass.
+        self.records.sort_unstable_by(|a, b| a.0.cmp(&b.0));
+    }
+}
+
+impl TryFrom<ProtoTable> for SortedTable {
+    type Error = anyhow::Error;
+
+    fn try_from(proto: ProtoTable) -> Result<Self> {
+        let mut records: Vec<(Vec<Cell>, Vec<Cell>)> = Vec::with_capacity(proto.records.len());
+        for proto_record in proto.records {
+            records.push(Record::try_from(proto_record)?.into());
+        }
+        let mut table = SortedTable {
+            primary_key_names: proto.primary_key_names,
+            subsidiary_value_names: proto.subsidiary_value_names,
+            records,
+        };
+        table.sort();
+        Ok(table)
+    }
+}
+
+impl From<Table> for SortedTable {
+    fn from(table: Table) -> Self {
+        let mut sorted = SortedTable {
             primary_key_names: table.primary_key_names,
             subsidiary_value_names: table.subsidiary_value_names,
-            records,
-        }
+            records: table.records.into_iter().collect(),
+        };
+        sorted.sort();
+        sorted
     }
 }
 
@@ -80,6 +245,27 @@ impl fmt::Display for ProtoTable {
 }
 
 impl Table {
+    /// Split the table into `partitions` tables by [`partition_of`] the
+    /// primary key. Partition `i` is at index `i`.
+    pub fn into_partitions(self, partitions: u32) -> Vec<Table> {
+        let count = partitions.max(1) as usize;
+        let mut split: Vec<Table> = (0..count)
+            .map(|_| Table {
+                primary_key_names: self.primary_key_names.clone(),
+                subsidiary_value_names: self.subsidiary_value_names.clone(),
+                records: RecordMap::with_capacity_and_hasher(
+                    self.records.len() / count,
+                    Default::default(),
+                ),
+            })
+            .collect();
+        for (key, value) in self.records {
+            let index = partition_of(&key, partitions) as usize;
+            split[index].records.insert(key, value);
+        }
+        split
+    }
+
     /// Loads a table from a CSV file. The table's `csv` block must be
     /// `Some`; callers (currently `State::compute`) check this before
     /// dispatching here.
@@ -120,7 +306,8 @@ impl Table {
     /// returns `LCH_END_OF_TABLE`. Within a row, leech2 requests cells in
     /// canonical order (primary keys lex-sorted, then subsidiaries lex-sorted)
     /// and the `col` it passes is the field's 0-based position in
-    /// `config.fields` (declaration order).
+    /// `config.fields` (declaration order). When the bundle provides
+    /// `read_batch`, rows are pulled in blocks through it instead.
     pub fn load_from_callbacks(
         name: &str,
         config: &TableConfig,
@@ -145,20 +332,45 @@ impl Table {
             .map(|(_, field)| field.name.clone())
             .collect();
 
-        let mut records: HashMap<Vec<Cell>, Vec<Cell>> = HashMap::new();
-        let mut row: usize = 0;
+        let mut records = RecordMap::default();
+        let mut interner = Interner::new();
+
+        if callbacks.has_read_batch() {
+            load_callback_batches(
+                callbacks,
+                &primary_columns,
+                &subsidiary_columns,
+                &mut records,
+                &mut interner,
+            )?;
+            log::debug!(
+                "Loaded table '{}' with {} records from batch callback",
+                name,
+                records.len()
+            );
+            return Ok(Table {
+                primary_key_names,
+                subsidiary_value_names,
+                records,
+            });
+        }
 
+        let mut row: usize = 0;
         loop {
-            let outcome =
-                fetch_callback_row(name, callbacks, row, &primary_columns, &subsidiary_columns)?;
+            let outcome = fetch_callback_row(
+                name,
+                callbacks,
+                row,
+                &primary_columns,
+                &subsidiary_columns,
+                &mut interner,
+            )?;
             match outcome {
                 RowOutcome::Row {
                     primary_key,
                     subsidiary,
                 } => {
-                    if records.insert(primary_key.clone(), subsidiary).is_some() {
-                        anyhow::bail!("duplicate primary key {:?}", primary_key);
-                    }
+                    insert_record(&mut records, primary_key, subsidiary)?;
                     row += 1;
                 }
                 RowOutcome::Filtered => {
@@ -269,10 +481,17 @@ impl Table {
             .map(|(_, field)| field.name.clone())
             .collect();
 
-        let mut records: HashMap<Vec<Cell>, Vec<Cell>> = HashMap::new();
+        let mut records = RecordMap::default();
+        let mut interner = Interner::new();
+        let row_filter = csv.row_filter(&field_names);
 
-        for (row_num, record) in reader.into_records().enumerate() {
-            let record = record?;
+        // One record buffer is reused for every row, so reading a row only
+        // allocates when it is longer than any row before it.
+        let mut record = csv::StringRecord::new();
+        for row_num in 0.. {
+            if !reader.read_record(&mut record)? {
+                break;
+            }
 
             if !csv.header && record.len() != field_names.len() {
                 anyhow::bail!(
@@ -283,21 +502,22 @@ impl Table {
                 );
             }
 
-            let values: Vec<&str> = field_indices.iter().map(|&i| &record[i]).collect();
-            let reason = csv.should_filter(&field_names, &values);
+            let reason = row_filter.check(|position| {
+                field_indices
+                    .get(position)
+                    .and_then(|&index| record.get(index))
+            });
             if let Some(reason) = reason {
                 log::debug!("Filtered record at row {}: {}", row_num + 1, reason);
                 continue;
             }
 
-            let primary_key = parse_columns(&record, &primary_columns, csv)
+            let primary_key = parse_columns(&record, &primary_columns, csv, &mut interner)
                 .with_context(|| format!("row {}", row_num + 1))?;
-            let subsidiary = parse_columns(&record, &subsidiary_columns, csv)
+            let subsidiary = parse_columns(&record, &subsidiary_columns, csv, &mut interner)
                 .with_context(|| format!("row {}", row_num + 1))?;
 
-            if records.insert(primary_key.clone(), subsidiary).is_some() {
-                anyhow::bail!("duplicate primary key {:?}", primary_key);
-            }
+            insert_record(&mut records, primary_key, subsidiary)?;
         }
 
         Ok(Table {
@@ -308,17 +528,86 @@ impl Table {
     }
 }
 
+/// Insert a freshly loaded record, rejecting a primary key seen before. The
+/// entry API keeps the key out of the duplicate check, so no row pays for a
+/// clone it only needs on the error path.
+fn insert_record(
+    records: &mut RecordMap,
+    primary_key: Vec<Cell>,
+    subsidiary: Vec<Cell>,
+) -> Result<()> {
+    match records.entry(primary_key) {
+        Entry::Occupied(entry) => anyhow::bail!("duplicate primary key {:?}", entry.key()),
+        Entry::Vacant(entry) => {
+            entry.insert(subsidiary);
+            Ok(())
+        }
+    }
+}
+
 /// For each `(column_index, field_config)` entry, pull the value at
 /// `column_index` out of `record` and parse it into a typed `Cell`
-/// according to `field_config` and the table's CSV sentinels.
+/// according to `field_config` and the table's CSV sentinels. Text values
+/// are deduplicated through `interner`.
 fn parse_columns(
     record: &csv::StringRecord,
     columns: &[(usize, &FieldConfig)],
     csv: &CsvConfig,
+    interner: &mut Interner,
 ) -> Result<Vec<Cell>> {
     let mut out = Vec::with_capacity(columns.len());
     for &(column_index, field) in columns {
-        out.push(parse_field_value(&record[column_index], field, csv)?);
+        out.push(parse_field_value(
+            &record[column_index],
+            field,
+            csv,
+            interner,
+        )?);
+    }
+    Ok(out)
+}
+
+/// Pull every row of a table through the caller's `read_batch` hook, up to
+/// [`CALLBACK_BATCH_ROWS`] rows per call. Cells arrive in declaration order
+/// and are moved into canonical key/value order here.
+fn load_callback_batches(
+    callbacks: &TableCallbacks<'_>,
+    primary_columns: &[(usize, &FieldConfig)],
+    subsidiary_columns: &[(usize, &FieldConfig)],
+    records: &mut RecordMap,
+    interner: &mut Interner,
+) -> Result<()> {
+    let mut batch = Vec::new();
+    let mut row: usize = 0;
+    loop {
+        let num_rows = match callbacks.read_batch(row, CALLBACK_BATCH_ROWS, &mut batch)? {
+            BatchResult::Rows(num_rows) => num_rows,
+            BatchResult::EndOfTable => return Ok(()),
+        };
+        let num_cols = batch.len() / num_rows;
+        for (offset, cells) in batch.chunks_exact_mut(num_cols).enumerate() {
+            let primary_key = take_batch_columns(cells, primary_columns, row + offset, interner)?;
+            let subsidiary = take_batch_columns(cells, subsidiary_columns, row + offset, interner)?;
+            insert_record(records, primary_key, subsidiary)?;
+        }
+        row += num_rows;
+    }
+}
+
+/// Move the cells of `columns` out of one batched row, validating each
+/// against its field.
+fn take_batch_columns(
+    cells: &mut [Cell],
+    columns: &[(usize, &FieldConfig)],
+    row: usize,
+    interner: &mut Interner,
+) -> Result<Vec<Cell>> {
+    let mut out = Vec::with_capacity(columns.len());
+    for &(decl_idx, field_cfg) in columns {
+        let cell = std::mem::replace(&mut cells[decl_idx], Cell::Null);
+        validate_cell(&cell, field_cfg)
+            .with_context(|| format!("row {} field '{}'", row + 1, field_cfg.name))?;
+        out.push(interner.intern(cell));
     }
     Ok(out)
 }
@@ -334,13 +623,15 @@ enum RowOutcome {
 }
 
 /// Walk all canonical columns of a single row, returning what the caller said
-/// about that row: a populated row, a filtered row, or end-of-table.
+/// about that row: a populated row, a filtered row, or end-of-table. Text
+/// cells are swapped for their `interner` copies as they arrive.
 fn fetch_callback_row(
     name: &str,
     callbacks: &TableCallbacks<'_>,
     row: usize,
     primary_columns: &[(usize, &FieldConfig)],
     subsidiary_columns: &[(usize, &FieldConfig)],
+    interner: &mut Interner,
 ) -> Result<RowOutcome> {
     let mut primary_key: Vec<Cell> = Vec::with_capacity(primary_columns.len());
     let mut subsidiary: Vec<Cell> = Vec::with_capacity(subsidiary_columns.len());
@@ -354,7 +645,7 @@ fn fetch_callback_row(
                 CellResult::Cell(cell) => {
                     validate_cell(&cell, field_cfg)
                         .with_context(|| format!("row {} field '{}'", row + 1, field_cfg.name))?;
-                    group_out.push(cell);
+                    group_out.push(interner.intern(cell));
                 }
                 CellResult::EndOfTable => return Ok(RowOutcome::EndOfTable),
                 CellResult::SkipRecord => {
@@ -404,8 +695,13 @@ fn validate_cell(cell: &Cell, field: &FieldConfig) -> Result<()> {
 /// (rejected on primary-key fields); BOOLEAN values match against
 /// `csv.true` / `csv.false` (falling back to the strict defaults `"true"` /
 /// `"false"` when the pattern is unset); other values parse by the field's
-/// declared kind.
-fn parse_field_value(value: &str, field: &FieldConfig, csv: &CsvConfig) -> Result<Cell> {
+/// declared kind, with TEXT values taken from `interner`.
+fn parse_field_value(
+    value: &str,
+    field: &FieldConfig,
+    csv: &CsvConfig,
+    interner: &mut Interner,
+) -> Result<Cell> {
     if let Some(pattern) = &csv.null_pattern
         && pattern.is_match(value)
     {
@@ -423,13 +719,16 @@ fn parse_field_value(value: &str, field: &FieldConfig, csv: &CsvConfig) -> Resul
             .map(Cell::Boolean)
             .with_context(|| format!("field '{}'", field.name));
     }
+    if let Kind::Text = field.kind {
+        return Ok(interner.text(value));
+    }
     parse_typed_cell(value, field.kind).with_context(|| format!("field '{}'", field.name))
 }
 
 #[cfg(test)]
 mod tests {
     use super::*;
-    use crate::config::FieldConfig;
+    use crate::config::{FieldConfig, FilterConfig};
     use regex::Regex;
 
     fn make_field(name: &str, primary_key: bool) -> FieldConfig {
@@ -452,6 +751,8 @@ mod tests {
         TableConfig {
             fields,
             csv: Some(make_csv(header)),
+            thread_safe: false,
+            partitions: 1,
         }
     }
 
@@ -459,6 +760,8 @@ mod tests {
         TableConfig {
             fields,
             csv: Some(csv),
+            thread_safe: false,
+            partitions: 1,
         }
     }
 
@@ -616,6 +919,53 @@ mod tests {
         );
     }
 
+    #[test]
+    fn test_parse_csv_filters_by_header_position() {
+        // The filter field sits at a different CSV column than its position
+        // in the config; the row filter must follow the header mapping.
+        let csv = CsvConfig {
+            source: "test.csv".to_string(),
+            header: true,
+            filter: Some(FilterConfig {
+                fields: vec!["status".to_string()],
+                include: Some(Regex::new("^active$").unwrap()),
+                exclude: None,
+            }),
+            ..Default::default()
+        };
+        let config = make_config_with_csv(
+            vec![make_field("id", true), make_field("status", false)],
+            csv,
+        );
+        let reader = Table::test_reader("status,id\nactive,1\ngone,2\nactive,3\n", true);
+        let table = Table::parse_csv(&config, reader).unwrap();
+
+        assert_eq!(table.records.len(), 2);
+        assert!(table.records.contains_key(&vec!["1".into()]));
+        assert!(!table.records.contains_key(&vec!["2".into()]));
+    }
+
+    #[test]
+    fn test_parse_csv_rejects_duplicate_primary_key() {
+        let config = make_config(vec![make_field("id", true), make_field("v", false)], false);
+        let reader = Table::test_reader("1,a\n1,b\n", false);
+        let err = Table::parse_csv(&config, reader).unwrap_err();
+        assert!(format!("{:#}", err).contains("duplicate primary key"));
+    }
+
+    #[test]
+    fn test_parse_csv_shares_repeated_text() {
+        let config = make_config(vec![make_field("id", true), make_field("os", false)], true);
+        let reader = Table::test_reader("id,os\n1,debian\n2,debian\n", true);
+        let table = Table::parse_csv(&config, reader).unwrap();
+
+        let os_of = |id: &str| match table.records.get(&vec![id.into()]).unwrap().as_slice() {
+            [Cell::Text(s)] => std::sync::Arc::clone(s),
+            other => panic!("unexpected subsidiary {:?}", other),
+        };
+        assert!(std::sync::Arc::ptr_eq(&os_of("1"), &os_of("2")));
+    }
+
     // -- resolve_field_indices tests --
 
     #[test]
@@ -879,14 +1229,55 @@ mod tests {
     #[test]
     fn test_validate_cell_rejects_kind_mismatch() {
         let field = make_typed_field("count", Kind::Number, false);
-        let err = validate_cell(&Cell::Text("oops".to_string()), &field).unwrap_err();
+        let err = validate_cell(&Cell::Text("oops".into()), &field).unwrap_err();
         assert!(format!("{:#}", err).contains("kind"), "got: {err:#}");
     }
 
     #[test]
     fn test_validate_cell_accepts_matching_kind() {
         let field = make_typed_field("name", Kind::Text, true);
-        validate_cell(&Cell::Text("Alice".to_string()), &field).unwrap();
+        validate_cell(&Cell::Text("Alice".into()), &field).unwrap();
+    }
+
+    // -- ordering tests --
+
+    fn unsorted_table() -> Table {
+        let records = [("3", "c"), ("1", "a"), ("2", "b")]
+            .iter()
+            .map(|(key, value)| (vec![Cell::from(*key)], vec![Cell::from(*value)]))
+            .collect();
+        Table {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: vec!["name".to_string()],
+            records,
+        }
+    }
+
+    #[test]
+    fn test_proto_table_records_sorted_by_key() {
+        let proto = ProtoTable::from(unsorted_table());
+        let keys: Vec<Vec<Cell>> = proto
+            .records
+            .into_iter()
+            .map(|record| Record::try_from(record).unwrap().key)
+            .collect();
+        assert_eq!(
+            keys,
+            vec![
+                vec![Cell::from("1")],
+                vec![Cell::from("2")],
+                vec![Cell::from("3")]
+            ]
+        );
+    }
+
+    #[test]
+    fn test_sorted_table_sorts_unsorted_proto() {
+        let mut proto = ProtoTable::from(unsorted_table());
+        proto.records.reverse();
+        let sorted = SortedTable::try_from(proto).unwrap();
+        assert_eq!(sorted, SortedTable::from(unsorted_table()));
+        assert!(sorted.records.is_sorted_by(|a, b| a.0 <= b.0));
     }
 
     // -- load_from_callbacks tests --
@@ -987,6 +1378,8 @@ mod tests {
             destroy_cell: None,
             table_end: None,
             usr_data: std::ptr::null_mut(),
+            read_batch: None,
+            destroy_batch: None,
         }
     }
 
@@ -998,7 +1391,12 @@ mod tests {
     }
 
     fn typed_config(fields: Vec<FieldConfig>) -> TableConfig {
-        TableConfig { fields, csv: None }
+        TableConfig {
+            fields,
+            csv: None,
+            thread_safe: false,
+            partitions: 1,
+        }
     }
 
     fn cell_text(s: &str) -> CellAction {
@@ -1009,6 +1407,98 @@ mod tests {
         CellAction::Cell(CellValue::Number(n))
     }
 
+    /// Row source for the `read_batch` tests, reached through `usr_data`.
+    struct BatchSource {
+        rows: Vec<(f64, CString)>,
+        calls: usize,
+        destroyed_rows: usize,
+    }
+
+    unsafe extern "C" fn test_read_batch(
+        _table: *const c_char,
+        field_names: *const *const c_char,
+        num_cols: usize,
+        first_row: usize,
+        max_rows: usize,
+        cells: *mut FfiCell,
+        out_rows: *mut usize,
+        usr_data: *mut c_void,
+    ) -> i32 {
+        let source = unsafe { &mut *(usr_data as *mut BatchSource) };
+        source.calls += 1;
+        if first_row >= source.rows.len() {
+            return END_OF_TABLE;
+        }
+        let num_rows = (source.rows.len() - first_row).min(max_rows);
+        for row in 0..num_rows {
+            let (id, name) = &source.rows[first_row + row];
+            for col in 0..num_cols {
+                let field = unsafe { CStr::from_ptr(*field_names.add(col)) };
+                let cell = match field.to_str().unwrap() {
+                    "id" => FfiCell {
+                        kind: 2, // LCH_VALUE_NUMBER
+                        payload: FfiCellPayload { number: *id },
+                    },
+                    _ => FfiCell {
+                        kind: 1, // LCH_VALUE_TEXT
+                        payload: FfiCellPayload {
+                            text: name.as_ptr(),
+                        },
+                    },
+                };
+                unsafe { *cells.add(row * num_cols + col) = cell };
+            }
+        }
+        unsafe { *out_rows = num_rows };
+        FFI_SUCCESS
+    }
+
+    unsafe extern "C" fn test_destroy_batch(
+        _cells: *mut FfiCell,
+        num_rows: usize,
+        _num_cols: usize,
+        usr_data: *mut c_void,
+    ) {
+        let source = unsafe { &mut *(usr_data as *mut BatchSource) };
+        source.destroyed_rows += num_rows;
+    }
+
+    #[test]
+    fn test_load_from_callbacks_reads_batches() {
+        // Declared subsidiary-first, so the batch's declaration-order cells
+        // must be rearranged into the canonical (id, name) tuple.
+        let config = typed_config(vec![
+            make_typed_field("name", Kind::Text, false),
+            make_typed_field("id", Kind::Number, true),
+        ]);
+        let num_rows = 2 * CALLBACK_BATCH_ROWS + 10;
+        let mut source = BatchSource {
+            rows: (0..num_rows)
+                .map(|i| (i as f64, CString::new(format!("name-{i}")).unwrap()))
+                .collect(),
+            calls: 0,
+            destroyed_rows: 0,
+        };
+        let callbacks = Callbacks {
+            read_cell: None,
+            read_batch: Some(test_read_batch),
+            destroy_batch: Some(test_destroy_batch),
+            usr_data: &mut source as *mut BatchSource as *mut c_void,
+            ..make_callbacks()
+        };
+        let bound = callbacks.for_table("t", &["name", "id"]).unwrap();
+        let table = Table::load_from_callbacks("t", &config, &bound).unwrap();
+
+        assert_eq!(table.records.len(), num_rows);
+        assert_eq!(
+            table.records.get(&vec![Cell::Number(7.0)]),
+            Some(&vec![Cell::from("name-7")])
+        );
+        // Three full-or-partial batches, then the end-of-table call.
+        assert_eq!(source.calls, 4);
+        assert_eq!(source.destroyed_rows, num_rows);
+    }
+
     #[test]
     fn test_load_from_callbacks_happy_path() {
         let config = typed_config(vec![
@@ -1128,4 +1618,46 @@ mod tests {
         assert!(format!("{:#}", err).contains("kind"), "got: {err:#}");
         clear_script();
     }
+
+    #[test]
+    fn test_partition_of_is_stable() {
+        // Pinned values: the partition of a record must not change between
+        // runs or releases.
+        assert_eq!(partition_of(&[Cell::from("alice")], 1000), 89);
+        assert_eq!(partition_of(&[Cell::number(1.0).unwrap()], 1000), 296);
+        assert_eq!(
+            partition_of(&[Cell::number(1.0).unwrap(), Cell::from("x")], 1000),
+            784
+        );
+        assert_eq!(partition_of(&[Cell::Boolean(true)], 1000), 255);
+        assert_eq!(partition_of(&[Cell::from("alice")], 1), 0);
+    }
+
+    #[test]
+    fn test_into_partitions() {
+        let mut table = Table {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: vec!["name".to_string()],
+            records: RecordMap::default(),
+        };
+        for i in 0..100 {
+            table.records.insert(
+                vec![Cell::from(i.to_string().as_str())],
+                vec![Cell::from("x")],
+            );
+        }
+
+        let partitions = table.clone().into_partitions(4);
+        assert_eq!(partitions.len(), 4);
+        let mut total = 0;
+        for (index, partition) in partitions.iter().enumerate() {
+            assert_eq!(partition.primary_key_names, table.primary_key_names);
+            for key in partition.records.keys() {
+                assert_eq!(partition_of(key, 4) as usize, index);
+                assert_eq!(table.records.get(key), partition.records.get(key));
+            }
+            total += partition.records.len();
+        }
+        assert_eq!(total, table.records.len());
+    }
 }
@@ -0,0 +1,211 @@
+//! Per-stage timings of block creation and SQL conversion.
+//!
+//! With `[stats] trace` enabled, every `Block::create` and every SQL
+//! conversion of a patch appends one JSON object as a line to the `TRACE`
+//! file in the state directory: total and per-stage wall time, plus per-table
+//! row or statement counts and timings. The file is only ever appended to,
+//! never rewritten, so recording a run costs one small write regardless of
+//! how many runs came before. Tracing is best-effort: a failure to record is
+//! logged and never fails the traced operation.
+
+use std::collections::BTreeMap;
+use std::time::Duration;
+
+use serde::Serialize;
+
+use crate::config::Config;
+use crate::storage;
+
+/// Name of the append-only trace file in the state directory.
+pub const TRACE_FILE: &str = "TRACE";
+
+/// `duration` in fractional milliseconds, the unit of every trace timing.
+pub(crate) fn ms(duration: Duration) -> f64 {
+    duration.as_secs_f64() * 1000.0
+}
+
+/// Wall time of each stage of one `Block::create` run, in milliseconds.
+#[derive(Debug, Default, Serialize)]
+pub(crate) struct BlockStages {
+    /// Fingerprinting, reading and parsing the sources (`State::compute`).
+    pub load_ms: f64,
+    /// Loading the previous state from STATE, or taking it from memory.
+    pub previous_ms: f64,
+    /// Diffing the previous state against the current one, including the
+    /// encoding and hashing of each table's delta, which overlaps with it.
+    pub diff_ms: f64,
+    /// Finishing the block hash once every table is appended.
+    pub encode_ms: f64,
+    /// Writing and fsyncing the block, STATE, HEAD and the `BLOCKS` index,
+    /// including the wait for the chain lock.
+    pub commit_ms: f64,
+}
+
+/// One table of a `Block::create` run.
+#[derive(Debug, Default, Serialize)]
+pub(crate) struct TableLoad {
+    /// Rows loaded; zero when the source was skipped.
+    pub rows: u64,
+    /// Time spent fingerprinting, reading and parsing the source.
+    pub load_ms: f64,
+    /// The source matched its fingerprint and was not parsed.
+    pub skipped: bool,
+}
+
+/// Trace record of one `Block::create` run.
+#[derive(Debug, Serialize)]
+pub(crate) struct BlockTrace {
+    pub timestamp: String,
+    pub operation: &'static str,
+    /// Hash of the created block.
+    pub block: String,
+    pub duration_ms: f64,
+    pub stages: BlockStages,
+    /// Encoded size of the block.
+    pub bytes: u64,
+    /// Peak resident set size of the process so far, where the platform
+    /// reports it.
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub max_rss_bytes: Option<u64>,
+    pub tables: BTreeMap<String, TableLoad>,
+}
+
+impl BlockTrace {
+    pub fn new(block: String) -> Self {
+        BlockTrace {
+            timestamp: chrono::Utc::now().to_rfc3339(),
+            operation: "block-create",
+            block,
+            duration_ms: 0.0,
+            stages: BlockStages::default(),
+            bytes: 0,
+            max_rss_bytes: max_rss_bytes(),
+            tables: BTreeMap::new(),
+        }
+    }
+}
+
+/// One table of a SQL conversion.
+#[derive(Debug, Default, Serialize)]
+pub(crate) struct TableRender {
+    /// Statements emitted for the table.
+    pub statements: u64,
+    /// Time spent rendering and validating them. With several threads,
+    /// tables render concurrently, so these can add up to more than the
+    /// run's `duration_ms`.
+    pub render_ms: f64,
+}
+
+/// Trace record of one conversion of a patch to SQL statements.
+#[derive(Debug, Serialize)]
+pub(crate) struct SqlTrace {
+    pub timestamp: String,
+    pub operation: &'static str,
+    /// Head block of the converted patch.
+    pub head: String,
+    pub duration_ms: f64,
+    pub statements: u64,
+    pub tables: BTreeMap<String, TableRender>,
+}
+
+impl SqlTrace {
+    /// `operation` tells SQL text (`patch-sql`) from parameterized
+    /// statements (`patch-statements`).
+    pub fn new(operation: &'static str, head: &str) -> Self {
+        SqlTrace {
+            timestamp: chrono::Utc::now().to_rfc3339(),
+            operation,
+            head: head.to_string(),
+            duration_ms: 0.0,
+            statements: 0,
+            tables: BTreeMap::new(),
+        }
+    }
+
+    /// Record that table `name` produced `statements` statements in
+    /// `elapsed`. Calls for the same table, one per chunk of a framed patch,
+    /// add up.
+    pub fn add_table(&mut self, name: &str, statements: usize, elapsed: Duration) {
+        let table = self.tables.entry(name.to_string()).or_default();
+        table.statements += statements as u64;
+        table.render_ms += ms(elapsed);
+    }
+}
+
+/// Peak resident set size of this process, read from `VmHWM` in
+/// `/proc/self/status`. `None` where that is unavailable.
+fn max_rss_bytes() -> Option<u64> {
+    let status = std::fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|line| line.starts_with("VmHWM:"))?;
+    let kilobytes: u64 = line
+        .trim_start_matches("VmHWM:")
+        .trim()
+        .trim_end_matches("kB")
+        .trim()
+        .parse()
+        .ok()?;
+    Some(kilobytes * 1024)
+}
+
+/// Append `record` as one line to the `TRACE` file. Callers should only
+/// invoke this when `config.stats.trace` is set. The append is not fsynced,
+/// and in a dry run nothing is written.
+pub(crate) fn record(config: &Config, record: &impl Serialize) {
+    let result = serde_json::to_vec(record)
+        .map_err(anyhow::Error::from)
+        .and_then(|mut line| {
+            line.push(b'\n');
+            let state_dir = config.ensure_state_dir()?;
+            storage::append(
+                &state_dir,
+                TRACE_FILE,
+                &line,
+                config.file_mode,
+                false,
+                config.dry_run,
+            )
+        });
+    if let Err(e) = result {
+        log::warn!("Trace: failed to record run: {:#}", e);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_record_appends_lines() {
+        let dir = tempfile::tempdir().unwrap();
+        let mut config = Config::default();
+        config.work_dir = dir.path().to_path_buf();
+
+        let mut trace = SqlTrace::new("patch-sql", "abc");
+        trace.add_table("users", 3, Duration::from_millis(1));
+        record(&config, &trace);
+        record(&config, &BlockTrace::new("def".to_string()));
+
+        let data = std::fs::read_to_string(config.state_dir().join(TRACE_FILE)).unwrap();
+        let lines: Vec<serde_json::Value> = data
+            .lines()
+            .map(|line| serde_json::from_str(line).unwrap())
+            .collect();
+        assert_eq!(lines.len(), 2);
+        assert_eq!(lines[0]["operation"], "patch-sql");
+        assert_eq!(lines[0]["tables"]["users"]["statements"], 3);
+        assert_eq!(lines[1]["operation"], "block-create");
+        assert_eq!(lines[1]["block"], "def");
+    }
+
+    #[test]
+    fn test_record_dry_run_writes_nothing() {
+        let dir = tempfile::tempdir().unwrap();
+        let mut config = Config::default();
+        config.work_dir = dir.path().to_path_buf();
+        config.dry_run = true;
+
+        record(&config, &BlockTrace::new("def".to_string()));
+
+        assert!(!config.state_dir().join(TRACE_FILE).exists());
+    }
+}
@@ -4,12 +4,14 @@ use std::time::SystemTime;
 
 use anyhow::{Context, Result};
 
-use crate::block::Block;
+use crate::chain::{self, BlockSummary, ChainIndex};
+use crate::checkpoint;
 use crate::config::{Config, TruncateConfig};
 use crate::head;
+use crate::pack;
 use crate::reported;
-use crate::storage;
-use crate::utils::{GENESIS_HASH, join_logging_panics};
+use crate::storage::{self, Transaction};
+use crate::utils::{GENESIS_HASH, is_hex_hash, join_logging_panics};
 
 /// Lock-file name used to serialize chain-mutating operations (block creation
 /// advancing HEAD, and truncation walking the chain and removing orphans).
@@ -20,6 +22,7 @@ const CHAIN_LOCK_NAME: &str = "chain";
 struct ChainEntry {
     hash: String,
     created: SystemTime,
+    summary: BlockSummary,
 }
 
 /// Strips the leading `.` and trailing `.lock` from a lock file name,
@@ -28,14 +31,10 @@ fn strip_lock_affixes(name: &str) -> Option<&str> {
     name.strip_prefix(".")?.strip_suffix(".lock")
 }
 
-/// Returns `true` if `s` is a 40-character hexadecimal string (i.e. a SHA-1 hash).
-fn is_hex_hash(s: &str) -> bool {
-    s.len() == 40 && s.chars().all(|c| c.is_ascii_hexdigit())
-}
-
 /// Returns `(block_hashes, stale_lock_files)` by scanning the work directory.
-/// Block hashes are 40-hex-char filenames. Stale lock files are `.<40-hex>.lock`
-/// files whose corresponding block is not on disk.
+/// Block hashes are 40-hex-char filenames, i.e. the loose blocks. Stale lock
+/// files are `.<40-hex>.lock` files whose corresponding block has no loose
+/// file, which includes the lock files of packed blocks.
 fn scan_work_dir(work_dir: &Path) -> Result<(HashSet<String>, Vec<String>)> {
     let mut blocks = HashSet::new();
     let mut lock_files = Vec::new();
@@ -66,14 +65,28 @@ fn scan_work_dir(work_dir: &Path) -> Result<(HashSet<String>, Vec<String>)> {
 }
 
 /// Walk the block chain from HEAD back toward GENESIS, returning an ordered
-/// list of chain entries and the set of reachable block hashes.
-fn walk_chain(work_dir: &Path, head_hash: &str, mode: u32) -> (Vec<ChainEntry>, HashSet<String>) {
+/// list of chain entries and the set of reachable block hashes. Parent
+/// pointers come from the `BLOCKS` index; only blocks it does not cover are
+/// opened. `on_disk` tells where the chain ends, as the index still lists
+/// blocks removed since it was last rewritten.
+fn walk_chain(
+    work_dir: &Path,
+    head_hash: &str,
+    index: &ChainIndex,
+    on_disk: &HashSet<String>,
+    mode: u32,
+) -> (Vec<ChainEntry>, HashSet<String>) {
     let mut chain = Vec::new();
     let mut reachable = HashSet::new();
 
     let mut current_hash = head_hash.to_string();
     while current_hash != GENESIS_HASH {
-        let Ok(header) = Block::load_header(work_dir, &current_hash, mode) else {
+        let summary = if on_disk.contains(&current_hash) {
+            index.summary(work_dir, &current_hash, mode).ok()
+        } else {
+            None
+        };
+        let Some(summary) = summary else {
             // Reached end of chain
             log::trace!(
                 "Block '{:.7}...' not found (previously truncated), stopping chain walk",
@@ -81,7 +94,7 @@ fn walk_chain(work_dir: &Path, head_hash: &str, mode: u32) -> (Vec<ChainEntry>,
             );
             break;
         };
-        let Some(created) = header.created else {
+        let Some(created) = summary.created else {
             log::warn!(
                 "Block '{:.7}...' has no timestamp, stopping chain walk",
                 current_hash
@@ -95,42 +108,44 @@ fn walk_chain(work_dir: &Path, head_hash: &str, mode: u32) -> (Vec<ChainEntry>,
             );
             break;
         };
+        let parent = summary.parent.clone();
         reachable.insert(current_hash.clone());
         chain.push(ChainEntry {
             hash: current_hash,
             created,
+            summary,
         });
-        current_hash = header.parent;
+        current_hash = parent;
     }
 
     (chain, reachable)
 }
 
-/// Remove orphaned blocks (not reachable from HEAD) and stale lock files
-/// (whose corresponding block no longer exists on disk). This also cleans up
-/// corrupt blocks, since `walk_chain` stops before adding them to the
-/// reachable set.
+/// Return the orphaned blocks (on disk but not reachable from HEAD) and
+/// remove stale lock files (whose corresponding block no longer exists on
+/// disk). This also cleans up unindexed corrupt blocks, since `walk_chain`
+/// stops before adding them to the reachable set.
 fn remove_orphans(
     work_dir: &Path,
     config: &TruncateConfig,
+    on_disk: &HashSet<String>,
+    stale_locks: &[String],
     reachable: &HashSet<String>,
-    mode: u32,
     dry_run: bool,
-) -> Result<()> {
-    let (on_disk, stale_locks) = scan_work_dir(work_dir)?;
-
+) -> Result<HashSet<String>> {
+    let mut orphans = HashSet::new();
     if config.remove_orphans {
-        for hash in &on_disk {
+        for hash in on_disk {
             if !reachable.contains(hash) {
                 if !dry_run {
                     log::info!("Removing orphaned block '{:.7}...'", hash);
                 }
-                storage::remove(work_dir, hash, mode, dry_run)?;
+                orphans.insert(hash.clone());
             }
         }
     }
 
-    for lock_file in &stale_locks {
+    for lock_file in stale_locks {
         if dry_run {
             eprintln!("Would have removed stale lock file '{}'", lock_file);
             continue;
@@ -145,18 +160,19 @@ fn remove_orphans(
         }
     }
 
-    Ok(())
+    Ok(orphans)
 }
 
 /// Truncate blocks from the chain according to the configured rules
-/// (max_blocks, max_age, truncate_reported). Never deletes HEAD.
+/// (max_blocks, max_age, truncate_reported). Never deletes HEAD. Returns the
+/// hashes of the truncated blocks.
 fn truncate_chain(
     work_dir: &Path,
     config: &TruncateConfig,
     chain: &[ChainEntry],
     mode: u32,
     dry_run: bool,
-) -> Result<()> {
+) -> Result<HashSet<String>> {
     let reported_pos = if config.truncate_reported {
         match reported::load(work_dir, mode)? {
             Some(hash) => chain
@@ -171,7 +187,7 @@ fn truncate_chain(
     let max_blocks = config.max_blocks.map(|n| n as usize);
     let max_age_cutoff = config.max_age.map(|max_age| SystemTime::now() - max_age);
 
-    let mut removed = 0;
+    let mut removed = HashSet::new();
     for (i, entry) in chain.iter().enumerate() {
         if i == 0 {
             continue; // Never delete HEAD
@@ -186,26 +202,49 @@ fn truncate_chain(
             if !dry_run {
                 log::info!("Truncating block '{:.7}...'", entry.hash);
             }
-            storage::remove(work_dir, &entry.hash, mode, dry_run)?;
-            removed += 1;
+            removed.insert(entry.hash.clone());
         }
     }
 
-    if removed > 0 {
+    if !removed.is_empty() {
         if dry_run {
-            eprintln!("Would have truncated {} block(s)", removed);
+            eprintln!("Would have truncated {} block(s)", removed.len());
         } else {
-            log::info!("Truncated {} block(s)", removed);
+            log::info!("Truncated {} block(s)", removed.len());
         }
     }
 
-    Ok(())
+    Ok(removed)
+}
+
+/// The retained loose blocks behind the newest `pack-after` blocks of
+/// `chain`, oldest first.
+fn blocks_to_pack(
+    config: &TruncateConfig,
+    chain: &[ChainEntry],
+    truncated: &HashSet<String>,
+    loose: &HashSet<String>,
+) -> Vec<String> {
+    let Some(pack_after) = config.pack_after else {
+        return Vec::new();
+    };
+    chain
+        .iter()
+        .skip(pack_after as usize)
+        .rev()
+        .filter(|entry| !truncated.contains(&entry.hash) && loose.contains(&entry.hash))
+        .map(|entry| entry.hash.clone())
+        .collect()
 }
 
 /// Run a single truncation pass under the chain lock. Blocks until the
 /// chain lock is available; serializes against `Block::create` and any
 /// other in-progress truncation in the same work directory.
 pub fn run(work_dir: &Path, config: &TruncateConfig, mode: u32, dry_run: bool) -> Result<()> {
+    // Recover HEAD from the journal first: walking the chain from a HEAD
+    // that a crash rolled back would treat the newer blocks as orphans.
+    storage::recover_journal(work_dir, mode, dry_run).context("failed to recover journal")?;
+
     // Grab the chain lock even in dry-run so the reported preview reflects a
     // consistent chain and cannot race a concurrent block creation or
     // truncation pass.
@@ -213,9 +252,72 @@ pub fn run(work_dir: &Path, config: &TruncateConfig, mode: u32, dry_run: bool) -
         .context("failed to acquire chain lock for truncation")?;
 
     let head_hash = head::load(work_dir, mode)?;
-    let (chain, reachable) = walk_chain(work_dir, &head_hash, mode);
-    remove_orphans(work_dir, config, &reachable, mode, dry_run)?;
-    truncate_chain(work_dir, config, &chain, mode, dry_run)?;
+    let index = ChainIndex::load(work_dir, mode);
+    let (loose, stale_locks) = scan_work_dir(work_dir)?;
+    let packed = pack::hashes(work_dir, mode)?;
+    let on_disk: HashSet<String> = loose.union(&packed).cloned().collect();
+    let (chain, mut reachable) = walk_chain(work_dir, &head_hash, &index, &on_disk, mode);
+    let mut removed = remove_orphans(
+        work_dir,
+        config,
+        &on_disk,
+        &stale_locks,
+        &reachable,
+        dry_run,
+    )?;
+    let truncated = truncate_chain(work_dir, config, &chain, mode, dry_run)?;
+    removed.extend(truncated.iter().cloned());
+
+    // Removing a packed block only drops it from the pack index, while loose
+    // blocks are removed file by file.
+    let mut removals = Transaction::default();
+    for hash in &removed {
+        if loose.contains(hash) {
+            removals.remove(hash);
+        }
+    }
+    let unpacked: HashSet<String> = removed.intersection(&packed).cloned().collect();
+    let to_pack = blocks_to_pack(config, &chain, &truncated, &loose);
+    if !to_pack.is_empty() || !unpacked.is_empty() {
+        let newly_packed: HashSet<String> =
+            pack::update(work_dir, &to_pack, &unpacked, mode, dry_run)?
+                .into_iter()
+                .collect();
+        // Blocks packed by an interrupted earlier pass still have their loose
+        // file as well.
+        for hash in &to_pack {
+            if newly_packed.contains(hash) || packed.contains(hash) {
+                removals.remove(hash);
+            }
+        }
+    }
+
+    // A journal that was not checkpointed yet would restore the removed
+    // blocks on the next recovery, so the removals are journaled as well.
+    if storage::journal_is_empty(work_dir) {
+        removals.apply(work_dir, mode, dry_run)?;
+    } else {
+        removals.commit_journaled(work_dir, u64::MAX, mode, dry_run)?;
+    }
+
+    // Rewrite the index to list exactly the retained chain whenever it
+    // differs: blocks were truncated or orphaned, or some were missing from
+    // it and had to be read from their files.
+    let index_is_exact =
+        index.len() == chain.len() && chain.iter().all(|entry| index.get(&entry.hash).is_some());
+    if !truncated.is_empty() || !index_is_exact {
+        let retained = chain
+            .iter()
+            .rev()
+            .filter(|entry| !truncated.contains(&entry.hash))
+            .map(|entry| &entry.summary);
+        chain::store(work_dir, retained, mode, dry_run)?;
+    }
+
+    // Checkpoints are keyed by their base block, so drop those whose base was
+    // just truncated or was never reachable.
+    reachable.retain(|hash| !truncated.contains(hash));
+    checkpoint::remove_stale(work_dir, &reachable, mode, dry_run)?;
 
     Ok(())
 }
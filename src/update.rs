@@ -1,4 +1,4 @@
-use std::collections::{HashMap, HashSet};
+use std::collections::HashSet;
 use std::fmt;
 
 use anyhow::{Result, bail};
@@ -6,8 +6,9 @@ use anyhow::{Result, bail};
 use crate::cell::{Cell, decode_proto_cells, display_proto_cells};
 use crate::proto::cell::Cell as ProtoCell;
 use crate::proto::update::Update as ProtoUpdate;
+use crate::utils::FastHashMap;
 
-pub type UpdateMap = HashMap<Vec<Cell>, (Vec<Cell>, Vec<Cell>)>;
+pub type UpdateMap = FastHashMap<Vec<Cell>, (Vec<Cell>, Vec<Cell>)>;
 
 /// A record whose subsidiary (non-key) cells changed between two states.
 ///
@@ -195,13 +196,13 @@ fn format_update_column(new: Option<&ProtoCell>, old: Option<&ProtoCell>, has_ol
     }
 }
 
-/// Decode a `Vec<ProtoUpdate>` into a `HashMap` keyed by each record's key.
+/// Decode a `Vec<ProtoUpdate>` into an [`UpdateMap`] keyed by each record's key.
 ///
 /// Updates are stored sparsely on the wire: only changed column indices and
 /// their values are included. Expand them back to full-width value vectors
 /// (one element per subsidiary column).
 pub fn decode_proto_updates(protos: Vec<ProtoUpdate>, num_subsidiary: usize) -> Result<UpdateMap> {
-    let mut updates = HashMap::with_capacity(protos.len());
+    let mut updates = UpdateMap::with_capacity_and_hasher(protos.len(), Default::default());
     for mut proto in protos {
         proto.expand_sparse(num_subsidiary)?;
         let update = Update::try_from(proto)?;
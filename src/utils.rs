@@ -1,3 +1,7 @@
+use std::collections::HashMap;
+use std::hash::{BuildHasherDefault, Hasher};
+use std::io::Read;
+use std::sync::Mutex;
 use std::time::Duration;
 
 use anyhow::{Result, bail};
@@ -64,6 +68,42 @@ pub fn compute_hash(data: &[u8]) -> String {
     format!("{:x}", hasher.finalize())
 }
 
+/// SHA-1 of data that arrives in pieces: the hash [`compute_hash`] would
+/// give for the pieces concatenated, without holding them together.
+pub struct StreamHasher(Sha1);
+
+impl Default for StreamHasher {
+    fn default() -> Self {
+        StreamHasher(Sha1::new())
+    }
+}
+
+impl StreamHasher {
+    pub fn update(&mut self, data: &[u8]) {
+        self.0.update(data);
+    }
+
+    pub fn finish(self) -> String {
+        format!("{:x}", self.0.finalize())
+    }
+}
+
+/// Like [`compute_hash`], but streams the data from `reader` in fixed-size
+/// chunks instead of requiring it in memory.
+pub fn compute_reader_hash(reader: &mut impl Read) -> std::io::Result<String> {
+    let mut hasher = Sha1::new();
+    let mut buf = vec![0u8; 64 * 1024];
+    loop {
+        match reader.read(&mut buf) {
+            Ok(0) => break,
+            Ok(n) => hasher.update(&buf[..n]),
+            Err(e) if e.kind() == std::io::ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e),
+        }
+    }
+    Ok(format!("{:x}", hasher.finalize()))
+}
+
 /// Indent all lines after the first by prepending `prefix`.
 ///
 /// The `Display` trait has no way to pass an indentation level, so nested
@@ -111,6 +151,79 @@ pub fn parse_file_mode(raw: &str) -> Result<u32> {
         .map_err(|e| anyhow::anyhow!("invalid octal file-mode '{}': {}", raw, e))
 }
 
+/// Multiplier of the word-at-a-time hash used by [`FastHasher`].
+const FAST_HASH_MULTIPLIER: u64 = 0x517c_c1b7_2722_0a95;
+
+/// Non-cryptographic hasher for the in-memory record maps.
+///
+/// Record keys are hashed on every insert and lookup while loading tables
+/// and merging deltas, and the standard library's SipHash spends most of
+/// that time on flood resistance the maps do not need: their keys come from
+/// the host's own tables, not from untrusted peers. This mixes one 64-bit
+/// word per step (the FxHash scheme), which is several times cheaper on
+/// short keys. Maps keyed by data from peers, such as the patches coalesced
+/// on the hub (`merge::CoalescedDelta`), keep the standard `RandomState`.
+#[derive(Clone, Copy, Default)]
+pub struct FastHasher {
+    hash: u64,
+}
+
+impl FastHasher {
+    fn add_word(&mut self, word: u64) {
+        self.hash = (self.hash.rotate_left(5) ^ word).wrapping_mul(FAST_HASH_MULTIPLIER);
+    }
+}
+
+impl Hasher for FastHasher {
+    fn write(&mut self, bytes: &[u8]) {
+        let mut chunks = bytes.chunks_exact(8);
+        for chunk in &mut chunks {
+            let mut word = [0u8; 8];
+            word.copy_from_slice(chunk);
+            self.add_word(u64::from_le_bytes(word));
+        }
+        // A partial tail occupies at most seven bytes; stash its length in the
+        // eighth so that zero padding cannot collide with trailing NULs.
+        let rest = chunks.remainder();
+        if !rest.is_empty() {
+            let mut word = [0u8; 8];
+            word[..rest.len()].copy_from_slice(rest);
+            word[7] = rest.len() as u8;
+            self.add_word(u64::from_le_bytes(word));
+        }
+    }
+
+    fn write_u8(&mut self, i: u8) {
+        self.add_word(u64::from(i));
+    }
+
+    fn write_u32(&mut self, i: u32) {
+        self.add_word(u64::from(i));
+    }
+
+    fn write_u64(&mut self, i: u64) {
+        self.add_word(i);
+    }
+
+    fn write_usize(&mut self, i: usize) {
+        self.add_word(i as u64);
+    }
+
+    fn finish(&self) -> u64 {
+        self.hash
+    }
+}
+
+/// A `HashMap` hashed with [`FastHasher`]. Construct with `default()`,
+/// `with_capacity_and_hasher` or `from_iter`; `HashMap::new` is specific to
+/// the standard hasher.
+pub type FastHashMap<K, V> = HashMap<K, V, BuildHasherDefault<FastHasher>>;
+
+/// Returns `true` if `s` is a 40-character hexadecimal string (i.e. a SHA-1 hash).
+pub fn is_hex_hash(s: &str) -> bool {
+    s.len() == 40 && s.chars().all(|c| c.is_ascii_hexdigit())
+}
+
 /// Join `handle` and surface any panic payload as a warning under `context`
 /// (e.g. `"Background truncation thread"`). Without this, `let _ = handle.join();`
 /// silently discards worker-thread panics.
@@ -125,6 +238,51 @@ pub fn join_logging_panics(handle: std::thread::JoinHandle<()>, context: &str) {
     }
 }
 
+/// Apply `f` to every item on a pool of at most `threads` scoped worker
+/// threads and return the results in input order. Workers pull the next item
+/// from a shared queue, so the wall time is bound by the slowest item rather
+/// than the sum of all of them. With `threads <= 1` (or a single item) the
+/// items are processed on the calling thread and no thread is spawned. A panic
+/// in `f` propagates to the caller once every worker has stopped.
+pub fn parallel_map<T, R, F>(items: Vec<T>, threads: usize, f: F) -> Vec<R>
+where
+    T: Send,
+    R: Send,
+    F: Fn(T) -> R + Sync,
+{
+    let num_items = items.len();
+    if threads <= 1 || num_items <= 1 {
+        return items.into_iter().map(f).collect();
+    }
+
+    let queue = Mutex::new(items.into_iter().enumerate());
+    let results: Mutex<Vec<Option<R>>> = Mutex::new((0..num_items).map(|_| None).collect());
+
+    std::thread::scope(|scope| {
+        for _ in 0..threads.min(num_items) {
+            scope.spawn(|| {
+                loop {
+                    let next = queue.lock().unwrap_or_else(|e| e.into_inner()).next();
+                    let Some((index, item)) = next else {
+                        break;
+                    };
+                    let result = f(item);
+                    results.lock().unwrap_or_else(|e| e.into_inner())[index] = Some(result);
+                }
+            });
+        }
+    });
+
+    // Every slot is filled: the scope only returns normally once all workers
+    // drained the queue.
+    results
+        .into_inner()
+        .unwrap_or_else(|e| e.into_inner())
+        .into_iter()
+        .flatten()
+        .collect()
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -135,6 +293,22 @@ mod tests {
         assert_eq!(hash, "aaf4c61ddcc5e8a2dabede0f3b482cd9aea9434d");
     }
 
+    #[test]
+    fn test_compute_reader_hash_matches_compute_hash() {
+        let data = vec![7u8; 200 * 1024];
+        let streamed = compute_reader_hash(&mut data.as_slice()).unwrap();
+        assert_eq!(streamed, compute_hash(&data));
+    }
+
+    #[test]
+    fn test_stream_hasher_matches_compute_hash() {
+        let mut hasher = StreamHasher::default();
+        hasher.update(b"hel");
+        hasher.update(b"");
+        hasher.update(b"lo");
+        assert_eq!(hasher.finish(), compute_hash(b"hello"));
+    }
+
     #[test]
     fn test_indent() {
         assert_eq!(indent("a\nb\nc", "  "), "a\n  b\n  c");
@@ -234,4 +408,43 @@ mod tests {
         assert_eq!(parse_file_mode(" 640 ").unwrap(), 0o640);
         assert!(parse_file_mode("99").is_err());
     }
+
+    #[test]
+    fn test_fast_hasher_distinguishes_trailing_bytes() {
+        use std::hash::{BuildHasher, Hash};
+
+        let build = BuildHasherDefault::<FastHasher>::default();
+        let hash = |value: &str| {
+            let mut hasher = build.build_hasher();
+            value.hash(&mut hasher);
+            hasher.finish()
+        };
+        assert_eq!(hash("hostname"), hash("hostname"));
+        assert_ne!(hash("hostname"), hash("hostname1"));
+        assert_ne!(hash("ab"), hash("ab\0"));
+    }
+
+    #[test]
+    fn test_fast_hash_map_round_trip() {
+        let mut map: FastHashMap<String, u32> = FastHashMap::default();
+        for i in 0..1000 {
+            map.insert(format!("key-{i}"), i);
+        }
+        assert_eq!(map.len(), 1000);
+        assert_eq!(map.get("key-512"), Some(&512));
+    }
+
+    #[test]
+    fn test_parallel_map_preserves_order() {
+        let items: Vec<usize> = (0..100).collect();
+        let expected: Vec<usize> = items.iter().map(|i| i * 2).collect();
+        assert_eq!(parallel_map(items.clone(), 1, |i| i * 2), expected);
+        assert_eq!(parallel_map(items, 4, |i| i * 2), expected);
+    }
+
+    #[test]
+    fn test_parallel_map_more_threads_than_items() {
+        assert_eq!(parallel_map(vec![1, 2], 8, |i| i + 1), vec![2, 3]);
+        assert!(parallel_map(Vec::<u32>::new(), 8, |i| i).is_empty());
+    }
 }
@@ -1,25 +1,59 @@
-use std::io::Read;
+use std::collections::HashMap;
+use std::collections::hash_map::Entry;
+use std::fmt;
+use std::io::{BufReader, Cursor, ErrorKind, Read, Write};
 use std::time::Instant;
 
 use anyhow::{Context, Result, bail};
 use prost::Message;
 
-use crate::config::Config;
+use crate::config::{CompressionConfig, Config};
+use crate::proto::delta::Delta as ProtoDelta;
 use crate::proto::patch::Patch;
+use crate::proto::record::Keys as ProtoKeys;
+use crate::proto::table::Table as ProtoTable;
+use crate::proto::wire::frame::Body as ProtoFrameBody;
+use crate::proto::wire::{
+    Frame as ProtoFrame, TableDelta as ProtoTableDelta, TableKeys as ProtoTableKeys,
+    TableState as ProtoTableState,
+};
 use crate::stats::{self, Stage, StageStats};
+use crate::utils::indent;
 
 /// Zstd frame magic number (little-endian).
 const ZSTD_MAGIC: [u8; 4] = [0x28, 0xB5, 0x2F, 0xFD];
 
+/// Maximum size of a zstd frame header (`ZSTD_FRAMEHEADERSIZE_MAX`), which
+/// holds the dictionary ID a frame was compressed with.
+const ZSTD_FRAME_HEADER_MAX: usize = 18;
+
 /// Upper bound on the decompressed size of a patch. A zstd frame can claim a
 /// tiny compressed size while expanding to gigabytes (a "decompression bomb").
 /// Patches decoded here may arrive from an untrusted peer, so refuse to
 /// allocate more than this; the ceiling is far above any realistic patch.
 const MAX_DECOMPRESSED_PATCH_SIZE: u64 = 1 << 30; // 1 GiB
 
+/// Magic bytes opening a framed patch stream (inside the zstd frame when
+/// compressed). A Patch protobuf never begins with them: `L` would be field 9
+/// with the end-group wire type.
+const FRAMED_MAGIC: [u8; 4] = *b"LCH\x01";
+
+/// Maximum number of records (inserts, deletes and updates together) that a
+/// single table chunk of a framed patch carries.
+pub const FRAME_RECORDS: usize = 4096;
+
+/// Upper bound on the encoded size of a single frame. Frames hold at most
+/// [`FRAME_RECORDS`] records, so only a corrupt or malicious length prefix
+/// comes near it; refuse to allocate for one.
+const MAX_FRAME_SIZE: u64 = 64 << 20; // 64 MiB
+
 /// Encode a Patch to protobuf, optionally compressing with zstd. When stats are
 /// enabled, records the compression stage into the config's in-flight run.
 pub fn encode_patch(config: &Config, patch: &Patch) -> Result<Vec<u8>> {
+    if config.framed_patches {
+        return encode_patch_framed(config, patch);
+    }
+
     let mut buf = Vec::new();
     patch.encode(&mut buf)?;
     let bytes_in = buf.len() as u64;
@@ -44,7 +78,14 @@ pub fn encode_patch(config: &Config, patch: &Patch) -> Result<Vec<u8>> {
     }
 
     let start = Instant::now();
-    let compressed = zstd::encode_all(buf.as_slice(), config.compression.level)?;
+    let compressed = match &config.compression.loaded_dictionary {
+        Some(dictionary) => {
+            zstd::bulk::Compressor::with_dictionary(config.compression.level, &dictionary.data)
+                .context("failed to load zstd dictionary")?
+                .compress(&buf)?
+        }
+        None => zstd::encode_all(buf.as_slice(), config.compression.level)?,
+    };
     let duration_ms = start.elapsed().as_secs_f64() * 1000.0;
     // Compressing a tiny payload can make it larger. When it doesn't shrink,
     // ship the raw protobuf instead; `decode_patch` auto-detects the missing
@@ -86,29 +127,154 @@ pub fn encode_patch(config: &Config, patch: &Patch) -> Result<Vec<u8>> {
     Ok(output)
 }
 
-/// Decode a Patch from protobuf, auto-detecting zstd compression.
+/// Encode a Patch as a framed stream into one buffer. The frames are
+/// compressed as they are written, so the uncompressed encoding never exists
+/// in full. Unlike [`encode_patch`]'s unframed path there is no fallback to
+/// the raw encoding when compression does not pay off.
+fn encode_patch_framed(config: &Config, patch: &Patch) -> Result<Vec<u8>> {
+    let start = Instant::now();
+    let mut encoder = FramedEncoder::new(config, Vec::new())?;
+    for chunk in patch_chunks(patch) {
+        encoder.write_chunk(chunk)?;
+    }
+    let bytes_in = encoder.bytes_in();
+    let output = encoder.finish()?;
+    let duration_ms = start.elapsed().as_secs_f64() * 1000.0;
+    log::info!(
+        "Patch encoded: {} bytes framed protobuf, {} bytes written{}",
+        bytes_in,
+        output.len(),
+        if config.compression.enable {
+            ""
+        } else {
+            " (compression disabled)"
+        }
+    );
+
+    if config.stats.enable {
+        stats::record_stage(
+            config,
+            Stage::Compression,
+            StageStats {
+                duration_ms,
+                bytes_in,
+                bytes_out: output.len() as u64,
+            },
+        );
+    }
+    Ok(output)
+}
+
+/// Decode a Patch from protobuf, auto-detecting zstd compression and the
+/// framed format.
 ///
 /// If the data starts with the zstd frame magic number, it is decompressed
-/// first. Otherwise, it is treated as raw protobuf.
+/// first. Otherwise, it is treated as raw protobuf. A framed stream is
+/// decompressed and reassembled frame by frame into a single patch; use
+/// [`open_patch`] to process one chunk at a time instead. Patches compressed
+/// with a dictionary need [`decode_patch_with`].
 pub fn decode_patch(data: &[u8]) -> Result<Patch> {
-    let bytes = if data.starts_with(&ZSTD_MAGIC) {
-        decompress_bounded(data, MAX_DECOMPRESSED_PATCH_SIZE)?
-    } else {
-        data.to_vec()
+    open(data, None)?.into_patch()
+}
+
+/// Like [`decode_patch`], but decompresses patches compressed with a zstd
+/// dictionary using the one from `config`'s `[compression]` section whose ID
+/// the patch names.
+pub fn decode_patch_with(config: &Config, data: &[u8]) -> Result<Patch> {
+    open(data, Some(&config.compression))?.into_patch()
+}
+
+/// An encoded patch opened for decoding.
+pub enum PatchReader<'a> {
+    /// A framed stream, decompressed and decoded one chunk at a time as it
+    /// is iterated.
+    Framed(FramedDecoder<'a>),
+    /// An unframed patch, decoded in one piece.
+    Unframed(Patch),
+}
+
+impl PatchReader<'_> {
+    /// The complete patch, reassembling a framed stream's chunks.
+    pub fn into_patch(self) -> Result<Patch> {
+        match self {
+            PatchReader::Framed(decoder) => decoder.into_patch(),
+            PatchReader::Unframed(patch) => Ok(patch),
+        }
+    }
+}
+
+/// Open the encoded patch `data`, auto-detecting zstd compression and the
+/// framed format as [`decode_patch`] does. A framed stream is not read past
+/// its magic bytes yet, so consuming it chunk by chunk holds only the
+/// current frame in memory, never the whole decompressed stream. Patches
+/// compressed with a dictionary need [`open_patch_with`].
+pub fn open_patch(data: &[u8]) -> Result<PatchReader<'_>> {
+    open(data, None)
+}
+
+/// Like [`open_patch`], but decompresses patches compressed with a zstd
+/// dictionary using the one from `config`'s `[compression]` section whose ID
+/// the patch names.
+pub fn open_patch_with<'a>(config: &Config, data: &'a [u8]) -> Result<PatchReader<'a>> {
+    open(data, Some(&config.compression))
+}
+
+fn open<'a>(data: &'a [u8], compression: Option<&CompressionConfig>) -> Result<PatchReader<'a>> {
+    if !data.starts_with(&ZSTD_MAGIC) {
+        if let Some(rest) = data.strip_prefix(&FRAMED_MAGIC) {
+            return Ok(PatchReader::Framed(FramedDecoder::from_payload(Box::new(
+                rest,
+            ))));
+        }
+        return Ok(PatchReader::Unframed(Patch::decode(data)?));
+    }
+
+    let dictionary = frame_dictionary(compression, data)?;
+    let mut decoder = zstd::stream::read::Decoder::with_dictionary(data, dictionary)
+        .context("failed to initialize zstd decoder")?;
+    let mut prefix = [0u8; FRAMED_MAGIC.len()];
+    let prefix_len = read_prefix(&mut decoder, &mut prefix)?;
+    if prefix[..prefix_len] == FRAMED_MAGIC {
+        // The decoder streams the rest of the frame into the chunk reader,
+        // so the decompressed stream never exists in full and needs no
+        // overall size limit; each frame is bounded by `MAX_FRAME_SIZE`.
+        // Frame lengths are read a byte at a time, hence the buffer.
+        return Ok(PatchReader::Framed(FramedDecoder::from_payload(Box::new(
+            BufReader::new(decoder),
+        ))));
+    }
+    let payload = Cursor::new(prefix[..prefix_len].to_vec()).chain(decoder);
+    let bytes = read_bounded(payload, MAX_DECOMPRESSED_PATCH_SIZE)?;
+    Ok(PatchReader::Unframed(Patch::decode(bytes.as_slice())?))
+}
+
+/// The dictionary to decompress the zstd frame starting at `frame` with: the
+/// configured dictionary whose ID the frame header names, or an empty one
+/// (no dictionary) when it names none.
+fn frame_dictionary<'c>(
+    compression: Option<&'c CompressionConfig>,
+    frame: &[u8],
+) -> Result<&'c [u8]> {
+    let Some(id) = zstd::zstd_safe::get_dict_id_from_frame(frame) else {
+        return Ok(&[]);
     };
-    let patch = Patch::decode(bytes.as_slice())?;
-    Ok(patch)
+    match compression.and_then(|compression| compression.dictionary_by_id(id.get())) {
+        Some(dictionary) => Ok(&dictionary.data),
+        None => bail!(
+            "patch is compressed with zstd dictionary {}, which is not configured in [compression]",
+            id
+        ),
+    }
 }
 
-/// Decompress a zstd frame, refusing to produce more than `max` bytes of
-/// output so a malicious frame cannot exhaust memory.
-fn decompress_bounded(data: &[u8], max: u64) -> Result<Vec<u8>> {
-    let decoder =
-        zstd::stream::read::Decoder::new(data).context("failed to initialize zstd decoder")?;
+/// Read a decompressed patch from `reader` to the end, refusing to produce
+/// more than `max` bytes of output so a malicious zstd frame cannot exhaust
+/// memory.
+fn read_bounded(reader: impl Read, max: u64) -> Result<Vec<u8>> {
     let mut bytes = Vec::new();
     // Read one byte past the limit so output that exactly fills `max` is still
     // accepted while anything larger is detected and rejected.
-    decoder
+    reader
         .take(max + 1)
         .read_to_end(&mut bytes)
         .context("failed to decompress patch")?;
@@ -118,9 +284,487 @@ fn decompress_bounded(data: &[u8], max: u64) -> Result<Vec<u8>> {
     Ok(bytes)
 }
 
+/// One unit of a framed patch stream.
+#[derive(Debug, Clone, PartialEq)]
+pub enum PatchChunk {
+    /// Patch-level fields (head, created, injected fields, number of
+    /// blocks), with empty deltas, states and replaced keys. Always the
+    /// first chunk.
+    Header(Patch),
+    /// A slice of the consolidated delta of the named table.
+    Delta(String, ProtoDelta),
+    /// A slice of the full state of the named table.
+    State(String, ProtoTable),
+    /// A slice of the keys the state of the named partition replaces. All
+    /// of them come before the partition's state chunks.
+    ReplacedKeys(String, ProtoKeys),
+}
+
+impl From<PatchChunk> for ProtoFrame {
+    fn from(chunk: PatchChunk) -> Self {
+        let body = match chunk {
+            PatchChunk::Header(header) => ProtoFrameBody::Header(header),
+            PatchChunk::Delta(table, delta) => ProtoFrameBody::Delta(ProtoTableDelta {
+                table,
+                delta: Some(delta),
+            }),
+            PatchChunk::State(table, state) => ProtoFrameBody::State(ProtoTableState {
+                table,
+                state: Some(state),
+            }),
+            PatchChunk::ReplacedKeys(table, keys) => ProtoFrameBody::ReplacedKeys(ProtoTableKeys {
+                table,
+                keys: Some(keys),
+            }),
+        };
+        ProtoFrame { body: Some(body) }
+    }
+}
+
+impl fmt::Display for ProtoTableDelta {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match &self.delta {
+            Some(delta) => write!(f, "'{}' {}", self.table, delta),
+            None => write!(f, "'{}' (no delta)", self.table),
+        }
+    }
+}
+
+impl fmt::Display for ProtoTableState {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match &self.state {
+            Some(state) => write!(f, "'{}' {}", self.table, state),
+            None => write!(f, "'{}' (no state)", self.table),
+        }
+    }
+}
+
+impl fmt::Display for ProtoTableKeys {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let len = self.keys.as_ref().map_or(0, |keys| keys.records.len());
+        write!(f, "'{}' ({} replaced keys)", self.table, len)
+    }
+}
+
+impl fmt::Display for ProtoFrame {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match &self.body {
+            Some(ProtoFrameBody::Header(header)) => {
+                write!(
+                    f,
+                    "Frame (header):\n  {}",
+                    indent(&header.to_string(), "  ")
+                )
+            }
+            Some(ProtoFrameBody::Delta(delta)) => {
+                write!(f, "Frame (delta):\n  {}", indent(&delta.to_string(), "  "))
+            }
+            Some(ProtoFrameBody::State(state)) => {
+                write!(f, "Frame (state):\n  {}", indent(&state.to_string(), "  "))
+            }
+            Some(ProtoFrameBody::ReplacedKeys(keys)) => {
+                write!(f, "Frame (replaced keys):\n  {}", keys)
+            }
+            Some(ProtoFrameBody::End(_)) => write!(f, "Frame (end)"),
+            None => write!(f, "Frame (empty)"),
+        }
+    }
+}
+
+/// Number of chunks a table with `len` records is split into. A table with
+/// no records still gets one chunk, so that it survives the round trip.
+fn chunk_count(len: usize) -> usize {
+    len.div_ceil(FRAME_RECORDS).max(1)
+}
+
+/// The records `start..end` of `delta`, counting its deletes, then inserts,
+/// then updates as one sequence: the order SQL applies them in, so a table
+/// converted chunk by chunk still runs every DELETE before any INSERT.
+fn delta_chunk(delta: &ProtoDelta, start: usize, end: usize) -> ProtoDelta {
+    let num_deletes = delta.deletes.len();
+    let num_inserts = delta.inserts.len();
+    let range = |offset: usize, len: usize| {
+        start.clamp(offset, offset + len) - offset..end.clamp(offset, offset + len) - offset
+    };
+    ProtoDelta {
+        primary_key_names: delta.primary_key_names.clone(),
+        subsidiary_value_names: delta.subsidiary_value_names.clone(),
+        deletes: delta.deletes[range(0, num_deletes)].to_vec(),
+        inserts: delta.inserts[range(num_deletes, num_inserts)].to_vec(),
+        updates: delta.updates[range(num_deletes + num_inserts, delta.updates.len())].to_vec(),
+    }
+}
+
+/// The entries of `map`, sorted by table name.
+fn by_name<V>(map: &HashMap<String, V>) -> Vec<(&String, &V)> {
+    let mut entries: Vec<_> = map.iter().collect();
+    entries.sort_unstable_by_key(|(name, _)| *name);
+    entries
+}
+
+/// Split `patch` into the chunks of a framed stream: the header, then every
+/// delta, replaced-key list and full-state table in slices of at most
+/// [`FRAME_RECORDS`] records. Chunks are built lazily, so only one chunk's copy of the records
+/// exists at a time. Each kind of payload comes sorted by table name, the
+/// order [`crate::sql::emit_patch_sql`] emits tables in, so converting the
+/// stream chunk by chunk keeps that order.
+pub fn patch_chunks(patch: &Patch) -> impl Iterator<Item = PatchChunk> + '_ {
+    let header = PatchChunk::Header(Patch {
+        head: patch.head.clone(),
+        created: patch.created,
+        injected_fields: patch.injected_fields.clone(),
+        num_blocks: patch.num_blocks,
+        deltas: HashMap::new(),
+        states: HashMap::new(),
+        replaced_keys: HashMap::new(),
+    });
+    let deltas = by_name(&patch.deltas)
+        .into_iter()
+        .flat_map(|(table, delta)| {
+            let len = delta.inserts.len() + delta.deletes.len() + delta.updates.len();
+            (0..chunk_count(len)).map(move |index| {
+                let start = index * FRAME_RECORDS;
+                let chunk = delta_chunk(delta, start, start + FRAME_RECORDS);
+                PatchChunk::Delta(table.clone(), chunk)
+            })
+        });
+    let states = by_name(&patch.states)
+        .into_iter()
+        .flat_map(|(table, state)| {
+            let len = state.records.len();
+            (0..chunk_count(len)).map(move |index| {
+                let start = index * FRAME_RECORDS;
+                let end = (start + FRAME_RECORDS).min(len);
+                let chunk = ProtoTable {
+                    primary_key_names: state.primary_key_names.clone(),
+                    subsidiary_value_names: state.subsidiary_value_names.clone(),
+                    records: state.records[start..end].to_vec(),
+                };
+                PatchChunk::State(table.clone(), chunk)
+            })
+        });
+    let replaced_keys = by_name(&patch.replaced_keys)
+        .into_iter()
+        .flat_map(|(table, keys)| {
+            let len = keys.records.len();
+            (0..chunk_count(len)).map(move |index| {
+                let start = index * FRAME_RECORDS;
+                let end = (start + FRAME_RECORDS).min(len);
+                let chunk = ProtoKeys {
+                    records: keys.records[start..end].to_vec(),
+                };
+                PatchChunk::ReplacedKeys(table.clone(), chunk)
+            })
+        });
+    std::iter::once(header)
+        .chain(deltas)
+        .chain(replaced_keys)
+        .chain(states)
+}
+
+/// Read from `reader` until `buf` is full or the input ends, and return the
+/// number of bytes read.
+fn read_prefix(reader: &mut impl Read, buf: &mut [u8]) -> Result<usize> {
+    let mut filled = 0;
+    while filled < buf.len() {
+        match reader.read(&mut buf[filled..]) {
+            Ok(0) => break,
+            Ok(read) => filled += read,
+            Err(e) if e.kind() == ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e).context("failed to read patch stream"),
+        }
+    }
+    Ok(filled)
+}
+
+/// Where a [`FramedEncoder`] writes: straight through, or through a
+/// streaming zstd compressor.
+enum FramedSink<W: Write> {
+    Raw(W),
+    Zstd(zstd::stream::write::Encoder<'static, W>),
+}
+
+impl<W: Write> FramedSink<W> {
+    fn write_all(&mut self, data: &[u8]) -> std::io::Result<()> {
+        match self {
+            FramedSink::Raw(writer) => writer.write_all(data),
+            FramedSink::Zstd(encoder) => encoder.write_all(data),
+        }
+    }
+}
+
+/// Writes a framed patch stream, zstd-compressing it on the fly when
+/// `[compression]` is enabled. Chunks must start with a single
+/// [`PatchChunk::Header`]; [`FramedEncoder::finish`] writes the end frame.
+pub struct FramedEncoder<W: Write> {
+    sink: FramedSink<W>,
+    frame_buf: Vec<u8>,
+    bytes_in: u64,
+    wrote_header: bool,
+}
+
+impl<W: Write> FramedEncoder<W> {
+    /// Start a stream on `writer` and write the magic bytes.
+    pub fn new(config: &Config, writer: W) -> Result<Self> {
+        let mut sink = if config.compression.enable {
+            let dictionary = match &config.compression.loaded_dictionary {
+                Some(dictionary) => dictionary.data.as_slice(),
+                None => &[],
+            };
+            let encoder = zstd::stream::write::Encoder::with_dictionary(
+                writer,
+                config.compression.level,
+                dictionary,
+            )
+            .context("failed to initialize zstd encoder")?;
+            FramedSink::Zstd(encoder)
+        } else {
+            FramedSink::Raw(writer)
+        };
+        sink.write_all(&FRAMED_MAGIC)
+            .context("failed to write patch stream")?;
+        Ok(FramedEncoder {
+            sink,
+            frame_buf: Vec::new(),
+            bytes_in: FRAMED_MAGIC.len() as u64,
+            wrote_header: false,
+        })
+    }
+
+    /// Append `chunk` to the stream as one frame.
+    pub fn write_chunk(&mut self, chunk: PatchChunk) -> Result<()> {
+        let is_header = matches!(chunk, PatchChunk::Header(_));
+        if is_header == self.wrote_header {
+            bail!("a framed patch stream must start with exactly one header chunk");
+        }
+        self.wrote_header = true;
+        self.write_frame(&ProtoFrame::from(chunk))
+    }
+
+    /// Uncompressed size of the stream written so far, in bytes.
+    pub fn bytes_in(&self) -> u64 {
+        self.bytes_in
+    }
+
+    /// Write the end frame, flush any compressed output and return the
+    /// underlying writer.
+    pub fn finish(mut self) -> Result<W> {
+        if !self.wrote_header {
+            bail!("a framed patch stream must start with exactly one header chunk");
+        }
+        self.write_frame(&ProtoFrame {
+            body: Some(ProtoFrameBody::End(true)),
+        })?;
+        match self.sink {
+            FramedSink::Raw(mut writer) => {
+                writer.flush().context("failed to flush patch stream")?;
+                Ok(writer)
+            }
+            FramedSink::Zstd(encoder) => encoder.finish().context("failed to finish zstd stream"),
+        }
+    }
+
+    fn write_frame(&mut self, frame: &ProtoFrame) -> Result<()> {
+        self.frame_buf.clear();
+        frame.encode_length_delimited(&mut self.frame_buf)?;
+        self.bytes_in += self.frame_buf.len() as u64;
+        self.sink
+            .write_all(&self.frame_buf)
+            .context("failed to write patch stream")
+    }
+}
+
+/// Reads a framed patch stream one chunk at a time, auto-detecting zstd
+/// compression. Only the current frame is held in memory, and frames larger
+/// than a fixed bound are rejected, so arbitrarily large patches from
+/// untrusted peers can be consumed with bounded memory. The iterator yields
+/// the header first and ends after the end frame; a stream that stops before
+/// it is reported as truncated.
+pub struct FramedDecoder<'a> {
+    reader: Box<dyn Read + 'a>,
+    frame_buf: Vec<u8>,
+    read_header: bool,
+    done: bool,
+}
+
+impl<'a> FramedDecoder<'a> {
+    /// Start reading a stream from `reader` and check its magic bytes.
+    /// Streams compressed with a zstd dictionary need
+    /// [`FramedDecoder::with_config`].
+    pub fn new(reader: impl Read + 'a) -> Result<Self> {
+        Self::open(reader, None)
+    }
+
+    /// Like [`FramedDecoder::new`], but decompresses streams compressed with
+    /// a zstd dictionary using the matching one from `config`.
+    pub fn with_config(config: &Config, reader: impl Read + 'a) -> Result<Self> {
+        Self::open(reader, Some(&config.compression))
+    }
+
+    fn open(mut reader: impl Read + 'a, compression: Option<&CompressionConfig>) -> Result<Self> {
+        // Read enough to see a whole zstd frame header, then put the bytes
+        // back in front of the rest of the input.
+        let mut prefix = [0u8; ZSTD_FRAME_HEADER_MAX];
+        let prefix_len = read_prefix(&mut reader, &mut prefix)?;
+        let prefix = &prefix[..prefix_len];
+        let input = BufReader::new(Cursor::new(prefix.to_vec()).chain(reader));
+
+        let mut reader: Box<dyn Read + 'a> = if prefix.starts_with(&ZSTD_MAGIC) {
+            let dictionary = frame_dictionary(compression, prefix)?;
+            let decoder = zstd::stream::read::Decoder::with_dictionary(input, dictionary)
+                .context("failed to initialize zstd decoder")?;
+            Box::new(decoder)
+        } else {
+            Box::new(input)
+        };
+        let mut magic = [0u8; 4];
+        reader
+            .read_exact(&mut magic)
+            .context("failed to read patch stream")?;
+        if magic != FRAMED_MAGIC {
+            bail!("not a framed patch stream");
+        }
+        Ok(Self::from_payload(reader))
+    }
+
+    /// Read the frames of a stream whose magic bytes have been consumed from
+    /// the (decompressed) `reader` already.
+    fn from_payload(reader: Box<dyn Read + 'a>) -> Self {
+        FramedDecoder {
+            reader,
+            frame_buf: Vec::new(),
+            read_header: false,
+            done: false,
+        }
+    }
+
+    /// Consume the rest of the stream and reassemble the complete patch,
+    /// joining the chunks of each table.
+    pub fn into_patch(self) -> Result<Patch> {
+        let mut patch = Patch::default();
+        for chunk in self {
+            match chunk? {
+                PatchChunk::Header(header) => patch = header,
+                PatchChunk::Delta(table, delta) => match patch.deltas.entry(table) {
+                    Entry::Occupied(entry) => {
+                        let merged = entry.into_mut();
+                        merged.inserts.extend(delta.inserts);
+                        merged.deletes.extend(delta.deletes);
+                        merged.updates.extend(delta.updates);
+                    }
+                    Entry::Vacant(entry) => {
+                        entry.insert(delta);
+                    }
+                },
+                PatchChunk::State(table, state) => match patch.states.entry(table) {
+                    Entry::Occupied(entry) => entry.into_mut().records.extend(state.records),
+                    Entry::Vacant(entry) => {
+                        entry.insert(state);
+                    }
+                },
+                PatchChunk::ReplacedKeys(table, keys) => match patch.replaced_keys.entry(table) {
+                    Entry::Occupied(entry) => entry.into_mut().records.extend(keys.records),
+                    Entry::Vacant(entry) => {
+                        entry.insert(keys);
+                    }
+                },
+            }
+        }
+        Ok(patch)
+    }
+
+    /// Read the next frame's length prefix, or `None` at a clean end of
+    /// input.
+    fn read_frame_len(&mut self) -> Result<Option<u64>> {
+        let mut byte = [0u8; 1];
+        let first = loop {
+            match self.reader.read(&mut byte) {
+                Ok(0) => return Ok(None),
+                Ok(_) => break byte[0],
+                Err(e) if e.kind() == ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e).context("failed to read patch stream"),
+            }
+        };
+        let mut len = u64::from(first & 0x7f);
+        let mut current = first;
+        let mut shift = 7;
+        while current & 0x80 != 0 {
+            if shift >= 64 {
+                bail!("invalid frame length in patch stream");
+            }
+            self.reader
+                .read_exact(&mut byte)
+                .context("truncated frame length in patch stream")?;
+            current = byte[0];
+            len |= u64::from(current & 0x7f) << shift;
+            shift += 7;
+        }
+        Ok(Some(len))
+    }
+
+    fn next_chunk(&mut self) -> Result<Option<PatchChunk>> {
+        let Some(len) = self.read_frame_len()? else {
+            bail!("patch stream ended without an end frame (truncated?)");
+        };
+        if len > MAX_FRAME_SIZE {
+            bail!(
+                "patch stream frame of {len} bytes exceeds the maximum of {MAX_FRAME_SIZE} bytes"
+            );
+        }
+        self.frame_buf.resize(len as usize, 0);
+        self.reader
+            .read_exact(&mut self.frame_buf)
+            .context("truncated frame in patch stream")?;
+        let frame = ProtoFrame::decode(self.frame_buf.as_slice())
+            .context("failed to decode patch frame")?;
+
+        let chunk = match frame.body {
+            Some(ProtoFrameBody::End(_)) => {
+                if !self.read_header {
+                    bail!("patch stream has no header frame");
+                }
+                return Ok(None);
+            }
+            Some(ProtoFrameBody::Header(header)) => PatchChunk::Header(header),
+            Some(ProtoFrameBody::Delta(delta)) => {
+                PatchChunk::Delta(delta.table, delta.delta.unwrap_or_default())
+            }
+            Some(ProtoFrameBody::State(state)) => {
+                PatchChunk::State(state.table, state.state.unwrap_or_default())
+            }
+            Some(ProtoFrameBody::ReplacedKeys(keys)) => {
+                PatchChunk::ReplacedKeys(keys.table, keys.keys.unwrap_or_default())
+            }
+            None => bail!("empty frame in patch stream"),
+        };
+        let is_header = matches!(chunk, PatchChunk::Header(_));
+        if is_header == self.read_header {
+            bail!("patch stream must start with exactly one header frame");
+        }
+        self.read_header = true;
+        Ok(Some(chunk))
+    }
+}
+
+impl Iterator for FramedDecoder<'_> {
+    type Item = Result<PatchChunk>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.done {
+            return None;
+        }
+        let result = self.next_chunk();
+        if !matches!(result, Ok(Some(_))) {
+            self.done = true;
+        }
+        result.transpose()
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
+    use crate::cell::text_proto_cells;
 
     #[test]
     fn test_decode_corrupted_protobuf() {
@@ -151,23 +795,249 @@ mod tests {
     }
 
     #[test]
-    fn test_decompress_bounded_rejects_oversized_output() {
+    fn test_read_bounded_rejects_oversized_output() {
         // A small frame that expands past the cap must be rejected rather than
         // allocated in full.
         let original = vec![0u8; 1_000_000];
         let compressed = zstd::encode_all(original.as_slice(), 0).unwrap();
         assert!(compressed.len() < 1_000_000, "expected high compression");
 
-        let err = decompress_bounded(&compressed, 1024).err().unwrap();
+        let decoder = zstd::stream::read::Decoder::new(compressed.as_slice()).unwrap();
+        let err = read_bounded(decoder, 1024).err().unwrap();
         let msg = format!("{:#}", err);
         assert!(msg.contains("maximum allowed size"), "got: {msg}");
     }
 
     #[test]
-    fn test_decompress_bounded_accepts_output_within_limit() {
+    fn test_read_bounded_accepts_output_within_limit() {
         let original = vec![7u8; 1000];
         let compressed = zstd::encode_all(original.as_slice(), 0).unwrap();
-        let out = decompress_bounded(&compressed, 1_000_000).unwrap();
+        let decoder = zstd::stream::read::Decoder::new(compressed.as_slice()).unwrap();
+        let out = read_bounded(decoder, 1_000_000).unwrap();
         assert_eq!(out, original);
     }
+
+    fn record(key: usize) -> crate::proto::record::Record {
+        crate::proto::record::Record {
+            key: text_proto_cells(&[&key.to_string()]),
+            value: text_proto_cells(&["value"]),
+        }
+    }
+
+    /// A patch with a delta and a full-state table large enough to be split
+    /// into several chunks each.
+    fn large_patch() -> Patch {
+        let primary_key_names = vec!["id".to_string()];
+        let subsidiary_value_names = vec!["name".to_string()];
+        let delta = ProtoDelta {
+            primary_key_names: primary_key_names.clone(),
+            subsidiary_value_names: subsidiary_value_names.clone(),
+            inserts: (0..FRAME_RECORDS).map(record).collect(),
+            deletes: (0..FRAME_RECORDS / 2).map(record).collect(),
+            updates: Vec::new(),
+        };
+        let state = ProtoTable {
+            primary_key_names,
+            subsidiary_value_names,
+            records: (0..FRAME_RECORDS * 2 + 1).map(record).collect(),
+        };
+        let partition = ProtoTable {
+            records: (0..3).map(record).collect(),
+            ..state.clone()
+        };
+        let keys = ProtoKeys {
+            records: (0..FRAME_RECORDS + 1).map(record).collect(),
+        };
+        Patch {
+            head: "a".repeat(40),
+            num_blocks: 3,
+            deltas: HashMap::from([
+                ("users".to_string(), delta),
+                ("empty".to_string(), ProtoDelta::default()),
+            ]),
+            states: HashMap::from([
+                ("orders".to_string(), state),
+                ("items#1".to_string(), partition),
+            ]),
+            replaced_keys: HashMap::from([("items#1".to_string(), keys)]),
+            ..Default::default()
+        }
+    }
+
+    fn framed_config(compress: bool) -> Config {
+        let mut config = Config::default();
+        config.framed_patches = true;
+        config.compression.enable = compress;
+        config
+    }
+
+    #[test]
+    fn test_patch_chunks_splits_tables() {
+        let patch = large_patch();
+        let chunks: Vec<PatchChunk> = patch_chunks(&patch).collect();
+        assert!(matches!(chunks[0], PatchChunk::Header(_)));
+        let count = |name: &str| {
+            chunks
+                .iter()
+                .filter(|chunk| match chunk {
+                    PatchChunk::Delta(table, _)
+                    | PatchChunk::State(table, _)
+                    | PatchChunk::ReplacedKeys(table, _) => table == name,
+                    PatchChunk::Header(_) => false,
+                })
+                .count()
+        };
+        assert_eq!(count("users"), 2);
+        assert_eq!(count("empty"), 1);
+        assert_eq!(count("orders"), 3);
+        assert_eq!(count("items#1"), 3);
+
+        // A partition's replaced keys come before its state.
+        let position = |want_keys: bool| {
+            chunks.iter().position(|chunk| match chunk {
+                PatchChunk::ReplacedKeys(table, _) => want_keys && table == "items#1",
+                PatchChunk::State(table, _) => !want_keys && table == "items#1",
+                _ => false,
+            })
+        };
+        assert!(position(true) < position(false));
+    }
+
+    #[test]
+    fn test_framed_round_trip() {
+        for compress in [false, true] {
+            let config = framed_config(compress);
+            let patch = large_patch();
+            let encoded = encode_patch(&config, &patch).unwrap();
+            assert_eq!(encoded.starts_with(&ZSTD_MAGIC), compress);
+            assert_eq!(decode_patch(&encoded).unwrap(), patch);
+
+            let chunks = FramedDecoder::new(encoded.as_slice())
+                .unwrap()
+                .collect::<Result<Vec<_>>>()
+                .unwrap();
+            assert_eq!(chunks.len(), patch_chunks(&patch).count());
+        }
+    }
+
+    #[test]
+    fn test_open_patch_streams_framed_chunks() {
+        for compress in [false, true] {
+            let patch = large_patch();
+            let encoded = encode_patch(&framed_config(compress), &patch).unwrap();
+            let PatchReader::Framed(decoder) = open_patch(&encoded).unwrap() else {
+                panic!("expected a framed patch");
+            };
+            let chunks = decoder.collect::<Result<Vec<_>>>().unwrap();
+            assert_eq!(chunks, patch_chunks(&patch).collect::<Vec<_>>());
+        }
+
+        let patch = large_patch();
+        let encoded = encode_patch(&Config::default(), &patch).unwrap();
+        let PatchReader::Unframed(decoded) = open_patch(&encoded).unwrap() else {
+            panic!("expected an unframed patch");
+        };
+        assert_eq!(decoded, patch);
+    }
+
+    #[test]
+    fn test_framed_truncated_stream_is_rejected() {
+        let encoded = encode_patch(&framed_config(false), &large_patch()).unwrap();
+        // Cutting off the end frame leaves only whole table chunks, which
+        // must still be reported rather than yield a partial patch.
+        let end_frame_len = ProtoFrame {
+            body: Some(ProtoFrameBody::End(true)),
+        }
+        .encode_length_delimited_to_vec()
+        .len();
+        for truncated in [
+            &encoded[..encoded.len() - end_frame_len],
+            &encoded[..encoded.len() / 2],
+        ] {
+            let err = decode_patch(truncated).unwrap_err();
+            assert!(format!("{:#}", err).contains("truncated"), "got: {err:#}");
+        }
+    }
+
+    #[test]
+    fn test_framed_rejects_oversized_frame() {
+        let mut data = FRAMED_MAGIC.to_vec();
+        prost::encode_length_delimiter((MAX_FRAME_SIZE + 1) as usize, &mut data).unwrap();
+        let err = decode_patch(&data).unwrap_err();
+        assert!(
+            format!("{:#}", err).contains("exceeds the maximum"),
+            "got: {err:#}"
+        );
+    }
+
+    #[test]
+    fn test_framed_encoder_requires_header_first() {
+        let mut encoder = FramedEncoder::new(&framed_config(false), Vec::new()).unwrap();
+        let chunk = PatchChunk::State("users".to_string(), ProtoTable::default());
+        assert!(encoder.write_chunk(chunk).is_err());
+    }
+
+    /// A small patch shaped like the ones a dictionary is trained on.
+    fn small_patch(seed: usize) -> Patch {
+        let delta = ProtoDelta {
+            primary_key_names: vec!["id".to_string()],
+            subsidiary_value_names: vec!["name".to_string()],
+            inserts: (seed..seed + 3).map(record).collect(),
+            deletes: Vec::new(),
+            updates: Vec::new(),
+        };
+        Patch {
+            head: format!("{:040x}", seed),
+            num_blocks: 1,
+            deltas: HashMap::from([("users".to_string(), delta)]),
+            ..Default::default()
+        }
+    }
+
+    fn dictionary_config(framed: bool) -> Config {
+        let samples: Vec<Vec<u8>> = (0..1000)
+            .map(|seed| small_patch(seed).encode_to_vec())
+            .collect();
+        let data = zstd::dict::from_samples(&samples, 4096).unwrap();
+        let id = zstd::zstd_safe::get_dict_id_from_dict(&data).unwrap().get();
+        let mut config = Config::default();
+        config.framed_patches = framed;
+        config.compression.loaded_dictionary = Some(crate::config::ZstdDictionary { id, data });
+        config
+    }
+
+    #[test]
+    fn test_dictionary_round_trip() {
+        for framed in [false, true] {
+            let config = dictionary_config(framed);
+            let id = config.compression.loaded_dictionary.as_ref().unwrap().id;
+            let patch = small_patch(5000);
+            let encoded = encode_patch(&config, &patch).unwrap();
+
+            assert!(encoded.starts_with(&ZSTD_MAGIC));
+            let frame_id = zstd::zstd_safe::get_dict_id_from_frame(&encoded).unwrap();
+            assert_eq!(frame_id.get(), id);
+            assert_eq!(decode_patch_with(&config, &encoded).unwrap(), patch);
+
+            let err = decode_patch(&encoded).unwrap_err();
+            assert!(
+                format!("{:#}", err).contains("not configured"),
+                "got: {err:#}"
+            );
+        }
+    }
+
+    #[test]
+    fn test_framed_decoder_picks_dictionary() {
+        let config = dictionary_config(true);
+        let patch = small_patch(5000);
+        let encoded = encode_patch(&config, &patch).unwrap();
+
+        assert!(FramedDecoder::new(encoded.as_slice()).is_err());
+        let decoded = FramedDecoder::with_config(&config, encoded.as_slice())
+            .unwrap()
+            .into_patch()
+            .unwrap();
+        assert_eq!(decoded, patch);
+    }
 }
@@ -0,0 +1,170 @@
+mod common;
+
+use leech2::block::Block;
+use leech2::config::{Config, TruncateConfig};
+use leech2::patch::Patch;
+use leech2::sql;
+use leech2::storage;
+use leech2::truncate;
+
+/// Helper: write a two-field users table config with the given checkpoint
+/// interval.
+fn setup_users(work_dir: &std::path::Path, interval: u32) -> Config {
+    common::write_config(
+        work_dir,
+        "config.toml",
+        &format!(
+            r#"
+checkpoint-interval = {interval}
+
+[tables.users]
+fields = [
+    {{ name = "id", type = "NUMBER", primary-key = true }},
+    {{ name = "name", type = "TEXT" }},
+]
+
+[tables.users.csv]
+source = "users.csv"
+"#
+        ),
+    );
+    Config::load(work_dir).unwrap()
+}
+
+fn checkpoint_path(config: &Config, base: &str) -> std::path::PathBuf {
+    config.state_dir().join(format!("CHECKPOINT.{}", base))
+}
+
+/// Rows that never change, so that consolidated deltas stay smaller than the
+/// full state and patches keep using them.
+const UNCHANGED_ROWS: &str = "10,Frank\n11,Grace\n12,Heidi\n13,Ivan\n14,Judy\n";
+
+fn write_users(work_dir: &std::path::Path, rows: &str) {
+    common::write_csv(
+        work_dir,
+        "users.csv",
+        &format!("{}{}", rows, UNCHANGED_ROWS),
+    );
+}
+
+/// Create the base block plus two blocks on top of it, and return the base
+/// hash together with the middle block's hash.
+fn build_chain(config: &Config, work_dir: &std::path::Path) -> (String, String) {
+    write_users(work_dir, "1,Alice\n2,Bob\n");
+    let base = Block::create(config, None).unwrap();
+
+    write_users(work_dir, "1,Alice\n2,Robert\n3,Carol\n");
+    let middle = Block::create(config, None).unwrap();
+
+    write_users(work_dir, "2,Robert\n3,Carol\n4,Dave\n");
+    Block::create(config, None).unwrap();
+
+    (base, middle)
+}
+
+const EXPECTED_AFTER_THREE_BLOCKS: &[&str] = &[
+    r#"DELETE FROM "users" WHERE "id" = 1;"#,
+    r#"UPDATE "users" SET "name" = 'Robert' WHERE "id" = 2;"#,
+    r#"INSERT INTO "users" ("id", "name") VALUES (3, 'Carol');"#,
+    r#"INSERT INTO "users" ("id", "name") VALUES (4, 'Eve');"#,
+];
+
+/// A consolidation merging at least `checkpoint-interval` blocks stores a
+/// checkpoint, and the next patch resumes from it: with the middle block
+/// gone the chain can no longer be re-merged from scratch, yet the patch is
+/// still built from deltas.
+#[test]
+fn test_patch_resumes_from_checkpoint() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup_users(work_dir, 2);
+    let (base, middle) = build_chain(&config, work_dir);
+
+    let patch = Patch::create(&config, &base).unwrap();
+    assert_eq!(patch.num_blocks, 2);
+    assert!(checkpoint_path(&config, &base).exists());
+
+    write_users(work_dir, "2,Robert\n3,Carol\n4,Eve\n");
+    let head = Block::create(&config, None).unwrap();
+    storage::remove(&config.state_dir(), &middle, config.file_mode, false).unwrap();
+
+    let patch = Patch::create(&config, &base).unwrap();
+    assert_eq!(patch.head, head);
+    assert_eq!(patch.num_blocks, 3);
+    assert!(patch.states.is_empty());
+
+    let sql = sql::patch_to_sql(&config, &patch).unwrap().unwrap();
+    common::assert_sql_statements(&sql, EXPECTED_AFTER_THREE_BLOCKS);
+}
+
+/// A patch resumed from a checkpoint is identical to one merged from scratch.
+#[test]
+fn test_checkpoint_matches_full_merge() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup_users(work_dir, 2);
+    let (base, _) = build_chain(&config, work_dir);
+
+    Patch::create(&config, &base).unwrap();
+    write_users(work_dir, "2,Robert\n3,Carol\n4,Eve\n");
+    Block::create(&config, None).unwrap();
+
+    let resumed = Patch::create(&config, &base).unwrap();
+    std::fs::remove_file(checkpoint_path(&config, &base)).unwrap();
+    let merged = Patch::create(&config, &base).unwrap();
+
+    assert_eq!(resumed.num_blocks, merged.num_blocks);
+    let resumed_sql = sql::patch_to_sql(&config, &resumed).unwrap().unwrap();
+    let merged_sql = sql::patch_to_sql(&config, &merged).unwrap().unwrap();
+    common::assert_sql_statements(&resumed_sql, EXPECTED_AFTER_THREE_BLOCKS);
+    common::assert_sql_statements(&merged_sql, EXPECTED_AFTER_THREE_BLOCKS);
+    common::assert_wire_roundtrip(&config, &resumed);
+}
+
+/// Short tails and a zero interval do not write checkpoints.
+#[test]
+fn test_checkpoint_interval_gates_storing() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup_users(work_dir, 3);
+    let (base, _) = build_chain(&config, work_dir);
+    Patch::create(&config, &base).unwrap();
+    assert!(!checkpoint_path(&config, &base).exists());
+
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup_users(work_dir, 0);
+    let (base, _) = build_chain(&config, work_dir);
+    Patch::create(&config, &base).unwrap();
+    assert!(!checkpoint_path(&config, &base).exists());
+}
+
+/// Truncating a checkpoint's base block also removes the checkpoint.
+#[test]
+fn test_truncation_removes_stale_checkpoint() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup_users(work_dir, 2);
+    let (base, _) = build_chain(&config, work_dir);
+    Patch::create(&config, &base).unwrap();
+    assert!(checkpoint_path(&config, &base).exists());
+
+    let truncate_config = TruncateConfig {
+        max_blocks: Some(2),
+        ..TruncateConfig::default()
+    };
+    truncate::run(
+        &config.state_dir(),
+        &truncate_config,
+        config.file_mode,
+        false,
+    )
+    .unwrap();
+
+    assert!(!config.state_dir().join(&base).exists());
+    assert!(!checkpoint_path(&config, &base).exists());
+}
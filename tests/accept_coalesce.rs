@@ -0,0 +1,129 @@
+mod common;
+
+use leech2::block::Block;
+use leech2::coalesce;
+use leech2::config::Config;
+use leech2::patch::Patch;
+use leech2::sql;
+use leech2::utils::GENESIS_HASH;
+
+const CONFIG: &str = r#"
+[tables.users]
+fields = [
+    { name = "id", type = "NUMBER", primary-key = true },
+    { name = "name", type = "TEXT" },
+    { name = "email", type = "TEXT" },
+]
+
+[tables.users.csv]
+source = "users.csv"
+"#;
+
+#[test]
+fn test_coalesce_incremental_patches() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    common::write_config(work_dir, "config.toml", CONFIG);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice,a@ex.com\n2,Bob,b@ex.com\n");
+    let config = Config::load(work_dir).unwrap();
+    let hash1 = Block::create(&config, None).unwrap();
+
+    // Block 2: insert Charlie, update Alice's email.
+    common::write_csv(
+        work_dir,
+        "users.csv",
+        "1,Alice,a@new.com\n2,Bob,b@ex.com\n3,Charlie,c@ex.com\n",
+    );
+    let hash2 = Block::create(&config, None).unwrap();
+    let patch1 = Patch::create(&config, &hash1).unwrap();
+
+    // Block 3: delete Charlie again, rename Alice, delete Bob.
+    common::write_csv(work_dir, "users.csv", "1,Alicia,a@new.com\n");
+    let hash3 = Block::create(&config, None).unwrap();
+    let patch2 = Patch::create(&config, &hash2).unwrap();
+
+    let coalesced = coalesce::coalesce(&config, [patch1, patch2]).unwrap();
+    assert_eq!(coalesced.head, hash3);
+    assert_eq!(coalesced.num_blocks, 2);
+
+    // Charlie nets out; Alice's two updates collapse into one.
+    let sql = sql::patch_to_sql(&config, &coalesced).unwrap().unwrap();
+    common::assert_sql_statements(
+        &sql,
+        &[
+            r#"DELETE FROM "users" WHERE "id" = 2;"#,
+            r#"UPDATE "users" SET "name" = 'Alicia', "email" = 'a@new.com' WHERE "id" = 1;"#,
+        ],
+    );
+
+    common::assert_wire_roundtrip(&config, &coalesced);
+}
+
+#[test]
+fn test_coalesce_state_supersedes_deltas() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    common::write_config(work_dir, "config.toml", CONFIG);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice,a@ex.com\n");
+    let config = Config::load(work_dir).unwrap();
+    let hash1 = Block::create(&config, None).unwrap();
+    let full = Patch::create(&config, GENESIS_HASH).unwrap();
+    assert_eq!(full.num_blocks, 0);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice,a@ex.com\n2,Bob,b@ex.com\n");
+    let hash2 = Block::create(&config, None).unwrap();
+    let delta = Patch::create(&config, &hash1).unwrap();
+
+    // An incremental patch on top of a full state folds into the state.
+    let coalesced = coalesce::coalesce(&config, [full.clone(), delta.clone()]).unwrap();
+    assert_eq!(coalesced.head, hash2);
+    let sql = sql::patch_to_sql(&config, &coalesced).unwrap().unwrap();
+    assert_eq!(common::count_sql(&sql, "TRUNCATE"), 1);
+    assert_eq!(common::count_sql(&sql, "INSERT INTO"), 2);
+    assert_eq!(common::count_sql(&sql, "UPDATE "), 0);
+    assert_eq!(common::count_sql(&sql, "DELETE FROM"), 0);
+
+    // A full state after a delta drops the delta.
+    let full2 = Patch::create(&config, GENESIS_HASH).unwrap();
+    let coalesced = coalesce::coalesce(&config, [delta, full2]).unwrap();
+    assert_eq!(coalesced.head, hash2);
+    let sql = sql::patch_to_sql(&config, &coalesced).unwrap().unwrap();
+    assert_eq!(common::count_sql(&sql, "TRUNCATE"), 1);
+    assert_eq!(common::count_sql(&sql, "INSERT INTO"), 2);
+
+    common::assert_wire_roundtrip(&config, &coalesced);
+}
+
+#[test]
+fn test_coalesce_rejects_bad_queues() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    common::write_config(work_dir, "config.toml", CONFIG);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice,a@ex.com\n");
+    let config = Config::load(work_dir).unwrap();
+    let hash1 = Block::create(&config, None).unwrap();
+    common::write_csv(work_dir, "users.csv", "1,Alice,a@ex.com\n2,Bob,b@ex.com\n");
+    Block::create(&config, None).unwrap();
+    let patch = Patch::create(&config, &hash1).unwrap();
+
+    let empty: Vec<Patch> = Vec::new();
+    assert!(coalesce::coalesce(&config, empty).is_err());
+
+    // The same patch queued twice.
+    let err = coalesce::coalesce(&config, [patch.clone(), patch.clone()]).unwrap_err();
+    assert!(format!("{:#}", err).contains("queued twice"), "{:#}", err);
+
+    // A single patch comes back unchanged.
+    let single = coalesce::coalesce(&config, [patch.clone()]).unwrap();
+    assert_eq!(single.head, patch.head);
+    assert_eq!(
+        sql::patch_to_sql(&config, &single).unwrap(),
+        sql::patch_to_sql(&config, &patch).unwrap()
+    );
+}
@@ -0,0 +1,85 @@
+mod common;
+
+use leech2::block::Block;
+use leech2::config::Config;
+use leech2::patch::Patch;
+use leech2::sql;
+
+/// Helper: write a users table config consolidating on `threads` workers.
+fn setup_users(work_dir: &std::path::Path, threads: usize) -> Config {
+    common::write_config(
+        work_dir,
+        "config.toml",
+        &format!(
+            r#"
+threads = {threads}
+
+[tables.users]
+fields = [
+    {{ name = "id", type = "NUMBER", primary-key = true }},
+    {{ name = "name", type = "TEXT" }},
+]
+
+[tables.users.csv]
+source = "users.csv"
+"#
+        ),
+    );
+    Config::load(work_dir).unwrap()
+}
+
+/// Rows that never change, so that the consolidated delta stays smaller than
+/// the full state and the patch keeps using it.
+const UNCHANGED_ROWS: &str = "100,Frank\n101,Grace\n102,Heidi\n103,Ivan\n104,Judy\n\
+                              105,Mallory\n106,Niaj\n107,Olivia\n108,Peggy\n109,Rupert\n";
+
+/// Build the same chain of `num_blocks` blocks on top of a base block, with
+/// rows inserted, renamed and deleted across blocks, and return the base.
+fn build_chain(config: &Config, work_dir: &std::path::Path, num_blocks: usize) -> String {
+    common::write_csv(
+        work_dir,
+        "users.csv",
+        &format!("0,Base\n{}", UNCHANGED_ROWS),
+    );
+    let base = Block::create(config, None).unwrap();
+    for i in 1..=num_blocks {
+        let mut rows = UNCHANGED_ROWS.to_string();
+        for id in i.saturating_sub(3)..=i {
+            rows.push_str(&format!("{},user{}-v{}\n", id, id, i - id));
+        }
+        common::write_csv(work_dir, "users.csv", &rows);
+        Block::create(config, None).unwrap();
+    }
+    base
+}
+
+/// Consolidating on several threads produces the same patch as the
+/// sequential merge, across several windows of blocks.
+#[test]
+fn test_parallel_merge_matches_sequential() {
+    common::init_logging();
+    // Two threads reduce windows of 8 blocks, so 19 blocks span three windows.
+    let num_blocks = 19;
+
+    let tmp = tempfile::tempdir().unwrap();
+    let config = setup_users(tmp.path(), 1);
+    let base = build_chain(&config, tmp.path(), num_blocks);
+    let sequential = Patch::create(&config, &base).unwrap();
+
+    let tmp = tempfile::tempdir().unwrap();
+    let config = setup_users(tmp.path(), 2);
+    let base = build_chain(&config, tmp.path(), num_blocks);
+    let parallel = Patch::create(&config, &base).unwrap();
+
+    assert_eq!(parallel.num_blocks, num_blocks as u32);
+    assert_eq!(parallel.num_blocks, sequential.num_blocks);
+    assert!(parallel.states.is_empty());
+    let sequential_sql = sql::patch_to_sql(&config, &sequential).unwrap().unwrap();
+    let parallel_sql = sql::patch_to_sql(&config, &parallel).unwrap().unwrap();
+    let mut sequential_lines: Vec<&str> = sequential_sql.lines().collect();
+    let mut parallel_lines: Vec<&str> = parallel_sql.lines().collect();
+    sequential_lines.sort_unstable();
+    parallel_lines.sort_unstable();
+    assert_eq!(parallel_lines, sequential_lines);
+    common::assert_wire_roundtrip(&config, &parallel);
+}
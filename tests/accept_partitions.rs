@@ -0,0 +1,91 @@
+mod common;
+
+use leech2::block::Block;
+use leech2::config::Config;
+use leech2::patch::Patch;
+use leech2::sql;
+
+fn items_config(partitions: u32) -> String {
+    format!(
+        r#"
+[tables.items]
+partitions = {}
+fields = [
+    {{ name = "id", type = "NUMBER", primary-key = true }},
+    {{ name = "name", type = "TEXT" }},
+]
+
+[tables.items.csv]
+source = "items.csv"
+"#,
+        partitions
+    )
+}
+
+/// A partitioned table is stored and shipped per partition, but its SQL
+/// targets the configured table.
+#[test]
+fn test_partitioned_table_ships_partition_deltas() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+
+    common::write_config(work_dir, "config.toml", &items_config(4));
+    common::write_csv(work_dir, "items.csv", "1,apple\n2,banana\n3,cherry\n");
+    let config = Config::load(work_dir).unwrap();
+    let hash1 = Block::create(&config, None).unwrap();
+
+    common::write_csv(work_dir, "items.csv", "1,apple\n2,blueberry\n4,date\n");
+    Block::create(&config, None).unwrap();
+
+    let patch = Patch::create(&config, &hash1).unwrap();
+    assert_eq!(patch.num_blocks, 1);
+    assert!(patch.states.is_empty());
+    assert!(patch.replaced_keys.is_empty());
+    assert!(!patch.deltas.is_empty());
+    assert!(
+        patch.deltas.keys().all(|name| name.starts_with("items#")),
+        "expected partition deltas, got {:?}",
+        patch.deltas.keys().collect::<Vec<_>>()
+    );
+
+    let sql = sql::patch_to_sql(&config, &patch).unwrap().unwrap();
+    assert!(sql.contains(r#"DELETE FROM "items" WHERE "id" = 3;"#));
+    assert!(sql.contains(r#"INSERT INTO "items" ("id", "name") VALUES (4, 'date');"#));
+    assert!(sql.contains(r#"UPDATE "items" SET "name" = 'blueberry' WHERE "id" = 2;"#));
+    assert!(!sql.contains("items#"));
+    common::assert_wire_roundtrip(&config, &patch);
+}
+
+/// Changing the partition count ships the whole table as one state under its
+/// configured name.
+#[test]
+fn test_repartition_ships_whole_table() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+
+    common::write_config(work_dir, "config.toml", &items_config(4));
+    common::write_csv(work_dir, "items.csv", "1,apple\n2,banana\n3,cherry\n");
+    let config = Config::load(work_dir).unwrap();
+    let hash1 = Block::create(&config, None).unwrap();
+
+    common::write_config(work_dir, "config.toml", &items_config(2));
+    common::write_csv(
+        work_dir,
+        "items.csv",
+        "1,apple\n2,banana\n3,cherry\n4,date\n",
+    );
+    let config = Config::load(work_dir).unwrap();
+    Block::create(&config, None).unwrap();
+
+    let patch = Patch::create(&config, &hash1).unwrap();
+    assert!(patch.deltas.is_empty(), "got {:?}", patch.deltas.keys());
+    assert_eq!(patch.states.keys().collect::<Vec<_>>(), ["items"]);
+    assert_eq!(patch.states["items"].records.len(), 4);
+
+    let sql = sql::patch_to_sql(&config, &patch).unwrap().unwrap();
+    assert!(sql.contains(r#"TRUNCATE "items";"#));
+    assert_eq!(common::count_sql(&sql, r#"INSERT INTO "items""#), 4);
+    common::assert_wire_roundtrip(&config, &patch);
+}
@@ -7,6 +7,7 @@ use leech2::patch::Patch;
 use leech2::reported;
 use leech2::sql;
 use leech2::storage;
+use leech2::truncate;
 use leech2::utils::GENESIS_HASH;
 
 /// Helper: write a two-field users table config.
@@ -298,3 +299,74 @@ source = "users.csv"
     // Must error rather than silently drop the changed table from the patch.
     assert!(Patch::create(&config, &hash1).is_err());
 }
+
+/// Helper: like `setup_users`, with journaled block commits.
+fn setup_journaled_users(work_dir: &std::path::Path) -> Config {
+    let mut config = setup_users(work_dir);
+    config.journal.enable = true;
+    config
+}
+
+/// With the journal enabled, files lost in a crash after the journal record
+/// was synced (here: the newest block, STATE and HEAD) are restored when the
+/// next patch is created.
+#[test]
+fn test_journal_restores_lost_commit() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup_journaled_users(work_dir);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n");
+    let hash1 = Block::create(&config, None).unwrap();
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n");
+    let hash2 = Block::create(&config, None).unwrap();
+    truncate::wait_for_pending(&config);
+    assert!(config.state_dir().join("JOURNAL").exists());
+
+    let state_dir = config.state_dir();
+    std::fs::remove_file(state_dir.join(&hash2)).unwrap();
+    std::fs::remove_file(state_dir.join("STATE")).unwrap();
+    std::fs::write(state_dir.join("HEAD"), &hash1).unwrap();
+
+    let patch = Patch::create(&config, &hash1).unwrap();
+    assert_eq!(patch.head, hash2);
+    assert_eq!(patch.num_blocks, 1);
+    assert!(state_dir.join(&hash2).exists());
+    assert!(state_dir.join("STATE").exists());
+
+    let sql = sql::patch_to_sql(&config, &patch).unwrap().unwrap();
+    common::assert_sql_statements(
+        &sql,
+        &[r#"INSERT INTO "users" ("id", "name") VALUES (2, 'Bob');"#],
+    );
+}
+
+/// Blocks truncated while the journal still holds them are not brought back
+/// by a later recovery, and the chain keeps growing on top of the journal.
+#[test]
+fn test_journal_truncation_is_not_undone() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let mut config = setup_journaled_users(work_dir);
+    config.truncate.max_blocks = Some(2);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n");
+    let hash1 = Block::create(&config, None).unwrap();
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n");
+    let hash2 = Block::create(&config, None).unwrap();
+    truncate::wait_for_pending(&config);
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n3,Carol\n");
+    let hash3 = Block::create(&config, None).unwrap();
+    truncate::wait_for_pending(&config);
+    assert!(!config.state_dir().join(&hash1).exists());
+
+    let patch = Patch::create(&config, &hash2).unwrap();
+    assert_eq!(patch.head, hash3);
+    assert!(!config.state_dir().join(&hash1).exists());
+    assert_eq!(
+        head::load(&config.state_dir(), config.file_mode).unwrap(),
+        hash3
+    );
+}
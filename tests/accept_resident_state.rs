@@ -0,0 +1,136 @@
+mod common;
+
+use std::time::{Duration, SystemTime};
+
+use leech2::block::Block;
+use leech2::config::Config;
+use leech2::patch::Patch;
+use leech2::sql;
+
+/// Helper: write a config with a `users` table that changes between blocks
+/// and a `groups` table that does not, and load it with `resident-state`.
+fn setup(work_dir: &std::path::Path) -> Config {
+    common::write_config(
+        work_dir,
+        "config.toml",
+        r#"
+resident-state = true
+
+[tables.users]
+fields = [
+    { name = "id", type = "NUMBER", primary-key = true },
+    { name = "name", type = "TEXT" },
+]
+
+[tables.users.csv]
+source = "users.csv"
+
+[tables.groups]
+fields = [
+    { name = "id", type = "NUMBER", primary-key = true },
+    { name = "name", type = "TEXT" },
+]
+
+[tables.groups.csv]
+source = "groups.csv"
+"#,
+    );
+    common::write_csv(work_dir, "groups.csv", "1,admins\n");
+    // Old enough to be fingerprinted, so later blocks skip the file.
+    let file = std::fs::File::options()
+        .write(true)
+        .open(work_dir.join("groups.csv"))
+        .unwrap();
+    file.set_modified(SystemTime::now() - Duration::from_secs(3600))
+        .unwrap();
+    Config::load(work_dir).unwrap()
+}
+
+fn remove_state_segments(config: &Config) {
+    for entry in std::fs::read_dir(config.state_dir()).unwrap() {
+        let entry = entry.unwrap();
+        if entry.file_name().to_string_lossy().starts_with("STATE.") {
+            std::fs::remove_file(entry.path()).unwrap();
+        }
+    }
+}
+
+/// With the previous state in memory, block creation does not read the
+/// STATE segments at all: it still works after they were removed.
+#[test]
+fn test_resident_state_skips_segment_loading() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup(work_dir);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n");
+    Block::create(&config, None).unwrap();
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n");
+    let hash2 = Block::create(&config, None).unwrap();
+
+    remove_state_segments(&config);
+    common::write_csv(work_dir, "users.csv", "2,Robert\n3,Carol\n");
+    Block::create(&config, None).unwrap();
+
+    let patch = Patch::create(&config, &hash2).unwrap();
+    let sql = sql::patch_to_sql(&config, &patch).unwrap().unwrap();
+    common::assert_sql_statements(
+        &sql,
+        &[
+            r#"DELETE FROM "users" WHERE "id" = 1;"#,
+            r#"UPDATE "users" SET "name" = 'Robert' WHERE "id" = 2;"#,
+            r#"INSERT INTO "users" ("id", "name") VALUES (3, 'Carol');"#,
+        ],
+    );
+
+    // The same removal without a resident state fails the next block.
+    std::fs::write(
+        work_dir.join("config.toml"),
+        std::fs::read_to_string(work_dir.join("config.toml"))
+            .unwrap()
+            .replace("resident-state = true", ""),
+    )
+    .unwrap();
+    let cold = Config::load(work_dir).unwrap();
+    remove_state_segments(&cold);
+    common::write_csv(work_dir, "users.csv", "3,Carol\n");
+    assert!(Block::create(&cold, None).is_err());
+}
+
+/// When another process advanced the chain, the resident state no longer
+/// matches HEAD and the previous state is loaded from disk instead.
+#[test]
+fn test_resident_state_reloads_after_foreign_block() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup(work_dir);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n");
+    let hash1 = Block::create(&config, None).unwrap();
+
+    let other = Config::load(work_dir).unwrap();
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n");
+    let hash2 = Block::create(&other, None).unwrap();
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n3,Carol\n");
+    Block::create(&config, None).unwrap();
+
+    let patch = Patch::create(&config, &hash2).unwrap();
+    let sql = sql::patch_to_sql(&config, &patch).unwrap().unwrap();
+    common::assert_sql_statements(
+        &sql,
+        &[r#"INSERT INTO "users" ("id", "name") VALUES (3, 'Carol');"#],
+    );
+
+    let patch = Patch::create(&config, &hash1).unwrap();
+    let sql = sql::patch_to_sql(&config, &patch).unwrap().unwrap();
+    common::assert_sql_statements(
+        &sql,
+        &[
+            r#"INSERT INTO "users" ("id", "name") VALUES (2, 'Bob');"#,
+            r#"INSERT INTO "users" ("id", "name") VALUES (3, 'Carol');"#,
+        ],
+    );
+}
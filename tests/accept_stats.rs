@@ -66,6 +66,12 @@ fn test_stats_enabled_writes_cumulative_records() {
         assert!(run[stage]["bytes_in"].is_u64());
         assert!(run[stage]["bytes_out"].is_u64());
     }
+    // A patch from genesis is full state, so the full-state baseline computed
+    // from the STATE index matches it byte for byte.
+    assert_eq!(
+        run["delta_merging"]["bytes_in"],
+        run["delta_merging"]["bytes_out"]
+    );
     // Pipeline invariant: the consolidated patch is what compression receives.
     assert_eq!(
         run["delta_merging"]["bytes_out"],
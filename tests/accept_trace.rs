@@ -0,0 +1,120 @@
+mod common;
+
+use std::time::{Duration, SystemTime};
+
+use leech2::block::Block;
+use leech2::config::Config;
+use leech2::patch::Patch;
+use leech2::sql;
+use leech2::trace::TRACE_FILE;
+use leech2::utils::GENESIS_HASH;
+use serde_json::Value;
+
+fn setup(work_dir: &std::path::Path, trace: bool) -> Config {
+    common::write_config(
+        work_dir,
+        "config.toml",
+        &format!(
+            r#"
+[stats]
+trace = {trace}
+
+[tables.users]
+fields = [
+    {{ name = "id", type = "NUMBER", primary-key = true }},
+    {{ name = "name", type = "TEXT" }},
+]
+
+[tables.users.csv]
+source = "users.csv"
+
+[tables.groups]
+fields = [
+    {{ name = "id", type = "NUMBER", primary-key = true }},
+    {{ name = "name", type = "TEXT" }},
+]
+
+[tables.groups.csv]
+source = "groups.csv"
+"#
+        ),
+    );
+    common::write_csv(work_dir, "groups.csv", "1,admins\n");
+    // Old enough to be fingerprinted, so the second block skips it.
+    let file = std::fs::File::options()
+        .write(true)
+        .open(work_dir.join("groups.csv"))
+        .unwrap();
+    file.set_modified(SystemTime::now() - Duration::from_secs(3600))
+        .unwrap();
+    Config::load(work_dir).unwrap()
+}
+
+fn read_trace(config: &Config) -> Vec<Value> {
+    std::fs::read_to_string(config.state_dir().join(TRACE_FILE))
+        .unwrap()
+        .lines()
+        .map(|line| serde_json::from_str(line).unwrap())
+        .collect()
+}
+
+/// Block creation and SQL conversion each append one line with per-stage
+/// and per-table figures.
+#[test]
+fn test_trace_records_blocks_and_sql() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup(work_dir, true);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n");
+    Block::create(&config, None).unwrap();
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n3,Carol\n");
+    let head = Block::create(&config, None).unwrap();
+
+    let patch = Patch::create(&config, GENESIS_HASH).unwrap();
+    sql::patch_to_sql(&config, &patch).unwrap().unwrap();
+
+    let lines = read_trace(&config);
+    assert_eq!(lines.len(), 3);
+
+    let block = &lines[1];
+    assert_eq!(block["operation"], "block-create");
+    assert_eq!(block["block"], head.as_str());
+    assert!(block["bytes"].as_u64().unwrap() > 0);
+    for stage in [
+        "load_ms",
+        "previous_ms",
+        "diff_ms",
+        "encode_ms",
+        "commit_ms",
+    ] {
+        assert!(block["stages"][stage].as_f64().unwrap() >= 0.0);
+    }
+    assert_eq!(block["tables"]["users"]["rows"], 3);
+    assert_eq!(block["tables"]["users"]["skipped"], false);
+    assert_eq!(block["tables"]["groups"]["skipped"], true);
+
+    let sql = &lines[2];
+    assert_eq!(sql["operation"], "patch-sql");
+    assert_eq!(sql["head"], head.as_str());
+    // A full-state patch: one TRUNCATE plus one INSERT per row.
+    assert_eq!(sql["tables"]["users"]["statements"], 4);
+    assert_eq!(sql["tables"]["groups"]["statements"], 2);
+    assert_eq!(sql["statements"], 6);
+}
+
+#[test]
+fn test_trace_disabled_writes_nothing() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+    let config = setup(work_dir, false);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n");
+    Block::create(&config, None).unwrap();
+    let patch = Patch::create(&config, GENESIS_HASH).unwrap();
+    sql::patch_to_sql(&config, &patch).unwrap().unwrap();
+
+    assert!(!config.state_dir().join(TRACE_FILE).exists());
+}
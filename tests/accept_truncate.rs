@@ -3,8 +3,10 @@ mod common;
 use leech2::block::Block;
 use leech2::config::Config;
 use leech2::head;
+use leech2::pack;
 use leech2::patch::Patch;
 use leech2::reported;
+use leech2::storage;
 use leech2::truncate;
 use leech2::utils::GENESIS_HASH;
 
@@ -363,3 +365,79 @@ source = "users.csv"
     assert!(state_dir.join(&hash3).exists());
     assert!(state_dir.join(&hash4).exists());
 }
+
+#[test]
+fn test_pack_old_blocks() {
+    common::init_logging();
+    let tmp = tempfile::tempdir().unwrap();
+    let work_dir = tmp.path();
+
+    let write_config = |max_blocks: &str| {
+        common::write_config(
+            work_dir,
+            "config.toml",
+            &format!(
+                r#"
+[truncate]
+pack-after = 1
+{}
+
+[tables.users]
+fields = [
+    {{ name = "id", type = "NUMBER", primary-key = true }},
+    {{ name = "name", type = "TEXT" }},
+]
+
+[tables.users.csv]
+source = "users.csv"
+"#,
+                max_blocks
+            ),
+        )
+    };
+    write_config("");
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n");
+    let config = Config::load(work_dir).unwrap();
+    let state_dir = config.state_dir();
+    let hash1 = create_block(&config);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n");
+    let hash2 = create_block(&config);
+
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n3,Charlie\n");
+    let hash3 = create_block(&config);
+
+    // Only HEAD stays loose; the older blocks and their lock files are gone.
+    for hash in [&hash1, &hash2] {
+        assert!(!state_dir.join(hash).exists(), "block should be packed");
+        assert!(!state_dir.join(format!(".{}.lock", hash)).exists());
+        assert!(pack::contains(&state_dir, hash, config.file_mode).unwrap());
+        assert!(Block::is_stored(&state_dir, hash, config.file_mode));
+    }
+    assert!(state_dir.join(&hash3).exists());
+
+    // Packed blocks still resolve and consolidate.
+    let resolved = storage::resolve_hash_prefix(&state_dir, &hash1[..8], config.file_mode).unwrap();
+    assert_eq!(resolved, hash1);
+    let patch = Patch::create(&config, &hash1).unwrap();
+    assert_eq!(patch.num_blocks, 2);
+    assert_eq!(patch.head, hash3);
+
+    // Truncating packed blocks drops them from the pack.
+    write_config("max-blocks = 2");
+    let config = Config::load(work_dir).unwrap();
+    common::write_csv(work_dir, "users.csv", "1,Alice\n2,Bob\n3,Charlie\n4,Dave\n");
+    let hash4 = create_block(&config);
+
+    assert!(!pack::contains(&state_dir, &hash1, config.file_mode).unwrap());
+    assert!(!pack::contains(&state_dir, &hash2, config.file_mode).unwrap());
+    assert!(pack::contains(&state_dir, &hash3, config.file_mode).unwrap());
+    assert!(state_dir.join(&hash4).exists());
+    assert_eq!(
+        Block::load(&state_dir, &hash3, config.file_mode)
+            .unwrap()
+            .parent,
+        hash2
+    );
+}
@@ -63,7 +63,7 @@ pub fn count_sql(sql: &str, keyword: &str) -> usize {
 /// zstd compression) and produces identical SQL output.
 pub fn assert_wire_roundtrip(config: &Config, patch: &Patch) {
     let encoded = wire::encode_patch(config, patch).unwrap();
-    let decoded = wire::decode_patch(&encoded).unwrap();
+    let decoded = wire::decode_patch_with(config, &encoded).unwrap();
 
     assert_eq!(patch.head, decoded.head);
     assert_eq!(patch.num_blocks, decoded.num_blocks);
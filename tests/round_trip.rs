@@ -92,6 +92,9 @@ fields = [
     s.push_str("source = \"users.csv\"\n");
     s.push_str(&format!("null = \"^{EMAIL_NULL_SENTINEL}$\"\n"));
     s.push_str("\n[stats]\nenable = true\n");
+    // Small batches so multi-row INSERT and IN-list DELETE statements, and
+    // the partial batch at the end of each table, are replayed on PostgreSQL.
+    s.push_str("\n[sql]\nbatch-size = 3\n");
     s
 }
 
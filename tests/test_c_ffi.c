@@ -36,6 +36,51 @@ static void log_callback(lch_log_level_t level, const char *msg,
   state->count++;
 }
 
+/* Tally of the statements streamed by lch_patch_to_sql_stream(). */
+typedef struct {
+  size_t statements;
+  size_t bytes;
+  int malformed;
+} sql_stream_state_t;
+
+static int sql_stream_callback(const char *stmt, size_t len, void *usr_data) {
+  sql_stream_state_t *s = (sql_stream_state_t *)usr_data;
+  if (len < 2 || strlen(stmt) != len || strcmp(stmt + len - 2, ";\n") != 0) {
+    s->malformed = 1;
+  }
+  s->statements++;
+  s->bytes += len;
+  return LCH_SUCCESS;
+}
+
+/* Tally of the statements bound by lch_patch_to_statements(). */
+typedef struct {
+  size_t statements;
+  size_t hostkey_params;
+  int malformed;
+} statement_state_t;
+
+static int statement_callback(const lch_statement_t *stmt, void *usr_data) {
+  statement_state_t *s = (statement_state_t *)usr_data;
+  if (stmt->table == NULL || stmt->sql == NULL ||
+      (stmt->num_params > 0 &&
+       (stmt->columns == NULL || stmt->params == NULL))) {
+    s->malformed = 1;
+    return LCH_FAILURE;
+  }
+  for (size_t i = 0; i < stmt->num_params; i++) {
+    if (strcmp(stmt->columns[i], "hostkey") == 0) {
+      if (stmt->params[i].kind != LCH_VALUE_TEXT ||
+          strcmp(stmt->params[i].text, "abc123") != 0) {
+        s->malformed = 1;
+      }
+      s->hostkey_params++;
+    }
+  }
+  s->statements++;
+  return LCH_SUCCESS;
+}
+
 /* Per-row data for the callback-backed `events` table. */
 typedef struct {
   double id;
@@ -111,6 +156,25 @@ static int test_read_cell(const char *table, size_t row, size_t col,
   return LCH_FAILURE;
 }
 
+/* Outcome of the asynchronous calls, written by their completion callbacks on
+ * executor threads and read after lch_deinit() has joined them. */
+typedef struct {
+  int block_status;
+  int patch_status;
+  lch_buffer_t patch;
+} async_state_t;
+
+static void block_done(int status, void *usr_data) {
+  async_state_t *s = (async_state_t *)usr_data;
+  s->block_status = status;
+}
+
+static void patch_done(int status, lch_buffer_t patch, void *usr_data) {
+  async_state_t *s = (async_state_t *)usr_data;
+  s->patch_status = status;
+  s->patch = patch;
+}
+
 /* Releases memory allocated for a cell in test_read_cell. Fires once for each
  * successful read_cell, for every kind; only TEXT cells own an allocation. */
 static void test_destroy_cell(lch_cell_t *cell, void *usr_data) {
@@ -221,8 +285,33 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
   printf("patch head: %s\n", hash);
+
+  char *hash_with = NULL;
+  ret = lch_patch_hash_with(cfg, &patch, &hash_with);
+  if (ret == LCH_FAILURE || hash_with == NULL || strcmp(hash, hash_with) != 0) {
+    fprintf(stderr, "lch_patch_hash_with: expected '%s', got '%s'\n", hash,
+            hash_with ? hash_with : "(null)");
+    lch_string_free(hash_with);
+    lch_string_free(hash);
+    lch_buffer_free(&patch);
+    lch_deinit(cfg);
+    return EXIT_FAILURE;
+  }
+  lch_string_free(hash_with);
   lch_string_free(hash);
 
+  /* A full state patch queued twice: the second supersedes the first. */
+  lch_buffer_t queued[2] = {patch, patch};
+  lch_buffer_t coalesced = {0};
+  ret = lch_patch_coalesce(cfg, queued, 2, &coalesced);
+  if (ret == LCH_FAILURE || coalesced.data == NULL) {
+    fprintf(stderr, "lch_patch_coalesce failed\n");
+    lch_buffer_free(&patch);
+    lch_deinit(cfg);
+    return EXIT_FAILURE;
+  }
+  lch_buffer_free(&coalesced);
+
   lch_buffer_t injected = {0};
   lch_cell_t hostkey_cell = {.kind = LCH_VALUE_TEXT, .text = "abc123"};
   ret = lch_patch_inject(cfg, &patch, "hostkey", &hostkey_cell, &injected);
@@ -253,6 +342,34 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
+  sql_stream_state_t stream_state = {0, 0, 0};
+  ret = lch_patch_to_sql_stream(cfg, &injected, sql_stream_callback,
+                                &stream_state);
+  if (ret == LCH_FAILURE || stream_state.statements == 0 ||
+      stream_state.malformed || stream_state.bytes != strlen(sql)) {
+    fprintf(stderr, "lch_patch_to_sql_stream: output differs from "
+                    "lch_patch_to_sql\n");
+    lch_string_free(sql);
+    lch_buffer_free(&injected);
+    lch_buffer_free(&patch);
+    lch_deinit(cfg);
+    return EXIT_FAILURE;
+  }
+
+  statement_state_t statement_state = {0, 0, 0};
+  ret = lch_patch_to_statements(cfg, &injected, statement_callback,
+                                &statement_state);
+  if (ret == LCH_FAILURE ||
+      statement_state.statements != stream_state.statements ||
+      statement_state.hostkey_params == 0 || statement_state.malformed) {
+    fprintf(stderr, "lch_patch_to_statements: unexpected statements\n");
+    lch_string_free(sql);
+    lch_buffer_free(&injected);
+    lch_buffer_free(&patch);
+    lch_deinit(cfg);
+    return EXIT_FAILURE;
+  }
+
   lch_buffer_free(&injected);
 
   ret = lch_patch_applied(cfg, &patch);
@@ -275,6 +392,54 @@ int main(int argc, char *argv[]) {
   lch_string_free(sql);
   lch_deinit(cfg);
 
+  cfg = lch_init_async(work_dir, 2);
+  if (cfg == NULL) {
+    fprintf(stderr, "lch_init_async failed\n");
+    return EXIT_FAILURE;
+  }
+
+  cb_state_t async_cb_state = {0};
+  callbacks.usr_data = &async_cb_state;
+  async_state_t async_state = {-1, -1, {NULL, 0}};
+  lch_task_t *block_task =
+      lch_block_create_async(cfg, &callbacks, block_done, &async_state);
+  if (block_task == NULL) {
+    fprintf(stderr, "lch_block_create_async failed\n");
+    lch_deinit(cfg);
+    return EXIT_FAILURE;
+  }
+  lch_task_free(block_task);
+
+  lch_task_t *patch_task =
+      lch_patch_create_async(cfg, NULL, patch_done, &async_state);
+  if (patch_task == NULL) {
+    fprintf(stderr, "lch_patch_create_async failed\n");
+    lch_deinit(cfg);
+    return EXIT_FAILURE;
+  }
+  lch_task_free(patch_task);
+
+  /* Waits for both tasks and their completion callbacks. */
+  lch_deinit(cfg);
+
+  if (async_state.block_status != LCH_SUCCESS ||
+      async_cb_state.events_begin_count != 1 ||
+      async_cb_state.destroy_cell_count !=
+          async_cb_state.read_cell_success_count) {
+    fprintf(stderr, "lch_block_create_async: unexpected outcome %d\n",
+            async_state.block_status);
+    lch_buffer_free(&async_state.patch);
+    return EXIT_FAILURE;
+  }
+  if (async_state.patch_status != LCH_SUCCESS ||
+      async_state.patch.data == NULL) {
+    fprintf(stderr, "lch_patch_create_async: unexpected outcome %d\n",
+            async_state.patch_status);
+    lch_buffer_free(&async_state.patch);
+    return EXIT_FAILURE;
+  }
+  lch_buffer_free(&async_state.patch);
+
   if (log_state.count == 0) {
     fprintf(stderr, "No log messages received\n");
     return EXIT_FAILURE;